@@ -0,0 +1,66 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <map>
+
+#include "logger.h"
+
+namespace d2d {
+namespace benchmarking {
+
+static std::map<std::string, BenchmarkCallback>& GetBenchmarks() {
+  static std::map<std::string, BenchmarkCallback> benchmarks;
+  return benchmarks;
+}
+
+bool RegisterBenchmark(const std::string& name, BenchmarkCallback callback) {
+  return GetBenchmarks().emplace(name, std::move(callback)).second;
+}
+
+bool RunBenchmarks(const std::string& filter, const Arguments& arguments) {
+  bool success = true;
+  size_t runs = 0;
+  for (const auto& benchmark : GetBenchmarks()) {
+    if (!filter.empty() && benchmark.first != filter) {
+      continue;
+    }
+    runs++;
+    D2D_LOG << "[ RUN      ] " << benchmark.first;
+    Stopwatch stopwatch;
+    const auto result = benchmark.second(arguments);
+    D2D_LOG << (result ? "[       OK ] " : "[  FAILED  ] ") << benchmark.first
+            << " (" << stopwatch.GetElapsedSeconds() << " s)";
+    success = success && result;
+  }
+
+  if (runs == 0) {
+    D2D_ERROR << "No benchmark named " << filter;
+    return false;
+  }
+
+  return success;
+}
+
+LatencySummary SummarizeLatencies(std::vector<double>& samples) {
+  LatencySummary summary;
+  if (samples.empty()) {
+    return summary;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  double total = 0.0;
+  for (const auto sample : samples) {
+    total += sample;
+  }
+  summary.mean = total / samples.size();
+  summary.p50 = samples[samples.size() / 2];
+  summary.p99 = samples[std::min(samples.size() - 1,
+                                 static_cast<size_t>(samples.size() * 0.99))];
+  return summary;
+}
+
+}  // namespace benchmarking
+}  // namespace d2d
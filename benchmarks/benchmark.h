@@ -0,0 +1,57 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+
+namespace d2d {
+namespace benchmarking {
+
+using Arguments = std::vector<std::string>;
+
+using BenchmarkCallback = std::function<bool(const Arguments& arguments)>;
+
+bool RegisterBenchmark(const std::string& name, BenchmarkCallback callback);
+
+bool RunBenchmarks(const std::string& filter, const Arguments& arguments);
+
+class Stopwatch {
+ public:
+  Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+  double GetElapsedSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(Stopwatch);
+};
+
+struct LatencySummary {
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p99 = 0.0;
+};
+
+// Summarizes a set of samples. The samples are sorted in place.
+LatencySummary SummarizeLatencies(std::vector<double>& samples);
+
+#define D2D_BENCHMARK(name)                                                 \
+  static bool name##Benchmark(const ::d2d::benchmarking::Arguments&);       \
+  static const bool name##Registered =                                      \
+      ::d2d::benchmarking::RegisterBenchmark(#name, name##Benchmark);       \
+  static bool name##Benchmark(                                              \
+      const ::d2d::benchmarking::Arguments& arguments)
+
+}  // namespace benchmarking
+}  // namespace d2d
@@ -0,0 +1,20 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include <stdlib.h>
+
+#include "benchmark.h"
+
+// Usage: doxygen2docset_benchmarks [benchmark name [arguments...]]
+int main(int argc, char const* argv[]) {
+  std::string filter;
+  d2d::benchmarking::Arguments arguments;
+  if (argc > 1) {
+    filter = argv[1];
+  }
+  for (int i = 2; i < argc; i++) {
+    arguments.emplace_back(argv[i]);
+  }
+  return d2d::benchmarking::RunBenchmarks(filter, arguments) ? EXIT_SUCCESS
+                                                             : EXIT_FAILURE;
+}
@@ -0,0 +1,578 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include <ctype.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "builder.h"
+#include "docset_index.h"
+#include "file.h"
+#include "fixture.h"
+#include "hash.h"
+#include "logger.h"
+#include "plist_parser.h"
+#include "scan.h"
+#include "token_parser.h"
+#include "token_table.h"
+
+namespace d2d {
+namespace benchmarking {
+
+class Database {
+ public:
+  Database(const std::string& path) {
+    if (sqlite3_open(path.c_str(), &database_) != SQLITE_OK) {
+      D2D_ERROR << "Could not open database " << path;
+      sqlite3_close(database_);
+      database_ = nullptr;
+    }
+  }
+
+  ~Database() {
+    for (auto& statement : statements_) {
+      sqlite3_finalize(statement.second);
+    }
+    sqlite3_close(database_);
+  }
+
+  bool IsValid() const { return database_ != nullptr; }
+
+  sqlite3* Get() const { return database_; }
+
+  bool Execute(const std::string& sql) {
+    char* error = nullptr;
+    if (sqlite3_exec(database_, sql.c_str(), nullptr, nullptr, &error) !=
+        SQLITE_OK) {
+      D2D_ERROR << "Could not execute " << sql << ": " << error;
+      sqlite3_free(error);
+      return false;
+    }
+    return true;
+  }
+
+  // Runs a COUNT(*) query with the given text bindings. Statements are cached
+  // so that only the query itself is measured.
+  bool Count(const std::string& sql, const std::vector<std::string>& bindings,
+             int64_t& count) {
+    auto& statement = statements_[sql];
+    if (statement == nullptr &&
+        sqlite3_prepare_v2(database_, sql.c_str(), -1, &statement, nullptr) !=
+            SQLITE_OK) {
+      D2D_ERROR << "Could not prepare " << sql << ": "
+                << sqlite3_errmsg(database_);
+      return false;
+    }
+    sqlite3_reset(statement);
+    for (size_t i = 0; i < bindings.size(); i++) {
+      sqlite3_bind_text(statement, static_cast<int>(i + 1), bindings[i].data(),
+                        static_cast<int>(bindings[i].size()), SQLITE_STATIC);
+    }
+    if (sqlite3_step(statement) != SQLITE_ROW) {
+      D2D_ERROR << "Could not step " << sql << ": "
+                << sqlite3_errmsg(database_);
+      return false;
+    }
+    count = sqlite3_column_int64(statement, 0);
+    return true;
+  }
+
+ private:
+  sqlite3* database_ = nullptr;
+  std::map<std::string, sqlite3_stmt*> statements_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(Database);
+};
+
+static size_t GetFileSize(const std::string& path) {
+  struct stat stat_buf = {};
+  if (::stat(path.c_str(), &stat_buf) != 0) {
+    return 0;
+  }
+  return stat_buf.st_size;
+}
+
+static std::string LowerASCII(std::string string) {
+  for (auto& c : string) {
+    if (c >= 'A' && c <= 'Z') {
+      c = c - 'A' + 'a';
+    }
+  }
+  return string;
+}
+
+static std::string EscapeLike(const std::string& string) {
+  std::string escaped;
+  for (auto c : string) {
+    if (c == '%' || c == '_' || c == '\\') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+
+// Builds the fixture docset when no index is specified on the command line.
+static std::string FindOrBuildIndex(const Arguments& arguments) {
+  if (!arguments.empty()) {
+    return arguments[0];
+  }
+
+  const std::string location = "/tmp/d2d_benchmark_docset";
+  if (!BuildDocset(D2D_FIXTURES_LOCATION, location)) {
+    return "";
+  }
+  PlistParser plist(D2D_FIXTURES_LOCATION "/Info.plist");
+  return JoinPaths({location, plist.ReadDocsetID() + ".docset", "Contents",
+                    "Resources", "docSet.dsidx"});
+}
+
+enum class LookupKind {
+  kPrefix,
+  kSubstring,
+  kExact,
+};
+
+struct Lookup {
+  LookupKind kind;
+  std::string text;
+};
+
+// A deterministic mix of what a user types into Dash or Zeal: short prefixes
+// in arbitrary case, fragments from the middle of a name and full names.
+static std::vector<Lookup> GenerateLookups(
+    const std::vector<std::string>& names, size_t count) {
+  std::vector<Lookup> lookups;
+  uint64_t state = 0x2545F4914F6CDD1DULL;
+  auto next = [&state]() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+
+  while (lookups.size() < count && !names.empty()) {
+    auto name = names[next() % names.size()];
+    if (name.size() < 4) {
+      continue;
+    }
+    for (auto& c : name) {
+      if (next() % 2 == 0) {
+        c = ::toupper(static_cast<unsigned char>(c));
+      }
+    }
+    lookups.push_back({LookupKind::kPrefix, name.substr(0, 1 + next() % 3)});
+    const auto length = std::min<size_t>(name.size(), 3 + next() % 3);
+    lookups.push_back({LookupKind::kSubstring,
+                       name.substr(next() % (name.size() - length + 1),
+                                   length)});
+    lookups.push_back({LookupKind::kExact, name});
+  }
+
+  return lookups;
+}
+
+static bool CountBaseline(Database& database, const Lookup& lookup,
+                          int64_t& count) {
+  switch (lookup.kind) {
+    case LookupKind::kPrefix:
+      return database.Count(
+          "SELECT COUNT(*) FROM searchIndex WHERE name LIKE ?1 ESCAPE '\\';",
+          {EscapeLike(lookup.text) + "%"}, count);
+    case LookupKind::kSubstring:
+      return database.Count(
+          "SELECT COUNT(*) FROM searchIndex WHERE name LIKE ?1 ESCAPE '\\';",
+          {"%" + EscapeLike(lookup.text) + "%"}, count);
+    case LookupKind::kExact:
+      return database.Count(
+          "SELECT COUNT(*) FROM searchIndex WHERE name = ?1 COLLATE NOCASE;",
+          {lookup.text}, count);
+  }
+  return false;
+}
+
+static bool CountAccelerated(Database& database, const Lookup& lookup,
+                             int64_t& count) {
+  const auto lower = LowerASCII(lookup.text);
+  switch (lookup.kind) {
+    case LookupKind::kPrefix: {
+      auto upper = lower;
+      while (!upper.empty() && static_cast<uint8_t>(upper.back()) == 0xFF) {
+        upper.pop_back();
+      }
+      if (upper.empty()) {
+        return database.Count(
+            "SELECT COUNT(*) FROM searchIndex WHERE lowerName >= ?1;", {lower},
+            count);
+      }
+      upper.back()++;
+      return database.Count(
+          "SELECT COUNT(*) FROM searchIndex WHERE lowerName >= ?1 AND "
+          "lowerName < ?2;",
+          {lower, upper}, count);
+    }
+    case LookupKind::kSubstring: {
+      std::vector<std::string> bindings = {lower};
+      std::string sql =
+          "SELECT COUNT(*) FROM searchIndex WHERE instr(lowerName, ?1) > 0";
+      for (size_t i = 0; i + 3 <= lower.size(); i++) {
+        sql += i == 0 ? " AND id IN (" : " INTERSECT ";
+        sql += "SELECT id FROM searchTrigram WHERE trigram = ?" +
+               std::to_string(bindings.size() + 1);
+        bindings.push_back(lower.substr(i, 3));
+      }
+      sql += bindings.size() > 1 ? ");" : ";";
+      return database.Count(sql, bindings, count);
+    }
+    case LookupKind::kExact:
+      return database.Count(
+          "SELECT COUNT(*) FROM searchIndex WHERE name = ?1 COLLATE NOCASE;",
+          {lookup.text}, count);
+  }
+  return false;
+}
+
+static const char* GetLookupKindName(LookupKind kind) {
+  switch (kind) {
+    case LookupKind::kPrefix:
+      return "prefix";
+    case LookupKind::kSubstring:
+      return "substring";
+    case LookupKind::kExact:
+      return "exact (nocase)";
+  }
+  return "";
+}
+
+// Usage: QueryLatency [path to docSet.dsidx] [lookup count]
+//
+// Copies the searchIndex of the docset into a plain index and into one with
+// the search accelerators, replays the same lookups against both and checks
+// that they agree.
+D2D_BENCHMARK(QueryLatency) {
+  const auto source_path = FindOrBuildIndex(arguments);
+  if (source_path.empty()) {
+    D2D_ERROR << "Could not locate a docset index to query.";
+    return false;
+  }
+  const size_t lookup_count =
+      arguments.size() > 1 ? std::stoul(arguments[1]) : 1000u;
+
+  const std::string baseline_path = "/tmp/d2d_benchmark_baseline.dsidx";
+  const std::string accelerated_path = "/tmp/d2d_benchmark_accelerated.dsidx";
+  ::remove(baseline_path.c_str());
+  ::remove(accelerated_path.c_str());
+
+  std::vector<std::string> names;
+  {
+    Database baseline(baseline_path);
+    if (!baseline.IsValid() ||
+        !baseline.Execute("ATTACH DATABASE '" + source_path +
+                          "' AS source;"
+                          "CREATE TABLE searchIndex(id INTEGER PRIMARY KEY, "
+                          "name TEXT, type TEXT, path TEXT);"
+                          "INSERT INTO searchIndex SELECT id, name, type, "
+                          "path FROM source.searchIndex;"
+                          "CREATE UNIQUE INDEX anchor ON searchIndex(name, "
+                          "type, path);"
+                          "DETACH DATABASE source;"
+                          "VACUUM INTO '" +
+                          accelerated_path + "';")) {
+      return false;
+    }
+
+    sqlite3_stmt* statement = nullptr;
+    sqlite3_prepare_v2(baseline.Get(), "SELECT name FROM searchIndex;", -1,
+                       &statement, nullptr);
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+      names.emplace_back(
+          reinterpret_cast<const char*>(sqlite3_column_text(statement, 0)));
+    }
+    sqlite3_finalize(statement);
+  }
+
+  {
+    Database accelerated(accelerated_path);
+    if (!accelerated.IsValid() ||
+        !BuildSearchAccelerators(accelerated.Get())) {
+      return false;
+    }
+  }
+
+  const auto lookups = GenerateLookups(names, lookup_count);
+  Database baseline(baseline_path);
+  Database accelerated(accelerated_path);
+
+  std::map<LookupKind, std::vector<double>> baseline_latencies;
+  std::map<LookupKind, std::vector<double>> accelerated_latencies;
+  size_t mismatches = 0;
+  for (const auto& lookup : lookups) {
+    int64_t baseline_count = 0;
+    int64_t accelerated_count = 0;
+    {
+      Stopwatch stopwatch;
+      if (!CountBaseline(baseline, lookup, baseline_count)) {
+        return false;
+      }
+      baseline_latencies[lookup.kind].push_back(
+          stopwatch.GetElapsedSeconds() * 1e6);
+    }
+    {
+      Stopwatch stopwatch;
+      if (!CountAccelerated(accelerated, lookup, accelerated_count)) {
+        return false;
+      }
+      accelerated_latencies[lookup.kind].push_back(
+          stopwatch.GetElapsedSeconds() * 1e6);
+    }
+    if (baseline_count != accelerated_count) {
+      D2D_ERROR << "Result mismatch for " << GetLookupKindName(lookup.kind)
+                << " lookup '" << lookup.text << "': " << baseline_count
+                << " vs. " << accelerated_count;
+      mismatches++;
+    }
+  }
+
+  D2D_LOG << "Rows: " << names.size() << ", lookups: " << lookups.size();
+  for (auto& latencies : baseline_latencies) {
+    const auto base = SummarizeLatencies(latencies.second);
+    const auto fast =
+        SummarizeLatencies(accelerated_latencies[latencies.first]);
+    D2D_LOG << "  " << GetLookupKindName(latencies.first)
+            << ": baseline mean " << base.mean << " us (p50 " << base.p50
+            << ", p99 " << base.p99 << "), accelerated mean " << fast.mean
+            << " us (p50 " << fast.p50 << ", p99 " << fast.p99
+            << "), speedup " << (fast.mean > 0 ? base.mean / fast.mean : 0)
+            << "x";
+  }
+
+  const auto baseline_size = GetFileSize(baseline_path);
+  const auto accelerated_size = GetFileSize(accelerated_path);
+  D2D_LOG << "Index size: baseline " << baseline_size << " bytes, accelerated "
+          << accelerated_size << " bytes (+"
+          << (baseline_size > 0
+                  ? 100.0 * (static_cast<double>(accelerated_size) - baseline_size) /
+                        baseline_size
+                  : 0)
+          << "%)";
+
+  return mismatches == 0;
+}
+
+// Runs |scan| over the input until at least |minimum_bytes| have been
+// processed and returns the throughput in GB/s.
+template <class Scan>
+static double MeasureThroughput(const char* begin, const char* end,
+                                size_t minimum_bytes, Scan scan) {
+  size_t bytes = 0;
+  size_t matches = 0;
+  Stopwatch stopwatch;
+  while (bytes < minimum_bytes) {
+    matches += scan(begin, end);
+    bytes += end - begin;
+  }
+  const auto seconds = stopwatch.GetElapsedSeconds();
+  // Keep the matches observable so the scans are not optimized away.
+  if (matches == static_cast<size_t>(-1)) {
+    D2D_LOG << matches;
+  }
+  return seconds > 0 ? bytes / seconds / 1e9 : 0;
+}
+
+// Usage: ScanThroughput [files...]
+//
+// Reports the throughput of each scan kernel available on this CPU over the
+// fixtures (or the given files).
+D2D_BENCHMARK(ScanThroughput) {
+  auto files = arguments;
+  if (files.empty()) {
+    files = {D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html",
+             D2D_FIXTURES_LOCATION "/Tokens.xml"};
+  }
+
+  const size_t kMinimumBytes = 256u << 20;
+  const ByteSet quote_or_close("\">");
+  const ByteSet whitespace(" \t\r\n");
+
+  for (const auto& file : files) {
+    auto mapping = OpenFileReadOnly(file);
+    if (!mapping || !mapping->IsValid()) {
+      D2D_ERROR << "Could not open " << file;
+      return false;
+    }
+    const auto begin = static_cast<const char*>(mapping->Get());
+    const auto end = begin + mapping->GetSize();
+    D2D_LOG << file << " (" << mapping->GetSize() << " bytes)";
+
+    for (const auto kernels : GetAvailableScanKernels()) {
+      const auto find = MeasureThroughput(
+          begin, end, kMinimumBytes, [kernels](const char* p, const char* e) {
+            size_t count = 0;
+            while ((p = kernels->find(p, e, "href=", 5)) != e) {
+              p += 5;
+              count++;
+            }
+            return count;
+          });
+      const auto find_any = MeasureThroughput(
+          begin, end, kMinimumBytes,
+          [kernels, &quote_or_close](const char* p, const char* e) {
+            size_t count = 0;
+            while ((p = kernels->find_any(p, e, quote_or_close)) != e) {
+              p++;
+              count++;
+            }
+            return count;
+          });
+      const auto skip = MeasureThroughput(
+          begin, end, kMinimumBytes,
+          [kernels, &whitespace](const char* p, const char* e) {
+            size_t count = 0;
+            while ((p = kernels->skip(p, e, whitespace)) != e) {
+              p = kernels->find_any(p, e, whitespace);
+              count++;
+            }
+            return count;
+          });
+      D2D_LOG << "  " << kernels->name << ": find \"href=\" " << find
+              << " GB/s, find quote or > " << find_any
+              << " GB/s, skip whitespace " << skip << " GB/s";
+    }
+  }
+
+  return true;
+}
+
+struct IOStrategy {
+  std::string name;
+  IOThresholds thresholds;
+};
+
+// Usage: IOStrategies [small file size] [large file size]
+//
+// Copies files of various sizes with each read strategy forced and with the
+// adaptive thresholds (the defaults or the given ones).
+D2D_BENCHMARK(IOStrategies) {
+  IOThresholds adaptive;
+  if (arguments.size() > 0) {
+    adaptive.small_file_size = std::stoul(arguments[0]);
+  }
+  if (arguments.size() > 1) {
+    adaptive.large_file_size = std::stoul(arguments[1]);
+  }
+
+  IOStrategy always_map{"always mmap", {}};
+  always_map.thresholds.small_file_size = 0;
+  always_map.thresholds.large_file_size = static_cast<size_t>(-1);
+  IOStrategy always_read{"always pread", {}};
+  always_read.thresholds.small_file_size = static_cast<size_t>(-1);
+  const std::vector<IOStrategy> strategies = {
+      always_map, always_read, {"adaptive", adaptive}};
+
+  const std::string directory = "/tmp/d2d_io_benchmark";
+  if (!MakeDirectories({directory})) {
+    return false;
+  }
+
+  const std::vector<size_t> sizes = {1u << 10,   4u << 10,  16u << 10,
+                                     64u << 10,  256u << 10, 1u << 20,
+                                     16u << 20, 64u << 20};
+  const size_t kBytesPerSize = 256u << 20;
+  const size_t kMaximumFilesPerSize = 2000;
+
+  std::vector<uint8_t> contents(sizes.back(), 'x');
+  const auto original_thresholds = GetIOThresholds();
+  bool success = true;
+
+  for (const auto size : sizes) {
+    const auto source = JoinPaths({directory, "source"});
+    if (!CopyData(contents.data(), size, source)) {
+      return false;
+    }
+    const size_t copies =
+        std::max<size_t>(1, std::min(kMaximumFilesPerSize, kBytesPerSize / size));
+
+    std::string line = std::to_string(size) + " bytes x " +
+                       std::to_string(copies) + ":";
+    for (const auto& strategy : strategies) {
+      SetIOThresholds(strategy.thresholds);
+      Stopwatch stopwatch;
+      for (size_t i = 0; i < copies; i++) {
+        if (!CopyFile(source,
+                      JoinPaths({directory, "copy" + std::to_string(i)}))) {
+          success = false;
+          break;
+        }
+      }
+      const auto seconds = stopwatch.GetElapsedSeconds();
+      line += " " + strategy.name + " " +
+              std::to_string(static_cast<size_t>(copies / seconds)) +
+              " files/s (" +
+              std::to_string(static_cast<size_t>(copies * size / seconds /
+                                                 (1 << 20))) +
+              " MB/s);";
+
+      // Truncating existing files is slower than creating new ones. Start
+      // each strategy from the same state.
+      for (size_t i = 0; i < copies; i++) {
+        ::remove(JoinPaths({directory, "copy" + std::to_string(i)}).c_str());
+      }
+    }
+    D2D_LOG << line;
+  }
+
+  SetIOThresholds(original_thresholds);
+  return success;
+}
+
+// Compares parsing Tokens.xml against loading the binary token cache. Takes an
+// optional path to a Tokens.xml.
+D2D_BENCHMARK(TokenLoading) {
+  const auto tokens_path = arguments.empty()
+                               ? std::string(D2D_FIXTURES_LOCATION "/Tokens.xml")
+                               : arguments[0];
+  const std::string cache_path = "/tmp/d2d_benchmark.tokencache";
+
+  Stopwatch parse_stopwatch;
+  TokenParser parser(tokens_path);
+  if (!parser.IsValid()) {
+    return false;
+  }
+  TokenTable table(parser.ReadTokens());
+  const auto parse_seconds = parse_stopwatch.GetElapsedSeconds();
+
+  uint64_t key = 0;
+  if (!HashFile(tokens_path, key) || !table.Save(cache_path, key)) {
+    return false;
+  }
+
+  Stopwatch load_stopwatch;
+  uint64_t loaded_key = 0;
+  TokenTable loaded;
+  if (!HashFile(tokens_path, loaded_key) ||
+      !loaded.Load(cache_path, loaded_key)) {
+    D2D_ERROR << "Could not load the token cache.";
+    return false;
+  }
+  const auto load_seconds = load_stopwatch.GetElapsedSeconds();
+
+  if (loaded.GetSize() != table.GetSize()) {
+    D2D_ERROR << "The token cache does not match Tokens.xml.";
+    return false;
+  }
+
+  D2D_LOG << table.GetSize() << " tokens: parse " << parse_seconds * 1e3
+          << " ms, hash and load cache " << load_seconds * 1e3 << " ms";
+  ::remove(cache_path.c_str());
+  return true;
+}
+
+}  // namespace benchmarking
+}  // namespace d2d
@@ -0,0 +1,101 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "anchor_filter.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "scan.h"
+
+namespace d2d {
+
+AnchorFilter::AnchorFilter(const TokenTable& table,
+                           const TokenTable::RowRange& rows) {
+  // Anchors without their leading "#".
+  std::vector<const char*> anchors;
+  anchors.reserve(rows.size());
+  for (const auto row : rows) {
+    anchors.push_back(table.GetAnchors().Get(row) + 1);
+  }
+  std::sort(anchors.begin(), anchors.end(),
+            [](const char* lhs, const char* rhs) {
+              return ::strcmp(lhs, rhs) < 0;
+            });
+
+  nodes_.emplace_back();
+  if (!anchors.empty()) {
+    AddNode(anchors, 0, anchors.size(), 0, 0);
+  }
+}
+
+void AnchorFilter::AddNode(const std::vector<const char*>& anchors,
+                           size_t first, size_t last, size_t depth,
+                           uint32_t node) {
+  // Sorting puts an anchor that ends here first.
+  if (anchors[first][depth] == '\0') {
+    nodes_[node].is_terminal = true;
+    return;
+  }
+
+  // The anchors starting at each child, and one past the last.
+  std::vector<size_t> groups;
+  for (size_t i = first; i < last; i++) {
+    if (i == first || anchors[i][depth] != anchors[i - 1][depth]) {
+      groups.push_back(i);
+    }
+  }
+  groups.push_back(last);
+
+  const auto child_count = groups.size() - 1;
+  const auto first_child = static_cast<uint32_t>(nodes_.size());
+  nodes_[node].first_edge = static_cast<uint32_t>(edges_.size());
+  nodes_[node].edge_count = static_cast<uint32_t>(child_count);
+  for (size_t i = 0; i < child_count; i++) {
+    Edge edge;
+    edge.byte = static_cast<uint8_t>(anchors[groups[i]][depth]);
+    edge.node = first_child + static_cast<uint32_t>(i);
+    edges_.push_back(edge);
+    nodes_.emplace_back();
+  }
+
+  for (size_t i = 0; i < child_count; i++) {
+    AddNode(anchors, groups[i], groups[i + 1], depth + 1,
+            first_child + static_cast<uint32_t>(i));
+  }
+}
+
+bool AnchorFilter::MayLinkToAnchors(const char* begin, const char* end) const {
+  if (edges_.empty() && !nodes_[0].is_terminal) {
+    return false;
+  }
+
+  // The find kernels only vectorize needles of two bytes or more.
+  static const ByteSet kHash("#");
+  for (auto hash = ScanFindAny(begin, end, kHash); hash != end;
+       hash = ScanFindAny(hash + 1, end, kHash)) {
+    const Node* node = &nodes_[0];
+    for (auto cursor = hash + 1;; cursor++) {
+      if (node->is_terminal) {
+        return true;
+      }
+      if (cursor == end) {
+        break;
+      }
+      const auto edges_begin = edges_.data() + node->first_edge;
+      const auto edges_end = edges_begin + node->edge_count;
+      const auto byte = static_cast<uint8_t>(*cursor);
+      const auto edge = std::lower_bound(
+          edges_begin, edges_end, byte,
+          [](const Edge& edge, uint8_t byte) { return edge.byte < byte; });
+      if (edge == edges_end || edge->byte != byte) {
+        break;
+      }
+      node = &nodes_[edge->node];
+    }
+  }
+  return false;
+}
+
+}  // namespace d2d
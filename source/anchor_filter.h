@@ -0,0 +1,51 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "macros.h"
+#include "token_table.h"
+
+namespace d2d {
+
+// Decides in one pass over a page, without parsing it, whether the page may
+// link to any of a set of tokens. Links to a token end with "#" and its
+// anchor, so the anchors are kept in a trie that is walked from every "#" in
+// the page. There are no false negatives for pages that spell out links
+// literally, which Doxygen always does. There may be false positives.
+class AnchorFilter {
+ public:
+  AnchorFilter(const TokenTable& table, const TokenTable::RowRange& rows);
+
+  bool MayLinkToAnchors(const char* begin, const char* end) const;
+
+ private:
+  struct Node {
+    uint32_t first_edge = 0;
+    uint32_t edge_count = 0;
+    // Whether an anchor ends here. The children of such a node are dropped
+    // since any longer anchor would also match.
+    bool is_terminal = false;
+  };
+
+  struct Edge {
+    uint8_t byte = 0;
+    uint32_t node = 0;
+  };
+
+  // Node 0 is the root. It matches the "#".
+  std::vector<Node> nodes_;
+  // The edges of each node are contiguous and sorted by byte.
+  std::vector<Edge> edges_;
+
+  void AddNode(const std::vector<const char*>& anchors, size_t first,
+               size_t last, size_t depth, uint32_t node);
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(AnchorFilter);
+};
+
+}  // namespace d2d
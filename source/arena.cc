@@ -0,0 +1,87 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#include "logger.h"
+
+namespace d2d {
+
+static constexpr size_t kAlignment = alignof(max_align_t);
+
+static size_t AlignUp(size_t size) {
+  return (size + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+Arena::Arena(size_t block_size) : block_size_(AlignUp(block_size)) {}
+
+Arena::~Arena() {
+  for (const auto& block : blocks_) {
+    ::free(block.data);
+  }
+}
+
+void* Arena::Allocate(size_t size) {
+  size = AlignUp(size == 0 ? 1 : size);
+
+  if (current_block_ < blocks_.size() &&
+      offset_ + size <= blocks_[current_block_].size) {
+    auto allocation = blocks_[current_block_].data + offset_;
+    offset_ += size;
+    bytes_allocated_ += size;
+    return allocation;
+  }
+
+  // Move on to the next retained block if it is large enough. Otherwise, put
+  // a new block in its place.
+  if (current_block_ < blocks_.size()) {
+    current_block_++;
+  }
+  if (current_block_ == blocks_.size() ||
+      blocks_[current_block_].size < size) {
+    Block block;
+    block.size = size > block_size_ ? size : block_size_;
+    block.data = static_cast<uint8_t*>(::malloc(block.size));
+    if (block.data == nullptr) {
+      D2D_ERROR << "Could not allocate an arena block of " << block.size
+                << " bytes.";
+      return nullptr;
+    }
+    blocks_.insert(blocks_.begin() + current_block_, block);
+  }
+
+  offset_ = size;
+  bytes_allocated_ += size;
+  return blocks_[current_block_].data;
+}
+
+void Arena::Reset() {
+  current_block_ = 0;
+  offset_ = 0;
+  bytes_allocated_ = 0;
+}
+
+void Arena::Retain() { users_++; }
+
+void Arena::Release() {
+  if (users_ > 0 && --users_ == 0) {
+    Reset();
+  }
+}
+
+size_t Arena::GetBytesReserved() const {
+  size_t reserved = 0;
+  for (const auto& block : blocks_) {
+    reserved += block.size;
+  }
+  return reserved;
+}
+
+Arena& Arena::GetThreadArena() {
+  static thread_local Arena arena;
+  return arena;
+}
+
+}  // namespace d2d
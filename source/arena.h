@@ -0,0 +1,60 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "macros.h"
+
+namespace d2d {
+
+// A bump allocator. Individual allocations are never freed. Instead, all of
+// them are released at once by |Reset|, which keeps the blocks around for
+// reuse.
+class Arena {
+ public:
+  static constexpr size_t kDefaultBlockSize = 1u << 20;
+
+  explicit Arena(size_t block_size = kDefaultBlockSize);
+
+  ~Arena();
+
+  // Aligned for any fundamental type.
+  void* Allocate(size_t size);
+
+  void Reset();
+
+  // Counts the users of a shared arena. The arena is reset when the last user
+  // releases it.
+  void Retain();
+
+  void Release();
+
+  size_t GetBytesAllocated() const { return bytes_allocated_; }
+
+  size_t GetBytesReserved() const;
+
+  // The arena of the calling thread. It must only be used on that thread.
+  static Arena& GetThreadArena();
+
+ private:
+  struct Block {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+  };
+
+  const size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t current_block_ = 0;
+  size_t offset_ = 0;
+  size_t bytes_allocated_ = 0;
+  size_t users_ = 0;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(Arena);
+};
+
+}  // namespace d2d
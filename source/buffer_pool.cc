@@ -0,0 +1,71 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "buffer_pool.h"
+
+#include <stdlib.h>
+
+namespace d2d {
+
+static size_t GetSizeClass(size_t size) {
+  size_t size_class = 0;
+  while (size_class < BufferPool::kSizeClassCount &&
+         (BufferPool::kMinimumSize << size_class) < size) {
+    size_class++;
+  }
+  return size_class;
+}
+
+BufferPool::BufferPool(size_t max_retained_bytes)
+    : max_retained_bytes_(max_retained_bytes) {}
+
+BufferPool::~BufferPool() {
+  for (auto& buffers : free_buffers_) {
+    for (auto buffer : buffers) {
+      ::free(buffer);
+    }
+  }
+}
+
+void* BufferPool::Acquire(size_t size, size_t& capacity) {
+  const auto size_class = GetSizeClass(size);
+  if (size_class >= kSizeClassCount) {
+    return nullptr;
+  }
+
+  capacity = kMinimumSize << size_class;
+
+  auto& buffers = free_buffers_[size_class];
+  if (!buffers.empty()) {
+    auto buffer = buffers.back();
+    buffers.pop_back();
+    retained_bytes_ -= capacity;
+    return buffer;
+  }
+
+  heap_allocations_++;
+  return ::malloc(capacity);
+}
+
+void BufferPool::Release(void* buffer, size_t capacity) {
+  if (buffer == nullptr) {
+    return;
+  }
+
+  const auto size_class = GetSizeClass(capacity);
+  if (size_class >= kSizeClassCount || (kMinimumSize << size_class) != capacity ||
+      retained_bytes_ + capacity > max_retained_bytes_) {
+    ::free(buffer);
+    return;
+  }
+
+  free_buffers_[size_class].push_back(buffer);
+  retained_bytes_ += capacity;
+}
+
+BufferPool& BufferPool::GetThreadPool() {
+  static thread_local BufferPool pool;
+  return pool;
+}
+
+}  // namespace d2d
@@ -0,0 +1,53 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "macros.h"
+
+namespace d2d {
+
+// Keeps released buffers around for reuse. Buffers are grouped into
+// power-of-two size classes, starting at |kMinimumSize|. The contents of a
+// reused buffer are not cleared.
+class BufferPool {
+ public:
+  static constexpr size_t kMinimumSize = 4096;
+
+  static constexpr size_t kDefaultMaxRetainedBytes = 64u << 20;
+
+  explicit BufferPool(size_t max_retained_bytes = kDefaultMaxRetainedBytes);
+
+  ~BufferPool();
+
+  // Returns a buffer of at least |size| bytes and its actual capacity, which
+  // must be passed back to |Release|.
+  void* Acquire(size_t size, size_t& capacity);
+
+  // Buffers that would push the retained total over the limit are freed.
+  void Release(void* buffer, size_t capacity);
+
+  size_t GetRetainedBytes() const { return retained_bytes_; }
+
+  // The number of buffers that had to be allocated from the heap.
+  size_t GetHeapAllocationCount() const { return heap_allocations_; }
+
+  // The pool of the calling thread.
+  static BufferPool& GetThreadPool();
+
+  static constexpr size_t kSizeClassCount = 48;
+
+ private:
+  const size_t max_retained_bytes_;
+  std::vector<void*> free_buffers_[kSizeClassCount];
+  size_t retained_bytes_ = 0;
+  size_t heap_allocations_ = 0;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+}  // namespace d2d
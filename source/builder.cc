@@ -3,26 +3,558 @@
 
 #include "builder.h"
 
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "anchor_filter.h"
+#include "compound_reader.h"
+#include "delta.h"
 #include "docset_index.h"
 #include "file.h"
+#include "hash.h"
 #include "html_parser.h"
 #include "logger.h"
+#include "object_store.h"
+#include "parallel.h"
+#include "path_filter.h"
+#include "perf_counters.h"
 #include "plist_parser.h"
+#include "shard.h"
+#include "tagfile_reader.h"
+#include "tar_reader.h"
 #include "token_parser.h"
+#include "token_sorter.h"
+#include "token_table.h"
 
 namespace d2d {
 
-bool BuildDocset(const std::string& docs, const std::string& location) {
-  PlistParser plist_parser(JoinPaths({docs, "Info.plist"}));
-  if (!plist_parser.IsValid()) {
-    D2D_ERROR << "Could not parse Info.plist.";
+// Whether |file_name| has one of the extensions Doxygen's
+// HTML_FILE_EXTENSION is usually set to. Pages with other extensions are
+// only known by their tokens.
+static bool IsHTMLFile(const std::string& file_name) {
+  for (const std::string extension : {".html", ".htm", ".xhtml"}) {
+    if (file_name.size() > extension.size() &&
+        file_name.compare(file_name.size() - extension.size(),
+                          extension.size(), extension) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the tokens from the cache at |cache_path| if it was made from the same
+// Tokens.xml or tag file at |tokens_path|. Otherwise, parses the file with
+// |read_tokens| and refreshes the cache. There is no cache if |cache_path| is
+// empty.
+static bool ReadTokenTable(
+    const std::string& tokens_path, const std::string& cache_path,
+    const std::function<bool(std::vector<Token>&)>& read_tokens,
+    TokenTable& table) {
+  uint64_t key = 0;
+  const auto use_cache = !cache_path.empty() && HashFile(tokens_path, key);
+  if (use_cache && table.Load(cache_path, key)) {
+    D2D_VERBOSE << "Read tokens from the cache at " << cache_path;
+    return true;
+  }
+
+  std::vector<Token> tokens;
+  if (!read_tokens(tokens)) {
+    return false;
+  }
+  table = TokenTable(tokens);
+
+  if (use_cache && !table.Save(cache_path, key)) {
+    // Only slows down the next run.
+    D2D_ERROR << "Could not write the token cache to " << cache_path;
+  }
+  return true;
+}
+
+static bool ReadCompoundTokens(const std::string& xml_directory,
+                               size_t concurrency, TokenTable& table) {
+  CompoundReader reader(xml_directory, concurrency);
+  auto tokens = reader.ReadTokens();
+  if (!reader.IsValid()) {
+    return false;
+  }
+  D2D_VERBOSE << "Read " << reader.GetCompoundCount() << " compounds.";
+  table = TokenTable(tokens);
+  return true;
+}
+
+// Writes an output file, through |store| if there is one.
+static bool WriteOutput(const void* data, size_t length,
+                        const std::string& to_file_name, ObjectStore* store) {
+  return store != nullptr ? store->Link(data, length, to_file_name)
+                          : CopyData(data, length, to_file_name);
+}
+
+// A file of the Doxygen output, either open on disk or already read, such as
+// one from an archive.
+struct PageInput {
+  const struct stat* stat = nullptr;
+  const AutoFD* fd = nullptr;
+  const AutoMapping* contents = nullptr;
+};
+
+static bool CopyOutput(const PageInput& input,
+                       const std::string& to_file_name, ObjectStore* store) {
+  if (input.contents != nullptr) {
+    return WriteOutput(input.contents->Get(), input.contents->GetSize(),
+                       to_file_name, store);
+  }
+  if (store == nullptr) {
+    return CopyFile(*input.stat, *input.fd, to_file_name);
+  }
+  auto mapping = OpenFileReadOnly(*input.fd, input.stat->st_size);
+  if (!mapping) {
+    D2D_ERROR << "Could not read the file to copy to " << to_file_name;
+    return false;
+  }
+  return store->Link(mapping->Get(), mapping->GetSize(), to_file_name);
+}
+
+// Adds the index rows and writes the page of a file that has tokens or text
+// to index. |page_path| is the path of the page in the docset. Other files are
+// copied as-is.
+static bool CopyPage(const std::string& from_file_name,
+                     const PageInput& input, const std::string& to_file_name,
+                     const std::string& page_path, const TokenTable& tokens,
+                     const TokenTable::RowRange& rows,
+                     const BuildOptions& options, DocsetIndex& index,
+                     ObjectStore* store) {
+  const bool needs_text = options.full_text_search &&
+                          (!rows.empty() || IsHTMLFile(from_file_name));
+
+  if (rows.empty() && !needs_text) {
+    return CopyOutput(input, to_file_name, store);
+  }
+
+  std::unique_ptr<AutoMapping> mapping;
+  auto contents = input.contents;
+  if (contents == nullptr) {
+    mapping = OpenFileReadOnly(*input.fd, input.stat->st_size);
+    if (!mapping) {
+      D2D_ERROR << "Could not read the file " << from_file_name;
+      return false;
+    }
+    contents = mapping.get();
+  }
+
+  // Pages that do not link to any of their tokens are left untouched, so
+  // they are not parsed unless their text is needed.
+  const auto data = static_cast<const char*>(contents->Get());
+  const bool needs_toc =
+      !rows.empty() && AnchorFilter(tokens, rows)
+                           .MayLinkToAnchors(data, data + contents->GetSize());
+
+  if (!needs_toc && !needs_text) {
+    return WriteOutput(data, contents->GetSize(), to_file_name, store);
+  }
+
+  // The page is parsed once for both the text extraction and the TOC.
+  HTMLParser parser(data, contents->GetSize());
+
+  if (needs_text && parser.IsValid()) {
+    if (!index.AddPageText(page_path, parser.ExtractTitle(),
+                           parser.ExtractText())) {
+      D2D_ERROR << "Could not add the text of " << from_file_name
+                << " to the full-text index.";
+      return false;
+    }
+  }
+
+  // Check if this is a file in which a TOC needs to be generated.
+  if (needs_toc) {
+    auto html_with_toc = parser.BuildHTMLWithTOC(tokens, rows);
+    if (html_with_toc.IsValid()) {
+      if (!WriteOutput(html_with_toc.Get(),      //
+                       html_with_toc.GetSize(),  //
+                       to_file_name, store)) {
+        D2D_ERROR << "Could not copy HTML with TOC to " << to_file_name
+                  << ". Will try moving file without TOC.";
+
+      } else {
+        return true;
+      }
+    } else {
+      D2D_ERROR << "Could not build TOC in file: " << from_file_name
+                << ". Skipping.";
+    }
+  }
+
+  // Copy file as-is.
+  D2D_VERBOSE << "Copying " << from_file_name;
+  return CopyOutput(input, to_file_name, store);
+}
+
+// Adds the tokens of |stream| (a |TokenStream|, |CompoundReader| or
+// |TagfileReader|) that belong to |shard| to the index one chunk at a time
+// and spills them to |sorter|.
+template <class Stream>
+static bool IndexTokensInChunks(Stream& stream, const Shard& shard,
+                                TokenSorter& sorter, DocsetIndex& index) {
+  if (!stream.IsValid()) {
+    return false;
+  }
+
+  size_t token_count = 0;
+  std::vector<Token> batch;
+  while (stream.ReadChunk(batch)) {
+    if (shard.IsPartial()) {
+      batch.erase(std::remove_if(batch.begin(), batch.end(),
+                                 [&shard](const Token& token) {
+                                   return !IsInShard(token.GetPath(), shard);
+                                 }),
+                  batch.end());
+    }
+    token_count += batch.size();
+    if (!index.AddTokens(TokenTable(batch))) {
+      D2D_ERROR << "Could not add tokens to docset index.";
+      return false;
+    }
+    if (!sorter.AddBatch(std::move(batch))) {
+      D2D_ERROR << "Could not spill tokens to disk.";
+      return false;
+    }
+    batch.clear();
+  }
+  if (!stream.IsValid() || !sorter.Finish()) {
+    return false;
+  }
+
+  D2D_VERBOSE << "Read " << token_count << " tokens into "
+              << sorter.GetRunCount() << " sorted runs.";
+  return true;
+}
+
+// Creates the directories of the |files| under |to|, which is also created.
+static bool MakeFileDirectories(const std::vector<std::string>& to,
+                                const std::vector<std::string>& files) {
+  if (!MakeDirectories(to)) {
+    D2D_ERROR << "Could not create the directory structure " << JoinPaths(to);
     return false;
   }
 
-  const auto docset_id = plist_parser.ReadDocsetID();
-  const auto docset_name = plist_parser.ReadDocsetName();
+  std::unordered_set<std::string> directories;
+  for (const auto& file : files) {
+    const auto slash = file.rfind('/');
+    if (slash != std::string::npos &&
+        directories.insert(file.substr(0, slash)).second &&
+        !MakeDirectories(to, file.substr(0, slash))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Opens |file| under |docs| and passes it to |copy|.
+static bool CopyInputFile(
+    const std::string& docs, const std::string& file,
+    const std::function<bool(const PageInput& input)>& copy) {
+  AutoFD from_fd(D2D_TEMP_FAILURE_RETRY(
+      ::open(JoinPaths({docs, file}).c_str(), O_RDONLY | O_CLOEXEC)));
+  if (!from_fd.IsValid()) {
+    D2D_ERROR << "From file could not be opened: " << file;
+    return false;
+  }
+
+  struct stat from_stat = {};
+  if (::fstat(from_fd.Get(), &from_stat) != 0) {
+    D2D_ERROR << "Could not stat file: " << file;
+    return false;
+  }
+
+  PageInput input;
+  input.stat = &from_stat;
+  input.fd = &from_fd;
+  if (!copy(input)) {
+    D2D_ERROR << "Could not copy file " << file;
+    return false;
+  }
+  return true;
+}
+
+// Opens the |files| under |docs| one at a time and passes them to |copy|.
+static bool ForEachFile(
+    const std::string& docs, const std::vector<std::string>& files,
+    const std::function<bool(const std::string& file, const PageInput& input)>&
+        copy) {
+  for (const auto& file : files) {
+    if (!CopyInputFile(docs, file, [&](const PageInput& input) {
+          return copy(file, input);
+        })) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies the files under |docs| in path order so that the tokens of each page
+// can be read back from |sorter|. Only the tokens of one page are held at a
+// time.
+static bool CopyFilesInPathOrder(const std::string& docs,
+                                 const std::vector<std::string>& to,
+                                 const PathFilter& filter,
+                                 TokenSorter& sorter,
+                                 const BuildOptions& options,
+                                 DocsetIndex& index, ObjectStore* store) {
+  std::vector<std::string> files;
+  if (!ListFiles(docs, files, &filter)) {
+    return false;
+  }
+  std::sort(files.begin(), files.end());
+  if (!MakeFileDirectories(to, files)) {
+    return false;
+  }
+
+  std::vector<Token> page_tokens;
+  return ForEachFile(
+      docs, files, [&](const std::string& file, const PageInput& input) {
+        if (!sorter.ReadPage(file, page_tokens)) {
+          D2D_ERROR << "Could not read the tokens of " << file;
+          return false;
+        }
+        const TokenTable tokens(page_tokens);
+        return CopyPage(file, input, JoinPaths(to, file), file, tokens,
+                        tokens.GetRowsForFile(file), options, index, store);
+      });
+}
+
+// Doxygen output read from a tar archive in one pass. Pages can only be
+// written once the tokens are known, so the entries ahead of Tokens.xml and
+// Info.plist in the archive are held in memory until they are found. Archives
+// that start with them are streamed.
+struct ArchiveInput {
+  explicit ArchiveInput(const std::string& path) : reader(path) {}
+
+  TarReader reader;
+  std::vector<TarEntry> pending;
+  std::unique_ptr<AutoMapping> info_plist;
+  std::unique_ptr<AutoMapping> tokens_xml;
+};
+
+// Reads |archive| up to the Info.plist and Tokens.xml that are needed. The
+// Doxygen output is the directory that holds them, such as the "html" of
+// "tar -cf html.tar html", and the held entries are made relative to it. If
+// neither is needed, it is the directory the archive starts with, if any. The
+// entries |filter| excludes are dropped.
+static bool ReadArchiveHead(ArchiveInput& archive, const PathFilter& filter,
+                            bool needs_info_plist, bool needs_tokens_xml) {
+  TarEntry entry;
+  std::string root;
+  bool has_root = false;
+  while ((needs_info_plist && !archive.info_plist) ||
+         (needs_tokens_xml && !archive.tokens_xml)) {
+    if (!archive.reader.ReadEntry(entry)) {
+      if (archive.reader.IsValid()) {
+        D2D_ERROR << (needs_info_plist && !archive.info_plist ? "Info.plist"
+                                                              : "Tokens.xml")
+                  << " was not found in the archive.";
+      }
+      return false;
+    }
+    const auto slash = entry.path.rfind('/');
+    const auto directory = slash == std::string::npos
+                               ? std::string()
+                               : entry.path.substr(0, slash);
+    const auto name = entry.path.substr(slash + 1);
+    std::unique_ptr<AutoMapping>* found = nullptr;
+    if (name == "Info.plist" && needs_info_plist && !archive.info_plist) {
+      found = &archive.info_plist;
+    } else if (name == "Tokens.xml" && needs_tokens_xml &&
+               !archive.tokens_xml) {
+      found = &archive.tokens_xml;
+    }
+    if (found != nullptr && (!has_root || directory == root)) {
+      *found = std::move(entry.contents);
+      root = directory;
+      has_root = true;
+    } else {
+      archive.pending.emplace_back(std::move(entry));
+    }
+  }
+  if (!has_root) {
+    root = archive.reader.GetLeadingDirectory();
+  }
+  archive.reader.SetRoot(root);
+
+  std::vector<TarEntry> pending;
+  for (auto& held : archive.pending) {
+    if (!RebaseTarPath(root, held.path)) {
+      D2D_ERROR << held.path << " is outside of " << root
+                << ", which holds the Doxygen output in the archive.";
+      return false;
+    }
+    if (filter.IsFileIncluded(held.path)) {
+      pending.emplace_back(std::move(held));
+    }
+  }
+  archive.pending.swap(pending);
+  if (!archive.pending.empty()) {
+    D2D_VERBOSE << "Held " << archive.pending.size()
+                << " files that come before Tokens.xml or Info.plist in the "
+                   "archive.";
+  }
+  return true;
+}
+
+// Writes the held entries of |archive|, then the rest of it as it is read.
+static bool CopyArchiveFiles(ArchiveInput& archive,
+                             const std::vector<std::string>& to,
+                             const PathFilter& filter, const TokenTable& tokens,
+                             const BuildOptions& options, DocsetIndex& index,
+                             ObjectStore* store) {
+  if (!MakeDirectories(to)) {
+    D2D_ERROR << "Could not create the directory structure " << JoinPaths(to);
+    return false;
+  }
+
+  std::string last_directory;
+  const auto copy = [&](const TarEntry& entry) {
+    const auto slash = entry.path.rfind('/');
+    const auto directory = slash == std::string::npos
+                               ? std::string()
+                               : entry.path.substr(0, slash);
+    if (!directory.empty() && directory != last_directory) {
+      if (!MakeDirectories(to, directory)) {
+        return false;
+      }
+      last_directory = directory;
+    }
+
+    PageInput input;
+    input.contents = entry.contents.get();
+    if (!CopyPage(entry.path, input, JoinPaths(to, entry.path), entry.path,
+                  tokens, tokens.GetRowsForFile(entry.path), options, index,
+                  store)) {
+      D2D_ERROR << "Could not copy file " << entry.path;
+      return false;
+    }
+    return true;
+  };
+
+  for (const auto& entry : archive.pending) {
+    if (!copy(entry)) {
+      return false;
+    }
+  }
+  archive.pending.clear();
+
+  TarEntry entry;
+  while (archive.reader.ReadEntry(entry)) {
+    if (filter.IsFileIncluded(entry.path) && !copy(entry)) {
+      return false;
+    }
+  }
+  return archive.reader.IsValid();
+}
+
+bool BuildDocset(const std::string& docs, const std::string& location,
+                 const BuildOptions& options) {
+  DoxygenInput input;
+  input.docs = docs;
+  return BuildDocset(std::vector<DoxygenInput>{input}, location, options);
+}
+
+bool BuildDocset(const std::vector<DoxygenInput>& inputs,
+                 const std::string& location, const BuildOptions& options) {
+  if (inputs.empty()) {
+    D2D_ERROR << "There is no Doxygen output to build the docset from.";
+    return false;
+  }
+  // The options that name a single source of tokens, and the archive and
+  // low memory readers, only apply to one output in Documents itself.
+  const auto is_mounted =
+      inputs.size() > 1 || !inputs[0].subdirectory.empty();
+  if (is_mounted) {
+    if (options.low_memory || !options.doxygen_xml.empty() ||
+        !options.tagfile.empty()) {
+      D2D_ERROR << "Doxygen outputs in subdirectories can only be read from "
+                   "their Tokens.xml and not with low memory use.";
+      return false;
+    }
+    std::unordered_set<std::string> subdirectories;
+    for (const auto& input : inputs) {
+      const auto& subdirectory = input.subdirectory;
+      if (subdirectory.empty() || subdirectory == "." ||
+          subdirectory == ".." || subdirectory.find('/') != std::string::npos ||
+          !subdirectories.insert(subdirectory).second) {
+        D2D_ERROR << "Every Doxygen output needs a subdirectory of its own. "
+                     "Got \""
+                  << subdirectory << "\" for " << input.docs;
+        return false;
+      }
+      if (IsTarArchive(input.docs)) {
+        D2D_ERROR << "Doxygen outputs in subdirectories cannot be read from "
+                     "an archive: "
+                  << input.docs;
+        return false;
+      }
+    }
+  }
+  const auto& docs = inputs[0].docs;
+
+  // The inputs that only describe the docset come first so that later rules
+  // can override them.
+  PathFilter filter;
+  for (const auto pattern : {"Tokens.xml", "Info.plist", "Makefile"}) {
+    PathRule rule;
+    rule.pattern = pattern;
+    filter.AddRule(rule);
+  }
+  for (const auto& rule : options.path_rules) {
+    if (!filter.AddRule(rule)) {
+      D2D_ERROR << "Invalid path pattern: \"" << rule.pattern << "\"";
+      return false;
+    }
+  }
+  filter.SetShard(options.shard);
+
+  auto docset_id = options.docset_id;
+  auto docset_name = options.docset_name;
+  const auto needs_info_plist = docset_id.empty() || docset_name.empty();
+
+  std::unique_ptr<ArchiveInput> archive;
+  if (IsTarArchive(docs)) {
+    if (options.low_memory) {
+      D2D_ERROR << "Doxygen output in an archive cannot be read with low "
+                   "memory use.";
+      return false;
+    }
+    archive.reset(new ArchiveInput(docs));
+    if (!archive->reader.IsValid() ||
+        !ReadArchiveHead(*archive, filter, needs_info_plist,
+                         options.doxygen_xml.empty() &&
+                             options.tagfile.empty())) {
+      D2D_ERROR << "Could not read the Doxygen output from the archive "
+                << docs;
+      return false;
+    }
+  }
+
+  if (needs_info_plist) {
+    std::unique_ptr<PlistParser> plist_parser(
+        archive ? new PlistParser(archive->info_plist->Get(),
+                                  archive->info_plist->GetSize())
+                : new PlistParser(JoinPaths({docs, "Info.plist"})));
+    if (!plist_parser->IsValid()) {
+      D2D_ERROR << "Could not parse Info.plist.";
+      return false;
+    }
+    if (docset_id.empty()) {
+      docset_id = plist_parser->ReadDocsetID();
+    }
+    if (docset_name.empty()) {
+      docset_name = plist_parser->ReadDocsetName();
+    }
+  }
   if (docset_id.size() == 0 || docset_name.size() == 0) {
     D2D_ERROR << "Docset name or ID could not be read from the Info.plist.";
     return false;
@@ -35,6 +567,26 @@ bool BuildDocset(const std::string& docs, const std::string& location) {
     return false;
   }
 
+  const auto docset_path = JoinPaths({location, docset_id + ".docset"});
+  if (!options.delta_from.empty() && options.shard.IsPartial()) {
+    D2D_ERROR << "A delta can only be written for the merged docset.";
+    return false;
+  }
+  if (!options.delta_from.empty()) {
+    struct stat old_stat = {};
+    struct stat new_stat = {};
+    if (::stat(options.delta_from.c_str(), &old_stat) != 0) {
+      D2D_ERROR << "Could not find the previous docset " << options.delta_from;
+      return false;
+    }
+    if (::stat(docset_path.c_str(), &new_stat) == 0 &&
+        old_stat.st_dev == new_stat.st_dev &&
+        old_stat.st_ino == new_stat.st_ino) {
+      D2D_ERROR << "The previous docset would be overwritten by the new one.";
+      return false;
+    }
+  }
+
   DocsetIndex index(JoinPaths(resources_dir, "docSet.dsidx"));
 
   if (!index.IsValid()) {
@@ -42,75 +594,343 @@ bool BuildDocset(const std::string& docs, const std::string& location) {
     return false;
   }
 
-  TokenParser token_parser(JoinPaths({docs, "Tokens.xml"}));
-  if (!token_parser.IsValid()) {
-    D2D_ERROR << "Tokens.xml file was not found in " << docs
-              << ". Did you make sure to generate Doxygen documentation with "
-                 "the GENERATE_DOCSET option set to YES?";
+  if (options.full_text_search && !index.EnableFullTextSearch()) {
+    D2D_ERROR << "Could not enable full-text search in the docset index.";
     return false;
   }
 
-  auto tokens = token_parser.ReadTokens();
+  std::vector<std::string> documents_directory = {
+      location, docset_id + ".docset", "Contents", "Resources", "Documents"};
 
-  if (!index.AddTokens(tokens)) {
-    D2D_ERROR << "Could not add tokens to docset index.";
-    return false;
+  std::unique_ptr<ObjectStore> store;
+  if (!options.store.empty()) {
+    store.reset(new ObjectStore(options.store));
+    if (!store->IsValid()) {
+      return false;
+    }
   }
 
-  std::vector<std::string> documents_directory = {
-      location, docset_id + ".docset", "Contents", "Resources", "Documents"};
+  if (!options.doxygen_xml.empty() && !options.tagfile.empty()) {
+    D2D_ERROR << "Tokens can be read from Doxygen XML or from a tag file, "
+                 "not both.";
+    return false;
+  }
 
-  const std::set<std::string> filtered = {
-      "Tokens.xml",
-      "Info.plist",
-      "Tokens.xml",
-      "Makefile",
+  const auto tokens_path = !options.tagfile.empty()
+                               ? options.tagfile
+                               : JoinPaths({docs, "Tokens.xml"});
+  const auto tokens_error = [&options](const std::string& docs) {
+    if (!options.tagfile.empty()) {
+      D2D_ERROR << "Could not read the tag file " << options.tagfile
+                << ". Did you make sure to generate it with the "
+                   "GENERATE_TAGFILE option?";
+      return;
+    }
+    if (!options.doxygen_xml.empty()) {
+      D2D_ERROR << "Could not read the Doxygen XML output in "
+                << options.doxygen_xml
+                << ". Did you make sure to generate it with the GENERATE_XML "
+                   "option set to YES?";
+      return;
+    }
+    D2D_ERROR << "Tokens.xml file was not found in " << docs
+              << ". Did you make sure to generate Doxygen documentation with "
+                 "the GENERATE_DOCSET option set to YES?";
   };
+  const auto concurrency = options.concurrency != 0 ? options.concurrency
+                                                    : GetDefaultConcurrency();
+  // The accelerators of a shard would only cover its own rows, so they are
+  // built when the shards are merged.
+  const auto search_accelerators =
+      options.search_accelerators && !options.shard.IsPartial();
 
-  auto tokens_by_file = Token::GetTokensByFile(tokens);
+  if (options.low_memory) {
+    // Spill files go next to the output rather than to a temporary directory
+    // that may itself be backed by memory.
+    TokenSorter sorter(location);
+    if (!sorter.IsValid()) {
+      return false;
+    }
+    bool indexed = false;
+    {
+      PerfScope scope("Indexing tokens", "task");
+      if (!options.doxygen_xml.empty()) {
+        CompoundReader reader(options.doxygen_xml, concurrency);
+        indexed = IndexTokensInChunks(reader, options.shard, sorter, index);
+      } else if (!options.tagfile.empty()) {
+        TagfileReader reader(options.tagfile);
+        indexed = IndexTokensInChunks(reader, options.shard, sorter, index);
+      } else {
+        TokenStream stream(tokens_path);
+        indexed = IndexTokensInChunks(stream, options.shard, sorter, index);
+      }
+    }
+    if (!indexed) {
+      tokens_error(docs);
+      return false;
+    }
+    PerfScope scope("Copying pages", "task");
+    if (!CopyFilesInPathOrder(docs, documents_directory, filter, sorter,
+                              options, index, store.get())) {
+      D2D_ERROR << "Could not copy files to the Docset documents directory.";
+      return false;
+    }
+  } else {
+    const auto read_tokens = [&options, &archive](
+                                 const std::string& tokens_path,
+                                 size_t concurrency,
+                                 std::vector<Token>& tokens) {
+      if (archive && options.tagfile.empty()) {
+        TokenParser token_parser(*archive->tokens_xml, concurrency);
+        tokens = token_parser.ReadTokens();
+        return token_parser.IsValid();
+      }
+      if (!options.tagfile.empty()) {
+        TagfileReader reader(tokens_path);
+        tokens = reader.ReadTokens();
+        return reader.IsValid();
+      }
+      TokenParser token_parser(tokens_path, concurrency);
+      tokens = token_parser.ReadTokens();
+      return token_parser.IsValid();
+    };
 
-  auto predicate = [&filtered, &tokens_by_file](
-                       const std::string& from_file_name,  //
-                       const struct stat& from_stat,       //
-                       const AutoFD& from_fd,              //
-                       const std::string& to_file_name) -> bool {
-    // Check if this file needs to be filtered away.
-    if (filtered.count(from_file_name) != 0) {
-      return true;
+    // The tokens and files of one Doxygen output. Its tokens and files are
+    // relative to it, and only the paths in the index and of the copies are
+    // rebased onto its subdirectory.
+    struct Mount {
+      std::string docs;
+      std::string tokens_path;
+      std::string cache_path;
+      std::vector<std::string> to;
+      std::string prefix;
+      TokenTable tokens;
+      std::vector<std::string> pages;
+      std::vector<std::string> assets;
+      // The assets that turned out to have tokens.
+      std::vector<std::string> other_pages;
+    };
+    std::vector<Mount> mounts(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+      const auto& subdirectory = inputs[i].subdirectory;
+      auto& mount = mounts[i];
+      mount.docs = inputs[i].docs;
+      mount.tokens_path = is_mounted
+                              ? JoinPaths({inputs[i].docs, "Tokens.xml"})
+                              : tokens_path;
+      // Tokens read from an archive are not cached.
+      if (options.token_cache && !archive) {
+        mount.cache_path = JoinPaths(
+            {location, docset_id + (subdirectory.empty() ? "" : ".") +
+                           subdirectory + ".tokencache"});
+      }
+      mount.to = documents_directory;
+      if (!subdirectory.empty()) {
+        mount.to.push_back(subdirectory);
+        mount.prefix = subdirectory + "/";
+      }
     }
 
-    // Check if this is a file in which a TOC needs to be generated.
-    {
-      const auto found = tokens_by_file.find(from_file_name);
-      if (found != tokens_by_file.end()) {
-        HTMLParser parser(OpenFileReadOnly(from_fd, from_stat.st_size));
-        auto html_with_toc = parser.BuildHTMLWithTOC(found->second);
-        if (html_with_toc.IsValid()) {
-          if (!CopyData(html_with_toc.Get(),      //
-                        html_with_toc.GetSize(),  //
-                        to_file_name)) {
-            D2D_ERROR << "Could not copy HTML with TOC to " << to_file_name
-                      << ". Will try moving file without TOC.";
-
-          } else {
-            return true;
+    // The index is written on its own thread while the pages are copied, and
+    // the files without tokens are copied while the tokens are still read.
+    TaskGraph graph;
+    const auto read = graph.Add("Reading tokens", [&]() {
+      // The outputs are read side by side and share the threads.
+      const auto mount_concurrency =
+          std::max<size_t>(1, concurrency / mounts.size());
+      std::atomic<bool> read_all(true);
+      ParallelFor(mounts.size(), concurrency, [&](size_t i) {
+        auto& mount = mounts[i];
+        const auto read =
+            !options.doxygen_xml.empty()
+                ? ReadCompoundTokens(options.doxygen_xml, mount_concurrency,
+                                     mount.tokens)
+                : ReadTokenTable(
+                      mount.tokens_path, mount.cache_path,
+                      [&](std::vector<Token>& tokens) {
+                        return read_tokens(mount.tokens_path,
+                                           mount_concurrency, tokens);
+                      },
+                      mount.tokens);
+        if (!read) {
+          tokens_error(mount.docs);
+          read_all = false;
+          return;
+        }
+        D2D_VERBOSE << "Read " << mount.tokens.GetSize() << " tokens in "
+                    << mount.tokens.GetFileCount() << " pages of "
+                    << mount.docs << ".";
+      });
+      return read_all.load();
+    });
+
+    graph.Add(
+        "Indexing tokens",
+        [&]() {
+          for (const auto& mount : mounts) {
+            // The pages of other shards are not copied, so neither are their
+            // tokens.
+            const auto& tokens = mount.tokens;
+            std::vector<uint32_t> rows;
+            for (size_t row = 0; row < tokens.GetSize(); row++) {
+              if (!options.shard.IsPartial() ||
+                  IsInShard(tokens.GetPaths().Get(row), options.shard)) {
+                rows.push_back(static_cast<uint32_t>(row));
+              }
+            }
+            // The index is held for one chunk at a time so that the page
+            // text can be added in between.
+            const size_t kChunkRows = 64u << 10;
+            for (size_t begin = 0; begin < rows.size(); begin += kChunkRows) {
+              const auto end = std::min(begin + kChunkRows, rows.size());
+              if (!index.AddTokens(tokens,
+                                   {rows.data() + begin, rows.data() + end},
+                                   mount.prefix)) {
+                D2D_ERROR << "Could not add tokens to docset index.";
+                return false;
+              }
+            }
           }
-        } else {
-          D2D_ERROR << "Could not build TOC in file: " << from_file_name
-                    << ". Skipping.";
+          return true;
+        },
+        {read});
+
+    // Copies the |files| of every mount on all threads. The files of all
+    // mounts are handed out together in chunks, so that small outputs do
+    // not leave threads idle.
+    using CopyMountedFile = std::function<bool(
+        const Mount& mount, const std::string& file, const PageInput& input)>;
+    const auto copy_files = [&](std::vector<std::string> Mount::*files,
+                                const CopyMountedFile& copy) {
+      const size_t kChunkFiles = 16;
+      // The mount and the first file of every chunk.
+      std::vector<std::pair<size_t, size_t>> chunks;
+      for (size_t i = 0; i < mounts.size(); i++) {
+        for (size_t begin = 0; begin < (mounts[i].*files).size();
+             begin += kChunkFiles) {
+          chunks.emplace_back(i, begin);
         }
       }
+      std::atomic<bool> copied_all(true);
+      ParallelFor(chunks.size(), concurrency, [&](size_t chunk) {
+        const auto& mount = mounts[chunks[chunk].first];
+        const auto& mount_files = mount.*files;
+        const auto end =
+            std::min(chunks[chunk].second + kChunkFiles, mount_files.size());
+        for (auto i = chunks[chunk].second; i < end && copied_all; i++) {
+          const auto& file = mount_files[i];
+          if (!CopyInputFile(mount.docs, file, [&](const PageInput& input) {
+                return copy(mount, file, input);
+              })) {
+            copied_all = false;
+          }
+        }
+      });
+      return copied_all.load();
+    };
+
+    const CopyMountedFile copy_page = [&](const Mount& mount,
+                                          const std::string& file,
+                                          const PageInput& input) {
+      return CopyPage(file, input, JoinPaths(mount.to, file),
+                      mount.prefix + file, mount.tokens,
+                      mount.tokens.GetRowsForFile(file), options, index,
+                      store.get());
+    };
+
+    if (archive) {
+      graph.Add(
+          "Copying the archive",
+          [&]() {
+            if (!CopyArchiveFiles(*archive, documents_directory, filter,
+                                  mounts[0].tokens, options, index,
+                                  store.get())) {
+              D2D_ERROR << "Could not copy files to the Docset documents "
+                           "directory.";
+              return false;
+            }
+            return true;
+          },
+          {read});
+    } else {
+      const auto list = graph.Add("Listing files", [&]() {
+        for (auto& mount : mounts) {
+          std::vector<std::string> files;
+          if (!ListFiles(mount.docs, files, &filter) ||
+              !MakeFileDirectories(mount.to, files)) {
+            D2D_ERROR << "Could not copy files to the Docset documents "
+                         "directory.";
+            return false;
+          }
+          for (auto& file : files) {
+            (IsHTMLFile(file) ? mount.pages : mount.assets)
+                .push_back(std::move(file));
+          }
+        }
+        return true;
+      });
+
+      // Files without an HTML extension are copied as-is while the tokens
+      // are read. The few of them that have tokens are rewritten after.
+      const auto assets = graph.Add(
+          "Copying assets",
+          [&]() {
+            return copy_files(&Mount::assets, [&](const Mount& mount,
+                                                  const std::string& file,
+                                                  const PageInput& input) {
+              return CopyOutput(input, JoinPaths(mount.to, file), store.get());
+            });
+          },
+          {list});
+
+      graph.Add(
+          "Copying pages",
+          [&]() { return copy_files(&Mount::pages, copy_page); }, {read, list});
+
+      graph.Add(
+          "Rewriting other pages",
+          [&]() {
+            for (auto& mount : mounts) {
+              for (const auto& file : mount.assets) {
+                if (!mount.tokens.GetRowsForFile(file).empty()) {
+                  mount.other_pages.push_back(file);
+                }
+              }
+            }
+            return copy_files(&Mount::other_pages, copy_page);
+          },
+          {read, assets});
     }
 
-    // Copy file as-is.
-    return CopyFile(from_stat, from_fd, to_file_name);
-  };
+    if (!graph.Run()) {
+      return false;
+    }
+  }
+
+  if (store) {
+    D2D_LOG << "Added " << store->GetAddedObjectCount() << " objects ("
+            << store->GetAddedBytes() << " bytes) to the store and reused "
+            << store->GetReusedObjectCount() << ".";
+  }
+
+  if (!index.Commit()) {
+    D2D_ERROR << "Could not commit the page text to the docset index.";
+    return false;
+  }
 
-  if (!CopyFiles(docs, documents_directory, predicate)) {
-    D2D_ERROR << "Could not copy files to the Docset documents directory.";
+  if (options.shard.IsPartial() &&
+      !index.SetShard(options.shard, options.search_accelerators)) {
     return false;
   }
 
+  {
+    PerfScope scope("Finalizing the index", "task");
+    if (!index.Finalize(search_accelerators)) {
+      D2D_ERROR << "Could not finalize the docset index.";
+      return false;
+    }
+  }
+
   if (!WriteDocSetPlist(docset_id, docset_name,
                         JoinPaths({location, docset_id + ".docset", "Contents",
                                    "Info.plist"}))) {
@@ -118,6 +938,25 @@ bool BuildDocset(const std::string& docs, const std::string& location) {
     return false;
   }
 
+  if (!NormalizeFileModes(docset_path, options.mtime)) {
+    return false;
+  }
+
+  if (!options.delta_from.empty()) {
+    const auto delta_path = JoinPaths({location, docset_id + ".delta"});
+    DeltaStats stats;
+    if (!WriteDocsetDelta(options.delta_from, docset_path, delta_path,
+                          stats)) {
+      D2D_ERROR << "Could not write the delta from " << options.delta_from;
+      return false;
+    }
+    D2D_LOG << "Wrote the delta to " << delta_path << ": "
+            << stats.written_files << " files (" << stats.written_bytes
+            << " bytes) written, " << stats.removed_files << " removed, "
+            << stats.added_rows << " index rows added and "
+            << stats.removed_rows << " removed.";
+  }
+
   return true;
 }
 
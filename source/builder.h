@@ -3,10 +3,87 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <string>
+#include <vector>
+
+#include "path_filter.h"
+#include "shard.h"
 
 namespace d2d {
 
-bool BuildDocset(const std::string& docs, const std::string& location);
+struct BuildOptions {
+  // Populate the searchText full-text table with symbols and page text.
+  bool full_text_search = false;
+  // Add the case-insensitive prefix and substring lookup structures. See
+  // |BuildSearchAccelerators|.
+  bool search_accelerators = false;
+  // Keep the parsed tokens in a binary cache next to the docset and reuse
+  // them while Tokens.xml is unchanged.
+  bool token_cache = false;
+  // Hold at most a chunk of Tokens.xml in memory at a time. Tokens are sorted
+  // by page through files next to the docset, and pages are matched to their
+  // tokens by their path relative to |docs|. The token cache is not used.
+  // The |CompoundReader| of |doxygen_xml| and the |TagfileReader| of
+  // |tagfile| still remember every member.
+  bool low_memory = false;
+  // If not empty, the directory of an |ObjectStore| that the files in
+  // Documents are linked into.
+  std::string store;
+  // If not empty, the path of the previous version of the docset. A delta
+  // package that turns it into the new docset is written next to the new
+  // docset, named after the docset ID with a ".delta" extension. See
+  // |WriteDocsetDelta|.
+  std::string delta_from;
+  // Rules for the files and directories of the Doxygen output to leave out
+  // of the docset, applied in order after the built-in rules that leave out
+  // Tokens.xml, Info.plist and Makefile. See |PathFilter|.
+  std::vector<PathRule> path_rules;
+  // If not empty, the directory of Doxygen's XML output (GENERATE_XML) to read
+  // the tokens from instead of Tokens.xml. See |CompoundReader|. The token
+  // cache is not used.
+  std::string doxygen_xml;
+  // If not empty, the path of a Doxygen tag file (GENERATE_TAGFILE) to read
+  // the tokens from instead of Tokens.xml. See |TagfileReader|.
+  std::string tagfile;
+  // If not empty, used instead of the docset ID and name in Info.plist.
+  // Info.plist is not read if both are given.
+  std::string docset_id;
+  std::string docset_name;
+  // If partial, only the files of the Doxygen output in |shard|, and the
+  // tokens documented in them, go into the docset. The shards of a build are
+  // combined with |MergeDocsetShards|.
+  Shard shard;
+  // The number of threads to use. Zero picks the number of CPUs.
+  size_t concurrency = 0;
+  // If not negative, the modification time of every file of the docset, in
+  // seconds since the epoch, such as from SOURCE_DATE_EPOCH. The rest of the
+  // docset only depends on the inputs.
+  int64_t mtime = -1;
+};
+
+bool BuildDocset(const std::string& docs, const std::string& location,
+                 const BuildOptions& options = {});
+
+// One of the Doxygen outputs of a docset built from several of them.
+struct DoxygenInput {
+  // The directory of Documents the output is copied to, or empty for
+  // Documents itself. A single name, without "/".
+  std::string subdirectory;
+  std::string docs;
+};
+
+// Builds one docset from several Doxygen outputs, such as those of the
+// subprojects of a repository, each copied to its own subdirectory. Their
+// tokens are read in parallel and indexed together with their paths rebased
+// onto the subdirectories. The docset ID and name are read from the
+// Info.plist of the first output unless |options| gives them. Outputs in
+// subdirectories must be directories with a Tokens.xml, and cannot be read
+// with |BuildOptions::low_memory|.
+bool BuildDocset(const std::vector<DoxygenInput>& inputs,
+                 const std::string& location,
+                 const BuildOptions& options = {});
 
 }  // namespace d2d
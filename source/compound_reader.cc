@@ -0,0 +1,307 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "compound_reader.h"
+
+#include <string.h>
+#include <tinyxml2.h>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#include "file.h"
+#include "logger.h"
+#include "parallel.h"
+#include "scan.h"
+
+namespace d2d {
+
+// The order compounds are read in. Compounds that are not read at all (pages,
+// examples and directories) have none.
+static int GetCompoundRank(const std::string& kind) {
+  if (IsClassCompoundKind(kind) || kind == "namespace") {
+    return 0;
+  }
+  if (kind == "file") {
+    return 1;
+  }
+  if (kind == "group") {
+    return 2;
+  }
+  return -1;
+}
+
+static std::string GetText(const tinyxml2::XMLElement* element,
+                           const char* name) {
+  const auto child = element->FirstChildElement(name);
+  const auto text = child != nullptr ? child->GetText() : nullptr;
+  return text != nullptr ? text : "";
+}
+
+// The name of the file a compound or member is declared in, without its
+// directory.
+static std::string GetDeclaredIn(const tinyxml2::XMLElement* element) {
+  const auto location = element->FirstChildElement("location");
+  const auto file =
+      location != nullptr ? location->Attribute("file") : nullptr;
+  if (file == nullptr) {
+    return "";
+  }
+  const auto slash = ::strrchr(file, '/');
+  return slash != nullptr ? slash + 1 : file;
+}
+
+// The scope of a qualified name, such as "a::b" for "a::b::c".
+static std::string GetEnclosingScope(const std::string& qualified_name,
+                                     const std::string& name) {
+  if (qualified_name.size() <= name.size() ||
+      qualified_name.compare(qualified_name.size() - name.size(),
+                             name.size(), name) != 0) {
+    return "";
+  }
+  auto scope = qualified_name.substr(0, qualified_name.size() - name.size());
+  while (!scope.empty() && (scope.back() == ':' || scope.back() == '.')) {
+    scope.pop_back();
+  }
+  return scope;
+}
+
+// Member IDs are the name of the page the member is documented on followed
+// by "_1" and its anchor. Anchors do not contain underscores.
+static bool SplitMemberID(const char* id, std::string& path,
+                          std::string& anchor) {
+  const std::string member_id = id != nullptr ? id : "";
+  const auto separator = member_id.rfind("_1");
+  if (separator == std::string::npos || separator == 0 ||
+      separator + 2 == member_id.size()) {
+    return false;
+  }
+  path = member_id.substr(0, separator) + ".html";
+  anchor = member_id.substr(separator + 2);
+  return true;
+}
+
+static void ReadMember(const tinyxml2::XMLElement* member,
+                       const std::string& compound_kind,
+                       const std::string& compound_scope,
+                       const std::string& language,
+                       std::vector<Token>& tokens) {
+  std::string path;
+  std::string anchor;
+  if (!SplitMemberID(member->Attribute("id"), path, anchor)) {
+    return;
+  }
+
+  const auto kind = member->Attribute("kind");
+  const auto name = GetText(member, "name");
+  if (kind == nullptr || name.empty()) {
+    return;
+  }
+
+  // Older versions of Doxygen do not write qualified names.
+  const auto qualified_name = GetText(member, "qualifiedname");
+  const auto scope = qualified_name.empty()
+                         ? compound_scope
+                         : GetEnclosingScope(qualified_name, name);
+  const auto declared_in = GetDeclaredIn(member);
+  const auto is_static = member->Attribute("static", "yes") != nullptr;
+  tokens.emplace_back(name, GetMemberTypeCode(kind, is_static, compound_kind),
+                      scope, path, anchor, language, declared_in);
+
+  // The values of an enumeration are in the scope of the enumeration.
+  for (auto value = member->FirstChildElement("enumvalue"); value != nullptr;
+       value = value->NextSiblingElement("enumvalue")) {
+    const auto value_name = GetText(value, "name");
+    if (!value_name.empty() &&
+        SplitMemberID(value->Attribute("id"), path, anchor)) {
+      tokens.emplace_back(value_name, "econst", scope, path, anchor, language,
+                          declared_in);
+    }
+  }
+}
+
+static void ReadCompound(const tinyxml2::XMLElement* compound,
+                         std::vector<Token>& tokens) {
+  const auto id = compound->Attribute("id");
+  const auto kind_attribute = compound->Attribute("kind");
+  if (id == nullptr || kind_attribute == nullptr) {
+    return;
+  }
+  const std::string kind = kind_attribute;
+  const auto name = GetText(compound, "compoundname");
+  const auto language_attribute = compound->Attribute("language");
+  const auto language =
+      language_attribute != nullptr ? GetLanguageCode(language_attribute) : "";
+
+  const auto type = GetCompoundTypeCode(
+      kind, compound->FirstChildElement("templateparamlist") != nullptr);
+  if (!type.empty() && !name.empty()) {
+    const auto separator = name.rfind("::");
+    tokens.emplace_back(
+        name, type,
+        separator != std::string::npos ? name.substr(0, separator) : "",
+        std::string(id) + ".html", "", language,
+        IsClassCompoundKind(kind) ? GetDeclaredIn(compound) : "");
+  }
+
+  // Members of files and groups that are not in a namespace are global.
+  const auto member_scope =
+      IsClassCompoundKind(kind) || kind == "namespace" ? name : "";
+  for (auto section = compound->FirstChildElement("sectiondef");
+       section != nullptr;
+       section = section->NextSiblingElement("sectiondef")) {
+    for (auto member = section->FirstChildElement("memberdef");
+         member != nullptr; member = member->NextSiblingElement("memberdef")) {
+      ReadMember(member, kind, member_scope, language, tokens);
+    }
+  }
+}
+
+static bool ReadCompoundFile(const std::string& path,
+                             std::vector<Token>& tokens) {
+  auto mapping = OpenFileReadOnly(path);
+  if (!mapping) {
+    D2D_ERROR << "Could not read XML file: " << path;
+    return false;
+  }
+
+  tinyxml2::XMLDocument document;
+  if (document.Parse(static_cast<const char*>(mapping->Get()),
+                     mapping->GetSize()) != tinyxml2::XML_SUCCESS) {
+    D2D_ERROR << "Could not parse XML file: " << path;
+    return false;
+  }
+
+  if (auto root = document.FirstChildElement("doxygen")) {
+    for (auto compound = root->FirstChildElement("compounddef");
+         compound != nullptr;
+         compound = compound->NextSiblingElement("compounddef")) {
+      ReadCompound(compound, tokens);
+    }
+  }
+  return true;
+}
+
+// The value of the attribute |name| in the tag [tag, tag_end).
+static std::string GetTagAttribute(const char* tag, const char* tag_end,
+                                   const std::string& name) {
+  const auto prefix = " " + name + "=\"";
+  const auto value = ScanFind(tag, tag_end, prefix.data(), prefix.size());
+  if (value == tag_end) {
+    return "";
+  }
+  const auto value_begin = value + prefix.size();
+  const auto value_end = static_cast<const char*>(
+      ::memchr(value_begin, '"', tag_end - value_begin));
+  return value_end != nullptr ? std::string(value_begin, value_end) : "";
+}
+
+CompoundReader::CompoundReader(const std::string& xml_directory,
+                               size_t concurrency, size_t chunk_size)
+    : xml_directory_(xml_directory),
+      concurrency_(std::max<size_t>(concurrency, 1)),
+      chunk_size_(std::max<size_t>(chunk_size, 1)) {
+  const auto index_path = JoinPaths({xml_directory, "index.xml"});
+  auto mapping = OpenFileReadOnly(index_path);
+  if (!mapping) {
+    D2D_ERROR << "Could not read XML file: " << index_path;
+    return;
+  }
+
+  // index.xml also lists every member of every compound, so it is only
+  // scanned for the <compound> tags rather than parsed.
+  static const char kTag[] = "<compound ";
+  const auto end = static_cast<const char*>(mapping->Get()) +
+                   mapping->GetSize();
+  std::vector<std::pair<int, Compound>> ranked;
+  for (auto tag = static_cast<const char*>(mapping->Get());;) {
+    tag = ScanFind(tag, end, kTag, sizeof(kTag) - 1);
+    if (tag == end) {
+      break;
+    }
+    const auto tag_end =
+        static_cast<const char*>(::memchr(tag, '>', end - tag));
+    if (tag_end == nullptr) {
+      break;
+    }
+    Compound compound;
+    compound.id = GetTagAttribute(tag, tag_end, "refid");
+    compound.kind = GetTagAttribute(tag, tag_end, "kind");
+    const auto rank = GetCompoundRank(compound.kind);
+    if (!compound.id.empty() && rank >= 0) {
+      ranked.emplace_back(rank, std::move(compound));
+    }
+    tag = tag_end;
+  }
+
+  if (ranked.empty()) {
+    D2D_ERROR << "No compounds were found in " << index_path;
+    return;
+  }
+
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const std::pair<int, Compound>& a,
+                      const std::pair<int, Compound>& b) {
+                     return a.first < b.first;
+                   });
+  compounds_.reserve(ranked.size());
+  for (auto& compound : ranked) {
+    compounds_.emplace_back(std::move(compound.second));
+  }
+  is_valid_ = true;
+}
+
+CompoundReader::~CompoundReader() = default;
+
+bool CompoundReader::IsValid() const { return is_valid_; }
+
+bool CompoundReader::ReadCompounds(size_t count, std::vector<Token>& tokens) {
+  tokens.clear();
+  if (!is_valid_ || next_compound_ == compounds_.size()) {
+    return false;
+  }
+
+  const auto first = next_compound_;
+  count = std::min(count, compounds_.size() - first);
+  next_compound_ += count;
+
+  std::vector<std::vector<Token>> compound_tokens(count);
+  std::atomic<bool> failed(false);
+  ParallelFor(count, concurrency_, [&](size_t index) {
+    const auto path =
+        JoinPaths({xml_directory_, compounds_[first + index].id + ".xml"});
+    if (!ReadCompoundFile(path, compound_tokens[index])) {
+      failed = true;
+    }
+  });
+  if (failed) {
+    is_valid_ = false;
+    return false;
+  }
+
+  // Merged in order so that the first compound to list a member wins,
+  // regardless of which thread finished first.
+  for (auto& compound : compound_tokens) {
+    for (auto& token : compound) {
+      if (!token.GetAnchor().empty() &&
+          !member_paths_.insert(token.GetIndexPath()).second) {
+        continue;
+      }
+      tokens.emplace_back(std::move(token));
+    }
+  }
+  return true;
+}
+
+bool CompoundReader::ReadChunk(std::vector<Token>& tokens) {
+  return ReadCompounds(chunk_size_, tokens);
+}
+
+std::vector<Token> CompoundReader::ReadTokens() {
+  std::vector<Token> tokens;
+  ReadCompounds(compounds_.size(), tokens);
+  return tokens;
+}
+
+}  // namespace d2d
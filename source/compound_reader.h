@@ -0,0 +1,70 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "macros.h"
+#include "token.h"
+
+namespace d2d {
+
+// Reads the tokens that Doxygen's docset generator writes to Tokens.xml from
+// its XML output (GENERATE_XML) instead. Every compound (class, namespace,
+// file, group...) has a file of its own, which are parsed on up to
+// |concurrency| threads. The list of compounds is scanned from index.xml.
+//
+// Compounds that declare scopes are read first, then files, then groups. A
+// member that several compounds list is only read the first time, so it keeps
+// the scope of its class or namespace. Pages are assumed to have the ".html"
+// extension.
+class CompoundReader {
+ public:
+  static constexpr size_t kDefaultChunkSize = 1024;
+
+  // |chunk_size| is the number of compounds read by |ReadChunk|.
+  CompoundReader(const std::string& xml_directory, size_t concurrency = 1,
+                 size_t chunk_size = kDefaultChunkSize);
+
+  ~CompoundReader();
+
+  bool IsValid() const;
+
+  size_t GetCompoundCount() const { return compounds_.size(); }
+
+  // Replaces |tokens| with those of the next chunk of compounds. Returns false
+  // once all compounds have been read, or if one could not be parsed, which
+  // also makes the reader invalid.
+  bool ReadChunk(std::vector<Token>& tokens);
+
+  // The tokens of all the compounds that have not been read yet.
+  std::vector<Token> ReadTokens();
+
+ private:
+  struct Compound {
+    std::string id;
+    std::string kind;
+  };
+
+  std::string xml_directory_;
+  std::vector<Compound> compounds_;
+  // The pages and anchors of the members read so far. They are kept for the
+  // whole run, so unlike the tokens, they grow with the number of members
+  // even when read a chunk at a time.
+  std::unordered_set<std::string> member_paths_;
+  size_t concurrency_ = 1;
+  size_t chunk_size_ = kDefaultChunkSize;
+  size_t next_compound_ = 0;
+  bool is_valid_ = false;
+
+  bool ReadCompounds(size_t count, std::vector<Token>& tokens);
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(CompoundReader);
+};
+
+}  // namespace d2d
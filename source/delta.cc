@@ -0,0 +1,588 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "delta.h"
+
+#include <errno.h>
+#include <sqlite3.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "file.h"
+#include "hash.h"
+#include "logger.h"
+
+namespace d2d {
+
+// A package is the magic and version followed by records up to the end of the
+// file. Integers are little-endian. Strings and file contents are a length
+// followed by the bytes.
+static constexpr char kDeltaMagic[] = "D2DDELTA";
+static constexpr uint32_t kDeltaVersion = 1;
+static constexpr char kIndexPath[] = "Contents/Resources/docSet.dsidx";
+
+namespace {
+
+enum class RecordKind : uint8_t {
+  // Path, whether there was an old file, the hash of the old file and the
+  // new contents.
+  kWriteFile = 1,
+  // Path and the hash of the old file.
+  kRemoveFile = 2,
+  // Name, type and path of a searchIndex row.
+  kAddRow = 3,
+  kRemoveRow = 4,
+};
+
+// Name, type and path.
+using Row = std::array<std::string, 3>;
+
+struct Record {
+  RecordKind kind = RecordKind::kWriteFile;
+  std::string path;
+  bool has_old = false;
+  uint64_t old_hash = 0;
+  const char* data = nullptr;
+  uint64_t length = 0;
+  Row row;
+  // Set while applying if the docset already has the new state.
+  bool is_applied = false;
+};
+
+// Collects records. File contents are kept mapped and written in place.
+class DeltaWriter {
+ public:
+  DeltaWriter() {
+    headers_.emplace_back(kDeltaMagic, sizeof(kDeltaMagic) - 1);
+    AppendInteger<uint32_t>(headers_.back(), kDeltaVersion);
+  }
+
+  void WriteFile(const std::string& path, bool has_old, uint64_t old_hash,
+                 std::unique_ptr<AutoMapping> contents) {
+    auto& header = AddHeader(RecordKind::kWriteFile);
+    AppendString(header, path.data(), path.size());
+    header.push_back(has_old ? 1 : 0);
+    AppendInteger<uint64_t>(header, old_hash);
+    AppendInteger<uint64_t>(header, contents ? contents->GetSize() : 0);
+    if (contents) {
+      contents_.emplace_back(headers_.size(), std::move(contents));
+    }
+  }
+
+  void RemoveFile(const std::string& path, uint64_t old_hash) {
+    auto& header = AddHeader(RecordKind::kRemoveFile);
+    AppendString(header, path.data(), path.size());
+    AppendInteger<uint64_t>(header, old_hash);
+  }
+
+  void ChangeRow(RecordKind kind, const Row& row) {
+    auto& header = AddHeader(kind);
+    for (const auto& field : row) {
+      AppendString(header, field.data(), field.size());
+    }
+  }
+
+  bool Write(const std::string& path) const {
+    std::vector<DataSpan> spans;
+    auto contents = contents_.begin();
+    for (size_t header = 0; header < headers_.size(); header++) {
+      spans.push_back({headers_[header].data(), headers_[header].size()});
+      for (; contents != contents_.end() && contents->first == header + 1;
+           contents++) {
+        spans.push_back({contents->second->Get(), contents->second->GetSize()});
+      }
+    }
+    return CopyData(spans, path);
+  }
+
+ private:
+  // Consecutive records share a header buffer until file contents come
+  // between them.
+  std::vector<std::string> headers_;
+  // The contents of files and the number of header buffers before them.
+  std::vector<std::pair<size_t, std::unique_ptr<AutoMapping>>> contents_;
+
+  template <class T>
+  static void AppendInteger(std::string& buffer, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+      buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+
+  static void AppendString(std::string& buffer, const char* data,
+                           size_t length) {
+    AppendInteger<uint32_t>(buffer, static_cast<uint32_t>(length));
+    buffer.append(data, length);
+  }
+
+  std::string& AddHeader(RecordKind kind) {
+    if (!contents_.empty() && contents_.back().first == headers_.size()) {
+      headers_.emplace_back();
+    }
+    headers_.back().push_back(static_cast<char>(kind));
+    return headers_.back();
+  }
+};
+
+class DeltaReader {
+ public:
+  DeltaReader(const void* data, size_t length)
+      : cursor_(static_cast<const char*>(data)), end_(cursor_ + length) {}
+
+  bool IsAtEnd() const { return cursor_ == end_; }
+
+  template <class T>
+  bool ReadInteger(T& value) {
+    if (static_cast<size_t>(end_ - cursor_) < sizeof(T)) {
+      return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      value |= static_cast<T>(static_cast<uint8_t>(cursor_[i])) << (8 * i);
+    }
+    cursor_ += sizeof(T);
+    return true;
+  }
+
+  bool ReadBytes(uint64_t length, const char*& data) {
+    if (static_cast<uint64_t>(end_ - cursor_) < length) {
+      return false;
+    }
+    data = cursor_;
+    cursor_ += length;
+    return true;
+  }
+
+  bool ReadString(std::string& string) {
+    uint32_t length = 0;
+    const char* data = nullptr;
+    if (!ReadInteger(length) || !ReadBytes(length, data)) {
+      return false;
+    }
+    string.assign(data, length);
+    return true;
+  }
+
+ private:
+  const char* cursor_;
+  const char* end_;
+};
+
+}  // namespace
+
+// The contents of the file at |path|. Empty files are not mapped.
+static bool ReadContents(const std::string& path, const struct stat& file_stat,
+                         std::unique_ptr<AutoMapping>& contents) {
+  contents.reset();
+  if (file_stat.st_size == 0) {
+    return true;
+  }
+  contents = OpenFileReadOnly(path);
+  return contents != nullptr;
+}
+
+static uint64_t HashContents(const std::unique_ptr<AutoMapping>& contents) {
+  return contents ? Hash64(contents->Get(), contents->GetSize())
+                  : Hash64("", 0);
+}
+
+// Reads the rows of the searchIndex table. |has_other_tables| tells whether
+// the index holds anything that is not described by those rows.
+static bool ReadSearchIndex(const std::string& index_path,
+                            std::vector<Row>& rows, bool& has_other_tables) {
+  sqlite3* database = nullptr;
+  if (sqlite3_open_v2(index_path.c_str(), &database, SQLITE_OPEN_READONLY,
+                      nullptr) != SQLITE_OK) {
+    D2D_ERROR << "Could not open the docset index " << index_path;
+    sqlite3_close(database);
+    return false;
+  }
+
+  auto read = [database](const char* query, std::vector<Row>& rows) {
+    sqlite3_stmt* statement = nullptr;
+    if (sqlite3_prepare_v2(database, query, -1, &statement, nullptr) !=
+        SQLITE_OK) {
+      return false;
+    }
+    int result = SQLITE_OK;
+    while ((result = sqlite3_step(statement)) == SQLITE_ROW) {
+      Row row;
+      for (size_t column = 0; column < row.size(); column++) {
+        auto value = sqlite3_column_text(statement, static_cast<int>(column));
+        if (value != nullptr) {
+          row[column] = reinterpret_cast<const char*>(value);
+        }
+      }
+      rows.emplace_back(std::move(row));
+    }
+    sqlite3_finalize(statement);
+    return result == SQLITE_DONE;
+  };
+
+  std::vector<Row> other_tables;
+  const auto success =
+      read("SELECT name, type, path FROM searchIndex;", rows) &&
+      read("SELECT name, '', '' FROM sqlite_master WHERE type = 'table' AND "
+           "name != 'searchIndex';",
+           other_tables);
+  if (!success) {
+    D2D_ERROR << "Could not read the docset index " << index_path << ": "
+              << sqlite3_errmsg(database);
+  }
+  sqlite3_close(database);
+  has_other_tables = !other_tables.empty();
+  return success;
+}
+
+bool WriteDocsetDelta(const std::string& old_docset,
+                      const std::string& new_docset,
+                      const std::string& delta_path, DeltaStats& stats) {
+  stats = DeltaStats();
+
+  std::vector<std::string> old_files;
+  std::vector<std::string> new_files;
+  if (!ListFiles(old_docset, old_files) || !ListFiles(new_docset, new_files)) {
+    return false;
+  }
+  std::sort(old_files.begin(), old_files.end());
+  std::sort(new_files.begin(), new_files.end());
+
+  // Index rows are diffed unless either index has more than searchIndex.
+  std::vector<Row> old_rows;
+  std::vector<Row> new_rows;
+  bool old_has_other_tables = false;
+  bool new_has_other_tables = false;
+  const auto diff_rows =
+      std::binary_search(old_files.begin(), old_files.end(), kIndexPath) &&
+      std::binary_search(new_files.begin(), new_files.end(), kIndexPath) &&
+      ReadSearchIndex(JoinPaths({old_docset, kIndexPath}), old_rows,
+                      old_has_other_tables) &&
+      ReadSearchIndex(JoinPaths({new_docset, kIndexPath}), new_rows,
+                      new_has_other_tables) &&
+      !old_has_other_tables && !new_has_other_tables;
+
+  DeltaWriter writer;
+  auto old_file = old_files.begin();
+  auto new_file = new_files.begin();
+  while (old_file != old_files.end() || new_file != new_files.end()) {
+    const bool in_old = old_file != old_files.end() &&
+                        (new_file == new_files.end() || *old_file <= *new_file);
+    const bool in_new = new_file != new_files.end() &&
+                        (old_file == old_files.end() || *new_file <= *old_file);
+    const auto& path = in_new ? *new_file : *old_file;
+    if (in_old) {
+      old_file++;
+    }
+    if (in_new) {
+      new_file++;
+    }
+    if (diff_rows && path == kIndexPath) {
+      continue;
+    }
+
+    struct stat old_stat = {};
+    struct stat new_stat = {};
+    std::unique_ptr<AutoMapping> old_contents;
+    std::unique_ptr<AutoMapping> new_contents;
+    const auto old_path = JoinPaths({old_docset, path});
+    const auto new_path = JoinPaths({new_docset, path});
+    if ((in_old && (::stat(old_path.c_str(), &old_stat) != 0 ||
+                    !ReadContents(old_path, old_stat, old_contents))) ||
+        (in_new && (::stat(new_path.c_str(), &new_stat) != 0 ||
+                    !ReadContents(new_path, new_stat, new_contents)))) {
+      D2D_ERROR << "Could not read " << path << " to compare the docsets.";
+      return false;
+    }
+
+    if (!in_new) {
+      writer.RemoveFile(path, HashContents(old_contents));
+      stats.removed_files++;
+      continue;
+    }
+
+    if (in_old) {
+      // Docsets built into the same store share unchanged files.
+      if (old_stat.st_dev == new_stat.st_dev &&
+          old_stat.st_ino == new_stat.st_ino) {
+        continue;
+      }
+      if (old_stat.st_size == new_stat.st_size &&
+          (!old_contents || ::memcmp(old_contents->Get(), new_contents->Get(),
+                                     old_contents->GetSize()) == 0)) {
+        continue;
+      }
+    }
+
+    stats.written_files++;
+    stats.written_bytes += new_stat.st_size;
+    writer.WriteFile(path, in_old, HashContents(old_contents),
+                     std::move(new_contents));
+  }
+
+  if (diff_rows) {
+    std::sort(old_rows.begin(), old_rows.end());
+    std::sort(new_rows.begin(), new_rows.end());
+    std::vector<Row> changed_rows;
+    std::set_difference(old_rows.begin(), old_rows.end(), new_rows.begin(),
+                        new_rows.end(), std::back_inserter(changed_rows));
+    for (const auto& row : changed_rows) {
+      writer.ChangeRow(RecordKind::kRemoveRow, row);
+    }
+    stats.removed_rows = changed_rows.size();
+
+    changed_rows.clear();
+    std::set_difference(new_rows.begin(), new_rows.end(), old_rows.begin(),
+                        old_rows.end(), std::back_inserter(changed_rows));
+    for (const auto& row : changed_rows) {
+      writer.ChangeRow(RecordKind::kAddRow, row);
+    }
+    stats.added_rows = changed_rows.size();
+  }
+
+  if (!writer.Write(delta_path)) {
+    D2D_ERROR << "Could not write the delta to " << delta_path;
+    return false;
+  }
+  return true;
+}
+
+// True if a component of |path| is "..". Names such as "a..b.html" are fine.
+static bool HasParentComponent(const std::string& path) {
+  for (size_t begin = 0; begin <= path.size();) {
+    const auto end = std::min(path.find('/', begin), path.size());
+    if (path.compare(begin, end - begin, "..") == 0) {
+      return true;
+    }
+    begin = end + 1;
+  }
+  return false;
+}
+
+static bool ReadRecords(const AutoMapping& package,
+                        std::vector<Record>& records) {
+  DeltaReader reader(package.Get(), package.GetSize());
+  const char* magic = nullptr;
+  uint32_t version = 0;
+  if (!reader.ReadBytes(sizeof(kDeltaMagic) - 1, magic) ||
+      ::memcmp(magic, kDeltaMagic, sizeof(kDeltaMagic) - 1) != 0 ||
+      !reader.ReadInteger(version) || version != kDeltaVersion) {
+    D2D_ERROR << "The file is not a docset delta of a supported version.";
+    return false;
+  }
+
+  while (!reader.IsAtEnd()) {
+    Record record;
+    uint8_t kind = 0;
+    bool success = reader.ReadInteger(kind);
+    record.kind = static_cast<RecordKind>(kind);
+    switch (record.kind) {
+      case RecordKind::kWriteFile: {
+        uint8_t has_old = 0;
+        success = success && reader.ReadString(record.path) &&
+                  reader.ReadInteger(has_old) &&
+                  reader.ReadInteger(record.old_hash) &&
+                  reader.ReadInteger(record.length) &&
+                  reader.ReadBytes(record.length, record.data);
+        record.has_old = has_old != 0;
+        break;
+      }
+      case RecordKind::kRemoveFile:
+        success = success && reader.ReadString(record.path) &&
+                  reader.ReadInteger(record.old_hash);
+        break;
+      case RecordKind::kAddRow:
+      case RecordKind::kRemoveRow:
+        for (auto& field : record.row) {
+          success = success && reader.ReadString(field);
+        }
+        break;
+      default:
+        success = false;
+        break;
+    }
+    // Paths must stay inside the docset.
+    if (!success || record.path.compare(0, 1, "/") == 0 ||
+        HasParentComponent(record.path)) {
+      D2D_ERROR << "The docset delta is corrupt.";
+      return false;
+    }
+    records.emplace_back(std::move(record));
+  }
+  return true;
+}
+
+// Checks that the file of |record| is in its old or new state. Records that
+// are already in their new state are marked as applied.
+static bool CheckFile(const std::string& docset, Record& record) {
+  const auto path = JoinPaths({docset, record.path});
+  struct stat file_stat = {};
+  if (::stat(path.c_str(), &file_stat) != 0) {
+    if (errno != ENOENT) {
+      return false;
+    }
+    record.is_applied = record.kind == RecordKind::kRemoveFile;
+    return record.is_applied || !record.has_old;
+  }
+
+  std::unique_ptr<AutoMapping> contents;
+  if (!ReadContents(path, file_stat, contents)) {
+    return false;
+  }
+  const auto hash = HashContents(contents);
+  if (record.kind == RecordKind::kWriteFile &&
+      hash == Hash64(record.data, record.length)) {
+    record.is_applied = true;
+    return true;
+  }
+  return (record.has_old || record.kind == RecordKind::kRemoveFile) &&
+         hash == record.old_hash;
+}
+
+static bool ApplyRows(sqlite3* database, const std::vector<Record>& records,
+                      DeltaStats& stats) {
+  sqlite3_stmt* remove_statement = nullptr;
+  sqlite3_stmt* add_statement = nullptr;
+  bool success =
+      sqlite3_prepare_v2(database,
+                         "DELETE FROM searchIndex WHERE name = ? AND type = ? "
+                         "AND path = ?;",
+                         -1, &remove_statement, nullptr) == SQLITE_OK &&
+      sqlite3_prepare_v2(database,
+                         "INSERT OR IGNORE INTO searchIndex(name, type, path) "
+                         "VALUES (?, ?, ?);",
+                         -1, &add_statement, nullptr) == SQLITE_OK;
+
+  for (const auto& record : records) {
+    if (!success) {
+      break;
+    }
+    sqlite3_stmt* statement = nullptr;
+    if (record.kind == RecordKind::kRemoveRow) {
+      statement = remove_statement;
+      stats.removed_rows++;
+    } else if (record.kind == RecordKind::kAddRow) {
+      statement = add_statement;
+      stats.added_rows++;
+    } else {
+      continue;
+    }
+    success = sqlite3_reset(statement) == SQLITE_OK;
+    for (size_t i = 0; i < record.row.size(); i++) {
+      success = success &&
+                sqlite3_bind_text(statement, static_cast<int>(i + 1),
+                                  record.row[i].data(),
+                                  static_cast<int>(record.row[i].size()),
+                                  SQLITE_STATIC) == SQLITE_OK;
+    }
+    success = success && sqlite3_step(statement) == SQLITE_DONE;
+  }
+
+  if (!success) {
+    D2D_ERROR << "Could not update the docset index: "
+              << sqlite3_errmsg(database);
+  }
+  sqlite3_finalize(remove_statement);
+  sqlite3_finalize(add_statement);
+  return success;
+}
+
+static bool ApplyFile(const std::string& docset, const Record& record) {
+  const auto path = JoinPaths({docset, record.path});
+  if (record.kind == RecordKind::kRemoveFile) {
+    if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+      D2D_ERROR << "Could not remove " << path << ": " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<std::string> directories = {docset};
+  for (size_t begin = 0;;) {
+    const auto end = record.path.find('/', begin);
+    if (end == std::string::npos) {
+      break;
+    }
+    directories.push_back(record.path.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return MakeDirectories(directories) &&
+         CopyData(record.data, record.length, path);
+}
+
+bool ApplyDocsetDelta(const std::string& delta_path, const std::string& docset,
+                      DeltaStats& stats) {
+  stats = DeltaStats();
+
+  auto package = OpenFileReadOnly(delta_path);
+  std::vector<Record> records;
+  if (!package || !ReadRecords(*package, records)) {
+    D2D_ERROR << "Could not read the docset delta " << delta_path;
+    return false;
+  }
+
+  bool has_rows = false;
+  for (auto& record : records) {
+    if (record.kind == RecordKind::kAddRow ||
+        record.kind == RecordKind::kRemoveRow) {
+      has_rows = true;
+    } else if (!CheckFile(docset, record)) {
+      D2D_ERROR << "The docset does not match the delta: " << record.path
+                << " was changed.";
+      return false;
+    }
+  }
+
+  // Index rows are committed last so that applying the delta again after an
+  // interruption adds and removes them again.
+  sqlite3* database = nullptr;
+  if (has_rows) {
+    const auto index_path = JoinPaths({docset, kIndexPath});
+    if (sqlite3_open_v2(index_path.c_str(), &database, SQLITE_OPEN_READWRITE,
+                        nullptr) != SQLITE_OK ||
+        sqlite3_exec(database, "BEGIN TRANSACTION;", nullptr, nullptr,
+                     nullptr) != SQLITE_OK ||
+        !ApplyRows(database, records, stats)) {
+      D2D_ERROR << "Could not update the docset index " << index_path;
+      sqlite3_close(database);
+      return false;
+    }
+  }
+
+  bool success = true;
+  for (const auto& record : records) {
+    if (record.kind != RecordKind::kWriteFile &&
+        record.kind != RecordKind::kRemoveFile) {
+      continue;
+    }
+    if (!record.is_applied && !ApplyFile(docset, record)) {
+      success = false;
+      break;
+    }
+    if (record.kind == RecordKind::kWriteFile) {
+      stats.written_files++;
+      stats.written_bytes += record.length;
+    } else {
+      stats.removed_files++;
+    }
+  }
+
+  if (database != nullptr) {
+    const auto end = success ? "COMMIT;" : "ROLLBACK;";
+    if (sqlite3_exec(database, end, nullptr, nullptr, nullptr) != SQLITE_OK) {
+      D2D_ERROR << "Could not commit the docset index: "
+                << sqlite3_errmsg(database);
+      success = false;
+    }
+    sqlite3_close(database);
+  }
+  return success;
+}
+
+}  // namespace d2d
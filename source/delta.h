@@ -0,0 +1,37 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace d2d {
+
+struct DeltaStats {
+  size_t written_files = 0;
+  size_t removed_files = 0;
+  uint64_t written_bytes = 0;
+  size_t added_rows = 0;
+  size_t removed_rows = 0;
+};
+
+// Writes a package to |delta_path| that turns the docset at |old_docset| into
+// the one at |new_docset|. It holds the files that were added or replaced,
+// the files that were removed, and the rows added to and removed from the
+// searchIndex table. An index with tables besides searchIndex (such as the
+// full-text or search accelerator tables) is shipped whole instead.
+bool WriteDocsetDelta(const std::string& old_docset,
+                      const std::string& new_docset,
+                      const std::string& delta_path, DeltaStats& stats);
+
+// Patches the docset at |docset| in place with the package at |delta_path|.
+// Nothing is changed unless every file the package replaces or removes still
+// holds either its old or its new contents. Applying a package again, for
+// example after an interruption, is harmless.
+bool ApplyDocsetDelta(const std::string& delta_path, const std::string& docset,
+                      DeltaStats& stats);
+
+}  // namespace d2d
@@ -4,13 +4,30 @@
 #include "docset_index.h"
 
 #include <stdio.h>
+#include <string.h>
 
+#include <mutex>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "logger.h"
 
 namespace d2d {
 
+// Finalize recreates the tables from these, so a finalized index has the
+// same schema as one built in a single pass.
+static const char kCreateSearchIndex[] =
+    "CREATE TABLE searchIndex(id INTEGER PRIMARY KEY, name TEXT, type TEXT, "
+    "path TEXT);";
+static const char kCreateAnchorIndex[] =
+    "CREATE UNIQUE INDEX anchor ON searchIndex(name, type, path);";
+// Symbol rows carry an empty body and page rows carry an empty scope. The
+// path is only ever returned, never matched.
+static const char kCreateSearchText[] =
+    "CREATE VIRTUAL TABLE searchText USING fts5(name, scope, path UNINDEXED, "
+    "body, prefix = '2 3');";
+
 static std::pair<bool, std::string> RunSingleStatement(
     sqlite3* db, const std::string& statement) {
   if (db == nullptr) {
@@ -27,7 +44,8 @@ static std::pair<bool, std::string> RunSingleStatement(
   return {true, ""};
 }
 
-DocsetIndex::DocsetIndex(const std::string& database_name) {
+DocsetIndex::DocsetIndex(const std::string& database_name)
+    : database_name_(database_name) {
   if (database_name.size() == 0) {
     D2D_ERROR << "Database name was empty";
     return;
@@ -42,19 +60,14 @@ DocsetIndex::DocsetIndex(const std::string& database_name) {
     return;
   }
 
-  auto create_result = RunSingleStatement(
-      database_,
-      "CREATE TABLE searchIndex(id INTEGER PRIMARY KEY, name TEXT, type TEXT, "
-      "path TEXT);");
+  auto create_result = RunSingleStatement(database_, kCreateSearchIndex);
 
   if (!create_result.first) {
     D2D_ERROR << "Could not create index table: " << create_result.second;
     return;
   }
 
-  auto index_result = RunSingleStatement(
-      database_,
-      "CREATE UNIQUE INDEX anchor ON searchIndex(name, type, path);");
+  auto index_result = RunSingleStatement(database_, kCreateAnchorIndex);
 
   if (!index_result.first) {
     D2D_ERROR << "Could not create the index: " << index_result.second;
@@ -78,70 +91,449 @@ DocsetIndex::DocsetIndex(const std::string& database_name) {
 }
 
 DocsetIndex::~DocsetIndex() {
+  if (in_transaction_ && !EndTransaction()) {
+    D2D_ERROR << "Could not commit pending index rows.";
+  }
   auto result = ::sqlite3_finalize(token_statement_);
   if (result != SQLITE_OK) {
     D2D_ERROR << "Could not finalize statement.";
   }
+  if (::sqlite3_finalize(text_statement_) != SQLITE_OK) {
+    D2D_ERROR << "Could not finalize statement.";
+  }
   ::sqlite3_close(database_);
 }
 
 bool DocsetIndex::IsValid() const { return is_valid_; }
 
 bool DocsetIndex::AddTokens(const std::vector<Token>& tokens) {
+  return AddTokens(TokenTable(tokens));
+}
+
+bool DocsetIndex::AddTokens(const TokenTable& tokens) {
+  std::vector<uint32_t> rows(tokens.GetSize());
+  for (size_t row = 0; row < rows.size(); row++) {
+    rows[row] = static_cast<uint32_t>(row);
+  }
+  return AddTokens(tokens, {rows.data(), rows.data() + rows.size()});
+}
+
+bool DocsetIndex::AddTokens(const TokenTable& tokens,
+                            const TokenTable::RowRange& rows,
+                            const std::string& path_prefix) {
+  std::lock_guard<std::mutex> lock(mutex_);
   if (!is_valid_) {
     D2D_ERROR << "Could not add tokens to an invalid docset index.";
     return false;
   }
 
-  auto begin_result = RunSingleStatement(database_, "BEGIN TRANSACTION;");
-  if (!begin_result.first) {
-    D2D_ERROR << "Could not begin the transaction.";
+  if (!BeginTransaction()) {
     return false;
   }
 
-  for (const auto& token : tokens) {
-    if (::sqlite3_reset(token_statement_) != SQLITE_OK) {
-      D2D_ERROR << "Could not reset the statement.";
-      return false;
-    }
+  const auto& names = tokens.GetIndexNames();
+  const auto& paths = tokens.GetIndexPaths();
 
-    if (::sqlite3_clear_bindings(token_statement_) != SQLITE_OK) {
-      D2D_ERROR << "Could clear previous statement bindings.";
-      return false;
+  // The table outlives every step so none of the columns need to be copied,
+  // unless their paths are prefixed.
+  std::string prefixed_path = path_prefix;
+  for (const auto row : rows) {
+    const char* path = paths.Get(row);
+    size_t path_length = paths.GetLength(row);
+    if (!path_prefix.empty()) {
+      prefixed_path.resize(path_prefix.size());
+      prefixed_path.append(path, path_length);
+      path = prefixed_path.c_str();
+      path_length = prefixed_path.size();
     }
 
-    const auto name = token.GetIndexName();
-    const auto type = token.GetIndexType();
-    const auto path = token.GetIndexPath();
-
-    if (::sqlite3_bind_text(token_statement_, 1, name.data(),
-                            static_cast<int>(name.size()),
-                            SQLITE_TRANSIENT) != SQLITE_OK) {
-      D2D_ERROR << "Could not bind name.";
+    if (!InsertRow(names.Get(row), names.GetLength(row),
+                   tokens.GetIndexType(row), path, path_length)) {
       return false;
     }
 
-    if (::sqlite3_bind_text(token_statement_, 2, type.data(),
-                            static_cast<int>(type.size()),
-                            SQLITE_TRANSIENT) != SQLITE_OK) {
-      D2D_ERROR << "Could not bind type.";
+    if (text_statement_ != nullptr &&
+        !InsertText(names.Get(row), tokens.GetScopes().Get(row), path, "")) {
       return false;
     }
+  }
+
+  return EndTransaction();
+}
+
+bool DocsetIndex::AddRow(const char* name, const char* type,
+                         const char* path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!is_valid_) {
+    D2D_ERROR << "Could not add a row to an invalid docset index.";
+    return false;
+  }
+
+  // Batched like page text.
+  if (!BeginTransaction()) {
+    return false;
+  }
+
+  return InsertRow(name, ::strlen(name), type, path, ::strlen(path));
+}
+
+bool DocsetIndex::AddTextRow(const char* name, const char* scope,
+                             const char* path, const char* body) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (text_statement_ == nullptr) {
+    D2D_ERROR << "Full-text search was not enabled on the docset index.";
+    return false;
+  }
+
+  if (!BeginTransaction()) {
+    return false;
+  }
+
+  return InsertText(name, scope, path, body);
+}
+
+bool DocsetIndex::EnableFullTextSearch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!is_valid_) {
+    D2D_ERROR << "Could not enable full-text search on an invalid index.";
+    return false;
+  }
+
+  if (text_statement_ != nullptr) {
+    return true;
+  }
 
-    if (::sqlite3_bind_text(token_statement_, 3, path.data(),
-                            static_cast<int>(path.size()),
+  auto create_result = RunSingleStatement(database_, kCreateSearchText);
+  if (!create_result.first) {
+    D2D_ERROR << "Could not create full-text table: " << create_result.second;
+    return false;
+  }
+
+  std::string text_statement_string =
+      "INSERT INTO searchText(name, scope, path, body) VALUES (?, ?, ?, ?);";
+  auto res = sqlite3_prepare_v2(database_, text_statement_string.c_str(),
+                                static_cast<int>(text_statement_string.size()),
+                                &text_statement_, nullptr);
+  if (res != SQLITE_OK) {
+    D2D_ERROR << "Could not create full-text insertion statement.";
+    return false;
+  }
+
+  return true;
+}
+
+bool DocsetIndex::AddPageText(const std::string& path, const std::string& title,
+                              const std::string& text) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (text_statement_ == nullptr) {
+    D2D_ERROR << "Full-text search was not enabled on the docset index.";
+    return false;
+  }
+
+  // Pages are added one at a time as they are copied. Batch them into a
+  // single transaction that is closed by |Commit|.
+  if (!BeginTransaction()) {
+    return false;
+  }
+
+  return InsertText(title.c_str(), "", path.c_str(), text.c_str());
+}
+
+bool DocsetIndex::Commit() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return EndTransaction();
+}
+
+bool DocsetIndex::EndTransaction() {
+  if (!in_transaction_) {
+    return true;
+  }
+
+  auto end_result = RunSingleStatement(database_, "END TRANSACTION;");
+  if (!end_result.first) {
+    D2D_ERROR << "Could not end the transaction.";
+    return false;
+  }
+
+  in_transaction_ = false;
+  return true;
+}
+
+bool DocsetIndex::Finalize(bool search_accelerators) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!is_valid_) {
+    D2D_ERROR << "Could not finalize an invalid docset index.";
+    return false;
+  }
+
+  if (!EndTransaction()) {
+    return false;
+  }
+
+  // The statements refer to the tables that are recreated, and no rows may be
+  // added from here on.
+  is_valid_ = false;
+  const auto has_text = text_statement_ != nullptr;
+  ::sqlite3_finalize(token_statement_);
+  ::sqlite3_finalize(text_statement_);
+  token_statement_ = nullptr;
+  text_statement_ = nullptr;
+
+  // The rows are copied out in sorted order through temporary tables, whose
+  // row IDs follow the order of the SELECT, and inserted back into fresh
+  // tables. The accelerators refer to row IDs, so they are rebuilt as well.
+  std::string statements =
+      "BEGIN TRANSACTION;"
+      "CREATE TEMP TABLE sortedIndex AS SELECT name, type, path FROM "
+      "searchIndex ORDER BY name, type, path;"
+      "DROP TABLE searchIndex;"
+      "DROP TABLE IF EXISTS searchTrigram;";
+  statements += kCreateSearchIndex;
+  statements += kCreateAnchorIndex;
+  statements +=
+      "INSERT INTO searchIndex(name, type, path) SELECT name, type, path "
+      "FROM temp.sortedIndex ORDER BY rowid;"
+      "DROP TABLE temp.sortedIndex;";
+  if (has_text) {
+    statements +=
+        "CREATE TEMP TABLE sortedText AS SELECT name, scope, path, body FROM "
+        "searchText ORDER BY path, name, scope, body;"
+        "DROP TABLE searchText;";
+    statements += kCreateSearchText;
+    statements +=
+        "INSERT INTO searchText(name, scope, path, body) SELECT name, scope, "
+        "path, body FROM temp.sortedText ORDER BY rowid;"
+        "DROP TABLE temp.sortedText;";
+  }
+  statements += "END TRANSACTION;";
+
+  auto sort_result = RunSingleStatement(database_, statements);
+  if (!sort_result.first) {
+    D2D_ERROR << "Could not sort the docset index: " << sort_result.second;
+    RunSingleStatement(database_, "ROLLBACK;");
+    return false;
+  }
+
+  if (search_accelerators && !::d2d::BuildSearchAccelerators(database_)) {
+    return false;
+  }
+
+  // VACUUM INTO writes a new file whose pages are laid out from the contents
+  // alone. Vacuuming in place would keep counters that depend on how many
+  // transactions built the index.
+  const auto vacuum_name = database_name_ + ".vacuum";
+  ::remove(vacuum_name.c_str());
+  auto vacuum = ::sqlite3_mprintf("VACUUM INTO %Q;", vacuum_name.c_str());
+  auto vacuum_result = RunSingleStatement(database_, vacuum);
+  ::sqlite3_free(vacuum);
+  ::sqlite3_close(database_);
+  database_ = nullptr;
+  if (!vacuum_result.first) {
+    D2D_ERROR << "Could not compact the docset index: "
+              << vacuum_result.second;
+    ::remove(vacuum_name.c_str());
+    return false;
+  }
+
+  if (::rename(vacuum_name.c_str(), database_name_.c_str()) != 0) {
+    D2D_ERROR << "Could not replace the docset index " << database_name_;
+    ::remove(vacuum_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DocsetIndex::SetShard(const Shard& shard, bool search_accelerators) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!is_valid_) {
+    D2D_ERROR << "Could not mark an invalid docset index as a shard.";
+    return false;
+  }
+
+  auto result = RunSingleStatement(
+      database_,
+      "CREATE TABLE shardInfo(shard INTEGER, count INTEGER, "
+      "searchAccelerators INTEGER);"
+      "INSERT INTO shardInfo VALUES (" +
+          std::to_string(shard.index) + ", " + std::to_string(shard.count) +
+          ", " + (search_accelerators ? "1" : "0") + ");");
+  if (!result.first) {
+    D2D_ERROR << "Could not record the shard: " << result.second;
+    return false;
+  }
+  return true;
+}
+
+bool DocsetIndex::BuildSearchAccelerators() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!is_valid_) {
+    D2D_ERROR << "Could not build accelerators on an invalid docset index.";
+    return false;
+  }
+
+  if (!EndTransaction()) {
+    return false;
+  }
+
+  return ::d2d::BuildSearchAccelerators(database_);
+}
+
+bool DocsetIndex::BeginTransaction() {
+  if (in_transaction_) {
+    return true;
+  }
+
+  auto begin_result = RunSingleStatement(database_, "BEGIN TRANSACTION;");
+  if (!begin_result.first) {
+    D2D_ERROR << "Could not begin the transaction.";
+    return false;
+  }
+
+  in_transaction_ = true;
+  return true;
+}
+
+bool DocsetIndex::InsertRow(const char* name, size_t name_length,
+                            const char* type, const char* path,
+                            size_t path_length) {
+  if (::sqlite3_reset(token_statement_) != SQLITE_OK) {
+    D2D_ERROR << "Could not reset the statement.";
+    return false;
+  }
+
+  if (::sqlite3_clear_bindings(token_statement_) != SQLITE_OK) {
+    D2D_ERROR << "Could clear previous statement bindings.";
+    return false;
+  }
+
+  if (::sqlite3_bind_text(token_statement_, 1, name,
+                          static_cast<int>(name_length),
+                          SQLITE_STATIC) != SQLITE_OK) {
+    D2D_ERROR << "Could not bind name.";
+    return false;
+  }
+
+  if (::sqlite3_bind_text(token_statement_, 2, type, -1, SQLITE_STATIC) !=
+      SQLITE_OK) {
+    D2D_ERROR << "Could not bind type.";
+    return false;
+  }
+
+  if (::sqlite3_bind_text(token_statement_, 3, path,
+                          static_cast<int>(path_length),
+                          SQLITE_STATIC) != SQLITE_OK) {
+    D2D_ERROR << "Could not bind path.";
+    return false;
+  }
+
+  if (::sqlite3_step(token_statement_) != SQLITE_DONE) {
+    D2D_ERROR << "Could not step on the statement.";
+    return false;
+  }
+
+  return true;
+}
+
+bool DocsetIndex::InsertText(const char* name, const char* scope,
+                             const char* path, const char* body) {
+  if (::sqlite3_reset(text_statement_) != SQLITE_OK) {
+    D2D_ERROR << "Could not reset the full-text statement.";
+    return false;
+  }
+
+  const char* columns[] = {name, scope, path, body};
+  for (int i = 0; i < 4; i++) {
+    if (::sqlite3_bind_text(text_statement_, i + 1, columns[i], -1,
                             SQLITE_TRANSIENT) != SQLITE_OK) {
-      D2D_ERROR << "Could not bind path.";
+      D2D_ERROR << "Could not bind full-text column.";
       return false;
     }
+  }
 
-    if (::sqlite3_step(token_statement_) != SQLITE_DONE) {
-      D2D_ERROR << "Could not step on the statement.";
-      return false;
+  if (::sqlite3_step(text_statement_) != SQLITE_DONE) {
+    D2D_ERROR << "Could not step on the full-text statement.";
+    return false;
+  }
+
+  return true;
+}
+
+static bool InsertTrigrams(sqlite3* database) {
+  sqlite3_stmt* select = nullptr;
+  sqlite3_stmt* insert = nullptr;
+  if (sqlite3_prepare_v2(database, "SELECT id, lowerName FROM searchIndex;",
+                         -1, &select, nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v2(database,
+                         "INSERT OR IGNORE INTO searchTrigram(trigram, id) "
+                         "VALUES (?, ?);",
+                         -1, &insert, nullptr) != SQLITE_OK) {
+    D2D_ERROR << "Could not prepare trigram statements: "
+              << sqlite3_errmsg(database);
+    sqlite3_finalize(select);
+    sqlite3_finalize(insert);
+    return false;
+  }
+
+  bool success = true;
+  int step = SQLITE_DONE;
+  while (success && (step = sqlite3_step(select)) == SQLITE_ROW) {
+    const auto id = sqlite3_column_int64(select, 0);
+    const auto name =
+        reinterpret_cast<const char*>(sqlite3_column_text(select, 1));
+    const auto length = sqlite3_column_bytes(select, 1);
+    for (int i = 0; i + 3 <= length; i++) {
+      if (sqlite3_reset(insert) != SQLITE_OK ||
+          sqlite3_bind_text(insert, 1, name + i, 3, SQLITE_STATIC) !=
+              SQLITE_OK ||
+          sqlite3_bind_int64(insert, 2, id) != SQLITE_OK ||
+          sqlite3_step(insert) != SQLITE_DONE) {
+        D2D_ERROR << "Could not insert trigram: " << sqlite3_errmsg(database);
+        success = false;
+        break;
+      }
     }
   }
 
-  auto end_result = RunSingleStatement(database_, "END TRANSACTION;");
+  if (success && step != SQLITE_DONE) {
+    D2D_ERROR << "Could not read names for trigrams: "
+              << sqlite3_errmsg(database);
+    success = false;
+  }
+
+  sqlite3_finalize(select);
+  sqlite3_finalize(insert);
+  return success;
+}
+
+bool BuildSearchAccelerators(sqlite3* database) {
+  auto begin_result = RunSingleStatement(database, "BEGIN TRANSACTION;");
+  if (!begin_result.first) {
+    D2D_ERROR << "Could not begin the transaction.";
+    return false;
+  }
+
+  auto schema_result = RunSingleStatement(
+      database,
+      "CREATE INDEX searchIndexNameNoCase ON searchIndex(name COLLATE "
+      "NOCASE);"
+      "ALTER TABLE searchIndex ADD COLUMN lowerName TEXT;"
+      "UPDATE searchIndex SET lowerName = lower(name);"
+      "CREATE INDEX searchIndexLowerName ON searchIndex(lowerName);"
+      "CREATE TABLE searchTrigram(trigram TEXT NOT NULL, id INTEGER NOT "
+      "NULL, PRIMARY KEY(trigram, id)) WITHOUT ROWID;");
+  if (!schema_result.first) {
+    D2D_ERROR << "Could not create the search accelerators: "
+              << schema_result.second;
+    RunSingleStatement(database, "ROLLBACK;");
+    return false;
+  }
+
+  if (!InsertTrigrams(database)) {
+    RunSingleStatement(database, "ROLLBACK;");
+    return false;
+  }
+
+  auto end_result = RunSingleStatement(database, "END TRANSACTION;");
   if (!end_result.first) {
     D2D_ERROR << "Could not end the transaction.";
     return false;
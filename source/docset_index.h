@@ -5,14 +5,19 @@
 
 #include <sqlite3.h>
 
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "macros.h"
-#include "token.h"
+#include "shard.h"
+#include "token_table.h"
 
 namespace d2d {
 
+// The searchIndex table of a docset, and optionally its searchText table.
+// Rows may be added from several threads. Every call holds the index for its
+// duration, so large token tables are best added a range of rows at a time.
 class DocsetIndex {
  public:
   DocsetIndex(const std::string& database_name);
@@ -23,12 +28,81 @@ class DocsetIndex {
 
   bool AddTokens(const std::vector<Token>& tokens);
 
+  bool AddTokens(const TokenTable& tokens);
+
+  // Only adds the given rows of |tokens|. Their paths are prefixed with
+  // |path_prefix|, such as the subdirectory of Documents the pages of the
+  // tokens are copied to.
+  bool AddTokens(const TokenTable& tokens, const TokenTable::RowRange& rows,
+                 const std::string& path_prefix = std::string());
+
+  // Adds a row as it is stored in searchIndex, such as one read from another
+  // index.
+  bool AddRow(const char* name, const char* type, const char* path);
+
+  // Adds a row as it is stored in searchText. Full-text search must be
+  // enabled.
+  bool AddTextRow(const char* name, const char* scope, const char* path,
+                  const char* body);
+
+  // Creates the searchText FTS5 table. Tokens added after this call are also
+  // indexed by name and scope, and page text may be added via |AddPageText|.
+  bool EnableFullTextSearch();
+
+  bool AddPageText(const std::string& path, const std::string& title,
+                   const std::string& text);
+
+  // Commits rows added outside of |AddTokens|.
+  bool Commit();
+
+  // Records in a shardInfo table that the index only holds the rows of
+  // |shard|, and whether the merged index gets the search accelerators. See
+  // |MergeDocsetShards|.
+  bool SetShard(const Shard& shard, bool search_accelerators);
+
+  // See |BuildSearchAccelerators| below. Call once all tokens are added.
+  bool BuildSearchAccelerators();
+
+  // Rewrites the index so that it only depends on its rows, not on the order
+  // or the threads they were added from: the rows of searchIndex and
+  // searchText are renumbered in sorted order, the search accelerators are
+  // built if |search_accelerators|, and the file is rewritten with VACUUM
+  // INTO. Call once everything else is done. The index is closed afterwards.
+  bool Finalize(bool search_accelerators);
+
  private:
+  std::string database_name_;
   sqlite3* database_ = nullptr;
   sqlite3_stmt* token_statement_ = nullptr;
+  sqlite3_stmt* text_statement_ = nullptr;
   bool is_valid_ = false;
+  bool in_transaction_ = false;
+  // Serializes the use of |database_| by the threads of a build. SQLite is
+  // built in multi-thread mode, in which a connection must not be used by
+  // two threads at once.
+  std::mutex mutex_;
+
+  bool BeginTransaction();
+
+  bool EndTransaction();
+
+  bool InsertRow(const char* name, size_t name_length, const char* type,
+                 const char* path, size_t path_length);
+
+  bool InsertText(const char* name, const char* scope, const char* path,
+                  const char* body);
 
   D2D_DISALLOW_COPY_AND_ASSIGN(DocsetIndex);
 };
 
+// Adds optional lookup structures over searchIndex.name for case-insensitive
+// prefix and substring queries:
+// * A COLLATE NOCASE index on name.
+// * A lowerName column (ASCII lowercased) with its own index so that a
+//   prefix query becomes the range lowerName >= 'abc' AND lowerName < 'abd'.
+// * A searchTrigram(trigram, id) table holding every 3-byte window of
+//   lowerName so that substring queries can intersect posting lists before
+//   verifying candidates with instr().
+bool BuildSearchAccelerators(sqlite3* database);
+
 }  // namespace d2d
@@ -8,6 +8,8 @@
 #include <algorithm>
 #include <sstream>
 
+#include "path_filter.h"
+
 namespace d2d {
 
 bool MakeDirectories(const std::vector<std::string>& directories) {
@@ -39,52 +41,111 @@ bool MakeDirectories(const std::vector<std::string>& directories) {
   return true;
 }
 
-bool CopyData(const void* from_data, size_t from_length,
-              const std::string& to_path) {
-  AutoFD to_file(
-      D2D_TEMP_FAILURE_RETRY(::open(to_path.c_str(), O_CREAT | O_TRUNC | O_RDWR,
-                                    S_IRUSR | S_IWUSR | S_IXUSR)));
-  if (!to_file.IsValid()) {
-    D2D_ERROR << "Could not create the file " << to_path
-              << " to write to: " << strerror(errno);
-    return false;
+bool MakeDirectories(const std::vector<std::string>& root,
+                     const std::string& path) {
+  auto directories = root;
+  for (size_t begin = 0; begin < path.size();) {
+    const auto end = std::min(path.find('/', begin), path.size());
+    if (end > begin) {
+      directories.push_back(path.substr(begin, end - begin));
+    }
+    begin = end + 1;
   }
+  return MakeDirectories(directories);
+}
 
-  if (::ftruncate(to_file.Get(), from_length) != 0) {
-    D2D_ERROR << "Could not truncate file " << to_path;
-    return false;
+static IOThresholds gIOThresholds;
+
+void SetIOThresholds(const IOThresholds& thresholds) {
+  gIOThresholds = thresholds;
+}
+
+const IOThresholds& GetIOThresholds() { return gIOThresholds; }
+
+static bool WriteFully(const AutoFD& fd, const void* data, size_t length,
+                       size_t file_offset = 0) {
+  const auto bytes = static_cast<const uint8_t*>(data);
+  size_t offset = 0;
+  while (offset < length) {
+    const auto written = D2D_TEMP_FAILURE_RETRY(::pwrite(
+        fd.Get(), bytes + offset, length - offset, file_offset + offset));
+    if (written <= 0) {
+      return false;
+    }
+    offset += written;
   }
-  AutoMapping to_mapping(::mmap(nullptr, from_length, PROT_WRITE,
-                                MAP_FILE | MAP_SHARED, to_file.Get(), 0),
-                         from_length);
+  return true;
+}
 
-  if (!to_mapping.IsValid()) {
-    D2D_ERROR << "Could not setup mapping to perform file copy.";
-    return false;
+static bool ReadFully(const AutoFD& fd, void* data, size_t length) {
+  const auto bytes = static_cast<uint8_t*>(data);
+  size_t offset = 0;
+  while (offset < length) {
+    const auto read = D2D_TEMP_FAILURE_RETRY(
+        ::pread(fd.Get(), bytes + offset, length - offset, offset));
+    if (read <= 0) {
+      return false;
+    }
+    offset += read;
   }
+  return true;
+}
 
-  ::memcpy(to_mapping.Get(), from_data, from_length);
+static int CreateFile(const std::string& path) {
+  return D2D_TEMP_FAILURE_RETRY(::open(path.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                                       S_IRUSR | S_IWUSR | S_IXUSR));
+}
 
-  if (::msync(to_mapping.Get(), from_length, MS_SYNC) != 0) {
-    D2D_ERROR << "Could not sync file contents.";
+static bool WriteSpans(const DataSpan* spans, size_t span_count,
+                       const std::string& to_path) {
+  // Existing files are replaced instead of truncated since they may be links
+  // into an object store.
+  AutoFD to_file(CreateFile(to_path));
+  if (!to_file.IsValid() && errno == EEXIST &&
+      ::unlink(to_path.c_str()) == 0) {
+    to_file.Reset(CreateFile(to_path));
+  }
+  if (!to_file.IsValid()) {
+    D2D_ERROR << "Could not create the file " << to_path
+              << " to write to: " << strerror(errno);
     return false;
   }
 
+  // Plain writes avoid the mapping setup, page faults and TLB shootdowns that
+  // dominate for the small files that make up most of the output.
+  size_t offset = 0;
+  for (size_t i = 0; i < span_count; i++) {
+    if (!WriteFully(to_file, spans[i].data, spans[i].length, offset)) {
+      D2D_ERROR << "Could not write to the file " << to_path << ": "
+                << strerror(errno);
+      return false;
+    }
+    offset += spans[i].length;
+  }
+
   return true;
 }
 
+bool CopyData(const void* from_data, size_t from_length,
+              const std::string& to_path) {
+  const DataSpan span = {from_data, from_length};
+  return WriteSpans(&span, 1, to_path);
+}
+
+bool CopyData(const std::vector<DataSpan>& spans, const std::string& to_path) {
+  return WriteSpans(spans.data(), spans.size(), to_path);
+}
+
 bool CopyFile(const struct stat& from_stat, const AutoFD& from,
               const std::string& to_path) {
-  AutoMapping from_mapping(::mmap(nullptr, from_stat.st_size, PROT_READ,
-                                  MAP_FILE | MAP_PRIVATE, from.Get(), 0),
-                           from_stat.st_size);
+  auto from_mapping = OpenFileReadOnly(from, from_stat.st_size);
 
-  if (!from_mapping.IsValid()) {
-    D2D_ERROR << "Could not setup mapping to perform file copy.";
+  if (!from_mapping) {
+    D2D_ERROR << "Could not read the file to copy to " << to_path;
     return false;
   }
 
-  return CopyData(from_mapping.Get(), from_stat.st_size, to_path);
+  return CopyData(from_mapping->Get(), from_mapping->GetSize(), to_path);
 }
 
 bool CopyFile(const std::string& from, const std::string& to) {
@@ -104,66 +165,114 @@ bool CopyFile(const std::string& from, const std::string& to) {
   return CopyFile(from_stat, from_fd, to);
 }
 
-bool CopyFiles(const std::string& from_path,
-               const std::vector<std::string>& to_path,
-               CopyPredicate predicate) {
-  AutoDir from(::opendir(from_path.c_str()));
-  if (!from.IsValid()) {
-    D2D_ERROR << "Could not open the directory to copy from.";
+// The type of a directory entry, or of the file a symbolic link points to.
+// Only stats the entry if the directory does not record its type or it is a
+// link.
+static bool GetEntryType(DIR* dir, const struct dirent* dir_ent,
+                         unsigned char& type) {
+  type = dir_ent->d_type;
+  if (type != DT_UNKNOWN && type != DT_LNK) {
+    return true;
+  }
+  struct stat file_stat = {};
+  if (::fstatat(::dirfd(dir), dir_ent->d_name, &file_stat, 0) != 0) {
+    D2D_ERROR << "Could not stat file: " << dir_ent->d_name;
     return false;
   }
+  type = S_ISDIR(file_stat.st_mode)
+             ? DT_DIR
+             : (S_ISREG(file_stat.st_mode) ? DT_REG : DT_UNKNOWN);
+  return true;
+}
 
-  if (!MakeDirectories(to_path)) {
-    D2D_ERROR << "Could not create the directory structure "
-              << JoinPaths(to_path);
+static bool ListFiles(const std::string& directory, const std::string& prefix,
+                      std::vector<std::string>& files,
+                      const PathFilter* filter) {
+  AutoDir dir(::opendir(directory.c_str()));
+  if (!dir.IsValid()) {
+    D2D_ERROR << "Could not open the directory " << directory;
     return false;
   }
 
-  while (auto dir_ent = ::readdir(from.Get())) {
+  while (auto dir_ent = ::readdir(dir.Get())) {
     std::string file_name(dir_ent->d_name);
-
-    if (file_name.size() == 0) {
-      D2D_ERROR << "Encountered empty filename.";
-      return false;
-    }
-
     if (file_name == "." || file_name == "..") {
       continue;
     }
 
-    AutoFD from_fd(D2D_TEMP_FAILURE_RETRY(
-        ::openat(::dirfd(from.Get()), file_name.c_str(), O_RDONLY)));
-    if (!from_fd.IsValid()) {
-      D2D_ERROR << "From file could not be opened: " << file_name;
+    unsigned char type = DT_UNKNOWN;
+    if (!GetEntryType(dir.Get(), dir_ent, type)) {
       return false;
     }
-
-    struct stat from_stat = {};
-    if (::fstat(from_fd.Get(), &from_stat) != 0) {
-      D2D_ERROR << "Could not stat file: " << file_name;
-      return false;
+    if (filter != nullptr &&
+        !filter->IsIncluded(prefix + file_name, type == DT_DIR)) {
+      continue;
     }
 
-    if (S_ISDIR(from_stat.st_mode)) {
-      std::vector<std::string> to_subpath = to_path;
-      to_subpath.push_back(file_name);
-      if (!CopyFiles(JoinPaths({from_path, file_name}), to_subpath,
-                     predicate)) {
-        D2D_ERROR << "Could not copy directory " << file_name;
+    if (type == DT_DIR) {
+      if (!ListFiles(JoinPaths({directory, file_name}),
+                     prefix + file_name + "/", files, filter)) {
         return false;
       }
-    } else {
-      if (!predicate(file_name,                     //
-                     from_stat,                     //
-                     from_fd,                       //
-                     JoinPaths(to_path, file_name)  //
-                     )) {
-        D2D_ERROR << "Could not copy file " << file_name;
+    } else if (type == DT_REG) {
+      files.push_back(prefix + file_name);
+    }
+  }
+  return true;
+}
+
+bool ListFiles(const std::string& directory, std::vector<std::string>& files,
+               const PathFilter* filter) {
+  return ListFiles(directory, "", files, filter);
+}
+
+bool NormalizeFileModes(const std::string& path, int64_t mtime) {
+  struct stat path_stat = {};
+  if (::lstat(path.c_str(), &path_stat) != 0) {
+    D2D_ERROR << "Could not stat file: " << path;
+    return false;
+  }
+
+  mode_t mode = 0;
+  if (S_ISDIR(path_stat.st_mode)) {
+    AutoDir dir(::opendir(path.c_str()));
+    if (!dir.IsValid()) {
+      D2D_ERROR << "Could not open the directory " << path;
+      return false;
+    }
+    while (auto dir_ent = ::readdir(dir.Get())) {
+      const std::string file_name(dir_ent->d_name);
+      if (file_name != "." && file_name != ".." &&
+          !NormalizeFileModes(JoinPaths({path, file_name}), mtime)) {
         return false;
       }
     }
+    mode = 0755;
+  } else if (S_ISREG(path_stat.st_mode) && path_stat.st_nlink == 1) {
+    mode = (path_stat.st_mode & S_IWUSR) != 0 ? 0644 : 0444;
+  } else {
+    // Files with several links share their mode and time with an object
+    // store or another docset, which must not change.
+    return true;
+  }
+
+  if ((path_stat.st_mode & 07777) != mode &&
+      ::chmod(path.c_str(), mode) != 0) {
+    D2D_ERROR << "Could not change the mode of " << path << ": "
+              << strerror(errno);
+    return false;
   }
 
+  if (mtime >= 0) {
+    struct timespec times[2] = {};
+    times[0].tv_sec = static_cast<time_t>(mtime);
+    times[1].tv_sec = static_cast<time_t>(mtime);
+    if (::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0) {
+      D2D_ERROR << "Could not change the modification time of " << path
+                << ": " << strerror(errno);
+      return false;
+    }
+  }
   return true;
 }
 
@@ -209,6 +318,15 @@ std::unique_ptr<AutoMapping> OpenFileReadOnly(const AutoFD& fd, size_t size) {
     return nullptr;
   }
 
+  if (size <= gIOThresholds.small_file_size) {
+    Allocation buffer(size);
+    if (!buffer.IsValid() || !ReadFully(fd, buffer.Get(), size)) {
+      D2D_ERROR << "Could not read file: " << strerror(errno);
+      return nullptr;
+    }
+    return std::make_unique<AutoMapping>(std::move(buffer));
+  }
+
   auto mapping =
       std::make_unique<AutoMapping>(::mmap(nullptr,                 //
                                            size,                    //
@@ -222,6 +340,14 @@ std::unique_ptr<AutoMapping> OpenFileReadOnly(const AutoFD& fd, size_t size) {
     return nullptr;
   }
 
+  if (size >= gIOThresholds.large_file_size) {
+    // Only hints. Failures are not interesting.
+    ::madvise(mapping->Get(), size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    ::madvise(mapping->Get(), size, MADV_HUGEPAGE);
+#endif
+  }
+
   return mapping;
 }
 
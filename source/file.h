@@ -5,19 +5,22 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "buffer_pool.h"
 #include "logger.h"
 
 namespace d2d {
 
+class PathFilter;
+
 class AutoFD {
  public:
   AutoFD(int fd) : fd_(fd) {}
@@ -74,41 +77,21 @@ class AutoDir {
   D2D_DISALLOW_COPY_AND_ASSIGN(AutoDir);
 };
 
-class AutoMapping {
- public:
-  AutoMapping(void* mapping, size_t size) : mapping_(mapping), size_(size) {}
-
-  ~AutoMapping() {
-    if (mapping_ != MAP_FAILED) {
-      if (::munmap(mapping_, size_) != 0) {
-        D2D_ERROR << "Error unmapping file.";
-      }
-    }
-  }
-
-  void* Get() const { return mapping_; }
-
-  size_t GetSize() const { return size_; }
-
-  bool IsValid() const { return mapping_ != MAP_FAILED; }
-
- private:
-  void* mapping_ = MAP_FAILED;
-  size_t size_ = 0;
-
-  D2D_DISALLOW_COPY_AND_ASSIGN(AutoMapping);
-};
-
+// A buffer drawn from the buffer pool of the calling thread. The contents are
+// not initialized.
 class Allocation {
  public:
   Allocation() = default;
 
-  Allocation(size_t size)
-      : allocation_(::calloc(size, sizeof(uint8_t))), size_(size) {}
+  Allocation(size_t size) : size_(size) {
+    allocation_ = BufferPool::GetThreadPool().Acquire(size, capacity_);
+  }
 
-  Allocation(Allocation&& o) : allocation_(o.allocation_), size_(o.size_) {
+  Allocation(Allocation&& o)
+      : allocation_(o.allocation_), size_(o.size_), capacity_(o.capacity_) {
     o.allocation_ = nullptr;
     o.size_ = 0;
+    o.capacity_ = 0;
   }
 
   Allocation(const Allocation&) = delete;
@@ -119,7 +102,7 @@ class Allocation {
 
   ~Allocation() {
     if (allocation_ != nullptr) {
-      ::free(allocation_);
+      BufferPool::GetThreadPool().Release(allocation_, capacity_);
     }
   }
 
@@ -132,6 +115,42 @@ class Allocation {
  private:
   void* allocation_ = nullptr;
   size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+// A read-only view of the contents of a file. Depending on the size of the
+// file, the contents are either mapped or read into a pooled buffer.
+class AutoMapping {
+ public:
+  AutoMapping(void* mapping, size_t size) : mapping_(mapping), size_(size) {}
+
+  AutoMapping(Allocation buffer)
+      : size_(buffer.GetSize()), buffer_(std::move(buffer)) {}
+
+  ~AutoMapping() {
+    if (mapping_ != MAP_FAILED) {
+      if (::munmap(mapping_, size_) != 0) {
+        D2D_ERROR << "Error unmapping file.";
+      }
+    }
+  }
+
+  void* Get() const {
+    return mapping_ != MAP_FAILED ? mapping_ : buffer_.Get();
+  }
+
+  size_t GetSize() const { return size_; }
+
+  bool IsValid() const {
+    return mapping_ != MAP_FAILED || buffer_.IsValid();
+  }
+
+ private:
+  void* mapping_ = MAP_FAILED;
+  size_t size_ = 0;
+  Allocation buffer_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(AutoMapping);
 };
 
 std::string JoinPaths(const std::vector<std::string>& paths);
@@ -147,13 +166,38 @@ std::string JoinPaths(const std::vector<std::string>& paths,
 
 bool MakeDirectories(const std::vector<std::string>& directories);
 
-using CopyPredicate = std::function<bool(const std::string& from_file_name,  //
-                                         const struct stat& from_stat,       //
-                                         const AutoFD& from_fd,              //
-                                         const std::string& to_file_name)>;
+// Creates the directories of |path|, which is relative to |root|, one
+// component at a time.
+bool MakeDirectories(const std::vector<std::string>& root,
+                     const std::string& path);
+
+// Reads and writes pick a strategy based on the size of the file.
+struct IOThresholds {
+  // Files of at most this many bytes are read into a pooled buffer with
+  // pread instead of being mapped.
+  size_t small_file_size = 64u << 10;
+  // Mappings of at least this many bytes are advised as sequential and as
+  // candidates for huge pages.
+  size_t large_file_size = 16u << 20;
+};
+
+// Must be set before any files are opened.
+void SetIOThresholds(const IOThresholds& thresholds);
+
+const IOThresholds& GetIOThresholds();
+
+// Appends the paths of all regular files under |directory|, relative to it,
+// to |files|. Symbolic links are followed. Entries |filter| excludes are
+// skipped.
+bool ListFiles(const std::string& directory, std::vector<std::string>& files,
+               const PathFilter* filter = nullptr);
 
-bool CopyFiles(const std::string& from, const std::vector<std::string>& to,
-               CopyPredicate predicate);
+// Gives |path| and everything under it a mode that does not depend on the
+// umask: 0755 for directories, 0644 for files and 0444 for read-only files.
+// If |mtime| is not negative, it also becomes their modification time, in
+// seconds since the epoch. Files with more than one link, such as those
+// linked to the objects of an |ObjectStore|, are left alone.
+bool NormalizeFileModes(const std::string& path, int64_t mtime);
 
 bool CopyFile(const struct stat& from_stat, const AutoFD& from,
               const std::string& to_path);
@@ -162,6 +206,14 @@ bool CopyFile(const std::string& from, const std::string& to);
 
 bool CopyData(const void* data, size_t length, const std::string& to);
 
+struct DataSpan {
+  const void* data = nullptr;
+  size_t length = 0;
+};
+
+// Writes the spans back to back.
+bool CopyData(const std::vector<DataSpan>& spans, const std::string& to);
+
 std::unique_ptr<AutoMapping> OpenFileReadOnly(const std::string& path);
 
 std::unique_ptr<AutoMapping> OpenFileReadOnly(const AutoFD& fd, size_t size);
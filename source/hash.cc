@@ -0,0 +1,104 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "hash.h"
+
+#include <string.h>
+
+#include "file.h"
+
+namespace d2d {
+
+static constexpr uint64_t kPrime1 = 11400714785074694791ull;
+static constexpr uint64_t kPrime2 = 14029467366897019727ull;
+static constexpr uint64_t kPrime3 = 1609587929392839161ull;
+static constexpr uint64_t kPrime4 = 9650029242287828579ull;
+static constexpr uint64_t kPrime5 = 2870177450012600261ull;
+
+static inline uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t Read64(const uint8_t* data) {
+  uint64_t value;
+  ::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline uint32_t Read32(const uint8_t* data) {
+  uint32_t value;
+  ::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline uint64_t Round(uint64_t accumulator, uint64_t input) {
+  accumulator += input * kPrime2;
+  accumulator = RotateLeft(accumulator, 31);
+  return accumulator * kPrime1;
+}
+
+static inline uint64_t MergeRound(uint64_t accumulator, uint64_t value) {
+  accumulator ^= Round(0, value);
+  return accumulator * kPrime1 + kPrime4;
+}
+
+uint64_t Hash64(const void* data, size_t length, uint64_t seed) {
+  auto p = static_cast<const uint8_t*>(data);
+  const auto end = p + length;
+  uint64_t hash = 0;
+
+  if (length >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    for (const auto limit = end - 32; p <= limit; p += 32) {
+      v1 = Round(v1, Read64(p));
+      v2 = Round(v2, Read64(p + 8));
+      v3 = Round(v3, Read64(p + 16));
+      v4 = Round(v4, Read64(p + 24));
+    }
+    hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) +
+           RotateLeft(v4, 18);
+    hash = MergeRound(hash, v1);
+    hash = MergeRound(hash, v2);
+    hash = MergeRound(hash, v3);
+    hash = MergeRound(hash, v4);
+  } else {
+    hash = seed + kPrime5;
+  }
+
+  hash += static_cast<uint64_t>(length);
+
+  for (; p + 8 <= end; p += 8) {
+    hash ^= Round(0, Read64(p));
+    hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    hash ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+    hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    hash ^= (*p) * kPrime5;
+    hash = RotateLeft(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+bool HashFile(const std::string& path, uint64_t& hash) {
+  auto mapping = OpenFileReadOnly(path);
+  if (!mapping) {
+    return false;
+  }
+  hash = Hash64(mapping->Get(), mapping->GetSize());
+  return true;
+}
+
+}  // namespace d2d
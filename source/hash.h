@@ -0,0 +1,21 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace d2d {
+
+// A fast non-cryptographic 64-bit hash (XXH64). Suitable for detecting
+// changed inputs, not for security.
+uint64_t Hash64(const void* data, size_t length, uint64_t seed = 0);
+
+// Hashes the contents of the file at |path|. Returns false if the file could
+// not be read.
+bool HashFile(const std::string& path, uint64_t& hash);
+
+}  // namespace d2d
@@ -3,23 +3,48 @@
 
 #include "html_parser.h"
 
-#include <map>
-#include <sstream>
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <utility>
 
 #include "logger.h"
 
 namespace d2d {
 
+static void* ArenaAllocate(void* arena, size_t size) {
+  return static_cast<Arena*>(arena)->Allocate(size);
+}
+
+static void ArenaDeallocate(void*, void*) {
+  // Everything is released when the arena is reset.
+}
+
 HTMLParser::HTMLParser(std::unique_ptr<AutoMapping> mapping)
-    : mapping_(std::move(mapping)) {
-  if (!mapping_ || !mapping_->IsValid()) {
+    : HTMLParser(mapping && mapping->IsValid() ? mapping->Get() : nullptr,
+                 mapping ? mapping->GetSize() : 0) {
+  mapping_ = std::move(mapping);
+}
+
+HTMLParser::HTMLParser(const void* data, size_t size)
+    : data_(static_cast<const char*>(data)),
+      size_(size),
+      arena_(Arena::GetThreadArena()),
+      options_(kGumboDefaultOptions) {
+  arena_.Retain();
+
+  if (data_ == nullptr) {
     D2D_ERROR << "HTML mapping was not valid.";
     return;
   }
 
-  parser_ = ::gumbo_parse_with_options(
-      &kGumboDefaultOptions, static_cast<const char*>(mapping_->Get()),
-      mapping_->GetSize());
+  options_.allocator = ArenaAllocate;
+  options_.deallocator = ArenaDeallocate;
+  options_.userdata = &arena_;
+
+  parser_ = ::gumbo_parse_with_options(&options_, data_, size_);
 
   if (!parser_ || parser_->root == nullptr) {
     D2D_ERROR << "Could not parse HTML file";
@@ -30,20 +55,13 @@ HTMLParser::HTMLParser(std::unique_ptr<AutoMapping> mapping)
 }
 
 HTMLParser::~HTMLParser() {
-  if (parser_) {
-    ::gumbo_destroy_output(&kGumboDefaultOptions, parser_);
-  }
+  // The output is not walked and destroyed node by node. The whole tree goes
+  // away when the arena is reset.
+  arena_.Release();
 }
 
 bool HTMLParser::IsValid() const { return is_valid_; }
 
-static std::string DashAnchorFromToken(const Token& token) {
-  std::stringstream stream;
-  stream << "<a name=\"//apple_ref/cpp/" << token.GetIndexType() << "/"
-         << token.GetIndexName() << "\" class=\"dashAnchor\">&nbsp;</a>";
-  return stream.str();
-}
-
 static void WalkHTMLTreeForAnchors(
     GumboNode* parent,
     std::function<void(const GumboElement& element)> callback) {
@@ -69,18 +87,29 @@ static void WalkHTMLTreeForAnchors(
 }
 
 Allocation HTMLParser::BuildHTMLWithTOC(
-    const std::vector<Token>& tokens) const {
+    const TokenTable& table,
+    const TokenTable::RowRange& rows) const {
   if (!IsValid()) {
     return {};
   }
 
-  std::map<std::string, Token> known_anchors;
-  for (const auto& token : tokens) {
-    known_anchors["#" + token.GetAnchor()] = token;
-    known_anchors[token.GetIndexPath()] = token;
+  // Links may refer to a token by its anchor or by its index path. Both are
+  // looked up in one sorted array of pointers into the table columns.
+  using KnownAnchor = std::pair<const char*, uint32_t>;
+  std::vector<KnownAnchor> known_anchors;
+  known_anchors.reserve(rows.size() * 2);
+  for (const auto row : rows) {
+    known_anchors.emplace_back(table.GetAnchors().Get(row), row);
+    known_anchors.emplace_back(table.GetIndexPaths().Get(row), row);
   }
+  auto compare_anchors = [](const KnownAnchor& lhs, const KnownAnchor& rhs) {
+    return ::strcmp(lhs.first, rhs.first) < 0;
+  };
+  std::stable_sort(known_anchors.begin(), known_anchors.end(),
+                   compare_anchors);
 
-  std::map<size_t, std::string, std::less<size_t>> source_insertions;
+  // Offset in the source and the row whose dashAnchor is inserted there.
+  std::vector<std::pair<size_t, uint32_t>> source_insertions;
 
   WalkHTMLTreeForAnchors(parser_->root, [&](const GumboElement& element) {
     const auto& attributes = element.attributes;
@@ -92,22 +121,46 @@ Allocation HTMLParser::BuildHTMLWithTOC(
         return;
       }
 
-      auto found_anchor = known_anchors.find(std::string{attribute->value});
-      if (found_anchor == known_anchors.end()) {
+      // The last token with a given anchor wins.
+      auto found_anchor = std::upper_bound(
+          known_anchors.begin(), known_anchors.end(),
+          KnownAnchor{attribute->value, 0}, compare_anchors);
+      if (found_anchor == known_anchors.begin() ||
+          ::strcmp((found_anchor - 1)->first, attribute->value) != 0) {
         return;
       }
 
-      source_insertions[element.start_pos.offset] =
-          DashAnchorFromToken(found_anchor->second);
+      source_insertions.emplace_back(element.start_pos.offset,
+                                     (found_anchor - 1)->second);
     }
   });
 
+  // Keep the last insertion at each offset.
+  std::stable_sort(source_insertions.begin(), source_insertions.end(),
+                   [](const std::pair<size_t, uint32_t>& lhs,
+                      const std::pair<size_t, uint32_t>& rhs) {
+                     return lhs.first < rhs.first;
+                   });
+  {
+    size_t kept = 0;
+    for (size_t i = 0; i < source_insertions.size(); i++) {
+      if (i + 1 < source_insertions.size() &&
+          source_insertions[i + 1].first == source_insertions[i].first) {
+        continue;
+      }
+      source_insertions[kept++] = source_insertions[i];
+    }
+    source_insertions.resize(kept);
+  }
+
+  const auto& dash_anchors = table.GetDashAnchors();
+
   size_t insertions_size = 0;
   for (const auto& insertion : source_insertions) {
-    insertions_size += insertion.second.size();
+    insertions_size += dash_anchors.GetLength(insertion.second);
   }
 
-  Allocation rewritten_allocation(mapping_->GetSize() + insertions_size);
+  Allocation rewritten_allocation(size_ + insertions_size);
 
   if (!rewritten_allocation.IsValid()) {
     D2D_ERROR << "Could not allocate bytes for HTML rewrite.";
@@ -117,11 +170,12 @@ Allocation HTMLParser::BuildHTMLWithTOC(
   size_t source_offset = 0;
   size_t destination_offset = 0;
   uint8_t* destination = rewritten_allocation.Get();
-  const uint8_t* source = static_cast<const uint8_t*>(mapping_->Get());
+  const uint8_t* source = reinterpret_cast<const uint8_t*>(data_);
 
   for (const auto& insertion : source_insertions) {
     const auto insertion_offset = insertion.first;
-    const auto& insertion_string = insertion.second;
+    const auto insertion_string = dash_anchors.Get(insertion.second);
+    const auto insertion_length = dash_anchors.GetLength(insertion.second);
 
     // Copy the HTML.
     ::memmove(destination + destination_offset, source + source_offset,
@@ -131,16 +185,107 @@ Allocation HTMLParser::BuildHTMLWithTOC(
     source_offset += (insertion_offset - source_offset);
 
     // Copy the insertion.
-    ::memmove(destination + destination_offset, insertion_string.data(),
-              insertion_string.size());
-    destination_offset += (insertion_string.size());
+    ::memmove(destination + destination_offset, insertion_string,
+              insertion_length);
+    destination_offset += insertion_length;
   }
 
   // Copy final block.
   ::memmove(destination + destination_offset, source + source_offset,
-            mapping_->GetSize() - source_offset);
+            size_ - source_offset);
 
   return rewritten_allocation;
 }
 
+static void AppendCollapsingWhitespace(std::string& text, const char* run) {
+  for (; *run != '\0'; ++run) {
+    if (::isspace(static_cast<unsigned char>(*run))) {
+      if (!text.empty() && text.back() != ' ') {
+        text.push_back(' ');
+      }
+    } else {
+      text.push_back(*run);
+    }
+  }
+}
+
+static void WalkHTMLTreeForText(const GumboNode* node, std::string& text) {
+  if (!node) {
+    return;
+  }
+
+  switch (node->type) {
+    case GumboNodeType::GUMBO_NODE_TEXT:
+    case GumboNodeType::GUMBO_NODE_CDATA:
+    case GumboNodeType::GUMBO_NODE_WHITESPACE:
+      AppendCollapsingWhitespace(text, node->v.text.text);
+      return;
+    case GumboNodeType::GUMBO_NODE_ELEMENT:
+      break;
+    default:
+      return;
+  }
+
+  const auto& element = node->v.element;
+  if (element.tag == GumboTag::GUMBO_TAG_SCRIPT ||
+      element.tag == GumboTag::GUMBO_TAG_STYLE) {
+    return;
+  }
+
+  const auto& children = element.children;
+  for (size_t i = 0; i < children.length; ++i) {
+    WalkHTMLTreeForText(reinterpret_cast<GumboNode**>(children.data)[i], text);
+    // Block boundaries are not tracked, so separate sibling elements.
+    if (!text.empty() && text.back() != ' ') {
+      text.push_back(' ');
+    }
+  }
+}
+
+static const GumboNode* FindFirstElement(const GumboNode* node, GumboTag tag) {
+  if (!node || node->type != GumboNodeType::GUMBO_NODE_ELEMENT) {
+    return nullptr;
+  }
+
+  if (node->v.element.tag == tag) {
+    return node;
+  }
+
+  const auto& children = node->v.element.children;
+  for (size_t i = 0; i < children.length; ++i) {
+    if (auto found = FindFirstElement(
+            reinterpret_cast<GumboNode**>(children.data)[i], tag)) {
+      return found;
+    }
+  }
+
+  return nullptr;
+}
+
+std::string HTMLParser::ExtractTitle() const {
+  if (!IsValid()) {
+    return "";
+  }
+
+  std::string title;
+  WalkHTMLTreeForText(FindFirstElement(parser_->root, GUMBO_TAG_TITLE), title);
+  while (!title.empty() && title.back() == ' ') {
+    title.pop_back();
+  }
+  return title;
+}
+
+std::string HTMLParser::ExtractText() const {
+  if (!IsValid()) {
+    return "";
+  }
+
+  std::string text;
+  WalkHTMLTreeForText(parser_->root, text);
+  while (!text.empty() && text.back() == ' ') {
+    text.pop_back();
+  }
+  return text;
+}
+
 }  // namespace d2d
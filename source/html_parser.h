@@ -8,24 +8,44 @@
 #include <string>
 #include <vector>
 
+#include "arena.h"
 #include "file.h"
 #include "macros.h"
-#include "token.h"
+#include "token_table.h"
 
 namespace d2d {
 
+// Parses a page with Gumbo. The DOM is allocated from the arena of the
+// calling thread and released in one go when the parser is destroyed, so the
+// parser must be destroyed on the thread that created it.
 class HTMLParser {
  public:
   HTMLParser(std::unique_ptr<AutoMapping> mapping);
 
+  // Parses |size| bytes at |data|, which must outlive the parser.
+  HTMLParser(const void* data, size_t size);
+
   ~HTMLParser();
 
   bool IsValid() const;
 
-  Allocation BuildHTMLWithTOC(const std::vector<Token>& tokens) const;
+  // Injects the dashAnchor of each of the given rows in front of the links to
+  // it.
+  Allocation BuildHTMLWithTOC(const TokenTable& table,
+                              const TokenTable::RowRange& rows) const;
+
+  std::string ExtractTitle() const;
+
+  // The visible text of the page with runs of whitespace collapsed. Used to
+  // populate the full-text search table.
+  std::string ExtractText() const;
 
  private:
   std::unique_ptr<AutoMapping> mapping_;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  Arena& arena_;
+  GumboOptions options_;
   GumboOutput* parser_ = nullptr;
   bool is_valid_ = false;
 
@@ -0,0 +1,390 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "logger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace d2d {
+
+static std::atomic<LogLevel> gLogLevel(LogLevel::kNormal);
+
+void SetLogLevel(LogLevel level) { gLogLevel.store(level); }
+
+LogLevel GetLogLevel() { return gLogLevel.load(std::memory_order_relaxed); }
+
+// Appends everything written to a string whose capacity is reused between
+// messages.
+class LogStreamBuffer : public std::streambuf {
+ public:
+  std::string& text() { return text_; }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      text_.push_back(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize size) override {
+    text_.append(data, static_cast<size_t>(size));
+    return size;
+  }
+
+ private:
+  std::string text_;
+};
+
+class LogStream {
+ public:
+  LogStream() : stream_(&buffer_) {}
+
+  std::ostream& stream() { return stream_; }
+
+  std::string& text() { return buffer_.text(); }
+
+  bool in_use = false;
+
+ private:
+  LogStreamBuffer buffer_;
+  std::ostream stream_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(LogStream);
+};
+
+namespace {
+
+struct LogRecord {
+  enum class Kind {
+    kMessage,
+    kFlush,
+  };
+
+  Kind kind = Kind::kMessage;
+  bool error = false;
+  const char* file = nullptr;
+  int line = 0;
+  std::string text;
+};
+
+// Drops messages from call sites that have logged too often and remembers how
+// many were dropped.
+class RepeatLimiter {
+ public:
+  bool ShouldWrite(const LogRecord& record) {
+    if (!record.error || GetLogLevel() == LogLevel::kVerbose) {
+      return true;
+    }
+    auto& site = sites_[std::make_pair(record.file, record.line)];
+    if (site.count++ < kLogRepeatLimit) {
+      return true;
+    }
+    site.last_text = record.text;
+    return false;
+  }
+
+  // A line for every call site that had messages suppressed. Resets the
+  // counts.
+  std::string TakeSummary() {
+    std::string summary;
+    for (const auto& site : sites_) {
+      if (site.second.count <= kLogRepeatLimit) {
+        continue;
+      }
+      summary += "Suppressed ";
+      summary += std::to_string(site.second.count - kLogRepeatLimit);
+      summary += " more messages like: ";
+      summary += site.second.last_text;
+      summary += '\n';
+    }
+    sites_.clear();
+    return summary;
+  }
+
+ private:
+  struct Site {
+    size_t count = 0;
+    std::string last_text;
+  };
+
+  std::map<std::pair<const char*, int>, Site> sites_;
+};
+
+void WriteFully(int fd, const std::string& text) {
+  size_t written = 0;
+  while (written < text.size()) {
+    auto result = D2D_TEMP_FAILURE_RETRY(
+        ::write(fd, text.data() + written, text.size() - written));
+    if (result <= 0) {
+      return;
+    }
+    written += result;
+  }
+}
+
+// Log records are passed from any number of producers to a single writer
+// thread through a bounded ring of slots. Each slot carries a sequence number
+// that tells producers and the writer whose turn it is, so neither side takes
+// a lock to hand off a record. The writer batches consecutive records for the
+// same stream into a single write.
+class LogWriter {
+ public:
+  static constexpr size_t kSlotCount = 4096;
+
+  LogWriter() {
+    for (size_t i = 0; i < kSlotCount; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  // Swaps |text| into the ring. |text| gets back the storage of a record the
+  // writer has already consumed.
+  void Submit(bool error, const char* file, int line, std::string& text) {
+    if (stopped_.load(std::memory_order_acquire)) {
+      WriteSynchronously(error, file, line, text);
+      return;
+    }
+    Enqueue(LogRecord::Kind::kMessage, error, file, line, &text);
+  }
+
+  void Flush() {
+    if (stopped_.load(std::memory_order_acquire)) {
+      return;
+    }
+    const auto position =
+        Enqueue(LogRecord::Kind::kFlush, false, nullptr, 0, nullptr);
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushed_condition_.wait(lock, [this, position]() {
+      return flushed_position_ > position;
+    });
+  }
+
+  // Writes out everything and stops the writer thread. Later messages are
+  // written synchronously.
+  void Stop() {
+    if (stopped_.load(std::memory_order_acquire)) {
+      return;
+    }
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_condition_.notify_one();
+    thread_.join();
+    stopped_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(synchronous_mutex_);
+    Drain();
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    LogRecord record;
+  };
+
+  Slot slots_[kSlotCount];
+  std::atomic<size_t> enqueue_position_{0};
+  size_t dequeue_position_ = 0;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_condition_;
+  std::condition_variable flushed_condition_;
+  std::atomic<bool> sleeping_{false};
+  bool stopping_ = false;
+  size_t flushed_position_ = 0;
+  std::atomic<bool> stopped_{false};
+
+  // Only touched by the writer thread, or under |synchronous_mutex_| once it
+  // has stopped.
+  RepeatLimiter limiter_;
+  std::string pending_;
+  int pending_fd_ = STDOUT_FILENO;
+  std::mutex synchronous_mutex_;
+
+  size_t Enqueue(LogRecord::Kind kind, bool error, const char* file, int line,
+                 std::string* text) {
+    auto position = enqueue_position_.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    for (;;) {
+      slot = &slots_[position % kSlotCount];
+      const auto sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<intptr_t>(sequence) -
+                              static_cast<intptr_t>(position);
+      if (difference == 0) {
+        if (enqueue_position_.compare_exchange_weak(
+                position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        // The ring is full. Wait for the writer to catch up.
+        Wake();
+        std::this_thread::yield();
+        position = enqueue_position_.load(std::memory_order_relaxed);
+      } else {
+        position = enqueue_position_.load(std::memory_order_relaxed);
+      }
+    }
+
+    auto& record = slot->record;
+    record.kind = kind;
+    record.error = error;
+    record.file = file;
+    record.line = line;
+    if (text != nullptr) {
+      record.text.swap(*text);
+    }
+    slot->sequence.store(position + 1, std::memory_order_release);
+    Wake();
+    return position;
+  }
+
+  void Wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_condition_.notify_one();
+    }
+  }
+
+  bool HasRecord() const {
+    const auto& slot = slots_[dequeue_position_ % kSlotCount];
+    return slot.sequence.load(std::memory_order_acquire) ==
+           dequeue_position_ + 1;
+  }
+
+  void Run() {
+    for (;;) {
+      Drain();
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopping_ && !HasRecord()) {
+        return;
+      }
+      sleeping_.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!HasRecord() && !stopping_) {
+        // The timeout covers a producer that checked |sleeping_| just before
+        // it was set.
+        wake_condition_.wait_for(lock, std::chrono::milliseconds(50));
+      }
+      sleeping_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  void Drain() {
+    while (HasRecord()) {
+      auto& slot = slots_[dequeue_position_ % kSlotCount];
+      Process(slot.record, dequeue_position_);
+      slot.record.text.clear();
+      slot.sequence.store(dequeue_position_ + kSlotCount,
+                          std::memory_order_release);
+      dequeue_position_++;
+    }
+    WritePending();
+  }
+
+  void Process(const LogRecord& record, size_t position) {
+    if (record.kind == LogRecord::Kind::kFlush) {
+      Append(STDERR_FILENO, limiter_.TakeSummary());
+      WritePending();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushed_position_ = position + 1;
+      }
+      flushed_condition_.notify_all();
+      return;
+    }
+    if (limiter_.ShouldWrite(record)) {
+      Append(record.error ? STDERR_FILENO : STDOUT_FILENO, record.text);
+      pending_ += '\n';
+    }
+  }
+
+  void Append(int fd, const std::string& text) {
+    if (fd != pending_fd_ || pending_.size() > (64u << 10)) {
+      WritePending();
+      pending_fd_ = fd;
+    }
+    pending_ += text;
+  }
+
+  void WritePending() {
+    WriteFully(pending_fd_, pending_);
+    pending_.clear();
+  }
+
+  void WriteSynchronously(bool error, const char* file, int line,
+                          std::string& text) {
+    std::lock_guard<std::mutex> lock(synchronous_mutex_);
+    LogRecord record;
+    record.error = error;
+    record.file = file;
+    record.line = line;
+    record.text.swap(text);
+    if (limiter_.ShouldWrite(record)) {
+      record.text += '\n';
+      WriteFully(error ? STDERR_FILENO : STDOUT_FILENO, record.text);
+    }
+  }
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(LogWriter);
+};
+
+}  // namespace
+
+// Started with the first message and stopped when the process exits. Never
+// destroyed so that messages logged by static destructors are still written.
+static LogWriter& GetLogWriter() {
+  static LogWriter* writer = []() {
+    auto created = new LogWriter();
+    ::atexit([]() { GetLogWriter().Stop(); });
+    return created;
+  }();
+  return *writer;
+}
+
+void FlushLogs() { GetLogWriter().Flush(); }
+
+static LogStream& GetThreadLogStream() {
+  static thread_local LogStream stream;
+  return stream;
+}
+
+LogMessage::LogMessage(bool error, const char* file, int line)
+    : error_(error), file_(file), line_(line) {
+  auto& thread_stream = GetThreadLogStream();
+  if (thread_stream.in_use) {
+    // Something logged while formatting another message.
+    owned_stream_.reset(new LogStream());
+    stream_ = owned_stream_.get();
+  } else {
+    stream_ = &thread_stream;
+  }
+  stream_->in_use = true;
+  stream_->text().clear();
+}
+
+LogMessage::~LogMessage() {
+  GetLogWriter().Submit(error_, file_, line_, stream_->text());
+  stream_->in_use = false;
+}
+
+std::ostream& LogMessage::stream() { return stream_->stream(); }
+
+}  // namespace d2d
@@ -3,37 +3,72 @@
 
 #pragma once
 
-#include <iostream>
+#include <stddef.h>
+
+#include <memory>
+#include <ostream>
 
 #include "macros.h"
 
 namespace d2d {
 
-template <class Type>
-class AutoLogger {
+class LogStream;
+
+enum class LogLevel {
+  // Only errors.
+  kQuiet,
+  // Errors and progress messages.
+  kNormal,
+  // Everything, including per-file details. Repeated errors are not
+  // rate-limited.
+  kVerbose,
+};
+
+void SetLogLevel(LogLevel level);
+
+LogLevel GetLogLevel();
+
+// Writes out all messages logged so far. Also called when the process exits.
+void FlushLogs();
+
+// The number of messages from a single call site that are printed before
+// further messages from that site are suppressed. Suppressed messages are
+// summarized by |FlushLogs|.
+constexpr size_t kLogRepeatLimit = 10;
+
+// Collects a message into a per-thread stream and hands it to the background
+// log writer when destroyed.
+class LogMessage {
  public:
-  AutoLogger(Type& logger) : logger_(logger) {}
+  LogMessage(bool error, const char* file, int line);
 
-  ~AutoLogger() {
-    logger_ << std::endl;
-    logger_.flush();
-  }
+  ~LogMessage();
 
-  template <class T>
-  AutoLogger& operator<<(const T& object) {
-    logger_ << object;
-    return *this;
-  }
+  std::ostream& stream();
 
  private:
-  Type& logger_;
+  const bool error_;
+  const char* file_;
+  const int line_;
+  LogStream* stream_ = nullptr;
+  std::unique_ptr<LogStream> owned_stream_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(LogMessage);
+};
 
-  D2D_DISALLOW_COPY_AND_ASSIGN(AutoLogger);
+// Lets the logging macros discard the stream expression in a statement.
+struct LogMessageVoidify {
+  void operator&(std::ostream&) {}
 };
 
-using AutoOStreamLogger = AutoLogger<std::ostream>;
+#define D2D_LOG_AT(level, error)                                           \
+  static_cast<int>(::d2d::GetLogLevel()) < static_cast<int>(level)         \
+      ? (void)0                                                            \
+      : ::d2d::LogMessageVoidify() &                                       \
+            ::d2d::LogMessage((error), __FILE__, __LINE__).stream()
 
-#define D2D_ERROR ::d2d::AutoOStreamLogger(std::cerr)
-#define D2D_LOG ::d2d::AutoOStreamLogger(std::cout)
+#define D2D_ERROR D2D_LOG_AT(::d2d::LogLevel::kQuiet, true)
+#define D2D_LOG D2D_LOG_AT(::d2d::LogLevel::kNormal, false)
+#define D2D_VERBOSE D2D_LOG_AT(::d2d::LogLevel::kVerbose, false)
 
 }  // namespace d2d
@@ -1,14 +1,24 @@
 // This source file is part of doxygen2docset.
 // Licensed under the MIT License. See LICENSE.md file for details.
 
-#include <map>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "builder.h"
+#include "delta.h"
 #include "logger.h"
 #include "macros.h"
+#include "object_store.h"
+#include "parallel.h"
+#include "perf_counters.h"
+#include "shard.h"
+#include "verifier.h"
 
 namespace d2d {
 
@@ -22,6 +32,11 @@ Usage
 =====
 
   doxgen2docset --doxygen <path to doxygen source> --docset <path to docset dir> [--help]
+  doxgen2docset --doxygen <subdirectory>=<path to doxygen source> ... --docset <path to docset dir>
+  doxgen2docset --verify <path to .docset>
+  doxgen2docset --apply-delta <path to delta> --docset <path to .docset>
+  doxgen2docset --merge <path to shard .docset> ... --docset <path to docset dir>
+  doxgen2docset --collect-garbage <path to store>
 
 Options
 =======
@@ -29,6 +44,30 @@ Options
   --doxygen       Required: The path the HTML sources generated by Doxygen,
                   see the explanatory section below on how to configure Doxygen.
 
+                  It may also be a tar archive of them, optionally compressed
+                  with gzip, bzip2, xz or zstd, or "-" to read the archive from
+                  standard input. The archive is read in one pass without
+                  extracting it. Files that come before Tokens.xml and
+                  Info.plist in the archive are held in memory until both are
+                  read, so put them first, for example with:
+
+                    tar -czf html.tar.gz -C html Tokens.xml Info.plist .
+
+                  The directory of the archive that holds them, such as the
+                  html/ of "tar -cf html.tar html", is the Doxygen output.
+                  Compressed archives need the matching tool on the PATH.
+                  Ignores --token-cache and cannot be combined with
+                  --low-memory.
+
+                  Give --doxygen several times as
+                  "<subdirectory>=<path>" to build one docset from the outputs
+                  of several Doxygen runs, such as one per subproject. Each
+                  output is copied to its own subdirectory of Documents and
+                  the tokens of all of them go into one index. They are read
+                  from Tokens.xml, and the first output's Info.plist names
+                  the docset. Cannot be combined with archives, --doxygen-xml,
+                  --tokens-from-tagfile or --low-memory.
+
   --docset        Required: The path to the directory where this tool will
                   generate the docset. The name of the docset will be derived
                   from the Docset bundle identifier. For example, if the
@@ -40,8 +79,139 @@ Options
                   DOCSET_BUNDLE_ID property in your Doxyfile before generating
                   documentation.
 
+  --doxygen-xml   Optional: The path to the XML output of Doxygen
+                  (GENERATE_XML). The index is built from the per-compound XML
+                  files, which are read in parallel, instead of Tokens.xml, so
+                  GENERATE_DOCSET is not needed. Ignores --token-cache. The
+                  page and anchor of every member are kept in memory to skip
+                  members listed twice, even with --low-memory.
+
+  --tokens-from-tagfile
+                  Optional: The path to a Doxygen tag file (GENERATE_TAGFILE)
+                  to read the tokens from instead of Tokens.xml. Tag files
+                  list the same compounds and members in far fewer bytes.
+                  Cannot be combined with --doxygen-xml. The page and anchor
+                  of every member are kept in memory to merge members listed
+                  twice, even with --low-memory.
+
+  --docset-id     Optional: The Docset bundle identifier to use instead of
+                  the one in Info.plist.
+
+  --docset-name   Optional: The docset name to use instead of the one in
+                  Info.plist. Info.plist is not needed if both --docset-id and
+                  --docset-name are given.
+
+  --full-text-search
+                  Optional: Build a searchText FTS5 table in the docset index
+                  over symbol names, scopes and the text of every page.
+
+  --search-accelerators
+                  Optional: Add a case-insensitive name index, a lowerName
+                  column and a searchTrigram table to the docset index to
+                  speed up prefix and substring lookups.
+
+  --token-cache   Optional: Keep the tokens read from Tokens.xml in a binary
+                  cache file next to the docset. Later runs skip parsing
+                  Tokens.xml if it has not changed.
+
+  --exclude       Optional: Leave the files and directories matching the
+                  given pattern out of the docset. May be given several times.
+                  Excluded directories are not read at all. In patterns, "*"
+                  matches anything but "/", "**" matches anything and "?"
+                  matches one character. Patterns without a "/" match file
+                  and directory names at any depth, others match paths
+                  relative to the Doxygen output. Patterns ending in "/" only
+                  match directories. For example:
+
+                    --exclude search/ --exclude "*.map" --exclude "*.md5"
+
+  --include       Optional: Keep the files and directories matching the
+                  given pattern even if an earlier --exclude matches them.
+                  Where several patterns match, the last one given wins.
+                  Files in excluded directories cannot be included again.
+
+  --store         Optional: The path to an object store shared between
+                  docsets. Every file in the Documents directory of the docset
+                  is a hardlink to an object in the store, and files with the
+                  same contents are stored once. The store must be on the same
+                  file system as the docset.
+
+  --collect-garbage
+                  Optional: Instead of building a docset, remove the objects
+                  in the store at the given path that no docset links to
+                  anymore. Do not run this while docsets are being built into
+                  the store.
+
+  --delta-from    Optional: The path to the previous version of the .docset.
+                  After building, write a delta package next to the new docset
+                  with the files that were added, replaced or removed and the
+                  changed index entries. It is named after the Docset bundle
+                  identifier with a ".delta" extension, for example
+                  "com.exmple.docs.delta".
+
+  --apply-delta   Optional: Instead of building a docset, patch the .docset
+                  given by --docset in place with the delta package at the
+                  given path. Nothing is changed if the docset is not the one
+                  the delta was made from.
+
+  --shard         Optional: Only build shard i of N, given as "i/N", for
+                  example "0/4". Pages are assigned to shards by a hash of
+                  their path relative to the Doxygen output, and each shard
+                  gets the index entries of its own pages. Build every shard
+                  from the same Doxygen output and combine them with --merge.
+                  Cannot be combined with --delta-from.
+
+  --merge         Optional: Instead of building a docset, combine the shard
+                  .docset at the given path with the others given by more
+                  --merge options into one docset in the directory given by
+                  --docset. Every shard of the build must be given once. The
+                  pages are hardlinked from the shards where possible, and
+                  the search accelerators are built here if the shards were
+                  built with --search-accelerators.
+
+  --verify        Optional: Instead of building a docset, check the docset
+                  at the given path. Every index entry must point at an
+                  existing page that defines its anchor, and every dashAnchor
+                  in a page must match an index entry for that page.
+
+  --low-memory    Optional: Read Tokens.xml a chunk at a time and sort the
+                  tokens by page through temporary files next to the docset
+                  instead of holding all of them in memory. For projects
+                  whose tokens do not fit in memory. Ignores --token-cache.
+                  Memory still grows with the number of members when the
+                  tokens are read with --doxygen-xml or --tokens-from-tagfile.
+
+  --jobs          Optional: The number of threads to use. Defaults to the
+                  number of CPUs.
+
+  --perf-counters Optional: Count the CPU cycles, instructions, cache misses,
+                  branch misses, page faults and context switches of every
+                  phase of the build and of every thread working on it, and
+                  print them with the time of each phase at the end. Needs
+                  Linux and a perf_event_paranoid setting that allows
+                  perf_event_open. Events that cannot be counted are left
+                  out, and only times are printed if none can.
+
+  --quiet         Optional: Only print errors.
+
+  --verbose       Optional: Also print details about every file and do not
+                  suppress repeated errors. By default, only the first few
+                  errors from the same place are printed and the rest are
+                  summarized at the end.
+
   --help          Print this documentation.
 
+Environment
+===========
+
+  SOURCE_DATE_EPOCH
+                  Optional: A number of seconds since the epoch to use as the
+                  modification time of every file of the docset. The rest of
+                  the docset, including the order of the index rows, only
+                  depends on the inputs, so builds of the same inputs are then
+                  identical byte for byte. Files linked to a --store keep the
+                  time of their object.
+
 Preparing Doxygen for Docsets
 =============================
 
@@ -54,6 +224,10 @@ Preparing Doxygen for Docsets
     these files are absent, the docset cannot be generated.
     * Tokens.xml
     * Info.plist
+* Alternatively, set GENERATE_XML = YES instead of GENERATE_DOCSET and pass
+  the xml/ directory with --doxygen-xml along with --docset-id and
+  --docset-name. A tag file written with GENERATE_TAGFILE can be passed with
+  --tokens-from-tagfile the same way.
 
 )~~~";
 
@@ -69,50 +243,261 @@ class ArgParser {
   ArgParser(const std::vector<std::string> &args) {
     for (size_t i = 0; i < args.size(); i++) {
       if (args[i].find_first_of("--") == 0) {
-        if (i < args.size() - 1 && args[i + 1].find_first_of("--") != 0) {
-          args_[args[i].substr(2)] = args[i + 1];
+        // "-" is a value that stands for standard input.
+        if (i < args.size() - 1 && (args[i + 1] == "-" ||
+                                    args[i + 1].find_first_of("--") != 0)) {
+          args_.emplace_back(args[i].substr(2), args[i + 1]);
         } else {
-          args_[args[i].substr(2)] = "";
+          args_.emplace_back(args[i].substr(2), "");
         }
       }
     }
   }
 
   bool HasRequiredOptions() const {
-    return args_.count("doxygen") == 1 && args_.count("docset") == 1;
+    return HasOption("doxygen") && HasOption("docset");
   }
 
   bool HasOption(const std::string &option) const {
-    return args_.count(option) == 1;
+    for (const auto &arg : args_) {
+      if (arg.first == option) {
+        return true;
+      }
+    }
+    return false;
   }
 
-  std::string GetDoxygenPath() const { return args_.at("doxygen"); }
+  // The value of the last occurrence of the option.
+  std::string GetOption(const std::string &option) const {
+    for (auto arg = args_.rbegin(); arg != args_.rend(); ++arg) {
+      if (arg->first == option) {
+        return arg->second;
+      }
+    }
+    return "";
+  }
 
-  std::string GetDocsetPath() const { return args_.at("docset"); }
+  // Every occurrence of any of the options, in order.
+  std::vector<std::pair<std::string, std::string>> GetOptions(
+      const std::set<std::string> &options) const {
+    std::vector<std::pair<std::string, std::string>> found;
+    for (const auto &arg : args_) {
+      if (options.count(arg.first) != 0) {
+        found.push_back(arg);
+      }
+    }
+    return found;
+  }
+
+  std::string GetDocsetPath() const { return GetOption("docset"); }
 
  private:
-  std::map<std::string, std::string> args_;
+  std::vector<std::pair<std::string, std::string>> args_;
   D2D_DISALLOW_COPY_AND_ASSIGN(ArgParser);
 };
 
+bool Verify(const std::string &docset, size_t concurrency) {
+  VerifyReport report;
+  if (!VerifyDocset(docset, concurrency, report)) {
+    D2D_ERROR << "Could not read the docset " << docset;
+    return false;
+  }
+
+  // A single message, so that the repeat limit of the logger does not hide
+  // any of the described problems.
+  if (!report.problems.empty()) {
+    std::string problems;
+    for (const auto &problem : report.problems) {
+      if (!problems.empty()) {
+        problems += '\n';
+      }
+      problems += problem;
+    }
+    D2D_ERROR << problems;
+  }
+  D2D_LOG << "Verified " << report.index_rows << " index entries, "
+          << report.pages << " pages and " << report.dash_anchors
+          << " dashAnchors in " << report.seconds << " s.";
+  D2D_LOG << "Missing pages: " << report.missing_pages
+          << ", missing anchors: " << report.missing_anchors
+          << ", unmatched dashAnchors: " << report.unmatched_dash_anchors;
+  return report.GetProblemCount() == 0;
+}
+
+bool ApplyDelta(const std::string &delta, const std::string &docset) {
+  DeltaStats stats;
+  if (!ApplyDocsetDelta(delta, docset, stats)) {
+    D2D_ERROR << "Could not apply the delta " << delta << " to " << docset;
+    return false;
+  }
+  D2D_LOG << "Wrote " << stats.written_files << " files ("
+          << stats.written_bytes << " bytes), removed " << stats.removed_files
+          << ", added " << stats.added_rows << " index entries and removed "
+          << stats.removed_rows << ".";
+  return true;
+}
+
+bool CollectGarbage(const std::string &store_path) {
+  ObjectStore store(store_path);
+  size_t removed_objects = 0;
+  uint64_t removed_bytes = 0;
+  if (!store.IsValid() ||
+      !store.CollectGarbage(removed_objects, removed_bytes)) {
+    D2D_ERROR << "Could not collect garbage in the store " << store_path;
+    return false;
+  }
+  D2D_LOG << "Removed " << removed_objects << " objects (" << removed_bytes
+          << " bytes) from the store.";
+  return true;
+}
+
+// Reads the modification time of the files of the docset from
+// SOURCE_DATE_EPOCH. |mtime| is negative if it is not set.
+bool ReadSourceDateEpoch(int64_t &mtime) {
+  mtime = -1;
+  const char *value = std::getenv("SOURCE_DATE_EPOCH");
+  if (value == nullptr || *value == '\0') {
+    return true;
+  }
+  char *end = nullptr;
+  errno = 0;
+  const auto epoch = std::strtoll(value, &end, 10);
+  if (errno != 0 || *end != '\0' || epoch < 0) {
+    D2D_ERROR << "User error: SOURCE_DATE_EPOCH must be a number of seconds "
+                 "since the epoch.";
+    return false;
+  }
+  mtime = epoch;
+  return true;
+}
+
+bool Merge(const std::vector<std::string> &shard_docsets,
+           const std::string &location, int64_t mtime) {
+  MergeStats stats;
+  if (!MergeDocsetShards(shard_docsets, location, stats, mtime)) {
+    D2D_ERROR << "Could not merge the shards into " << location;
+    return false;
+  }
+  D2D_LOG << "Merged " << shard_docsets.size() << " shards: " << stats.files
+          << " files, " << stats.rows << " index entries and "
+          << stats.text_rows << " full-text entries.";
+  return true;
+}
+
+// Parses a --doxygen value, either a path or "<subdirectory>=<path>". Paths
+// that contain "=" but no "/" before it can be given as "./<path>".
+DoxygenInput ParseDoxygenInput(const std::string &value) {
+  DoxygenInput input;
+  const auto equals = value.find('=');
+  if (equals != std::string::npos && equals != 0 &&
+      value.find('/') > equals) {
+    input.subdirectory = value.substr(0, equals);
+    input.docs = value.substr(equals + 1);
+  } else {
+    input.docs = value;
+  }
+  return input;
+}
+
 bool Main(const std::vector<std::string> &args) {
   ArgParser parser(args);
 
+  if (parser.HasOption("quiet")) {
+    SetLogLevel(LogLevel::kQuiet);
+  } else if (parser.HasOption("verbose")) {
+    SetLogLevel(LogLevel::kVerbose);
+  }
+
   if (parser.HasOption("help")) {
     PrintUsage();
     return true;
   }
 
+  const auto concurrency =
+      std::strtoul(parser.GetOption("jobs").c_str(), nullptr, 10);
+
+  if (parser.HasOption("verify")) {
+    return Verify(parser.GetOption("verify"),
+                  concurrency != 0 ? concurrency : GetDefaultConcurrency());
+  }
+
+  if (parser.HasOption("apply-delta")) {
+    if (!parser.HasOption("docset")) {
+      D2D_ERROR << "User error: --apply-delta needs --docset. See usage....";
+      PrintUsage(true);
+      return false;
+    }
+    return ApplyDelta(parser.GetOption("apply-delta"),
+                      parser.GetDocsetPath());
+  }
+
+  int64_t mtime = -1;
+  if (!ReadSourceDateEpoch(mtime)) {
+    return false;
+  }
+
+  EnablePerfCounters(parser.HasOption("perf-counters"));
+
+  if (parser.HasOption("merge")) {
+    if (!parser.HasOption("docset")) {
+      D2D_ERROR << "User error: --merge needs --docset. See usage....";
+      PrintUsage(true);
+      return false;
+    }
+    std::vector<std::string> shard_docsets;
+    for (const auto &option : parser.GetOptions({"merge"})) {
+      shard_docsets.push_back(option.second);
+    }
+    const auto merged = Merge(shard_docsets, parser.GetDocsetPath(), mtime);
+    ReportPerfCounters();
+    return merged;
+  }
+
+  if (parser.HasOption("collect-garbage")) {
+    return CollectGarbage(parser.GetOption("collect-garbage"));
+  }
+
   if (!parser.HasRequiredOptions()) {
     D2D_ERROR << "User error: Required options absent. See usage....";
     PrintUsage(true);
     return false;
   }
 
-  D2D_LOG << "Packing Docs:     " << parser.GetDoxygenPath();
+  std::vector<DoxygenInput> inputs;
+  for (const auto &option : parser.GetOptions({"doxygen"})) {
+    inputs.push_back(ParseDoxygenInput(option.second));
+    D2D_LOG << "Packing Docs:     " << option.second;
+  }
   D2D_LOG << "Output Directory: " << parser.GetDocsetPath();
   D2D_LOG << "Working...";
-  auto result = BuildDocset(parser.GetDoxygenPath(), parser.GetDocsetPath());
+  BuildOptions options;
+  options.full_text_search = parser.HasOption("full-text-search");
+  options.search_accelerators = parser.HasOption("search-accelerators");
+  options.token_cache = parser.HasOption("token-cache");
+  options.low_memory = parser.HasOption("low-memory");
+  options.store = parser.GetOption("store");
+  options.delta_from = parser.GetOption("delta-from");
+  options.doxygen_xml = parser.GetOption("doxygen-xml");
+  options.tagfile = parser.GetOption("tokens-from-tagfile");
+  options.docset_id = parser.GetOption("docset-id");
+  options.docset_name = parser.GetOption("docset-name");
+  for (const auto &option : parser.GetOptions({"exclude", "include"})) {
+    PathRule rule;
+    rule.exclude = option.first == "exclude";
+    rule.pattern = option.second;
+    options.path_rules.push_back(rule);
+  }
+  if (parser.HasOption("shard") &&
+      !ParseShard(parser.GetOption("shard"), options.shard)) {
+    D2D_ERROR << "User error: --shard must be given as \"i/N\" with i less "
+                 "than N. See usage....";
+    PrintUsage(true);
+    return false;
+  }
+  options.concurrency = concurrency;
+  options.mtime = mtime;
+  auto result = BuildDocset(inputs, parser.GetDocsetPath(), options);
+  ReportPerfCounters();
   D2D_LOG << (result ? "Success." : "Failed.");
   return result;
 }
@@ -124,5 +509,7 @@ int main(int argc, char const *argv[]) {
   for (int i = 1; i < argc; i++) {
     args.emplace_back(argv[i]);
   }
-  return d2d::Main(args) ? EXIT_SUCCESS : EXIT_FAILURE;
+  const auto result = d2d::Main(args);
+  d2d::FlushLogs();
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
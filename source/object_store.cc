@@ -0,0 +1,150 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "object_store.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "hash.h"
+#include "logger.h"
+
+namespace d2d {
+
+static constexpr char kTemporaryPrefix[] = ".tmp-";
+
+// Two differently seeded hashes make accidental collisions between objects
+// practically impossible.
+static std::string GetObjectName(const void* data, size_t length) {
+  char name[33] = {};
+  ::snprintf(name, sizeof(name), "%016llx%016llx",
+             static_cast<unsigned long long>(Hash64(data, length, 0)),
+             static_cast<unsigned long long>(Hash64(data, length, 1)));
+  return name;
+}
+
+ObjectStore::ObjectStore(const std::string& directory)
+    : objects_directory_(JoinPaths({directory, "objects"})) {
+  // Objects are spread over 256 directories by the first byte of their name.
+  for (int fan_out = 0; fan_out < 256; fan_out++) {
+    char fan_out_name[3] = {};
+    ::snprintf(fan_out_name, sizeof(fan_out_name), "%02x", fan_out);
+    if (!MakeDirectories({directory, "objects", fan_out_name})) {
+      D2D_ERROR << "Could not create the object store in " << directory;
+      return;
+    }
+  }
+  is_valid_ = true;
+}
+
+ObjectStore::~ObjectStore() = default;
+
+bool ObjectStore::IsValid() const { return is_valid_; }
+
+bool ObjectStore::AddObject(const void* data, size_t length,
+                            const std::string& object_path, bool& added) {
+  added = false;
+  struct stat object_stat = {};
+  if (::stat(object_path.c_str(), &object_stat) == 0) {
+    return true;
+  }
+
+  // Written aside and renamed so that a partial object is never linked to.
+  const auto temporary_path =
+      JoinPaths({objects_directory_,
+                 kTemporaryPrefix + std::to_string(::getpid()) + "-" +
+                     std::to_string(next_temporary_id_++)});
+  if (!CopyData(data, length, temporary_path)) {
+    return false;
+  }
+  // Objects are shared, so they must not be edited through any of their
+  // links.
+  if (::chmod(temporary_path.c_str(), S_IRUSR | S_IRGRP | S_IROTH) != 0 ||
+      ::rename(temporary_path.c_str(), object_path.c_str()) != 0) {
+    D2D_ERROR << "Could not add the object " << object_path << ": "
+              << strerror(errno);
+    ::unlink(temporary_path.c_str());
+    return false;
+  }
+
+  added = true;
+  added_objects_++;
+  added_bytes_ += length;
+  return true;
+}
+
+bool ObjectStore::Link(const void* data, size_t length,
+                       const std::string& to_path) {
+  if (!is_valid_) {
+    return false;
+  }
+
+  const auto name = GetObjectName(data, length);
+  const auto object_path =
+      JoinPaths({objects_directory_, name.substr(0, 2), name});
+
+  bool added = false;
+  if (!AddObject(data, length, object_path, added)) {
+    return false;
+  }
+
+  if (::unlink(to_path.c_str()) != 0 && errno != ENOENT) {
+    D2D_ERROR << "Could not replace the file " << to_path << ": "
+              << strerror(errno);
+    return false;
+  }
+  if (::link(object_path.c_str(), to_path.c_str()) != 0) {
+    // For example, the store is on another file system or the object has
+    // too many links.
+    D2D_VERBOSE << "Could not link " << to_path << " to the object store ("
+                << strerror(errno) << "). Copying it instead.";
+    return CopyData(data, length, to_path);
+  }
+
+  if (!added) {
+    reused_objects_++;
+  }
+  return true;
+}
+
+bool ObjectStore::CollectGarbage(size_t& removed_objects,
+                                 uint64_t& removed_bytes) {
+  removed_objects = 0;
+  removed_bytes = 0;
+  if (!is_valid_) {
+    return false;
+  }
+
+  std::vector<std::string> objects;
+  if (!ListFiles(objects_directory_, objects)) {
+    return false;
+  }
+
+  for (const auto& object : objects) {
+    const auto object_path = JoinPaths({objects_directory_, object});
+    struct stat object_stat = {};
+    if (::lstat(object_path.c_str(), &object_stat) != 0) {
+      D2D_ERROR << "Could not stat the object " << object_path;
+      return false;
+    }
+    // Temporary files left behind by interrupted builds have a single link
+    // too.
+    if (object_stat.st_nlink > 1) {
+      continue;
+    }
+    if (::unlink(object_path.c_str()) != 0) {
+      D2D_ERROR << "Could not remove the object " << object_path << ": "
+                << strerror(errno);
+      return false;
+    }
+    removed_objects++;
+    removed_bytes += object_stat.st_size;
+  }
+  return true;
+}
+
+}  // namespace d2d
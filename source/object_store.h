@@ -0,0 +1,62 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "macros.h"
+
+namespace d2d {
+
+// A directory of read-only files named after the hash of their contents.
+// Output files are hardlinks to these objects, so docsets built into the same
+// store share the storage of the files they have in common. An object is no
+// longer used by any docset once the store holds its only link.
+//
+// The store must be on the same file system as the docsets. Files that cannot
+// be linked are copied instead.
+class ObjectStore {
+ public:
+  explicit ObjectStore(const std::string& directory);
+
+  ~ObjectStore();
+
+  bool IsValid() const;
+
+  // Replaces the file at |to_path| with a link to the object holding |data|.
+  // The object is only written if the store does not have it yet. May be
+  // called from several threads at once.
+  bool Link(const void* data, size_t length, const std::string& to_path);
+
+  // Removes the objects that are not linked to from outside the store. Must
+  // not be run while docsets are being built into the store.
+  bool CollectGarbage(size_t& removed_objects, uint64_t& removed_bytes);
+
+  size_t GetAddedObjectCount() const { return added_objects_; }
+
+  uint64_t GetAddedBytes() const { return added_bytes_; }
+
+  size_t GetReusedObjectCount() const { return reused_objects_; }
+
+ private:
+  std::string objects_directory_;
+  std::atomic<size_t> next_temporary_id_{0};
+  std::atomic<size_t> added_objects_{0};
+  std::atomic<uint64_t> added_bytes_{0};
+  std::atomic<size_t> reused_objects_{0};
+  bool is_valid_ = false;
+
+  // Writes the object at |object_path| if it is missing. |added| tells
+  // whether it was.
+  bool AddObject(const void* data, size_t length,
+                 const std::string& object_path, bool& added);
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(ObjectStore);
+};
+
+}  // namespace d2d
@@ -0,0 +1,117 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "parallel.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "logger.h"
+#include "perf_counters.h"
+
+namespace d2d {
+
+size_t GetDefaultConcurrency() {
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+void ParallelFor(size_t count, size_t concurrency,
+                 const std::function<void(size_t index)>& body) {
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (auto index = next++; index < count; index = next++) {
+      body(index);
+    }
+  };
+
+  const auto thread_count = std::min(std::max<size_t>(concurrency, 1), count);
+  // The calling thread is already counted by the scope of its phase.
+  const auto phase = GetCurrentPerfPhase();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back([&work, &phase, i]() {
+      std::unique_ptr<PerfScope> scope;
+      if (ArePerfCountersEnabled() && !phase.empty()) {
+        scope.reset(new PerfScope(phase, "worker " + std::to_string(i)));
+      }
+      work();
+    });
+  }
+  work();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+size_t TaskGraph::Add(std::string name, Task task,
+                      std::vector<size_t> dependencies) {
+  for (const auto dependency : dependencies) {
+    if (dependency >= nodes_.size()) {
+      D2D_ERROR << "Task " << name << " depends on a task added after it.";
+      std::abort();
+    }
+  }
+  nodes_.push_back({std::move(name), std::move(task), std::move(dependencies)});
+  return nodes_.size() - 1;
+}
+
+bool TaskGraph::Run() {
+  enum class State { kPending, kSucceeded, kFailed };
+  std::vector<State> states(nodes_.size(), State::kPending);
+  std::mutex mutex;
+  std::condition_variable done;
+
+  auto run = [&](size_t id) {
+    const auto& node = nodes_[id];
+    bool can_run = true;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (const auto dependency : node.dependencies) {
+        done.wait(lock, [&] { return states[dependency] != State::kPending; });
+        can_run = can_run && states[dependency] == State::kSucceeded;
+      }
+    }
+
+    bool succeeded = false;
+    if (can_run) {
+      const auto start = std::chrono::steady_clock::now();
+      {
+        PerfScope scope(node.name, "task");
+        succeeded = node.task();
+      }
+      D2D_VERBOSE << node.name << " took "
+                  << std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count()
+                  << " s.";
+    } else {
+      D2D_VERBOSE << "Skipped " << node.name << ".";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    states[id] = succeeded ? State::kSucceeded : State::kFailed;
+    done.notify_all();
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t id = 0; id < nodes_.size(); id++) {
+    threads.emplace_back(run, id);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::all_of(states.begin(), states.end(),
+                     [](State state) { return state == State::kSucceeded; });
+}
+
+}  // namespace d2d
@@ -0,0 +1,50 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace d2d {
+
+// The number of CPUs, or one if that cannot be determined.
+size_t GetDefaultConcurrency();
+
+// Calls |body| once for every index in [0, count) on up to |concurrency|
+// threads, one of which is the calling thread. Indices are handed out in
+// order as threads become free. Returns once every call has returned.
+void ParallelFor(size_t count, size_t concurrency,
+                 const std::function<void(size_t index)>& body);
+
+// A small set of tasks that depend on each other. Every task runs on its own
+// thread as soon as the tasks it depends on have succeeded, so independent
+// tasks overlap. A task whose dependencies failed is not run and counts as
+// failed.
+class TaskGraph {
+ public:
+  using Task = std::function<bool()>;
+
+  // Returns the ID other tasks use to depend on this one. Tasks can only
+  // depend on tasks added before them.
+  size_t Add(std::string name, Task task,
+             std::vector<size_t> dependencies = {});
+
+  // Runs every task and returns once all of them are done. Returns whether
+  // all of them succeeded.
+  bool Run();
+
+ private:
+  struct Node {
+    std::string name;
+    Task task;
+    std::vector<size_t> dependencies;
+  };
+
+  std::vector<Node> nodes_;
+};
+
+}  // namespace d2d
@@ -0,0 +1,128 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "path_filter.h"
+
+#include <utility>
+
+namespace d2d {
+
+// Matches [pattern, pattern_end) against all of [path, path_end).
+static bool MatchGlob(const char* pattern, const char* pattern_end,
+                      const char* path, const char* path_end) {
+  while (pattern != pattern_end) {
+    if (*pattern == '*') {
+      const bool any_depth = pattern + 1 != pattern_end && pattern[1] == '*';
+      pattern += any_depth ? 2 : 1;
+      // "**/" also matches no directories at all.
+      if (any_depth && pattern != pattern_end && *pattern == '/' &&
+          MatchGlob(pattern + 1, pattern_end, path, path_end)) {
+        return true;
+      }
+      for (auto rest = path;; rest++) {
+        if (MatchGlob(pattern, pattern_end, rest, path_end)) {
+          return true;
+        }
+        if (rest == path_end || (!any_depth && *rest == '/')) {
+          return false;
+        }
+      }
+    }
+
+    if (path == path_end) {
+      return false;
+    }
+    if (*pattern == '?' ? *path == '/' : *pattern != *path) {
+      return false;
+    }
+    pattern++;
+    path++;
+  }
+  return path == path_end;
+}
+
+bool PathFilter::AddRule(const PathRule& rule) {
+  CompiledRule compiled;
+  compiled.exclude = rule.exclude;
+  compiled.pattern = rule.pattern;
+  if (!compiled.pattern.empty() && compiled.pattern.back() == '/') {
+    compiled.directories_only = true;
+    compiled.pattern.pop_back();
+  }
+  // A leading "/" anchors a pattern to the root like any other "/" does.
+  if (!compiled.pattern.empty() && compiled.pattern.front() == '/') {
+    compiled.pattern.erase(0, 1);
+    compiled.match_name = false;
+  }
+  if (compiled.pattern.empty()) {
+    return false;
+  }
+  if (compiled.pattern.find('/') != std::string::npos) {
+    compiled.match_name = false;
+  }
+
+  const auto wildcard = compiled.pattern.find_first_of("*?");
+  if (wildcard == std::string::npos) {
+    compiled.kind = MatchKind::kLiteral;
+  } else if (wildcard == 0 && compiled.pattern.size() > 1 &&
+             compiled.pattern.find_first_of("*?/", 1) == std::string::npos) {
+    compiled.kind = MatchKind::kSuffix;
+    compiled.pattern.erase(0, 1);
+  }
+
+  rules_.emplace_back(std::move(compiled));
+  return true;
+}
+
+bool PathFilter::IsIncluded(const std::string& path, bool is_directory) const {
+  // The rules cannot bring back the files of other shards.
+  if (!is_directory && !IsInShard(path, shard_)) {
+    return false;
+  }
+
+  const auto slash = path.rfind('/');
+  const auto name_offset = slash == std::string::npos ? 0 : slash + 1;
+
+  for (auto rule = rules_.rbegin(); rule != rules_.rend(); ++rule) {
+    if (rule->directories_only && !is_directory) {
+      continue;
+    }
+    const auto offset = rule->match_name ? name_offset : 0;
+    const auto length = path.size() - offset;
+    const auto& pattern = rule->pattern;
+
+    bool matches = false;
+    switch (rule->kind) {
+      case MatchKind::kLiteral:
+        matches = path.compare(offset, length, pattern) == 0;
+        break;
+      case MatchKind::kSuffix:
+        matches = length >= pattern.size() &&
+                  path.compare(path.size() - pattern.size(), pattern.size(),
+                               pattern) == 0 &&
+                  (rule->match_name ||
+                   path.find('/', path.size() - length) == std::string::npos);
+        break;
+      case MatchKind::kGlob:
+        matches = MatchGlob(pattern.data(), pattern.data() + pattern.size(),
+                            path.data() + offset, path.data() + path.size());
+        break;
+    }
+    if (matches) {
+      return !rule->exclude;
+    }
+  }
+  return true;
+}
+
+bool PathFilter::IsFileIncluded(const std::string& path) const {
+  for (auto slash = path.find('/'); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    if (!IsIncluded(path.substr(0, slash), true)) {
+      return false;
+    }
+  }
+  return IsIncluded(path, false);
+}
+
+}  // namespace d2d
@@ -0,0 +1,69 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "shard.h"
+
+namespace d2d {
+
+struct PathRule {
+  bool exclude = true;
+  std::string pattern;
+};
+
+// Decides which files and directories of a tree to walk, from an ordered list
+// of glob rules. The last rule that matches a path decides. Paths no rule
+// matches are included.
+//
+// In patterns, "*" matches any run of characters other than "/", "**" also
+// matches across directories and "?" matches one character other than "/". A
+// pattern without a "/" is matched against the last component of the path at
+// any depth. Other patterns are matched against the whole path relative to
+// the root of the tree. A pattern ending in "/" only matches directories.
+// Excluded directories are not walked, so files inside them cannot be
+// included again.
+class PathFilter {
+ public:
+  // Returns false if the pattern is empty.
+  bool AddRule(const PathRule& rule);
+
+  // Also leaves out the files that do not belong to |shard|. Directories are
+  // walked by every shard.
+  void SetShard(const Shard& shard) { shard_ = shard; }
+
+  // |path| is relative to the root of the tree.
+  bool IsIncluded(const std::string& path, bool is_directory) const;
+
+  // Whether the file at |path| is included along with every directory it is
+  // in, for trees that are not walked, such as archives.
+  bool IsFileIncluded(const std::string& path) const;
+
+ private:
+  // Patterns are sorted into the cheapest way to match them when they are
+  // added.
+  enum class MatchKind {
+    kLiteral,
+    // "*" followed by a literal.
+    kSuffix,
+    kGlob,
+  };
+
+  struct CompiledRule {
+    bool exclude = true;
+    bool directories_only = false;
+    bool match_name = true;
+    MatchKind kind = MatchKind::kGlob;
+    std::string pattern;
+  };
+
+  std::vector<CompiledRule> rules_;
+  Shard shard_;
+};
+
+}  // namespace d2d
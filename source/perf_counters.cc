@@ -0,0 +1,233 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "perf_counters.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "logger.h"
+
+namespace d2d {
+
+static const char* const kPerfEventNames[kPerfEventCount] = {
+    "cycles",        "instructions", "cache misses",
+    "branch misses", "page faults",  "context switches",
+};
+
+void PerfCounts::Add(const PerfCounts& other) {
+  for (size_t i = 0; i < kPerfEventCount; i++) {
+    values[i] += other.values[i];
+    available[i] = available[i] || other.available[i];
+  }
+  seconds += other.seconds;
+}
+
+namespace {
+
+std::atomic<bool> gPerfCountersEnabled(false);
+std::mutex gPhasesMutex;
+std::vector<PerfPhase> gPhases;
+std::once_flag gUnavailableOnce;
+thread_local const std::string* gCurrentPhase = nullptr;
+
+}  // namespace
+
+void EnablePerfCounters(bool enabled) { gPerfCountersEnabled = enabled; }
+
+bool ArePerfCountersEnabled() { return gPerfCountersEnabled; }
+
+// Returns -1 if |event| cannot be counted for the calling thread.
+static int OpenPerfCounter(size_t event) {
+#if defined(__linux__)
+  struct perf_event_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  const std::pair<uint32_t, uint64_t> configs[kPerfEventCount] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  };
+  attr.type = configs[event].first;
+  attr.config = configs[event].second;
+  // Counters are multiplexed when there are more of them than the CPU has,
+  // so the times are read to scale the counts.
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_hv = 1;
+
+  // Unprivileged processes may only count user space events once
+  // perf_event_paranoid is 2 or more.
+  for (const auto exclude_kernel : {0, 1}) {
+    attr.exclude_kernel = exclude_kernel;
+    const auto fd = static_cast<int>(::syscall(
+        __NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    if (fd >= 0) {
+      return fd;
+    }
+    if (errno != EACCES && errno != EPERM) {
+      break;
+    }
+  }
+  return -1;
+#else
+  (void)event;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Returns false if the count could not be read or the counter never ran.
+static bool ReadPerfCounter(int fd, uint64_t& value) {
+  uint64_t counts[3] = {};
+  if (::read(fd, counts, sizeof(counts)) != sizeof(counts) ||
+      counts[2] == 0) {
+    return false;
+  }
+  value = counts[2] == counts[1]
+              ? counts[0]
+              : static_cast<uint64_t>(static_cast<double>(counts[0]) *
+                                      counts[1] / counts[2]);
+  return true;
+}
+
+PerfScope::PerfScope(std::string phase, std::string thread)
+    : phase_(std::move(phase)), thread_(std::move(thread)) {
+  std::fill(fds_, fds_ + kPerfEventCount, -1);
+  if (!ArePerfCountersEnabled()) {
+    return;
+  }
+  is_enabled_ = true;
+
+  bool any_available = false;
+  int error = 0;
+  for (size_t i = 0; i < kPerfEventCount; i++) {
+    fds_[i] = OpenPerfCounter(i);
+    if (fds_[i] >= 0) {
+      any_available = true;
+    } else if (error == 0) {
+      error = errno;
+    }
+  }
+  if (!any_available) {
+    std::call_once(gUnavailableOnce, [error]() {
+      D2D_LOG << "Performance counters are not available ("
+              << ::strerror(error)
+              << "), so only times are reported. Lowering "
+                 "/proc/sys/kernel/perf_event_paranoid may help.";
+    });
+  }
+
+  previous_phase_ = gCurrentPhase;
+  gCurrentPhase = &phase_;
+  start_ = std::chrono::steady_clock::now();
+}
+
+PerfScope::~PerfScope() {
+  if (!is_enabled_) {
+    return;
+  }
+
+  PerfCounts counts;
+  counts.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count();
+  for (size_t i = 0; i < kPerfEventCount; i++) {
+    if (fds_[i] >= 0) {
+      counts.available[i] = ReadPerfCounter(fds_[i], counts.values[i]);
+      ::close(fds_[i]);
+    }
+  }
+  gCurrentPhase = previous_phase_;
+
+  std::lock_guard<std::mutex> lock(gPhasesMutex);
+  auto phase = std::find_if(
+      gPhases.begin(), gPhases.end(),
+      [this](const PerfPhase& other) { return other.name == phase_; });
+  if (phase == gPhases.end()) {
+    gPhases.push_back({phase_, {}});
+    phase = gPhases.end() - 1;
+  }
+  auto thread = std::find_if(
+      phase->threads.begin(), phase->threads.end(),
+      [this](const std::pair<std::string, PerfCounts>& other) {
+        return other.first == thread_;
+      });
+  if (thread == phase->threads.end()) {
+    phase->threads.emplace_back(thread_, counts);
+  } else {
+    thread->second.Add(counts);
+  }
+}
+
+const std::string& GetCurrentPerfPhase() {
+  static const std::string kNoPhase;
+  return gCurrentPhase != nullptr ? *gCurrentPhase : kNoPhase;
+}
+
+// Logs a line such as "Copying pages: 1.20 s, 3000000 cycles, 4500000
+// instructions (1.50 per cycle), ...".
+static void LogPerfCounts(const std::string& label, const PerfCounts& counts,
+                          double seconds) {
+  std::ostringstream stream;
+  stream << label << ": " << std::fixed << std::setprecision(2) << seconds
+         << " s";
+  for (size_t i = 0; i < kPerfEventCount; i++) {
+    if (!counts.available[i]) {
+      continue;
+    }
+    stream << ", " << counts.values[i] << " " << kPerfEventNames[i];
+    const auto cycles = static_cast<size_t>(PerfEvent::kCycles);
+    if (i == static_cast<size_t>(PerfEvent::kInstructions) &&
+        counts.available[cycles] && counts.values[cycles] != 0) {
+      stream << " ("
+             << static_cast<double>(counts.values[i]) / counts.values[cycles]
+             << " per cycle)";
+    }
+  }
+  D2D_LOG << stream.str();
+}
+
+std::vector<PerfPhase> TakePerfCounts() {
+  std::vector<PerfPhase> phases;
+  std::lock_guard<std::mutex> lock(gPhasesMutex);
+  phases.swap(gPhases);
+  return phases;
+}
+
+void ReportPerfCounters() {
+  for (const auto& phase : TakePerfCounts()) {
+    PerfCounts total;
+    double seconds = 0;
+    for (const auto& thread : phase.threads) {
+      total.Add(thread.second);
+      seconds = std::max(seconds, thread.second.seconds);
+    }
+    LogPerfCounts(phase.name, total, seconds);
+    if (phase.threads.size() > 1) {
+      for (const auto& thread : phase.threads) {
+        LogPerfCounts("  " + thread.first, thread.second,
+                      thread.second.seconds);
+      }
+    }
+  }
+}
+
+}  // namespace d2d
@@ -0,0 +1,86 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "macros.h"
+
+namespace d2d {
+
+// The events counted for every phase of a build.
+enum class PerfEvent {
+  kCycles,
+  kInstructions,
+  kCacheMisses,
+  kBranchMisses,
+  kPageFaults,
+  kContextSwitches,
+};
+
+constexpr size_t kPerfEventCount = 6;
+
+struct PerfCounts {
+  uint64_t values[kPerfEventCount] = {};
+  // Events that could not be counted, for example because the kernel does
+  // not allow it or the CPU has no such counter, are left out of reports.
+  bool available[kPerfEventCount] = {};
+  double seconds = 0;
+
+  void Add(const PerfCounts& other);
+};
+
+// Counters are off unless enabled, and |PerfScope| does nothing then.
+void EnablePerfCounters(bool enabled);
+
+bool ArePerfCountersEnabled();
+
+// Counts the events of the calling thread with perf_event_open for as long
+// as it is in scope, and adds them to the counts of |phase| and |thread| for
+// |ReportPerfCounters|. Threads that a scope's thread starts are not counted
+// by that scope; see |ParallelFor|. Only on Linux, and only where
+// perf_event_paranoid allows it. Elsewhere only the time is measured.
+class PerfScope {
+ public:
+  PerfScope(std::string phase, std::string thread);
+
+  ~PerfScope();
+
+ private:
+  std::string phase_;
+  std::string thread_;
+  int fds_[kPerfEventCount];
+  const std::string* previous_phase_ = nullptr;
+  std::chrono::steady_clock::time_point start_;
+  bool is_enabled_ = false;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(PerfScope);
+};
+
+// The phase of the innermost |PerfScope| of the calling thread, or an empty
+// string if there is none.
+const std::string& GetCurrentPerfPhase();
+
+struct PerfPhase {
+  std::string name;
+  // In the order the threads were first seen. Threads with the same name,
+  // such as the workers of several |ParallelFor| calls, are added up.
+  std::vector<std::pair<std::string, PerfCounts>> threads;
+};
+
+// Returns the counts of every phase, in the order the phases were first seen,
+// and forgets them.
+std::vector<PerfPhase> TakePerfCounts();
+
+// Logs the counts taken by |TakePerfCounts| with a line per phase, followed
+// by a line per thread if there were several.
+void ReportPerfCounters();
+
+}  // namespace d2d
@@ -19,6 +19,16 @@ PlistParser::PlistParser(const std::string& plist_path) {
   is_valid_ = true;
 }
 
+PlistParser::PlistParser(const void* data, size_t size) {
+  if (xml_document_.Parse(static_cast<const char*>(data), size) !=
+      tinyxml2::XML_SUCCESS) {
+    D2D_ERROR << "Could not parse Info.plist.";
+    return;
+  }
+
+  is_valid_ = true;
+}
+
 PlistParser::~PlistParser() = default;
 
 bool PlistParser::IsValid() const { return is_valid_; }
@@ -14,6 +14,9 @@ class PlistParser {
  public:
   PlistParser(const std::string& plist_path);
 
+  // Parses the contents of an Info.plist that was already read.
+  PlistParser(const void* data, size_t size);
+
   ~PlistParser();
 
   bool IsValid() const;
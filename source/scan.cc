@@ -0,0 +1,306 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "scan.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define D2D_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace d2d {
+
+ByteSet::ByteSet(const char* bytes, size_t size) {
+  for (size_t i = 0; i < size && size_ < kMaxSize; i++) {
+    const auto byte = static_cast<uint8_t>(bytes[i]);
+    if (Contains(byte)) {
+      continue;
+    }
+    bytes_[size_++] = bytes[i];
+    bitmap_[byte >> 6] |= 1ull << (byte & 63);
+  }
+}
+
+ByteSet::ByteSet(const char* bytes) : ByteSet(bytes, ::strlen(bytes)) {}
+
+static const char* ScalarFind(const char* begin, const char* end,
+                              const char* needle, size_t needle_length) {
+  if (needle_length == 0) {
+    return begin;
+  }
+  if (static_cast<size_t>(end - begin) < needle_length) {
+    return end;
+  }
+  for (const char* last = end - needle_length; begin <= last; ++begin) {
+    if (*begin == *needle &&
+        ::memcmp(begin + 1, needle + 1, needle_length - 1) == 0) {
+      return begin;
+    }
+  }
+  return end;
+}
+
+static const char* ScalarFindAny(const char* begin, const char* end,
+                                 const ByteSet& set) {
+  for (; begin < end; ++begin) {
+    if (set.Contains(static_cast<uint8_t>(*begin))) {
+      return begin;
+    }
+  }
+  return end;
+}
+
+static const char* ScalarSkip(const char* begin, const char* end,
+                              const ByteSet& set) {
+  for (; begin < end; ++begin) {
+    if (!set.Contains(static_cast<uint8_t>(*begin))) {
+      return begin;
+    }
+  }
+  return end;
+}
+
+static const ScanKernels kScalarKernels = {
+    "scalar",
+    ScalarFind,
+    ScalarFindAny,
+    ScalarSkip,
+};
+
+#ifdef D2D_SCAN_X86
+
+// Compares the first and last needle bytes against two overlapping blocks and
+// only verifies the positions where both match.
+__attribute__((target("sse2"))) static const char* SSE2Find(
+    const char* begin, const char* end, const char* needle,
+    size_t needle_length) {
+  if (needle_length < 2 ||
+      static_cast<size_t>(end - begin) < needle_length + 16) {
+    return ScalarFind(begin, end, needle, needle_length);
+  }
+
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+  const char* p = begin;
+  for (; p + needle_length - 1 + 16 <= end; p += 16) {
+    const __m128i block_first =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i block_last = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(p + needle_length - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+    while (mask != 0) {
+      const auto bit = __builtin_ctz(mask);
+      if (::memcmp(p + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return p + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return ScalarFind(p, end, needle, needle_length);
+}
+
+__attribute__((target("sse2"))) static unsigned SSE2SetMask(
+    __m128i block, const ByteSet& set) {
+  __m128i matches = _mm_setzero_si128();
+  for (size_t i = 0; i < set.GetSize(); i++) {
+    matches = _mm_or_si128(
+        matches, _mm_cmpeq_epi8(block, _mm_set1_epi8(set.GetBytes()[i])));
+  }
+  return _mm_movemask_epi8(matches);
+}
+
+__attribute__((target("sse2"))) static const char* SSE2FindAny(
+    const char* begin, const char* end, const ByteSet& set) {
+  for (; begin + 16 <= end; begin += 16) {
+    const unsigned mask = SSE2SetMask(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), set);
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+  }
+  return ScalarFindAny(begin, end, set);
+}
+
+__attribute__((target("sse2"))) static const char* SSE2Skip(
+    const char* begin, const char* end, const ByteSet& set) {
+  for (; begin + 16 <= end; begin += 16) {
+    const unsigned mask =
+        ~SSE2SetMask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)),
+                     set) &
+        0xFFFFu;
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+  }
+  return ScalarSkip(begin, end, set);
+}
+
+static const ScanKernels kSSE2Kernels = {
+    "sse2",
+    SSE2Find,
+    SSE2FindAny,
+    SSE2Skip,
+};
+
+// PCMPESTRI matches a block against the whole set in one instruction. The
+// needle search is the same as SSE2 since the ordered compare mode needs
+// special handling of matches straddling blocks.
+__attribute__((target("sse4.2"))) static const char* SSE42FindAny(
+    const char* begin, const char* end, const ByteSet& set) {
+  const __m128i bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(set.GetBytes()));
+  const int size = static_cast<int>(set.GetSize());
+  for (; begin + 16 <= end; begin += 16) {
+    const int index = _mm_cmpestri(
+        bytes, size, _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)),
+        16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+    if (index < 16) {
+      return begin + index;
+    }
+  }
+  return ScalarFindAny(begin, end, set);
+}
+
+__attribute__((target("sse4.2"))) static const char* SSE42Skip(
+    const char* begin, const char* end, const ByteSet& set) {
+  const __m128i bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(set.GetBytes()));
+  const int size = static_cast<int>(set.GetSize());
+  for (; begin + 16 <= end; begin += 16) {
+    const int index = _mm_cmpestri(
+        bytes, size, _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)),
+        16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY |
+            _SIDD_LEAST_SIGNIFICANT);
+    if (index < 16) {
+      return begin + index;
+    }
+  }
+  return ScalarSkip(begin, end, set);
+}
+
+static const ScanKernels kSSE42Kernels = {
+    "sse4.2",
+    SSE2Find,
+    SSE42FindAny,
+    SSE42Skip,
+};
+
+__attribute__((target("avx2"))) static const char* AVX2Find(
+    const char* begin, const char* end, const char* needle,
+    size_t needle_length) {
+  if (needle_length < 2 ||
+      static_cast<size_t>(end - begin) < needle_length + 32) {
+    return SSE2Find(begin, end, needle, needle_length);
+  }
+
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+  const char* p = begin;
+  for (; p + needle_length - 1 + 32 <= end; p += 32) {
+    const __m256i block_first =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i block_last = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p + needle_length - 1));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                         _mm256_cmpeq_epi8(last, block_last)));
+    while (mask != 0) {
+      const auto bit = __builtin_ctz(mask);
+      if (::memcmp(p + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return p + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return SSE2Find(p, end, needle, needle_length);
+}
+
+__attribute__((target("avx2"))) static unsigned AVX2SetMask(
+    __m256i block, const ByteSet& set) {
+  __m256i matches = _mm256_setzero_si256();
+  for (size_t i = 0; i < set.GetSize(); i++) {
+    matches = _mm256_or_si256(
+        matches, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set.GetBytes()[i])));
+  }
+  return static_cast<unsigned>(_mm256_movemask_epi8(matches));
+}
+
+__attribute__((target("avx2"))) static const char* AVX2FindAny(
+    const char* begin, const char* end, const ByteSet& set) {
+  for (; begin + 32 <= end; begin += 32) {
+    const unsigned mask = AVX2SetMask(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), set);
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+  }
+  return SSE2FindAny(begin, end, set);
+}
+
+__attribute__((target("avx2"))) static const char* AVX2Skip(
+    const char* begin, const char* end, const ByteSet& set) {
+  for (; begin + 32 <= end; begin += 32) {
+    const unsigned mask = ~AVX2SetMask(_mm256_loadu_si256(
+                                           reinterpret_cast<const __m256i*>(
+                                               begin)),
+                                       set);
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+  }
+  return SSE2Skip(begin, end, set);
+}
+
+static const ScanKernels kAVX2Kernels = {
+    "avx2",
+    AVX2Find,
+    AVX2FindAny,
+    AVX2Skip,
+};
+
+#endif  // D2D_SCAN_X86
+
+const ScanKernels* GetScanKernels(ScanKernelType type) {
+#ifdef D2D_SCAN_X86
+  __builtin_cpu_init();
+#endif
+  switch (type) {
+    case ScanKernelType::kScalar:
+      return &kScalarKernels;
+#ifdef D2D_SCAN_X86
+    case ScanKernelType::kSSE2:
+      return __builtin_cpu_supports("sse2") ? &kSSE2Kernels : nullptr;
+    case ScanKernelType::kSSE42:
+      return __builtin_cpu_supports("sse4.2") ? &kSSE42Kernels : nullptr;
+    case ScanKernelType::kAVX2:
+      return __builtin_cpu_supports("avx2") ? &kAVX2Kernels : nullptr;
+#else
+    default:
+      break;
+#endif
+  }
+  return nullptr;
+}
+
+std::vector<const ScanKernels*> GetAvailableScanKernels() {
+  std::vector<const ScanKernels*> kernels;
+  for (auto type : {ScanKernelType::kScalar, ScanKernelType::kSSE2,
+                    ScanKernelType::kSSE42, ScanKernelType::kAVX2}) {
+    if (auto available = GetScanKernels(type)) {
+      kernels.push_back(available);
+    }
+  }
+  return kernels;
+}
+
+const ScanKernels& GetScanKernels() {
+  static const ScanKernels* kernels = GetAvailableScanKernels().back();
+  return *kernels;
+}
+
+}  // namespace d2d
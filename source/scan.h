@@ -0,0 +1,86 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace d2d {
+
+// A small set of bytes (at most 16) to search for or skip over.
+class ByteSet {
+ public:
+  static constexpr size_t kMaxSize = 16;
+
+  ByteSet(const char* bytes, size_t size);
+
+  // NUL-terminated.
+  ByteSet(const char* bytes);
+
+  bool Contains(uint8_t byte) const {
+    return (bitmap_[byte >> 6] >> (byte & 63)) & 1;
+  }
+
+  const char* GetBytes() const { return bytes_; }
+
+  size_t GetSize() const { return size_; }
+
+ private:
+  char bytes_[kMaxSize] = {};
+  size_t size_ = 0;
+  uint64_t bitmap_[4] = {};
+};
+
+// A set of byte scanning routines. Each returns a pointer to the match or
+// |end| if there is none.
+struct ScanKernels {
+  const char* name;
+
+  // The first occurrence of |needle| in [begin, end).
+  const char* (*find)(const char* begin, const char* end, const char* needle,
+                      size_t needle_length);
+
+  // The first byte in [begin, end) that is in |set|.
+  const char* (*find_any)(const char* begin, const char* end,
+                          const ByteSet& set);
+
+  // The first byte in [begin, end) that is not in |set|.
+  const char* (*skip)(const char* begin, const char* end, const ByteSet& set);
+};
+
+enum class ScanKernelType {
+  kScalar,
+  kSSE2,
+  kSSE42,
+  kAVX2,
+};
+
+// The kernels of the given type or nullptr if the CPU (or the compiler) does
+// not support them.
+const ScanKernels* GetScanKernels(ScanKernelType type);
+
+// All kernels usable on this CPU, slowest first.
+std::vector<const ScanKernels*> GetAvailableScanKernels();
+
+// The fastest kernels usable on this CPU. Picked once via CPUID.
+const ScanKernels& GetScanKernels();
+
+inline const char* ScanFind(const char* begin, const char* end,
+                            const char* needle, size_t needle_length) {
+  return GetScanKernels().find(begin, end, needle, needle_length);
+}
+
+inline const char* ScanFindAny(const char* begin, const char* end,
+                               const ByteSet& set) {
+  return GetScanKernels().find_any(begin, end, set);
+}
+
+inline const char* ScanSkip(const char* begin, const char* end,
+                            const ByteSet& set) {
+  return GetScanKernels().skip(begin, end, set);
+}
+
+}  // namespace d2d
@@ -0,0 +1,394 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "shard.h"
+
+#include <errno.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_set>
+
+#include "docset_index.h"
+#include "file.h"
+#include "hash.h"
+#include "logger.h"
+#include "perf_counters.h"
+#include "plist_parser.h"
+
+namespace d2d {
+
+bool ParseShard(const std::string& text, Shard& shard) {
+  const auto slash = text.find('/');
+  if (slash == std::string::npos || slash == 0 || slash + 1 == text.size() ||
+      text.find_first_not_of("0123456789/") != std::string::npos ||
+      text.find('/', slash + 1) != std::string::npos) {
+    return false;
+  }
+  Shard parsed;
+  parsed.index = std::strtoul(text.c_str(), nullptr, 10);
+  parsed.count = std::strtoul(text.c_str() + slash + 1, nullptr, 10);
+  if (parsed.count == 0 || parsed.index >= parsed.count) {
+    return false;
+  }
+  shard = parsed;
+  return true;
+}
+
+bool IsInShard(const std::string& path, const Shard& shard) {
+  return !shard.IsPartial() ||
+         Hash64(path.data(), path.size()) % shard.count == shard.index;
+}
+
+namespace {
+
+// The index of a docset built as a shard. Reads its searchIndex rows in
+// (name, type, path) order.
+class ShardIndex {
+ public:
+  explicit ShardIndex(const std::string& docset) : docset_(docset) {
+    const auto index_path =
+        JoinPaths({docset, "Contents", "Resources", "docSet.dsidx"});
+    if (sqlite3_open_v2(index_path.c_str(), &database_, SQLITE_OPEN_READONLY,
+                        nullptr) != SQLITE_OK) {
+      D2D_ERROR << "Could not open the docset index " << index_path;
+      return;
+    }
+
+    sqlite3_stmt* info = nullptr;
+    const auto has_info =
+        sqlite3_prepare_v2(database_,
+                           "SELECT shard, count, searchAccelerators FROM "
+                           "shardInfo;",
+                           -1, &info, nullptr) == SQLITE_OK &&
+        sqlite3_step(info) == SQLITE_ROW;
+    if (has_info) {
+      shard_.index = static_cast<size_t>(sqlite3_column_int64(info, 0));
+      shard_.count = static_cast<size_t>(sqlite3_column_int64(info, 1));
+      search_accelerators_ = sqlite3_column_int(info, 2) != 0;
+    }
+    sqlite3_finalize(info);
+    if (!has_info || shard_.count == 0 || shard_.index >= shard_.count) {
+      D2D_ERROR << docset << " was not built as a shard.";
+      return;
+    }
+
+    sqlite3_stmt* text_table = nullptr;
+    full_text_search_ =
+        sqlite3_prepare_v2(database_,
+                           "SELECT 1 FROM sqlite_master WHERE type = 'table' "
+                           "AND name = 'searchText';",
+                           -1, &text_table, nullptr) == SQLITE_OK &&
+        sqlite3_step(text_table) == SQLITE_ROW;
+    sqlite3_finalize(text_table);
+
+    if (sqlite3_prepare_v2(database_,
+                           "SELECT name, type, path FROM searchIndex ORDER BY "
+                           "name, type, path;",
+                           -1, &rows_, nullptr) != SQLITE_OK) {
+      D2D_ERROR << "Could not read the docset index " << index_path << ": "
+                << sqlite3_errmsg(database_);
+      return;
+    }
+    is_valid_ = true;
+    Step();
+  }
+
+  ~ShardIndex() {
+    sqlite3_finalize(rows_);
+    sqlite3_close(database_);
+  }
+
+  bool IsValid() const { return is_valid_; }
+
+  const Shard& GetShard() const { return shard_; }
+
+  bool HasSearchAccelerators() const { return search_accelerators_; }
+
+  bool HasFullTextSearch() const { return full_text_search_; }
+
+  bool HasRow() const { return has_row_; }
+
+  // The name, type or path of the current row. Valid until |Step|.
+  const char* GetColumn(int column) const {
+    const auto text = sqlite3_column_text(rows_, column);
+    return text != nullptr ? reinterpret_cast<const char*>(text) : "";
+  }
+
+  // Moves to the next row. Makes the index invalid on errors.
+  void Step() {
+    const auto result = sqlite3_step(rows_);
+    has_row_ = result == SQLITE_ROW;
+    if (!has_row_ && result != SQLITE_DONE) {
+      D2D_ERROR << "Could not read the index of " << docset_ << ": "
+                << sqlite3_errmsg(database_);
+      is_valid_ = false;
+    }
+  }
+
+  bool CopyTextRows(DocsetIndex& index, size_t& count) {
+    sqlite3_stmt* text_rows = nullptr;
+    if (sqlite3_prepare_v2(database_,
+                           "SELECT name, scope, path, body FROM searchText;",
+                           -1, &text_rows, nullptr) != SQLITE_OK) {
+      D2D_ERROR << "Could not read the full-text index of " << docset_;
+      return false;
+    }
+    int result = SQLITE_OK;
+    bool success = true;
+    while (success && (result = sqlite3_step(text_rows)) == SQLITE_ROW) {
+      const char* columns[4] = {};
+      for (int column = 0; column < 4; column++) {
+        const auto text = sqlite3_column_text(text_rows, column);
+        columns[column] =
+            text != nullptr ? reinterpret_cast<const char*>(text) : "";
+      }
+      success =
+          index.AddTextRow(columns[0], columns[1], columns[2], columns[3]);
+      count++;
+    }
+    sqlite3_finalize(text_rows);
+    if (success && result != SQLITE_DONE) {
+      D2D_ERROR << "Could not read the full-text index of " << docset_;
+      return false;
+    }
+    return success;
+  }
+
+ private:
+  std::string docset_;
+  sqlite3* database_ = nullptr;
+  sqlite3_stmt* rows_ = nullptr;
+  Shard shard_;
+  bool search_accelerators_ = false;
+  bool full_text_search_ = false;
+  bool has_row_ = false;
+  bool is_valid_ = false;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(ShardIndex);
+};
+
+}  // namespace
+
+// Orders rows the way SQLite's BINARY collation does.
+static bool IsRowBefore(const ShardIndex& a, const ShardIndex& b) {
+  for (int column = 0; column < 3; column++) {
+    const auto order = ::strcmp(a.GetColumn(column), b.GetColumn(column));
+    if (order != 0) {
+      return order < 0;
+    }
+  }
+  return false;
+}
+
+// Links the files of the Documents directory of |shard_docset| into |to|.
+// |paths| holds the paths already taken by other shards.
+static bool LinkDocuments(const std::string& shard_docset,
+                          const std::vector<std::string>& to,
+                          std::unordered_set<std::string>& paths,
+                          size_t& count) {
+  const auto from =
+      JoinPaths({shard_docset, "Contents", "Resources", "Documents"});
+  std::vector<std::string> files;
+  if (!ListFiles(from, files)) {
+    return false;
+  }
+  std::sort(files.begin(), files.end());
+
+  std::string last_directory;
+  for (const auto& file : files) {
+    if (!paths.insert(file).second) {
+      D2D_ERROR << file << " was built by more than one shard.";
+      return false;
+    }
+
+    const auto slash = file.rfind('/');
+    const auto directory =
+        slash == std::string::npos ? std::string() : file.substr(0, slash);
+    if (!directory.empty() && directory != last_directory) {
+      if (!MakeDirectories(to, directory)) {
+        return false;
+      }
+      last_directory = directory;
+    }
+
+    const auto from_path = JoinPaths({from, file});
+    const auto to_path = JoinPaths(to, file);
+    if (::unlink(to_path.c_str()) != 0 && errno != ENOENT) {
+      D2D_ERROR << "Could not replace the file " << to_path << ": "
+                << strerror(errno);
+      return false;
+    }
+    if (::link(from_path.c_str(), to_path.c_str()) != 0 &&
+        !CopyFile(from_path, to_path)) {
+      D2D_ERROR << "Could not copy " << from_path << " to " << to_path;
+      return false;
+    }
+    count++;
+  }
+  return true;
+}
+
+bool MergeDocsetShards(const std::vector<std::string>& shard_docsets,
+                       const std::string& location, MergeStats& stats,
+                       int64_t mtime) {
+  PerfScope scope("Merging shards", "task");
+  stats = MergeStats();
+  if (shard_docsets.empty()) {
+    D2D_ERROR << "No shards to merge.";
+    return false;
+  }
+
+  std::string docset_id;
+  std::string docset_name;
+  std::vector<std::unique_ptr<ShardIndex>> shards;
+  std::vector<bool> has_shard(shard_docsets.size(), false);
+  for (const auto& shard_docset : shard_docsets) {
+    PlistParser plist_parser(
+        JoinPaths({shard_docset, "Contents", "Info.plist"}));
+    if (!plist_parser.IsValid()) {
+      D2D_ERROR << "Could not read the Info.plist of " << shard_docset;
+      return false;
+    }
+    if (shards.empty()) {
+      docset_id = plist_parser.ReadDocsetID();
+      docset_name = plist_parser.ReadDocsetName();
+    } else if (plist_parser.ReadDocsetID() != docset_id) {
+      D2D_ERROR << shard_docset << " is a shard of another docset.";
+      return false;
+    }
+
+    std::unique_ptr<ShardIndex> shard(new ShardIndex(shard_docset));
+    if (!shard->IsValid()) {
+      return false;
+    }
+    const auto& info = shard->GetShard();
+    if (info.count != shard_docsets.size()) {
+      D2D_ERROR << shard_docset << " is one of " << info.count
+                << " shards. Every shard must be given once.";
+      return false;
+    }
+    if (has_shard[info.index]) {
+      D2D_ERROR << "Shard " << info.index << "/" << info.count
+                << " was given more than once.";
+      return false;
+    }
+    has_shard[info.index] = true;
+    if (!shards.empty() &&
+        (shard->HasFullTextSearch() != shards[0]->HasFullTextSearch() ||
+         shard->HasSearchAccelerators() !=
+             shards[0]->HasSearchAccelerators())) {
+      D2D_ERROR << shard_docset
+                << " was built with other options than the other shards.";
+      return false;
+    }
+    shards.emplace_back(std::move(shard));
+  }
+
+  if (docset_id.empty() || docset_name.empty()) {
+    D2D_ERROR << "Docset name or ID could not be read from the shards.";
+    return false;
+  }
+
+  const auto docset_path = JoinPaths({location, docset_id + ".docset"});
+  struct stat docset_stat = {};
+  if (::stat(docset_path.c_str(), &docset_stat) == 0) {
+    for (const auto& shard_docset : shard_docsets) {
+      struct stat shard_stat = {};
+      if (::stat(shard_docset.c_str(), &shard_stat) == 0 &&
+          shard_stat.st_dev == docset_stat.st_dev &&
+          shard_stat.st_ino == docset_stat.st_ino) {
+        D2D_ERROR << "The shard " << shard_docset
+                  << " would be overwritten by the merged docset.";
+        return false;
+      }
+    }
+  }
+
+  const std::vector<std::string> resources_directory = {
+      location, docset_id + ".docset", "Contents", "Resources"};
+  auto documents_directory = resources_directory;
+  documents_directory.push_back("Documents");
+  if (!MakeDirectories(documents_directory)) {
+    D2D_ERROR << "Could not not create docset directories.";
+    return false;
+  }
+
+  DocsetIndex index(JoinPaths(resources_directory, "docSet.dsidx"));
+  if (!index.IsValid()) {
+    D2D_ERROR << "Could not create docset index.";
+    return false;
+  }
+  if (shards[0]->HasFullTextSearch() && !index.EnableFullTextSearch()) {
+    D2D_ERROR << "Could not enable full-text search in the docset index.";
+    return false;
+  }
+
+  // Every shard is already sorted, so the smallest current row comes next.
+  for (;;) {
+    ShardIndex* next = nullptr;
+    for (const auto& shard : shards) {
+      if (!shard->IsValid()) {
+        return false;
+      }
+      if (shard->HasRow() && (next == nullptr || IsRowBefore(*shard, *next))) {
+        next = shard.get();
+      }
+    }
+    if (next == nullptr) {
+      break;
+    }
+    if (!index.AddRow(next->GetColumn(0), next->GetColumn(1),
+                      next->GetColumn(2))) {
+      D2D_ERROR << "Could not add the rows of the shards to the index.";
+      return false;
+    }
+    stats.rows++;
+    next->Step();
+  }
+
+  if (shards[0]->HasFullTextSearch()) {
+    for (const auto& shard : shards) {
+      if (!shard->CopyTextRows(index, stats.text_rows)) {
+        return false;
+      }
+    }
+  }
+
+  if (!index.Commit()) {
+    D2D_ERROR << "Could not commit the merged docset index.";
+    return false;
+  }
+
+  {
+    PerfScope finalize_scope("Finalizing the index", "task");
+    if (!index.Finalize(shards[0]->HasSearchAccelerators())) {
+      D2D_ERROR << "Could not finalize the merged docset index.";
+      return false;
+    }
+  }
+
+  std::unordered_set<std::string> paths;
+  for (const auto& shard_docset : shard_docsets) {
+    if (!LinkDocuments(shard_docset, documents_directory, paths,
+                       stats.files)) {
+      return false;
+    }
+  }
+
+  if (!WriteDocSetPlist(docset_id, docset_name,
+                        JoinPaths({location, docset_id + ".docset", "Contents",
+                                   "Info.plist"}))) {
+    D2D_ERROR << "Could not write Info.plist to the docset.";
+    return false;
+  }
+  return NormalizeFileModes(JoinPaths({location, docset_id + ".docset"}),
+                            mtime);
+}
+
+}  // namespace d2d
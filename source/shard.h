@@ -0,0 +1,48 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace d2d {
+
+// One of |count| parts of a docset built on its own, for example on another
+// machine. Files and the tokens documented in them are assigned to shards by
+// a hash of their path relative to the Doxygen output, so every shard agrees
+// on the partition without coordinating.
+struct Shard {
+  size_t index = 0;
+  size_t count = 1;
+
+  bool IsPartial() const { return count > 1; }
+};
+
+// Parses "i/N", such as "0/4". |i| must be less than |N|.
+bool ParseShard(const std::string& text, Shard& shard);
+
+// Whether |path|, relative to the Doxygen output, belongs to |shard|.
+bool IsInShard(const std::string& path, const Shard& shard);
+
+struct MergeStats {
+  size_t files = 0;
+  size_t rows = 0;
+  size_t text_rows = 0;
+};
+
+// Combines the docsets built by every shard of a build into one docset in
+// |location|, named after their docset ID. The searchIndex rows of the shards
+// are merged in (name, type, path) order, so the result does not depend on
+// the number of shards. The full-text rows and the Documents trees are
+// unioned. Documents are hardlinked from the shards where possible. The
+// search accelerators are built once over the merged rows if the shards were
+// built with them. |mtime| is as in |BuildOptions|.
+bool MergeDocsetShards(const std::vector<std::string>& shard_docsets,
+                       const std::string& location, MergeStats& stats,
+                       int64_t mtime = -1);
+
+}  // namespace d2d
@@ -0,0 +1,378 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "tagfile_reader.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "logger.h"
+#include "scan.h"
+
+namespace d2d {
+
+namespace {
+
+// A start, end or empty element tag. Names and attributes point into the
+// mapped file.
+struct Tag {
+  const char* name = nullptr;
+  size_t name_length = 0;
+  const char* attributes = nullptr;
+  const char* attributes_end = nullptr;
+  bool is_end = false;
+  bool is_empty = false;
+
+  bool Is(const char* literal) const {
+    return ::strlen(literal) == name_length &&
+           ::memcmp(name, literal, name_length) == 0;
+  }
+};
+
+}  // namespace
+
+static void AppendUTF8(uint32_t code_point, std::string& text) {
+  if (code_point < 0x80) {
+    text += static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    text += static_cast<char>(0xc0 | (code_point >> 6));
+    text += static_cast<char>(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    text += static_cast<char>(0xe0 | (code_point >> 12));
+    text += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    text += static_cast<char>(0x80 | (code_point & 0x3f));
+  } else {
+    text += static_cast<char>(0xf0 | (code_point >> 18));
+    text += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+    text += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    text += static_cast<char>(0x80 | (code_point & 0x3f));
+  }
+}
+
+// Replaces the predefined and numeric character references. Others are kept
+// as they are.
+static std::string DecodeText(const char* begin, const char* end) {
+  std::string text;
+  text.reserve(end - begin);
+  while (begin < end) {
+    const auto ampersand =
+        static_cast<const char*>(::memchr(begin, '&', end - begin));
+    if (ampersand == nullptr) {
+      text.append(begin, end);
+      break;
+    }
+    const auto semicolon =
+        static_cast<const char*>(::memchr(ampersand, ';', end - ampersand));
+    if (semicolon == nullptr) {
+      text.append(begin, end);
+      break;
+    }
+    text.append(begin, ampersand);
+
+    const std::string entity(ampersand + 1, semicolon);
+    if (entity == "lt") {
+      text += '<';
+    } else if (entity == "gt") {
+      text += '>';
+    } else if (entity == "amp") {
+      text += '&';
+    } else if (entity == "quot") {
+      text += '"';
+    } else if (entity == "apos") {
+      text += '\'';
+    } else if (entity.size() > 1 && entity[0] == '#') {
+      const bool hex = entity[1] == 'x' || entity[1] == 'X';
+      AppendUTF8(static_cast<uint32_t>(::strtoul(
+                     entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10)),
+                 text);
+    } else {
+      text.append(ampersand, semicolon + 1);
+    }
+    begin = semicolon + 1;
+  }
+  return text;
+}
+
+static std::string GetAttribute(const Tag& tag, const char* name) {
+  const auto prefix = std::string(" ") + name + "=\"";
+  const auto value = ScanFind(tag.attributes, tag.attributes_end,
+                              prefix.data(), prefix.size());
+  if (value == tag.attributes_end) {
+    return "";
+  }
+  const auto value_begin = value + prefix.size();
+  const auto value_end = static_cast<const char*>(
+      ::memchr(value_begin, '"', tag.attributes_end - value_begin));
+  return value_end != nullptr ? DecodeText(value_begin, value_end) : "";
+}
+
+// Moves |position| past the next tag, skipping text, comments, processing
+// instructions and declarations. Returns false at the end of the file, or if
+// the file ends within a tag, which sets |malformed|.
+static bool NextTag(const char*& position, const char* end, Tag& tag,
+                    bool& malformed) {
+  static const char kCommentEnd[] = "-->";
+  for (;;) {
+    const auto open =
+        static_cast<const char*>(::memchr(position, '<', end - position));
+    if (open == nullptr || end - open < 2) {
+      position = end;
+      return false;
+    }
+
+    if (end - open >= 4 && ::memcmp(open, "<!--", 4) == 0) {
+      const auto comment_end =
+          ScanFind(open + 4, end, kCommentEnd, sizeof(kCommentEnd) - 1);
+      if (comment_end == end) {
+        malformed = true;
+        return false;
+      }
+      position = comment_end + sizeof(kCommentEnd) - 1;
+      continue;
+    }
+
+    const auto close =
+        static_cast<const char*>(::memchr(open, '>', end - open));
+    if (close == nullptr) {
+      malformed = true;
+      return false;
+    }
+    position = close + 1;
+    if (open[1] == '?' || open[1] == '!') {
+      continue;
+    }
+
+    tag.is_end = open[1] == '/';
+    tag.is_empty = !tag.is_end && close[-1] == '/';
+    tag.name = open + (tag.is_end ? 2 : 1);
+    auto name_end = tag.name;
+    while (name_end < close && *name_end != ' ' && *name_end != '\t' &&
+           *name_end != '\r' && *name_end != '\n' && *name_end != '/') {
+      name_end++;
+    }
+    tag.name_length = name_end - tag.name;
+    tag.attributes = name_end;
+    tag.attributes_end = tag.is_empty ? close - 1 : close;
+    return true;
+  }
+}
+
+// The text up to the next tag.
+static std::string ReadText(const char*& position, const char* end) {
+  const auto text_end =
+      static_cast<const char*>(::memchr(position, '<', end - position));
+  const auto text = DecodeText(position, text_end != nullptr ? text_end : end);
+  position = text_end != nullptr ? text_end : end;
+  return text;
+}
+
+// Older versions of Doxygen leave the extension out of file names.
+static std::string GetPagePath(const std::string& file_name) {
+  return file_name.find('.') == std::string::npos ? file_name + ".html"
+                                                  : file_name;
+}
+
+// Reads the contents of a <compound> element up to its end tag. Returns false
+// if the file ends before it. |scoped| tells whether the compound is the
+// scope of its members.
+static bool ReadCompound(const Tag& compound_tag, const char*& position,
+                         const char* end, std::vector<Token>& tokens,
+                         bool& scoped) {
+  const auto kind = GetAttribute(compound_tag, "kind");
+  const auto language_name = GetAttribute(compound_tag, "language");
+  const auto language =
+      language_name.empty() ? language_name : GetLanguageCode(language_name);
+  scoped = IsClassCompoundKind(kind) || kind == "namespace";
+
+  std::string name;
+  std::string file_name;
+  bool is_template = false;
+
+  bool in_member = false;
+  std::string member_kind;
+  std::string member_name;
+  std::string anchor_file;
+  std::string anchor;
+  bool is_static = false;
+  // The values of an enumeration, as pages, anchors and names.
+  std::vector<std::string> enum_values;
+
+  bool malformed = false;
+  Tag tag;
+  while (NextTag(position, end, tag, malformed)) {
+    if (tag.is_end) {
+      if (tag.Is("compound")) {
+        const auto type = GetCompoundTypeCode(kind, is_template);
+        if (!type.empty() && !name.empty() && !file_name.empty()) {
+          const auto separator = name.rfind("::");
+          tokens.insert(
+              tokens.begin(),
+              Token(name, type,
+                    separator != std::string::npos ? name.substr(0, separator)
+                                                   : "",
+                    GetPagePath(file_name), "", language));
+        }
+        return true;
+      }
+      if (tag.Is("member") && in_member) {
+        in_member = false;
+        if (member_name.empty() || anchor_file.empty() || anchor.empty()) {
+          continue;
+        }
+        const auto scope = scoped ? name : "";
+        const auto declared_in = kind == "file" ? name : "";
+        tokens.emplace_back(member_name,
+                            GetMemberTypeCode(member_kind, is_static, kind),
+                            scope, GetPagePath(anchor_file), anchor, language,
+                            declared_in);
+        for (size_t i = 0; i + 2 < enum_values.size(); i += 3) {
+          tokens.emplace_back(enum_values[i + 2], "econst", scope,
+                              GetPagePath(enum_values[i]), enum_values[i + 1],
+                              language, declared_in);
+        }
+      }
+      continue;
+    }
+    if (tag.is_empty) {
+      continue;
+    }
+
+    if (tag.Is("member")) {
+      in_member = true;
+      member_kind = GetAttribute(tag, "kind");
+      is_static = GetAttribute(tag, "static") == "yes";
+      member_name.clear();
+      anchor_file.clear();
+      anchor.clear();
+      enum_values.clear();
+    } else if (tag.Is("name")) {
+      (in_member ? member_name : name) = ReadText(position, end);
+    } else if (in_member && tag.Is("anchorfile")) {
+      anchor_file = ReadText(position, end);
+    } else if (in_member && tag.Is("anchor")) {
+      anchor = ReadText(position, end);
+    } else if (in_member && tag.Is("enumvalue")) {
+      auto value_file = GetAttribute(tag, "file");
+      auto value_anchor = GetAttribute(tag, "anchor");
+      auto value_name = ReadText(position, end);
+      if (!value_file.empty() && !value_anchor.empty() &&
+          !value_name.empty()) {
+        enum_values.push_back(std::move(value_file));
+        enum_values.push_back(std::move(value_anchor));
+        enum_values.push_back(std::move(value_name));
+      }
+    } else if (!in_member && tag.Is("filename")) {
+      file_name = ReadText(position, end);
+    } else if (!in_member && tag.Is("templarg")) {
+      is_template = true;
+    }
+  }
+  return false;
+}
+
+TagfileReader::TagfileReader(const std::string& file_path, size_t chunk_size)
+    : file_path_(file_path),
+      mapping_(OpenFileReadOnly(file_path)),
+      chunk_size_(std::max<size_t>(chunk_size, 1)) {
+  if (!mapping_) {
+    D2D_ERROR << "Could not read the tag file: " << file_path;
+    return;
+  }
+
+  static const char kRoot[] = "<tagfile";
+  position_ = static_cast<const char*>(mapping_->Get());
+  end_ = position_ + mapping_->GetSize();
+  if (ScanFind(position_, end_, kRoot, sizeof(kRoot) - 1) == end_) {
+    D2D_ERROR << "Not a Doxygen tag file: " << file_path;
+    return;
+  }
+  is_valid_ = true;
+}
+
+TagfileReader::~TagfileReader() = default;
+
+bool TagfileReader::IsValid() const { return is_valid_; }
+
+void TagfileReader::AddTokens(std::vector<Token>& compound_tokens,
+                              bool scoped, std::vector<Token>& tokens) {
+  for (auto& token : compound_tokens) {
+    if (token.GetAnchor().empty()) {
+      tokens.emplace_back(std::move(token));
+      continue;
+    }
+
+    Member member;
+    member.chunk = chunk_;
+    member.index = tokens.size();
+    member.scoped = scoped;
+    auto inserted = members_.emplace(token.GetIndexPath(), member);
+    if (inserted.second) {
+      tokens.emplace_back(std::move(token));
+      continue;
+    }
+
+    // Merge what the two listings know, unless the first was already read.
+    auto& seen = inserted.first->second;
+    if (seen.chunk != chunk_) {
+      continue;
+    }
+    auto& first = tokens[seen.index];
+    const auto& declared = first.GetDeclaredIn().empty() ? token : first;
+    const auto& scoping = scoped && !seen.scoped ? token : first;
+    first = Token(scoping.GetName(), scoping.GetType(), scoping.GetScope(),
+                  scoping.GetPath(), scoping.GetAnchor(),
+                  scoping.GetLanguage(), declared.GetDeclaredIn());
+    seen.scoped = seen.scoped || scoped;
+  }
+}
+
+bool TagfileReader::ReadCompounds(size_t max_bytes,
+                                  std::vector<Token>& tokens) {
+  tokens.clear();
+  if (!is_valid_ || position_ == end_) {
+    return false;
+  }
+
+  const auto chunk_begin = position_;
+  bool malformed = false;
+  Tag tag;
+  while (static_cast<size_t>(position_ - chunk_begin) < max_bytes &&
+         NextTag(position_, end_, tag, malformed)) {
+    if (tag.is_end || tag.is_empty || !tag.Is("compound")) {
+      continue;
+    }
+    std::vector<Token> compound_tokens;
+    bool scoped = false;
+    if (!ReadCompound(tag, position_, end_, compound_tokens, scoped)) {
+      malformed = true;
+      break;
+    }
+    AddTokens(compound_tokens, scoped, tokens);
+  }
+
+  if (malformed) {
+    D2D_ERROR << "Could not parse the tag file: " << file_path_;
+    is_valid_ = false;
+    tokens.clear();
+    return false;
+  }
+  chunk_++;
+  return true;
+}
+
+bool TagfileReader::ReadChunk(std::vector<Token>& tokens) {
+  return ReadCompounds(chunk_size_, tokens);
+}
+
+std::vector<Token> TagfileReader::ReadTokens() {
+  std::vector<Token> tokens;
+  ReadCompounds(std::numeric_limits<size_t>::max(), tokens);
+  return tokens;
+}
+
+}  // namespace d2d
@@ -0,0 +1,76 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file.h"
+#include "macros.h"
+#include "token.h"
+
+namespace d2d {
+
+// Reads tokens from a Doxygen tag file (GENERATE_TAGFILE), which lists every
+// compound and member with the page and anchor it is documented at. The file
+// is mapped and scanned once, one compound at a time, without building a
+// document tree.
+//
+// Tag files list members again in the files and groups they belong to, and
+// list files before classes and namespaces. A member is only read once. It
+// takes its scope from its class or namespace and its declaring file from the
+// file that lists it, as long as both are in the same chunk.
+class TagfileReader {
+ public:
+  static constexpr size_t kDefaultChunkSize = 16u << 20;
+
+  // |chunk_size| is the number of bytes of the file read by |ReadChunk|,
+  // rounded up to whole compounds.
+  TagfileReader(const std::string& file_path,
+                size_t chunk_size = kDefaultChunkSize);
+
+  ~TagfileReader();
+
+  bool IsValid() const;
+
+  // Replaces |tokens| with those of the next chunk, in file order. Returns
+  // false once the whole file has been read, or if it is malformed, which
+  // also makes the reader invalid.
+  bool ReadChunk(std::vector<Token>& tokens);
+
+  // The tokens of the rest of the file.
+  std::vector<Token> ReadTokens();
+
+ private:
+  struct Member {
+    size_t chunk = 0;
+    size_t index = 0;
+    bool scoped = false;
+  };
+
+  std::string file_path_;
+  std::unique_ptr<AutoMapping> mapping_;
+  const char* position_ = nullptr;
+  const char* end_ = nullptr;
+  size_t chunk_size_ = kDefaultChunkSize;
+  size_t chunk_ = 0;
+  // The members read so far by page and anchor. They are kept for the whole
+  // run, so unlike the tokens, they grow with the number of members even
+  // when read a chunk at a time.
+  std::unordered_map<std::string, Member> members_;
+  bool is_valid_ = false;
+
+  bool ReadCompounds(size_t max_bytes, std::vector<Token>& tokens);
+
+  void AddTokens(std::vector<Token>& compound_tokens, bool scoped,
+                 std::vector<Token>& tokens);
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(TagfileReader);
+};
+
+}  // namespace d2d
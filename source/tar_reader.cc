@@ -0,0 +1,504 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "tar_reader.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "logger.h"
+
+namespace d2d {
+
+static constexpr size_t kBlockSize = 512;
+
+// GNU long names and pax headers larger than this are treated as corrupt.
+static constexpr size_t kMaxHeaderDataSize = 1u << 20;
+
+bool IsTarArchive(const std::string& path) {
+  struct stat path_stat = {};
+  return path == "-" ||
+         (::stat(path.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode));
+}
+
+// The tool that decompresses data starting with |head|, if it is compressed.
+static const char* GetDecompressor(const std::string& head) {
+  static const struct {
+    const char* magic;
+    size_t length;
+    const char* tool;
+  } kFormats[] = {
+      {"\x1f\x8b", 2, "gzip"},
+      {"BZh", 3, "bzip2"},
+      {"\xfd" "7zXZ\0", 6, "xz"},
+      {"\x28\xb5\x2f\xfd", 4, "zstd"},
+  };
+  for (const auto& format : kFormats) {
+    if (head.size() >= format.length &&
+        ::memcmp(head.data(), format.magic, format.length) == 0) {
+      return format.tool;
+    }
+  }
+  return nullptr;
+}
+
+// Reads a numeric header field. GNU tar stores numbers that do not fit in
+// octal in base 256, flagged by the high bit of the first byte.
+static bool ParseNumber(const char* field, size_t size, uint64_t& value) {
+  value = 0;
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    for (size_t i = 0; i < size; i++) {
+      const auto byte = static_cast<unsigned char>(field[i]);
+      if ((value >> 56) != 0) {
+        return false;
+      }
+      value = (value << 8) | (i == 0 ? byte & 0x7f : byte);
+    }
+    return true;
+  }
+
+  size_t i = 0;
+  while (i < size && field[i] == ' ') {
+    i++;
+  }
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = value * 8 + (field[i] - '0');
+  }
+  return i == size || field[i] == ' ' || field[i] == '\0';
+}
+
+static std::string GetField(const char* field, size_t size) {
+  return std::string(field, ::strnlen(field, size));
+}
+
+static bool IsZeroBlock(const char* block) {
+  for (size_t i = 0; i < kBlockSize; i++) {
+    if (block[i] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The checksum is the sum of the bytes of the header with the checksum field
+// taken as spaces.
+static bool IsChecksumValid(const char* block) {
+  uint64_t expected = 0;
+  if (!ParseNumber(block + 148, 8, expected)) {
+    return false;
+  }
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kBlockSize; i++) {
+    sum += i >= 148 && i < 156 ? ' ' : static_cast<unsigned char>(block[i]);
+  }
+  return sum == expected;
+}
+
+// Reads the path and size of the next entry from pax records, which are
+// "<length> <key>=<value>\n" each.
+static bool ParsePaxRecords(const std::string& records, std::string& path,
+                            uint64_t& size, bool& has_size) {
+  for (size_t begin = 0; begin < records.size();) {
+    const auto space = records.find(' ', begin);
+    if (space == std::string::npos) {
+      return false;
+    }
+    const auto length = std::strtoull(records.c_str() + begin, nullptr, 10);
+    if (length <= space - begin || begin + length > records.size() ||
+        records[begin + length - 1] != '\n') {
+      return false;
+    }
+    const auto record = records.substr(space + 1, begin + length - space - 2);
+    const auto equals = record.find('=');
+    if (equals != std::string::npos) {
+      const auto key = record.substr(0, equals);
+      if (key == "path") {
+        path = record.substr(equals + 1);
+      } else if (key == "size") {
+        size = std::strtoull(record.c_str() + equals + 1, nullptr, 10);
+        has_size = true;
+      }
+    }
+    begin += length;
+  }
+  return true;
+}
+
+// A buffer for |size| bytes. Like mapped files, large entries get their own
+// mapping rather than a pooled buffer.
+static std::unique_ptr<AutoMapping> AllocateContents(size_t size) {
+  if (size <= GetIOThresholds().small_file_size) {
+    Allocation buffer(size);
+    if (!buffer.IsValid()) {
+      return nullptr;
+    }
+    return std::make_unique<AutoMapping>(std::move(buffer));
+  }
+  auto mapping = std::make_unique<AutoMapping>(
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+      size);
+  return mapping->IsValid() ? std::move(mapping) : nullptr;
+}
+
+TarReader::TarReader(const std::string& path) : path_(path) {
+  // Standard input is duplicated so that it is not closed along with the
+  // reader.
+  AutoFD source(path == "-" ? ::dup(STDIN_FILENO)
+                            : D2D_TEMP_FAILURE_RETRY(::open(
+                                  path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (!source.IsValid()) {
+    D2D_ERROR << "Could not open the archive " << path << ": "
+              << strerror(errno);
+    return;
+  }
+
+  // Enough for the magic numbers of every compressed format.
+  char magic[6] = {};
+  size_t magic_size = 0;
+  while (magic_size < sizeof(magic)) {
+    const auto result = D2D_TEMP_FAILURE_RETRY(::read(
+        source.Get(), magic + magic_size, sizeof(magic) - magic_size));
+    if (result < 0) {
+      D2D_ERROR << "Could not read the archive " << path << ": "
+                << strerror(errno);
+      return;
+    }
+    if (result == 0) {
+      break;
+    }
+    magic_size += result;
+  }
+  head_.assign(magic, magic_size);
+
+  const auto decompressor = GetDecompressor(head_);
+  if (decompressor == nullptr) {
+    input_ = std::move(source);
+  } else if (!StartDecompressor(decompressor, source)) {
+    return;
+  }
+  is_valid_ = true;
+}
+
+TarReader::~TarReader() {
+  if (decompressor_ >= 0) {
+    ::kill(decompressor_, SIGTERM);
+    StopDecompressor();
+  }
+}
+
+bool TarReader::IsValid() const { return is_valid_; }
+
+bool TarReader::StartDecompressor(const char* tool, AutoFD& source) {
+  int to_tool[2] = {-1, -1};
+  int from_tool[2] = {-1, -1};
+  if (::pipe(to_tool) != 0 || ::pipe(from_tool) != 0) {
+    D2D_ERROR << "Could not create a pipe: " << strerror(errno);
+    for (const auto fd : {to_tool[0], to_tool[1]}) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+    return false;
+  }
+  for (const auto fd : {to_tool[0], to_tool[1], from_tool[0], from_tool[1]}) {
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  AutoFD tool_input(to_tool[0]);
+  auto sink = std::make_shared<AutoFD>(to_tool[1]);
+  AutoFD output(from_tool[0]);
+  AutoFD tool_output(from_tool[1]);
+
+  const auto pid = ::fork();
+  if (pid < 0) {
+    D2D_ERROR << "Could not start " << tool << ": " << strerror(errno);
+    return false;
+  }
+  if (pid == 0) {
+    // The duplicates do not inherit FD_CLOEXEC.
+    if (::dup2(tool_input.Get(), STDIN_FILENO) < 0 ||
+        ::dup2(tool_output.Get(), STDOUT_FILENO) < 0) {
+      ::_exit(127);
+    }
+    ::execlp(tool, tool, "-dc", static_cast<char*>(nullptr));
+    ::_exit(127);
+  }
+  decompressor_ = pid;
+  decompressor_name_ = tool;
+  input_ = std::move(output);
+
+  // The feeder owns the archive and the write end of the pipe, which is
+  // closed once the archive has been written.
+  auto archive = std::make_shared<AutoFD>(-1);
+  *archive = std::move(source);
+  auto head = std::move(head_);
+  head_.clear();
+  feeder_ = std::thread([archive, sink, head]() {
+    // The decompressor may exit early, for example on corrupt input. Writes
+    // then fail instead of raising SIGPIPE.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    auto write_all = [&sink](const char* data, size_t size) {
+      while (size > 0) {
+        const auto written =
+            D2D_TEMP_FAILURE_RETRY(::write(sink->Get(), data, size));
+        if (written <= 0) {
+          return false;
+        }
+        data += written;
+        size -= written;
+      }
+      return true;
+    };
+    if (!write_all(head.data(), head.size())) {
+      return;
+    }
+    char buffer[64 << 10];
+    for (;;) {
+      const auto result = D2D_TEMP_FAILURE_RETRY(
+          ::read(archive->Get(), buffer, sizeof(buffer)));
+      if (result <= 0 || !write_all(buffer, result)) {
+        return;
+      }
+    }
+  });
+  return true;
+}
+
+bool TarReader::StopDecompressor() {
+  if (decompressor_ < 0) {
+    return true;
+  }
+  input_.Reset();
+  int status = 0;
+  const auto result =
+      D2D_TEMP_FAILURE_RETRY(::waitpid(decompressor_, &status, 0));
+  decompressor_ = -1;
+  if (feeder_.joinable()) {
+    feeder_.join();
+  }
+  return result >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool TarReader::Read(void* data, size_t size) {
+  auto bytes = static_cast<char*>(data);
+  const auto from_head = std::min(size, head_.size());
+  ::memcpy(bytes, head_.data(), from_head);
+  head_.erase(0, from_head);
+  bytes += from_head;
+  size -= from_head;
+
+  while (size > 0) {
+    const auto result =
+        D2D_TEMP_FAILURE_RETRY(::read(input_.Get(), bytes, size));
+    if (result <= 0) {
+      return false;
+    }
+    bytes += result;
+    size -= result;
+  }
+  return true;
+}
+
+bool TarReader::Skip(size_t size) {
+  char buffer[16 << 10];
+  while (size > 0) {
+    const auto chunk = std::min(size, sizeof(buffer));
+    if (!Read(buffer, chunk)) {
+      return false;
+    }
+    size -= chunk;
+  }
+  return true;
+}
+
+bool RebaseTarPath(const std::string& root, std::string& path) {
+  if (root.empty()) {
+    return true;
+  }
+  if (path.size() <= root.size() || path.compare(0, root.size(), root) != 0 ||
+      path[root.size()] != '/') {
+    return false;
+  }
+  path.erase(0, root.size() + 1);
+  return true;
+}
+
+const std::string& TarReader::GetLeadingDirectory() const {
+  return leading_directory_;
+}
+
+void TarReader::SetRoot(const std::string& root) { root_ = root; }
+
+bool TarReader::NormalizePath(std::string& path) const {
+  while (path.compare(0, 2, "./") == 0) {
+    path.erase(0, 2);
+  }
+  if (!RebaseTarPath(root_, path)) {
+    return false;
+  }
+  if (path.empty() || path[0] == '/') {
+    return false;
+  }
+  // Entries must not be written outside of the docset.
+  for (size_t begin = 0; begin <= path.size();) {
+    const auto end = std::min(path.find('/', begin), path.size());
+    if (path.compare(begin, end - begin, "..") == 0) {
+      return false;
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+bool TarReader::ReadEntry(TarEntry& entry) {
+  if (!is_valid_ || is_done_) {
+    return false;
+  }
+
+  const auto fail = [this](const std::string& problem) {
+    D2D_ERROR << "Could not read the archive " << path_ << ": " << problem;
+    is_valid_ = false;
+    return false;
+  };
+  // The input also ends early when the decompressor fails.
+  const auto truncated = [this, &fail]() {
+    if (decompressor_ >= 0 && !StopDecompressor()) {
+      D2D_ERROR << "Could not decompress " << path_ << " with "
+                << decompressor_name_ << ".";
+      is_valid_ = false;
+      return false;
+    }
+    return fail("it is truncated.");
+  };
+
+  // Set by GNU long name and pax headers for the entry that follows them.
+  std::string next_path;
+  uint64_t next_size = 0;
+  bool has_next_size = false;
+  for (;;) {
+    char block[kBlockSize];
+    if (!Read(block, sizeof(block))) {
+      return truncated();
+    }
+    if (IsZeroBlock(block)) {
+      break;
+    }
+    uint64_t size = 0;
+    if (!IsChecksumValid(block) || !ParseNumber(block + 124, 12, size)) {
+      return fail("it is not a tar archive or it is corrupt.");
+    }
+    if (has_next_size) {
+      size = next_size;
+    }
+    const auto padding = (kBlockSize - size % kBlockSize) % kBlockSize;
+    const auto type = block[156];
+
+    if (type == 'L' || type == 'x') {
+      if (size > kMaxHeaderDataSize) {
+        return fail("a header is too large.");
+      }
+      std::string data(size, '\0');
+      if (!Read(&data[0], size) || !Skip(padding)) {
+        return truncated();
+      }
+      if (type == 'L') {
+        next_path = data.c_str();
+      } else if (!ParsePaxRecords(data, next_path, next_size,
+                                  has_next_size)) {
+        return fail("a pax header is corrupt.");
+      }
+      continue;
+    }
+
+    auto path = next_path;
+    if (path.empty()) {
+      path = GetField(block, 100);
+      // Old GNU headers ("ustar  ") keep times where POSIX keeps the prefix.
+      const auto prefix = GetField(block + 345, 155);
+      if (::memcmp(block + 257, "ustar", 6) == 0 && !prefix.empty()) {
+        path = prefix + "/" + path;
+      }
+    }
+    next_path.clear();
+    has_next_size = false;
+
+    // Global pax headers do not describe an entry.
+    if (type == 'g') {
+      if (!Skip(size + padding)) {
+        return truncated();
+      }
+      continue;
+    }
+
+    const auto is_first_entry = is_first_entry_;
+    is_first_entry_ = false;
+    if (type == '5' && is_first_entry) {
+      while (path.compare(0, 2, "./") == 0) {
+        path.erase(0, 2);
+      }
+      while (!path.empty() && path.back() == '/') {
+        path.pop_back();
+      }
+      if (path != "." && path.find('/') == std::string::npos) {
+        leading_directory_ = path;
+      }
+    }
+    if (type != '0' && type != '\0' && type != '7') {
+      if (type != '5') {
+        D2D_VERBOSE << "Skipping " << path << ", which is not a regular file.";
+      }
+      if (!Skip(size + padding)) {
+        return truncated();
+      }
+      continue;
+    }
+
+    const auto archive_path = path;
+    if (!NormalizePath(path)) {
+      return fail(archive_path + " is outside of the root of the archive.");
+    }
+    auto contents = AllocateContents(size);
+    if (!contents) {
+      return fail("there is not enough memory for " + path + ".");
+    }
+    if (!Read(contents->Get(), size) || !Skip(padding)) {
+      return truncated();
+    }
+    entry.path = std::move(path);
+    entry.contents = std::move(contents);
+    return true;
+  }
+
+  // Archives usually end in more zeros than the two blocks that mark the
+  // end. They are drained so that the decompressor exits on its own.
+  is_done_ = true;
+  if (decompressor_ >= 0) {
+    char buffer[16 << 10];
+    while (D2D_TEMP_FAILURE_RETRY(
+               ::read(input_.Get(), buffer, sizeof(buffer))) > 0) {
+    }
+    if (!StopDecompressor()) {
+      D2D_ERROR << "Could not decompress " << path_ << " with "
+                << decompressor_name_ << ".";
+      is_valid_ = false;
+    }
+  }
+  return false;
+}
+
+}  // namespace d2d
@@ -0,0 +1,97 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "file.h"
+#include "macros.h"
+
+namespace d2d {
+
+// A regular file read from a tar archive.
+struct TarEntry {
+  // Relative to the root of the archive. See |TarReader::SetRoot|.
+  std::string path;
+  std::unique_ptr<AutoMapping> contents;
+};
+
+// Whether |path| names a tar archive to read rather than a directory. "-"
+// stands for standard input.
+bool IsTarArchive(const std::string& path);
+
+// Reads the regular files of a tar archive (ustar, GNU or pax) one at a time
+// in archive order, from a file or from standard input, without extracting
+// them. Archives compressed with gzip, bzip2, xz or zstd are piped through
+// the matching tool, which must be on the PATH.
+//
+// Leading "./" is removed from paths. Links and special files are skipped.
+class TarReader {
+ public:
+  // Reads standard input if |path| is "-".
+  explicit TarReader(const std::string& path);
+
+  ~TarReader();
+
+  bool IsValid() const;
+
+  // Reads the next regular file into |entry|. Returns false once the whole
+  // archive has been read, or if it is malformed, which also makes the reader
+  // invalid.
+  bool ReadEntry(TarEntry& entry);
+
+  // The top-level directory the archive starts with, such as the "html/" of
+  // "tar -cf html.tar html", once the first entry was read. Empty if the
+  // archive starts with anything else. The entries that follow need not be
+  // in it, as in "tar -cf html.tar search index.html".
+  const std::string& GetLeadingDirectory() const;
+
+  // Makes the paths of the entries read from now on relative to |root|,
+  // a directory of the archive. They are relative to the top of the
+  // archive until then. Entries outside of |root| make the archive invalid.
+  void SetRoot(const std::string& root);
+
+ private:
+  std::string path_;
+  // The archive, or the output of the decompressor.
+  AutoFD input_{-1};
+  // The bytes read from |input_| to detect compression that are not consumed
+  // yet.
+  std::string head_;
+  pid_t decompressor_ = -1;
+  const char* decompressor_name_ = nullptr;
+  // Writes the compressed archive to the decompressor.
+  std::thread feeder_;
+  std::string leading_directory_;
+  std::string root_;
+  bool is_first_entry_ = true;
+  bool is_done_ = false;
+  bool is_valid_ = false;
+
+  bool Read(void* data, size_t size);
+
+  bool Skip(size_t size);
+
+  bool StartDecompressor(const char* tool, AutoFD& source);
+
+  // Waits for the decompressor to exit. Returns false if it failed.
+  bool StopDecompressor();
+
+  // Applies the leading "./" and root directory rules to |path|. Returns
+  // false if |path| is outside of the root or not relative.
+  bool NormalizePath(std::string& path) const;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(TarReader);
+};
+
+// Makes |path|, relative to the top of an archive, relative to |root|.
+// Returns false if it is not inside |root|. An empty |root| is the top.
+bool RebaseTarPath(const std::string& root, std::string& path);
+
+}  // namespace d2d
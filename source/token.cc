@@ -3,8 +3,12 @@
 
 #include "token.h"
 
+#include <ctype.h>
+
+#include <algorithm>
 #include <map>
 #include <string>
+#include <utility>
 
 #include "logger.h"
 
@@ -25,6 +29,7 @@ Token::Token(const tinyxml2::XMLElement* element) {
     }
     if (auto xml = token_identifier_xml->FirstChildElement("Type")) {
       type_ = xml->GetText();
+      token_type_ = ClassifyTokenType(type_.data(), type_.size());
     }
     if (auto xml = token_identifier_xml->FirstChildElement("Scope")) {
       scope_ = xml->GetText();
@@ -46,6 +51,19 @@ Token::Token(const tinyxml2::XMLElement* element) {
   is_valid_ = true;
 }
 
+Token::Token(std::string name, std::string type, std::string scope,
+             std::string path, std::string anchor, std::string language,
+             std::string declared_in)
+    : is_valid_(true),
+      name_(std::move(name)),
+      language_(std::move(language)),
+      type_(std::move(type)),
+      token_type_(ClassifyTokenType(type_.data(), type_.size())),
+      scope_(std::move(scope)),
+      path_(std::move(path)),
+      anchor_(std::move(anchor)),
+      declared_in_(std::move(declared_in)) {}
+
 Token::Token() = default;
 
 Token::Token(Token&&) = default;
@@ -56,6 +74,8 @@ Token::~Token() = default;
 
 Token& Token::operator=(const Token&) = default;
 
+Token& Token::operator=(Token&&) = default;
+
 bool Token::IsValid() const { return is_valid_; }
 
 const std::string& Token::GetName() const { return name_; }
@@ -84,33 +104,17 @@ std::string Token::GetIndexName() const {
   return name_;
 }
 
-static const std::map<std::string, std::string> kDocsetTypeMap = {
-    {"cat", "Category"},    //
-    {"cl", "Class"},        //
-    {"clm", "Method"},      //
-    {"data", "Variable"},   //
-    {"econst", "Enum"},     //
-    {"ffunc", "Class"},     //
-    {"func", "Function"},   //
-    {"instm", "Method"},    //
-    {"instp", "Variable"},  //
-    {"intf", "Class"},      //
-    {"intfcm", "Method"},   //
-    {"intfm", "Method"},    //
-    {"intfp", "Variable"},  //
-    {"macro", "Macro"},     //
-    {"ns", "Namespace"},    //
-    {"tdef", "Type"},       //
-    {"tmplt", "Class"},     //
-};
-
-std::string Token::GetIndexType() const {
-  auto found = kDocsetTypeMap.find(type_);
-  if (found != kDocsetTypeMap.end()) {
-    return found->second;
-  }
-
-  return "Data";
+static_assert(ClassifyTokenType("func", 4) == TokenType::kFunction,
+              "Type codes must classify at compile time.");
+static_assert(ClassifyTokenType("intfp", 5) == TokenType::kInterfaceProperty,
+              "Type codes must classify at compile time.");
+static_assert(ClassifyTokenType("inst", 4) == TokenType::kUnknown,
+              "Unknown type codes must not classify.");
+
+TokenType Token::GetTokenType() const { return token_type_; }
+
+const char* Token::GetIndexType() const {
+  return GetTokenTypeIndexName(token_type_);
 }
 
 std::string Token::GetIndexPath() const { return path_ + "#" + anchor_; }
@@ -123,4 +127,86 @@ Token::TOCLinks Token::GetTokensByFile(const std::vector<Token>& tokens) {
   return links;
 }
 
+bool IsClassCompoundKind(const std::string& kind) {
+  return kind == "class" || kind == "struct" || kind == "union" ||
+         kind == "interface" || kind == "protocol" || kind == "category" ||
+         kind == "exception" || kind == "service" || kind == "singleton";
+}
+
+std::string GetCompoundTypeCode(const std::string& kind, bool is_template) {
+  if (kind == "namespace") {
+    return "ns";
+  }
+  if (kind == "file") {
+    return "file";
+  }
+  if (kind == "protocol") {
+    return "intf";
+  }
+  if (kind == "category") {
+    return "cat";
+  }
+  if (IsClassCompoundKind(kind)) {
+    return is_template ? "tmplt" : "cl";
+  }
+  return "";
+}
+
+std::string GetMemberTypeCode(const std::string& kind, bool is_static,
+                              const std::string& compound_kind) {
+  const bool in_class =
+      compound_kind == "class" || compound_kind == "interface";
+  const bool in_protocol = compound_kind == "protocol";
+  if (kind == "function") {
+    if (in_class) {
+      return is_static ? "clm" : "instm";
+    }
+    if (in_protocol) {
+      return is_static ? "intfcm" : "intfm";
+    }
+    return "func";
+  }
+  if (kind == "property") {
+    return in_protocol ? "intfp" : "instp";
+  }
+  if (kind == "define") {
+    return "macro";
+  }
+  if (kind == "variable") {
+    return "data";
+  }
+  if (kind == "typedef") {
+    return "tdef";
+  }
+  if (kind == "friend") {
+    return "ffunc";
+  }
+  if (kind == "enum" || kind == "enumeration") {
+    return "enum";
+  }
+  if (kind == "enumvalue") {
+    return "econst";
+  }
+  // Doxygen uses the kind itself for the rest, such as "signal" and "slot".
+  return kind;
+}
+
+std::string GetLanguageCode(const std::string& language) {
+  // The other languages are written in lower case.
+  static const char* const kCodes[][2] = {
+      {"C++", "cpp"},
+      {"Objective-C", "occ"},
+      {"C#", "csharp"},
+  };
+  for (const auto& code : kCodes) {
+    if (language == code[0]) {
+      return code[1];
+    }
+  }
+  std::string code = language;
+  std::transform(code.begin(), code.end(), code.begin(),
+                 [](unsigned char c) { return ::tolower(c); });
+  return code;
+}
+
 }  // namespace d2d
@@ -5,6 +5,9 @@
 
 #include <tinyxml2.h>
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <map>
 #include <string>
 #include <vector>
@@ -13,25 +16,199 @@
 
 namespace d2d {
 
+// The Doxygen docset token type codes (the <Type> element in Tokens.xml).
+enum class TokenType : uint8_t {
+  kUnknown,
+  kCategory,              // cat
+  kClass,                 // cl
+  kClassMethod,           // clm
+  kData,                  // data
+  kEnumConstant,          // econst
+  kFriendFunction,        // ffunc
+  kFunction,              // func
+  kInstanceMethod,        // instm
+  kInstanceProperty,      // instp
+  kInterface,             // intf
+  kInterfaceClassMethod,  // intfcm
+  kInterfaceMethod,       // intfm
+  kInterfaceProperty,     // intfp
+  kMacro,                 // macro
+  kNamespace,             // ns
+  kTypedef,               // tdef
+  kTemplate,              // tmplt
+};
+
+constexpr bool TokenTypeCodeEquals(const char* code, const char* literal,
+                                   size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (code[i] != literal[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Classifies a Doxygen type code. Dispatches on the length and the first
+// character so that at most one comparison is made.
+constexpr TokenType ClassifyTokenType(const char* code, size_t length) {
+#define D2D_TOKEN_TYPE_CASE(literal, type)                        \
+  if (TokenTypeCodeEquals(code, literal, sizeof(literal) - 1)) { \
+    return type;                                                 \
+  }                                                              \
+  break;
+
+  switch (length) {
+    case 2:
+      switch (code[0]) {
+        case 'c':
+          D2D_TOKEN_TYPE_CASE("cl", TokenType::kClass);
+        case 'n':
+          D2D_TOKEN_TYPE_CASE("ns", TokenType::kNamespace);
+      }
+      break;
+    case 3:
+      switch (code[0]) {
+        case 'c':
+          if (code[1] == 'a') {
+            D2D_TOKEN_TYPE_CASE("cat", TokenType::kCategory);
+          }
+          D2D_TOKEN_TYPE_CASE("clm", TokenType::kClassMethod);
+      }
+      break;
+    case 4:
+      switch (code[0]) {
+        case 'd':
+          D2D_TOKEN_TYPE_CASE("data", TokenType::kData);
+        case 'f':
+          D2D_TOKEN_TYPE_CASE("func", TokenType::kFunction);
+        case 'i':
+          D2D_TOKEN_TYPE_CASE("intf", TokenType::kInterface);
+        case 't':
+          D2D_TOKEN_TYPE_CASE("tdef", TokenType::kTypedef);
+      }
+      break;
+    case 5:
+      switch (code[0]) {
+        case 'f':
+          D2D_TOKEN_TYPE_CASE("ffunc", TokenType::kFriendFunction);
+        case 'm':
+          D2D_TOKEN_TYPE_CASE("macro", TokenType::kMacro);
+        case 't':
+          D2D_TOKEN_TYPE_CASE("tmplt", TokenType::kTemplate);
+        case 'i':
+          switch (code[4]) {
+            case 'm':
+              if (code[3] == 't') {
+                D2D_TOKEN_TYPE_CASE("instm", TokenType::kInstanceMethod);
+              }
+              D2D_TOKEN_TYPE_CASE("intfm", TokenType::kInterfaceMethod);
+            case 'p':
+              if (code[3] == 't') {
+                D2D_TOKEN_TYPE_CASE("instp", TokenType::kInstanceProperty);
+              }
+              D2D_TOKEN_TYPE_CASE("intfp", TokenType::kInterfaceProperty);
+          }
+          break;
+      }
+      break;
+    case 6:
+      switch (code[0]) {
+        case 'e':
+          D2D_TOKEN_TYPE_CASE("econst", TokenType::kEnumConstant);
+        case 'i':
+          D2D_TOKEN_TYPE_CASE("intfcm", TokenType::kInterfaceClassMethod);
+      }
+      break;
+  }
+
+#undef D2D_TOKEN_TYPE_CASE
+  return TokenType::kUnknown;
+}
+
+// The docset entry type (the searchIndex.type column) for a token type.
+constexpr const char* GetTokenTypeIndexName(TokenType type) {
+  switch (type) {
+    case TokenType::kCategory:
+      return "Category";
+    case TokenType::kClass:
+    case TokenType::kFriendFunction:
+    case TokenType::kInterface:
+    case TokenType::kTemplate:
+      return "Class";
+    case TokenType::kClassMethod:
+    case TokenType::kInstanceMethod:
+    case TokenType::kInterfaceClassMethod:
+    case TokenType::kInterfaceMethod:
+      return "Method";
+    case TokenType::kData:
+    case TokenType::kInstanceProperty:
+    case TokenType::kInterfaceProperty:
+      return "Variable";
+    case TokenType::kEnumConstant:
+      return "Enum";
+    case TokenType::kFunction:
+      return "Function";
+    case TokenType::kMacro:
+      return "Macro";
+    case TokenType::kNamespace:
+      return "Namespace";
+    case TokenType::kTypedef:
+      return "Type";
+    case TokenType::kUnknown:
+      break;
+  }
+  return "Data";
+}
+
+// Doxygen's XML output and tag files describe compounds and members by their
+// kind, such as "class" or "function". These give the type codes that its
+// docset generator writes to Tokens.xml for them.
+
+// Whether compounds of the kind are classes or class-like.
+bool IsClassCompoundKind(const std::string& kind);
+
+// The type code of a compound, or nothing for compounds that have no token of
+// their own, such as groups and pages.
+std::string GetCompoundTypeCode(const std::string& kind, bool is_template);
+
+// The type code of a member of a compound of the kind |compound_kind|. Both
+// "enum" and "enumeration" name enumerations.
+std::string GetMemberTypeCode(const std::string& kind, bool is_static,
+                              const std::string& compound_kind);
+
+// The <APILanguage> code for the name of a language as Doxygen spells it, such
+// as "cpp" for "C++".
+std::string GetLanguageCode(const std::string& language);
+
 class Token {
  public:
   Token();
 
   Token(const tinyxml2::XMLElement* element);
 
+  // A token that was not read from Tokens.xml. |type| is a Doxygen type code
+  // such as "func".
+  Token(std::string name, std::string type, std::string scope,
+        std::string path, std::string anchor, std::string language = "",
+        std::string declared_in = "");
+
   Token(Token&&);
 
   Token(const Token& token);
 
   Token& operator=(const Token&);
 
+  Token& operator=(Token&&);
+
   ~Token();
 
   bool IsValid() const;
 
   std::string GetIndexName() const;
 
-  std::string GetIndexType() const;
+  TokenType GetTokenType() const;
+
+  const char* GetIndexType() const;
 
   std::string GetIndexPath() const;
 
@@ -57,6 +234,7 @@ class Token {
   std::string name_;
   std::string language_;
   std::string type_;
+  TokenType token_type_ = TokenType::kUnknown;
   std::string scope_;
   std::string path_;
   std::string anchor_;
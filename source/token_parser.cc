@@ -3,13 +3,150 @@
 
 #include "token_parser.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+#include "file.h"
 #include "logger.h"
+#include "parallel.h"
+#include "scan.h"
 
 namespace d2d {
 
-TokenParser::TokenParser(const std::string& file_path) {
-  if (xml_document_.LoadFile(file_path.c_str()) != tinyxml2::XML_SUCCESS) {
+// Below this, the cost of the extra threads outweighs the parse.
+static constexpr size_t kMinimumChunkSize = 1u << 20;
+
+static bool IsTokenStart(const char* tag, const char* end) {
+  static const char kTag[] = "<Token";
+  const auto after = tag + sizeof(kTag) - 1;
+  return after < end &&
+         (*after == '>' || *after == ' ' || *after == '\t' ||
+          *after == '\r' || *after == '\n');
+}
+
+// The first <Token> element starting at or after |from|.
+static const char* FindTokenStart(const char* from, const char* end) {
+  static const char kTag[] = "<Token";
+  for (;;) {
+    from = ScanFind(from, end, kTag, sizeof(kTag) - 1);
+    if (from == end || IsTokenStart(from, end)) {
+      return from;
+    }
+    from += sizeof(kTag) - 1;
+  }
+}
+
+std::vector<const char*> SplitTokens(const char* begin, const char* end,
+                                     size_t max_chunks) {
+  static const char kRoot[] = "<Tokens";
+  static const char kRootEnd[] = "</Tokens>";
+  auto root = ScanFind(begin, end, kRoot, sizeof(kRoot) - 1);
+  if (root == end) {
+    return {};
+  }
+  const auto content_begin =
+      static_cast<const char*>(::memchr(root, '>', end - root));
+  if (content_begin == nullptr) {
+    return {};
+  }
+
+  // Doxygen writes a single root, so the last closing tag ends it.
+  const auto root_end_length = sizeof(kRootEnd) - 1;
+  if (static_cast<size_t>(end - content_begin) < root_end_length + 1) {
+    return {};
+  }
+  auto content_end = end - root_end_length;
+  while (content_end > content_begin &&
+         ::strncmp(content_end, kRootEnd, root_end_length) != 0) {
+    content_end--;
+  }
+  if (content_end == content_begin) {
+    return {};
+  }
+
+  std::vector<const char*> boundaries = {content_begin + 1};
+  const auto size = static_cast<size_t>(content_end - boundaries[0]);
+  for (size_t i = 1; i < max_chunks; i++) {
+    const auto target = boundaries[0] + size / max_chunks * i;
+    if (target <= boundaries.back()) {
+      continue;
+    }
+    const auto boundary = FindTokenStart(target, content_end);
+    if (boundary == content_end) {
+      break;
+    }
+    boundaries.push_back(boundary);
+  }
+  boundaries.push_back(content_end);
+  return boundaries;
+}
+
+// Parses a range of <Token> elements split off by |SplitTokens|.
+static bool ParseTokenRange(const char* begin, const char* end,
+                            tinyxml2::XMLDocument& document) {
+  std::string xml = "<Tokens>";
+  xml.append(begin, end);
+  xml += "</Tokens>";
+  return document.Parse(xml.data(), xml.size()) == tinyxml2::XML_SUCCESS;
+}
+
+TokenParser::TokenParser(const std::string& file_path, size_t concurrency)
+    : concurrency_(std::max<size_t>(concurrency, 1)) {
+  auto mapping = OpenFileReadOnly(file_path);
+  if (!mapping) {
+    D2D_ERROR << "Could not read XML file: " << file_path;
+    return;
+  }
+  Parse(*mapping, file_path);
+}
+
+TokenParser::TokenParser(const AutoMapping& contents, size_t concurrency)
+    : concurrency_(std::max<size_t>(concurrency, 1)) {
+  Parse(contents, "Tokens.xml");
+}
+
+void TokenParser::Parse(const AutoMapping& contents,
+                        const std::string& file_path) {
+  const auto begin = static_cast<const char*>(contents.Get());
+  const auto end = begin + contents.GetSize();
+  const auto max_chunks =
+      std::min(concurrency_, std::max<size_t>(1, (end - begin) /
+                                                     kMinimumChunkSize));
+  const auto boundaries =
+      max_chunks > 1 ? SplitTokens(begin, end, max_chunks)
+                     : std::vector<const char*>();
+
+  // Fall back to parsing the whole file as is.
+  if (boundaries.size() <= 2) {
+    auto document = std::make_unique<tinyxml2::XMLDocument>();
+    if (document->Parse(begin, end - begin) != tinyxml2::XML_SUCCESS) {
+      D2D_ERROR << "Could not parse XML file: " << file_path;
+      return;
+    }
+    xml_documents_.emplace_back(std::move(document));
+    is_valid_ = true;
+    return;
+  }
+
+  const auto chunk_count = boundaries.size() - 1;
+  xml_documents_.resize(chunk_count);
+  std::atomic<bool> failed(false);
+  ParallelFor(chunk_count, concurrency_, [&](size_t chunk) {
+    auto document = std::make_unique<tinyxml2::XMLDocument>();
+    if (!ParseTokenRange(boundaries[chunk], boundaries[chunk + 1],
+                         *document)) {
+      failed = true;
+      return;
+    }
+    xml_documents_[chunk] = std::move(document);
+  });
+
+  if (failed) {
     D2D_ERROR << "Could not parse XML file: " << file_path;
+    xml_documents_.clear();
     return;
   }
 
@@ -20,14 +157,9 @@ TokenParser::~TokenParser() = default;
 
 bool TokenParser::IsValid() const { return is_valid_; }
 
-std::vector<Token> TokenParser::ReadTokens() const {
-  if (!is_valid_) {
-    return {};
-  }
-
-  std::vector<Token> tokens;
-
-  if (auto xml_tokens = xml_document_.FirstChildElement("Tokens")) {
+static void ReadTokens(const tinyxml2::XMLDocument& document,
+                       std::vector<Token>& tokens) {
+  if (auto xml_tokens = document.FirstChildElement("Tokens")) {
     for (auto xml_token = xml_tokens->FirstChildElement("Token");
          xml_token != nullptr;
          xml_token = xml_token->NextSiblingElement("Token")) {
@@ -37,8 +169,83 @@ std::vector<Token> TokenParser::ReadTokens() const {
       }
     }
   }
+}
 
+std::vector<Token> TokenParser::ReadTokens() const {
+  if (!is_valid_) {
+    return {};
+  }
+
+  if (xml_documents_.size() == 1) {
+    std::vector<Token> tokens;
+    d2d::ReadTokens(*xml_documents_[0], tokens);
+    return tokens;
+  }
+
+  std::vector<std::vector<Token>> chunks(xml_documents_.size());
+  ParallelFor(chunks.size(), concurrency_, [&](size_t chunk) {
+    d2d::ReadTokens(*xml_documents_[chunk], chunks[chunk]);
+  });
+
+  size_t count = 0;
+  for (const auto& chunk : chunks) {
+    count += chunk.size();
+  }
+  std::vector<Token> tokens;
+  tokens.reserve(count);
+  for (auto& chunk : chunks) {
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(tokens));
+  }
   return tokens;
 }
 
+TokenStream::TokenStream(const std::string& file_path, size_t chunk_size)
+    : file_path_(file_path), mapping_(OpenFileReadOnly(file_path)) {
+  if (!mapping_) {
+    D2D_ERROR << "Could not read XML file: " << file_path;
+    return;
+  }
+
+  const auto begin = static_cast<const char*>(mapping_->Get());
+  const auto end = begin + mapping_->GetSize();
+  boundaries_ = SplitTokens(
+      begin, end,
+      std::max<size_t>(1, mapping_->GetSize() / std::max<size_t>(chunk_size, 1)));
+  if (boundaries_.empty()) {
+    // Let the parser report what is wrong with the file.
+    boundaries_ = {begin, end};
+    wrap_chunks_ = false;
+  }
+  is_valid_ = true;
+}
+
+TokenStream::~TokenStream() = default;
+
+bool TokenStream::IsValid() const { return is_valid_; }
+
+bool TokenStream::ReadChunk(std::vector<Token>& tokens) {
+  tokens.clear();
+  if (!is_valid_ || next_chunk_ + 1 >= boundaries_.size()) {
+    return false;
+  }
+
+  const auto begin = boundaries_[next_chunk_];
+  const auto end = boundaries_[next_chunk_ + 1];
+  next_chunk_++;
+
+  tinyxml2::XMLDocument document;
+  const auto parsed =
+      wrap_chunks_
+          ? ParseTokenRange(begin, end, document)
+          : document.Parse(begin, end - begin) == tinyxml2::XML_SUCCESS;
+  if (!parsed) {
+    D2D_ERROR << "Could not parse XML file: " << file_path_;
+    is_valid_ = false;
+    return false;
+  }
+
+  d2d::ReadTokens(document, tokens);
+  return true;
+}
+
 }  // namespace d2d
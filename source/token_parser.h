@@ -4,9 +4,11 @@
 #pragma once
 
 #include <tinyxml2.h>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "file.h"
 #include "macros.h"
 #include "token.h"
 
@@ -14,19 +16,71 @@ namespace d2d {
 
 class TokenParser {
  public:
-  TokenParser(const std::string& file_path);
+  // Large files are split into up to |concurrency| chunks at <Token>
+  // boundaries. The chunks are parsed on their own threads.
+  TokenParser(const std::string& file_path, size_t concurrency = 1);
+
+  // Parses the contents of a Tokens.xml that was already read, such as one
+  // from an archive.
+  TokenParser(const AutoMapping& contents, size_t concurrency = 1);
 
   ~TokenParser();
 
   bool IsValid() const;
 
+  // The tokens in document order, regardless of how the file was split.
   std::vector<Token> ReadTokens() const;
 
+  size_t GetChunkCount() const { return xml_documents_.size(); }
+
  private:
-  tinyxml2::XMLDocument xml_document_;
+  std::vector<std::unique_ptr<tinyxml2::XMLDocument>> xml_documents_;
+  size_t concurrency_ = 1;
   bool is_valid_ = false;
 
+  // |file_path| is only used in errors.
+  void Parse(const AutoMapping& contents, const std::string& file_path);
+
   D2D_DISALLOW_COPY_AND_ASSIGN(TokenParser);
 };
 
+// Reads the tokens of a Tokens.xml one chunk of about |chunk_size| bytes at a
+// time. Only the chunk being read is parsed into memory.
+class TokenStream {
+ public:
+  static constexpr size_t kDefaultChunkSize = 16u << 20;
+
+  TokenStream(const std::string& file_path,
+              size_t chunk_size = kDefaultChunkSize);
+
+  ~TokenStream();
+
+  bool IsValid() const;
+
+  // Replaces |tokens| with those of the next chunk, in document order.
+  // Returns false once all chunks have been read, or if a chunk could not be
+  // parsed, which also makes the stream invalid.
+  bool ReadChunk(std::vector<Token>& tokens);
+
+ private:
+  std::string file_path_;
+  std::unique_ptr<AutoMapping> mapping_;
+  // Chunk i is [boundaries_[i], boundaries_[i + 1]).
+  std::vector<const char*> boundaries_;
+  // Whether the chunks are ranges of <Token> elements that need a root, or
+  // the whole file.
+  bool wrap_chunks_ = true;
+  size_t next_chunk_ = 0;
+  bool is_valid_ = false;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(TokenStream);
+};
+
+// Splits the contents of a Tokens.xml into at most |max_chunks| byte ranges
+// that each hold whole <Token> elements. Returns the start of every chunk and
+// the end of the last one. Returns no ranges if the root element cannot be
+// found.
+std::vector<const char*> SplitTokens(const char* begin, const char* end,
+                                     size_t max_chunks);
+
 }  // namespace d2d
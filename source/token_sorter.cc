@@ -0,0 +1,349 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "token_sorter.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "file.h"
+#include "logger.h"
+
+namespace d2d {
+
+static constexpr size_t kSpillBufferSize = 256u << 10;
+
+// Runs are sequences of records. A record is the path, name, type code, scope
+// and anchor of a token, each as a 32-bit length followed by the bytes.
+static constexpr size_t kSpillFieldCount = 5;
+
+class SpillWriter {
+ public:
+  explicit SpillWriter(const std::string& path)
+      : path_(path),
+        fd_(D2D_TEMP_FAILURE_RETRY(
+            ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR))) {
+    if (!fd_.IsValid()) {
+      D2D_ERROR << "Could not create the spill file " << path;
+    }
+    buffer_.reserve(kSpillBufferSize);
+  }
+
+  bool IsValid() const { return fd_.IsValid(); }
+
+  bool Write(const Token& token) {
+    for (const auto field : {&token.GetPath(), &token.GetName(),
+                             &token.GetType(), &token.GetScope(),
+                             &token.GetAnchor()}) {
+      const auto length = static_cast<uint32_t>(field->size());
+      buffer_.append(reinterpret_cast<const char*>(&length), sizeof(length));
+      buffer_.append(*field);
+    }
+    return buffer_.size() < kSpillBufferSize || Flush();
+  }
+
+  bool Flush() {
+    size_t written = 0;
+    while (written < buffer_.size()) {
+      const auto result = D2D_TEMP_FAILURE_RETRY(::write(
+          fd_.Get(), buffer_.data() + written, buffer_.size() - written));
+      if (result <= 0) {
+        D2D_ERROR << "Could not write to the spill file " << path_ << ": "
+                  << strerror(errno);
+        return false;
+      }
+      written += result;
+    }
+    buffer_.clear();
+    return true;
+  }
+
+ private:
+  const std::string path_;
+  AutoFD fd_;
+  std::string buffer_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(SpillWriter);
+};
+
+class SpillReader {
+ public:
+  explicit SpillReader(const std::string& path)
+      : path_(path),
+        fd_(D2D_TEMP_FAILURE_RETRY(
+            ::open(path.c_str(), O_RDONLY | O_CLOEXEC))),
+        buffer_(kSpillBufferSize) {
+    if (!fd_.IsValid()) {
+      D2D_ERROR << "Could not open the spill file " << path;
+      has_error_ = true;
+    }
+  }
+
+  // Returns false at the end of the run or on error.
+  bool Read(Token& token) {
+    if (has_error_ || !Fill()) {
+      return false;
+    }
+    std::string fields[kSpillFieldCount];
+    for (auto& field : fields) {
+      uint32_t length = 0;
+      if (!ReadBytes(&length, sizeof(length))) {
+        return false;
+      }
+      field.resize(length);
+      if (!ReadBytes(&field[0], length)) {
+        return false;
+      }
+    }
+    token = Token(std::move(fields[1]), std::move(fields[2]),
+                  std::move(fields[3]), std::move(fields[0]),
+                  std::move(fields[4]));
+    return true;
+  }
+
+  bool HasError() const { return has_error_; }
+
+ private:
+  const std::string path_;
+  AutoFD fd_;
+  std::vector<char> buffer_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  bool has_error_ = false;
+
+  // Whether at least one more byte could be buffered.
+  bool Fill() {
+    if (begin_ < end_) {
+      return true;
+    }
+    const auto result = D2D_TEMP_FAILURE_RETRY(
+        ::read(fd_.Get(), buffer_.data(), buffer_.size()));
+    if (result < 0) {
+      D2D_ERROR << "Could not read the spill file " << path_ << ": "
+                << strerror(errno);
+      has_error_ = true;
+      return false;
+    }
+    begin_ = 0;
+    end_ = result;
+    return result > 0;
+  }
+
+  // Records are never cut short. Running out of bytes in one is an error.
+  bool ReadBytes(void* data, size_t length) {
+    auto out = static_cast<char*>(data);
+    while (length > 0) {
+      if (!Fill()) {
+        if (!has_error_) {
+          D2D_ERROR << "The spill file " << path_ << " is truncated.";
+          has_error_ = true;
+        }
+        return false;
+      }
+      const auto available = std::min(length, end_ - begin_);
+      ::memcpy(out, buffer_.data() + begin_, available);
+      begin_ += available;
+      out += available;
+      length -= available;
+    }
+    return true;
+  }
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(SpillReader);
+};
+
+// Merges sorted runs. Ties between runs go to the run that comes first, so
+// tokens of a page keep the order of the runs.
+class RunMerger {
+ public:
+  explicit RunMerger(const std::vector<std::string>& runs) {
+    for (const auto& run : runs) {
+      cursors_.emplace_back(new Cursor(run));
+    }
+    for (size_t i = 0; i < cursors_.size(); i++) {
+      Advance(i);
+    }
+  }
+
+  // The smallest token left, or nullptr once all runs are exhausted.
+  const Token* Peek() const {
+    return heap_.empty() ? nullptr : &cursors_[heap_.front()]->token;
+  }
+
+  bool Pop(Token& token) {
+    if (heap_.empty()) {
+      return false;
+    }
+    const auto later = [this](size_t a, size_t b) { return IsLater(a, b); };
+    std::pop_heap(heap_.begin(), heap_.end(), later);
+    const auto cursor = heap_.back();
+    heap_.pop_back();
+    token = std::move(cursors_[cursor]->token);
+    Advance(cursor);
+    return true;
+  }
+
+  bool HasError() const {
+    for (const auto& cursor : cursors_) {
+      if (cursor->reader.HasError()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Cursor {
+    explicit Cursor(const std::string& path) : reader(path) {}
+
+    SpillReader reader;
+    Token token;
+  };
+
+  std::vector<std::unique_ptr<Cursor>> cursors_;
+  // A min-heap of the cursors that hold a token.
+  std::vector<size_t> heap_;
+
+  bool IsLater(size_t a, size_t b) const {
+    const auto comparison =
+        cursors_[a]->token.GetPath().compare(cursors_[b]->token.GetPath());
+    return comparison != 0 ? comparison > 0 : a > b;
+  }
+
+  void Advance(size_t cursor) {
+    if (cursors_[cursor]->reader.Read(cursors_[cursor]->token)) {
+      heap_.push_back(cursor);
+      std::push_heap(heap_.begin(), heap_.end(),
+                     [this](size_t a, size_t b) { return IsLater(a, b); });
+    }
+  }
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(RunMerger);
+};
+
+TokenSorter::TokenSorter(const std::string& directory) {
+  std::string path_template = JoinPaths({directory, ".d2d-sort-XXXXXX"});
+  if (::mkdtemp(&path_template[0]) == nullptr) {
+    D2D_ERROR << "Could not create a spill directory in " << directory << ": "
+              << strerror(errno);
+    return;
+  }
+  directory_ = path_template;
+  is_valid_ = true;
+}
+
+TokenSorter::~TokenSorter() {
+  merger_.reset();
+  for (const auto& run : runs_) {
+    ::unlink(run.c_str());
+  }
+  if (!directory_.empty()) {
+    ::rmdir(directory_.c_str());
+  }
+}
+
+bool TokenSorter::IsValid() const { return is_valid_; }
+
+std::string TokenSorter::MakeRunPath() {
+  return JoinPaths({directory_, "run" + std::to_string(next_run_id_++)});
+}
+
+bool TokenSorter::AddBatch(std::vector<Token> tokens) {
+  if (!is_valid_ || merger_) {
+    return false;
+  }
+  if (tokens.empty()) {
+    return true;
+  }
+
+  std::stable_sort(tokens.begin(), tokens.end(),
+                   [](const Token& lhs, const Token& rhs) {
+                     return lhs.GetPath() < rhs.GetPath();
+                   });
+
+  runs_.push_back(MakeRunPath());
+  SpillWriter writer(runs_.back());
+  if (!writer.IsValid()) {
+    return false;
+  }
+  for (const auto& token : tokens) {
+    if (!writer.Write(token)) {
+      return false;
+    }
+  }
+  return writer.Flush();
+}
+
+bool TokenSorter::Finish() {
+  if (!is_valid_ || merger_) {
+    return false;
+  }
+
+  // Merge neighbouring runs so that run order, and with it the order of the
+  // tokens of a page, is kept.
+  while (runs_.size() > kMaxMergeWidth) {
+    std::vector<std::string> merged_runs;
+    // Keeps track of every file for the destructor to remove.
+    auto fail = [this, &merged_runs]() {
+      runs_.insert(runs_.end(), merged_runs.begin(), merged_runs.end());
+      return false;
+    };
+    for (size_t first = 0; first < runs_.size(); first += kMaxMergeWidth) {
+      const auto last = std::min(first + kMaxMergeWidth, runs_.size());
+      if (last - first == 1) {
+        merged_runs.push_back(runs_[first]);
+        continue;
+      }
+
+      const std::vector<std::string> group(runs_.begin() + first,
+                                           runs_.begin() + last);
+      merged_runs.push_back(MakeRunPath());
+      SpillWriter writer(merged_runs.back());
+      RunMerger merger(group);
+      Token token;
+      while (merger.Pop(token)) {
+        if (!writer.Write(token)) {
+          return fail();
+        }
+      }
+      if (merger.HasError() || !writer.Flush()) {
+        return fail();
+      }
+      for (const auto& run : group) {
+        ::unlink(run.c_str());
+      }
+    }
+    runs_ = std::move(merged_runs);
+  }
+
+  merger_.reset(new RunMerger(runs_));
+  return !merger_->HasError();
+}
+
+bool TokenSorter::ReadPage(const std::string& path,
+                           std::vector<Token>& tokens) {
+  tokens.clear();
+  if (!merger_) {
+    return false;
+  }
+
+  while (auto next = merger_->Peek()) {
+    const auto comparison = next->GetPath().compare(path);
+    if (comparison > 0) {
+      break;
+    }
+    Token token;
+    merger_->Pop(token);
+    if (comparison == 0) {
+      tokens.emplace_back(std::move(token));
+    }
+  }
+  return !merger_->HasError();
+}
+
+}  // namespace d2d
@@ -0,0 +1,61 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+#include "token.h"
+
+namespace d2d {
+
+class RunMerger;
+
+// Sorts tokens by page without holding all of them in memory. Each batch of
+// tokens is sorted and spilled to a run file. The runs are merged as pages
+// are read back, in path order. Tokens of a page stay in the order they were
+// added.
+class TokenSorter {
+ public:
+  // The most runs merged at once. More runs are merged in several passes.
+  static constexpr size_t kMaxMergeWidth = 64;
+
+  // Spill files are kept in a new directory inside |directory|, which should
+  // be on disk rather than in memory. It is removed with the sorter.
+  explicit TokenSorter(const std::string& directory);
+
+  ~TokenSorter();
+
+  bool IsValid() const;
+
+  bool AddBatch(std::vector<Token> tokens);
+
+  // Must be called once, after the last batch and before reading pages.
+  bool Finish();
+
+  // Replaces |tokens| with those of the page at |path|. Pages must be read in
+  // increasing path order. The tokens of pages that are never read are
+  // skipped.
+  bool ReadPage(const std::string& path, std::vector<Token>& tokens);
+
+  size_t GetRunCount() const { return runs_.size(); }
+
+ private:
+  std::string directory_;
+  // In the order the batches were added.
+  std::vector<std::string> runs_;
+  size_t next_run_id_ = 0;
+  std::unique_ptr<RunMerger> merger_;
+  bool is_valid_ = false;
+
+  std::string MakeRunPath();
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(TokenSorter);
+};
+
+}  // namespace d2d
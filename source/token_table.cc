@@ -0,0 +1,376 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "token_table.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace d2d {
+
+StringColumn::StringColumn() { offsets_.PushBack(0); }
+
+StringColumn::StringColumn(StringColumn&&) = default;
+
+StringColumn& StringColumn::operator=(StringColumn&&) = default;
+
+StringColumn::~StringColumn() = default;
+
+StringColumn StringColumn::Borrow(const char* blob, size_t blob_size,
+                                  const uint64_t* offsets, size_t row_count) {
+  StringColumn column;
+  column.blob_ = Column<char>::Borrow(blob, blob_size);
+  column.offsets_ = Column<uint64_t>::Borrow(offsets, row_count + 1);
+  return column;
+}
+
+StringColumn& StringColumn::Write(const char* data, size_t length) {
+  blob_.Append(data, length);
+  return *this;
+}
+
+StringColumn& StringColumn::Write(const std::string& string) {
+  return Write(string.data(), string.size());
+}
+
+void StringColumn::EndRow() {
+  blob_.PushBack('\0');
+  offsets_.PushBack(blob_.size());
+}
+
+void StringColumn::Reserve(size_t rows, size_t bytes) {
+  offsets_.Reserve(rows + 1);
+  blob_.Reserve(bytes);
+}
+
+TokenTable::TokenTable() = default;
+
+TokenTable::TokenTable(TokenTable&&) = default;
+
+TokenTable& TokenTable::operator=(TokenTable&&) = default;
+
+TokenTable::~TokenTable() = default;
+
+TokenTable::TokenTable(const std::vector<Token>& tokens) {
+  size_t name_bytes = 0;
+  size_t scope_bytes = 0;
+  size_t path_bytes = 0;
+  size_t anchor_bytes = 0;
+  for (const auto& token : tokens) {
+    name_bytes += token.GetName().size() + 1;
+    scope_bytes += token.GetScope().size() + 1;
+    path_bytes += token.GetPath().size() + 1;
+    anchor_bytes += token.GetAnchor().size() + 2;
+  }
+
+  const auto rows = tokens.size();
+  index_names_.Reserve(rows, name_bytes);
+  types_.Reserve(rows);
+  scopes_.Reserve(rows, scope_bytes);
+  paths_.Reserve(rows, path_bytes);
+  anchors_.Reserve(rows, anchor_bytes);
+  index_paths_.Reserve(rows, path_bytes + anchor_bytes);
+  dash_anchors_.Reserve(rows, name_bytes + rows * 64);
+
+  for (const auto& token : tokens) {
+    // Get rid of the namespace in the name.
+    const auto& name = token.GetName();
+    auto found = name.find_last_of("::");
+    auto index_name = name.data();
+    auto index_name_length = name.size();
+    if (found != std::string::npos) {
+      index_name += found + 1;
+      index_name_length -= found + 1;
+    }
+
+    const auto type = token.GetTokenType();
+    const auto index_type = GetTokenTypeIndexName(type);
+
+    index_names_.Write(index_name, index_name_length).EndRow();
+    types_.PushBack(type);
+    scopes_.Write(token.GetScope()).EndRow();
+    paths_.Write(token.GetPath()).EndRow();
+    anchors_.Write("#", 1).Write(token.GetAnchor()).EndRow();
+    index_paths_.Write(token.GetPath())
+        .Write("#", 1)
+        .Write(token.GetAnchor())
+        .EndRow();
+
+    const char kPrefix[] = "<a name=\"//apple_ref/cpp/";
+    const char kSuffix[] = "\" class=\"dashAnchor\">&nbsp;</a>";
+    dash_anchors_.Write(kPrefix, sizeof(kPrefix) - 1)
+        .Write(index_type, ::strlen(index_type))
+        .Write("/", 1)
+        .Write(index_name, index_name_length)
+        .Write(kSuffix, sizeof(kSuffix) - 1)
+        .EndRow();
+  }
+
+  GroupRowsByFile();
+}
+
+void TokenTable::GroupRowsByFile() {
+  const auto rows = GetSize();
+  std::vector<uint32_t> file_rows(rows);
+  for (size_t row = 0; row < rows; row++) {
+    file_rows[row] = static_cast<uint32_t>(row);
+  }
+
+  std::stable_sort(file_rows.begin(), file_rows.end(),
+                   [this](uint32_t lhs, uint32_t rhs) {
+                     return ::strcmp(paths_.Get(lhs), paths_.Get(rhs)) < 0;
+                   });
+
+  files_ = StringColumn();
+  std::vector<uint32_t> file_offsets;
+  for (size_t i = 0; i < rows; i++) {
+    const auto path = paths_.Get(file_rows[i]);
+    if (i == 0 || ::strcmp(path, paths_.Get(file_rows[i - 1])) != 0) {
+      files_.Write(path, paths_.GetLength(file_rows[i])).EndRow();
+      file_offsets.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  file_offsets.push_back(static_cast<uint32_t>(rows));
+
+  file_rows_.Assign(std::move(file_rows));
+  file_offsets_.Assign(std::move(file_offsets));
+}
+
+TokenTable::RowRange TokenTable::GetRowsForFile(const char* path) const {
+  size_t low = 0;
+  size_t high = files_.GetRowCount();
+  while (low < high) {
+    const auto middle = low + (high - low) / 2;
+    const auto comparison = ::strcmp(files_.Get(middle), path);
+    if (comparison == 0) {
+      RowRange range;
+      range.first = file_rows_.data() + file_offsets_[middle];
+      range.last = file_rows_.data() + file_offsets_[middle + 1];
+      return range;
+    }
+    if (comparison < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return {};
+}
+
+// The cache file is a header followed by one section per column. Sections
+// start at multiples of eight bytes so that the columns can be used in place
+// once mapped. Values are in host byte order.
+
+static constexpr char kCacheMagic[8] = {'D', '2', 'D', 'T', 'O', 'K', 'N', 'S'};
+// Bump whenever the layout or a derived column changes.
+static constexpr uint32_t kCacheVersion = 1;
+static constexpr uint32_t kCacheByteOrder = 0x01020304;
+
+// Each string column is stored as a blob section followed by an offsets
+// section. They are followed by the types, the file offsets and the file rows.
+static constexpr size_t kCacheStringColumnCount = 7;
+static constexpr size_t kCacheSectionCount = kCacheStringColumnCount * 2 + 3;
+
+struct CacheSection {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t key;
+  uint64_t row_count;
+  uint64_t file_count;
+  CacheSection sections[kCacheSectionCount];
+};
+
+static size_t AlignCacheOffset(size_t offset) { return (offset + 7) & ~7ull; }
+
+bool TokenTable::Save(const std::string& path, uint64_t key) const {
+  const StringColumn* strings[kCacheStringColumnCount] = {
+      &index_names_, &scopes_,       &paths_, &anchors_,
+      &index_paths_, &dash_anchors_, &files_,
+  };
+
+  std::vector<DataSpan> contents;
+  for (const auto string : strings) {
+    contents.push_back({string->GetBlob().data(), string->GetBlob().size()});
+    contents.push_back({string->GetOffsets().data(),
+                        string->GetOffsets().size() * sizeof(uint64_t)});
+  }
+  contents.push_back({types_.data(), types_.size() * sizeof(TokenType)});
+  contents.push_back(
+      {file_offsets_.data(), file_offsets_.size() * sizeof(uint32_t)});
+  contents.push_back({file_rows_.data(), file_rows_.size() * sizeof(uint32_t)});
+
+  CacheHeader header = {};
+  ::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.version = kCacheVersion;
+  header.byte_order = kCacheByteOrder;
+  header.key = key;
+  header.row_count = GetSize();
+  header.file_count = GetFileCount();
+
+  static const char kPadding[8] = {};
+  std::vector<DataSpan> spans = {{&header, sizeof(header)}};
+  size_t offset = sizeof(header);
+  for (size_t i = 0; i < kCacheSectionCount; i++) {
+    const auto aligned = AlignCacheOffset(offset);
+    spans.push_back({kPadding, aligned - offset});
+    header.sections[i].offset = aligned;
+    header.sections[i].size = contents[i].length;
+    spans.push_back(contents[i]);
+    offset = aligned + contents[i].length;
+  }
+
+  // Written aside and renamed so that concurrent runs never see a partial
+  // cache.
+  const auto temporary_path = path + ".tmp";
+  if (!CopyData(spans, temporary_path)) {
+    return false;
+  }
+  if (::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    D2D_ERROR << "Could not move the token cache to " << path;
+    ::unlink(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Rows must be NUL-terminated and lie back to back within the blob.
+static bool IsValidStringColumn(const StringColumn& column) {
+  const auto& blob = column.GetBlob();
+  const auto& offsets = column.GetOffsets();
+  if (offsets.empty() || offsets[0] != 0 ||
+      offsets[offsets.size() - 1] != blob.size()) {
+    return false;
+  }
+  for (size_t row = 0; row < column.GetRowCount(); row++) {
+    if (offsets[row + 1] <= offsets[row] ||
+        blob[offsets[row + 1] - 1] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TokenTable::Load(const std::string& path, uint64_t key) {
+  struct stat stat_buf = {};
+  if (::stat(path.c_str(), &stat_buf) != 0) {
+    return false;
+  }
+
+  auto mapping = OpenFileReadOnly(path);
+  if (!mapping) {
+    return false;
+  }
+
+  const auto base = static_cast<const uint8_t*>(mapping->Get());
+  const auto size = mapping->GetSize();
+  CacheHeader header = {};
+  if (size < sizeof(header)) {
+    D2D_VERBOSE << "Token cache " << path << " is truncated.";
+    return false;
+  }
+  ::memcpy(&header, base, sizeof(header));
+  if (::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header.version != kCacheVersion ||
+      header.byte_order != kCacheByteOrder) {
+    D2D_VERBOSE << "Token cache " << path << " is from a different version.";
+    return false;
+  }
+  if (header.key != key) {
+    D2D_VERBOSE << "Token cache " << path << " is stale.";
+    return false;
+  }
+
+  const auto rows = header.row_count;
+  const auto files = header.file_count;
+  for (const auto& section : header.sections) {
+    if (section.offset % 8 != 0 || section.offset > size ||
+        section.size > size - section.offset) {
+      D2D_VERBOSE << "Token cache " << path << " is corrupt.";
+      return false;
+    }
+  }
+  auto section_data = [&](size_t index) {
+    return base + header.sections[index].offset;
+  };
+  auto section_count = [&](size_t index, size_t value_size) {
+    return header.sections[index].size / value_size;
+  };
+
+  TokenTable table;
+  StringColumn* strings[kCacheStringColumnCount] = {
+      &table.index_names_, &table.scopes_,       &table.paths_,
+      &table.anchors_,     &table.index_paths_,  &table.dash_anchors_,
+      &table.files_,
+  };
+  for (size_t i = 0; i < kCacheStringColumnCount; i++) {
+    const auto blob = 2 * i;
+    const auto offsets = 2 * i + 1;
+    const auto expected_rows = strings[i] == &table.files_ ? files : rows;
+    if (header.sections[offsets].size !=
+        (expected_rows + 1) * sizeof(uint64_t)) {
+      D2D_VERBOSE << "Token cache " << path << " is corrupt.";
+      return false;
+    }
+    *strings[i] = StringColumn::Borrow(
+        reinterpret_cast<const char*>(section_data(blob)),
+        header.sections[blob].size,
+        reinterpret_cast<const uint64_t*>(section_data(offsets)),
+        expected_rows);
+    if (!IsValidStringColumn(*strings[i])) {
+      D2D_VERBOSE << "Token cache " << path << " is corrupt.";
+      return false;
+    }
+  }
+
+  const auto types = kCacheStringColumnCount * 2;
+  const auto file_offsets = types + 1;
+  const auto file_rows = types + 2;
+  if (section_count(types, sizeof(TokenType)) != rows ||
+      header.sections[types].size % sizeof(TokenType) != 0 ||
+      section_count(file_offsets, sizeof(uint32_t)) != files + 1 ||
+      header.sections[file_offsets].size % sizeof(uint32_t) != 0 ||
+      section_count(file_rows, sizeof(uint32_t)) != rows ||
+      header.sections[file_rows].size % sizeof(uint32_t) != 0) {
+    D2D_VERBOSE << "Token cache " << path << " is corrupt.";
+    return false;
+  }
+  table.types_ = Column<TokenType>::Borrow(
+      reinterpret_cast<const TokenType*>(section_data(types)), rows);
+  table.file_offsets_ = Column<uint32_t>::Borrow(
+      reinterpret_cast<const uint32_t*>(section_data(file_offsets)),
+      files + 1);
+  table.file_rows_ = Column<uint32_t>::Borrow(
+      reinterpret_cast<const uint32_t*>(section_data(file_rows)), rows);
+
+  bool valid = table.file_offsets_[0] == 0 && table.file_offsets_[files] == rows;
+  for (size_t i = 0; valid && i < files; i++) {
+    valid = table.file_offsets_[i] <= table.file_offsets_[i + 1];
+  }
+  for (size_t row = 0; valid && row < rows; row++) {
+    // kTemplate is the last token type.
+    valid = table.types_[row] <= TokenType::kTemplate &&
+            table.file_rows_[row] < rows;
+  }
+  if (!valid) {
+    D2D_VERBOSE << "Token cache " << path << " is corrupt.";
+    return false;
+  }
+
+  table.mapping_ = std::move(mapping);
+  *this = std::move(table);
+  return true;
+}
+
+}  // namespace d2d
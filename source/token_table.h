@@ -0,0 +1,223 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file.h"
+#include "macros.h"
+#include "token.h"
+
+namespace d2d {
+
+// A column of fixed-width values. The values are either owned or borrowed
+// from memory kept alive by the owner of the column (such as a mapped cache
+// file).
+template <class T>
+class Column {
+ public:
+  Column() = default;
+
+  Column(Column&& other) { *this = std::move(other); }
+
+  Column& operator=(Column&& other) {
+    owned_ = std::move(other.owned_);
+    data_ = other.data_;
+    size_ = other.size_;
+    other.owned_.clear();
+    other.data_ = nullptr;
+    other.size_ = 0;
+    return *this;
+  }
+
+  static Column Borrow(const T* data, size_t size) {
+    Column column;
+    column.data_ = data;
+    column.size_ = size;
+    return column;
+  }
+
+  void Assign(std::vector<T> values) {
+    owned_ = std::move(values);
+    Update();
+  }
+
+  void PushBack(T value) {
+    owned_.push_back(value);
+    Update();
+  }
+
+  void Append(const T* values, size_t count) {
+    owned_.insert(owned_.end(), values, values + count);
+    Update();
+  }
+
+  void Reserve(size_t size) { owned_.reserve(size); }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  const T* data() const { return data_; }
+
+  const T& operator[](size_t index) const { return data_[index]; }
+
+ private:
+  std::vector<T> owned_;
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+
+  void Update() {
+    data_ = owned_.data();
+    size_ = owned_.size();
+  }
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(Column);
+};
+
+// A column of NUL-terminated strings packed back to back into one buffer.
+class StringColumn {
+ public:
+  StringColumn();
+
+  StringColumn(StringColumn&&);
+
+  StringColumn& operator=(StringColumn&&);
+
+  ~StringColumn();
+
+  // Uses |row_count| + 1 offsets into |blob| without copying either.
+  static StringColumn Borrow(const char* blob, size_t blob_size,
+                             const uint64_t* offsets, size_t row_count);
+
+  // Appends to the row being built. The row is closed by |EndRow|.
+  StringColumn& Write(const char* data, size_t length);
+
+  StringColumn& Write(const std::string& string);
+
+  void EndRow();
+
+  void Reserve(size_t rows, size_t bytes);
+
+  size_t GetRowCount() const {
+    return offsets_.empty() ? 0 : offsets_.size() - 1;
+  }
+
+  const char* Get(size_t row) const { return blob_.data() + offsets_[row]; }
+
+  size_t GetLength(size_t row) const {
+    return offsets_[row + 1] - offsets_[row] - 1;
+  }
+
+  const Column<char>& GetBlob() const { return blob_; }
+
+  const Column<uint64_t>& GetOffsets() const { return offsets_; }
+
+ private:
+  Column<char> blob_;
+  Column<uint64_t> offsets_;
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(StringColumn);
+};
+
+// A structure-of-arrays view of the tokens read from Tokens.xml. Every field
+// derived from a token (index name, type, index path and the dashAnchor
+// snippet injected into pages) is computed once when the table is built.
+// Rows are in document order. Rows are also grouped by the page they live in.
+class TokenTable {
+ public:
+  struct RowRange {
+    const uint32_t* first = nullptr;
+    const uint32_t* last = nullptr;
+
+    const uint32_t* begin() const { return first; }
+
+    const uint32_t* end() const { return last; }
+
+    size_t size() const { return last - first; }
+
+    bool empty() const { return first == last; }
+  };
+
+  TokenTable();
+
+  explicit TokenTable(const std::vector<Token>& tokens);
+
+  TokenTable(TokenTable&&);
+
+  TokenTable& operator=(TokenTable&&);
+
+  ~TokenTable();
+
+  size_t GetSize() const { return types_.size(); }
+
+  // The name without its namespace.
+  const StringColumn& GetIndexNames() const { return index_names_; }
+
+  TokenType GetTokenType(size_t row) const { return types_[row]; }
+
+  const char* GetIndexType(size_t row) const {
+    return GetTokenTypeIndexName(types_[row]);
+  }
+
+  const StringColumn& GetScopes() const { return scopes_; }
+
+  // The page the token is documented in, relative to the Doxygen output.
+  const StringColumn& GetPaths() const { return paths_; }
+
+  // "#" followed by the anchor.
+  const StringColumn& GetAnchors() const { return anchors_; }
+
+  // The page followed by "#" and the anchor.
+  const StringColumn& GetIndexPaths() const { return index_paths_; }
+
+  // The HTML snippet injected in front of links to the token.
+  const StringColumn& GetDashAnchors() const { return dash_anchors_; }
+
+  size_t GetFileCount() const { return files_.GetRowCount(); }
+
+  // The rows of tokens documented in the given page, in document order.
+  RowRange GetRowsForFile(const char* path) const;
+
+  RowRange GetRowsForFile(const std::string& path) const {
+    return GetRowsForFile(path.c_str());
+  }
+
+  // Writes the table to a versioned binary file tagged with |key|, usually
+  // the hash of the Tokens.xml it was read from.
+  bool Save(const std::string& path, uint64_t key) const;
+
+  // Replaces the contents of the table with those saved at |path|. Fails
+  // without logging if there is no such file, it was saved by a different
+  // version or it was not saved with |key|. The file is mapped and its
+  // columns are used in place.
+  bool Load(const std::string& path, uint64_t key);
+
+ private:
+  std::unique_ptr<AutoMapping> mapping_;
+  StringColumn index_names_;
+  Column<TokenType> types_;
+  StringColumn scopes_;
+  StringColumn paths_;
+  StringColumn anchors_;
+  StringColumn index_paths_;
+  StringColumn dash_anchors_;
+
+  // Distinct pages sorted by name. The rows of page i are
+  // file_rows_[file_offsets_[i]] to file_rows_[file_offsets_[i + 1]].
+  StringColumn files_;
+  Column<uint32_t> file_offsets_;
+  Column<uint32_t> file_rows_;
+
+  void GroupRowsByFile();
+
+  D2D_DISALLOW_COPY_AND_ASSIGN(TokenTable);
+};
+
+}  // namespace d2d
@@ -0,0 +1,253 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#include "verifier.h"
+
+#include <sqlite3.h>
+#include <string.h>
+
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "file.h"
+#include "logger.h"
+#include "parallel.h"
+#include "scan.h"
+
+namespace d2d {
+
+static constexpr char kDashAnchorPrefix[] = "//apple_ref/cpp/";
+
+namespace {
+
+struct IndexRow {
+  std::string anchor;
+  // "Type/Name", as written in the dashAnchor for the row.
+  std::string reference;
+};
+
+struct Page {
+  std::string path;
+  std::vector<IndexRow> rows;
+  bool exists = false;
+};
+
+struct PageResult {
+  size_t dash_anchors = 0;
+  size_t missing_pages = 0;
+  size_t missing_anchors = 0;
+  size_t unmatched_dash_anchors = 0;
+  std::vector<std::string> problems;
+
+  void AddProblem(std::string problem) {
+    if (problems.size() < VerifyReport::kMaxDescribedProblems) {
+      problems.emplace_back(std::move(problem));
+    }
+  }
+};
+
+}  // namespace
+
+static bool ReadIndex(const std::string& index_path,
+                      std::unordered_map<std::string, size_t>& page_ids,
+                      std::vector<Page>& pages, size_t& row_count) {
+  sqlite3* database = nullptr;
+  if (sqlite3_open_v2(index_path.c_str(), &database, SQLITE_OPEN_READONLY,
+                      nullptr) != SQLITE_OK) {
+    D2D_ERROR << "Could not open the docset index " << index_path;
+    sqlite3_close(database);
+    return false;
+  }
+
+  sqlite3_stmt* statement = nullptr;
+  if (sqlite3_prepare_v2(database,
+                         "SELECT name, type, path FROM searchIndex;", -1,
+                         &statement, nullptr) != SQLITE_OK) {
+    D2D_ERROR << "Could not read the docset index: "
+              << sqlite3_errmsg(database);
+    sqlite3_close(database);
+    return false;
+  }
+
+  int result = SQLITE_OK;
+  while ((result = sqlite3_step(statement)) == SQLITE_ROW) {
+    auto text = [statement](int column) {
+      auto value = sqlite3_column_text(statement, column);
+      return value != nullptr ? reinterpret_cast<const char*>(value) : "";
+    };
+    const std::string path = text(2);
+    const auto hash = path.find('#');
+    const auto page_path = path.substr(0, hash);
+
+    auto found = page_ids.find(page_path);
+    if (found == page_ids.end()) {
+      found = page_ids.emplace(page_path, pages.size()).first;
+      pages.emplace_back();
+      pages.back().path = page_path;
+    }
+
+    IndexRow row;
+    if (hash != std::string::npos) {
+      row.anchor = path.substr(hash + 1);
+    }
+    row.reference = std::string(text(1)) + "/" + text(0);
+    pages[found->second].rows.emplace_back(std::move(row));
+    row_count++;
+  }
+
+  const auto success = result == SQLITE_DONE;
+  if (!success) {
+    D2D_ERROR << "Could not read the docset index: "
+              << sqlite3_errmsg(database);
+  }
+  sqlite3_finalize(statement);
+  sqlite3_close(database);
+  return success;
+}
+
+static bool IsAttributeStart(const char* begin, const char* attribute) {
+  if (attribute == begin) {
+    return false;
+  }
+  const auto previous = attribute[-1];
+  return previous == ' ' || previous == '\t' || previous == '\r' ||
+         previous == '\n';
+}
+
+// Collects the values of the id and name attributes in the page. Names of
+// dashAnchors are collected separately, without their prefix.
+static void ScanAnchors(const char* begin, const char* end,
+                        std::unordered_set<std::string>& anchors,
+                        std::vector<std::string>& dash_anchors) {
+  static const char kId[] = "id=\"";
+  static const char kName[] = "name=\"";
+  const size_t prefix_length = sizeof(kDashAnchorPrefix) - 1;
+
+  for (const auto attribute : {kId, kName}) {
+    const auto length = ::strlen(attribute);
+    for (auto found = ScanFind(begin, end, attribute, length); found != end;
+         found = ScanFind(found + length, end, attribute, length)) {
+      if (!IsAttributeStart(begin, found)) {
+        continue;
+      }
+      const auto value = found + length;
+      const auto value_end =
+          static_cast<const char*>(::memchr(value, '"', end - value));
+      if (value_end == nullptr) {
+        break;
+      }
+      const auto value_length = static_cast<size_t>(value_end - value);
+      if (attribute == kName && value_length > prefix_length &&
+          ::memcmp(value, kDashAnchorPrefix, prefix_length) == 0) {
+        dash_anchors.emplace_back(value + prefix_length,
+                                  value_length - prefix_length);
+      } else {
+        anchors.emplace(value, value_length);
+      }
+    }
+  }
+}
+
+static void VerifyPage(const std::string& documents, const Page& page,
+                       PageResult& result) {
+  if (!page.exists) {
+    result.missing_pages += page.rows.size();
+    result.AddProblem("Missing page " + page.path + " referenced by " +
+                      std::to_string(page.rows.size()) + " index rows.");
+    return;
+  }
+
+  auto mapping = OpenFileReadOnly(JoinPaths({documents, page.path}));
+  if (!mapping) {
+    result.missing_pages += page.rows.size();
+    result.AddProblem("Could not read page " + page.path + ".");
+    return;
+  }
+
+  const auto begin = static_cast<const char*>(mapping->Get());
+  std::unordered_set<std::string> anchors;
+  std::vector<std::string> dash_anchors;
+  ScanAnchors(begin, begin + mapping->GetSize(), anchors, dash_anchors);
+
+  std::unordered_set<std::string> references;
+  for (const auto& row : page.rows) {
+    references.insert(row.reference);
+    if (!row.anchor.empty() && anchors.count(row.anchor) == 0) {
+      result.missing_anchors++;
+      result.AddProblem("Missing anchor " + page.path + "#" + row.anchor +
+                        " for " + row.reference + ".");
+    }
+  }
+
+  result.dash_anchors += dash_anchors.size();
+  for (const auto& dash_anchor : dash_anchors) {
+    if (references.count(dash_anchor) == 0) {
+      result.unmatched_dash_anchors++;
+      result.AddProblem("Unmatched dashAnchor " + dash_anchor + " in " +
+                        page.path + ".");
+    }
+  }
+}
+
+bool VerifyDocset(const std::string& docset_path, size_t concurrency,
+                  VerifyReport& report) {
+  const auto start = std::chrono::steady_clock::now();
+  report = VerifyReport();
+
+  const auto resources = JoinPaths({docset_path, "Contents", "Resources"});
+  const auto documents = JoinPaths({resources, "Documents"});
+
+  std::unordered_map<std::string, size_t> page_ids;
+  std::vector<Page> pages;
+  if (!ReadIndex(JoinPaths({resources, "docSet.dsidx"}), page_ids, pages,
+                 report.index_rows)) {
+    return false;
+  }
+
+  std::vector<std::string> files;
+  if (!ListFiles(documents, files)) {
+    return false;
+  }
+  for (const auto& file : files) {
+    const auto found = page_ids.find(file);
+    if (found != page_ids.end()) {
+      pages[found->second].exists = true;
+      continue;
+    }
+    // Pages without index rows may still carry dashAnchors.
+    const std::string extension = ".html";
+    if (file.size() > extension.size() &&
+        file.compare(file.size() - extension.size(), extension.size(),
+                     extension) == 0) {
+      pages.emplace_back();
+      pages.back().path = file;
+      pages.back().exists = true;
+    }
+  }
+
+  std::vector<PageResult> results(pages.size());
+  ParallelFor(pages.size(), concurrency, [&](size_t page) {
+    VerifyPage(documents, pages[page], results[page]);
+  });
+
+  for (auto& result : results) {
+    report.dash_anchors += result.dash_anchors;
+    report.missing_pages += result.missing_pages;
+    report.missing_anchors += result.missing_anchors;
+    report.unmatched_dash_anchors += result.unmatched_dash_anchors;
+    for (auto& problem : result.problems) {
+      if (report.problems.size() == VerifyReport::kMaxDescribedProblems) {
+        break;
+      }
+      report.problems.emplace_back(std::move(problem));
+    }
+  }
+  report.pages = pages.size();
+  report.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return true;
+}
+
+}  // namespace d2d
@@ -0,0 +1,45 @@
+// This source file is part of doxygen2docset.
+// Licensed under the MIT License. See LICENSE.md file for details.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace d2d {
+
+struct VerifyReport {
+  // The number of problems that are described in |problems|. The counts
+  // below are always complete.
+  static constexpr size_t kMaxDescribedProblems = 100;
+
+  size_t index_rows = 0;
+  size_t pages = 0;
+  size_t dash_anchors = 0;
+
+  // Index rows whose page is not in the docset.
+  size_t missing_pages = 0;
+  // Index rows whose anchor is not defined in their page.
+  size_t missing_anchors = 0;
+  // dashAnchors in pages that no index row of that page accounts for.
+  size_t unmatched_dash_anchors = 0;
+
+  std::vector<std::string> problems;
+  double seconds = 0.0;
+
+  size_t GetProblemCount() const {
+    return missing_pages + missing_anchors + unmatched_dash_anchors;
+  }
+};
+
+// Checks that every row of the docset index points at an existing page that
+// defines the referenced anchor, and that every dashAnchor injected into a
+// page matches an index row for that page. Pages are scanned on up to
+// |concurrency| threads. Returns false if the docset could not be read.
+// Problems found in a readable docset are only recorded in |report|.
+bool VerifyDocset(const std::string& docset_path, size_t concurrency,
+                  VerifyReport& report);
+
+}  // namespace d2d
@@ -1,13 +1,41 @@
 // This source file is part of doxygen2docset.
 // Licensed under the MIT License. See LICENSE.md file for details.
 
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "anchor_filter.h"
+#include "arena.h"
+#include "buffer_pool.h"
 #include "builder.h"
+#include "compound_reader.h"
+#include "delta.h"
 #include "docset_index.h"
 #include "fixture.h"
+#include "hash.h"
 #include "html_parser.h"
+#include "logger.h"
+#include "object_store.h"
+#include "parallel.h"
+#include "path_filter.h"
+#include "perf_counters.h"
+#include "plist_parser.h"
+#include "scan.h"
+#include "shard.h"
+#include "tagfile_reader.h"
+#include "tar_reader.h"
 #include "token_parser.h"
+#include "token_sorter.h"
+#include "token_table.h"
+#include "verifier.h"
 
 #ifndef D2D_FIXTURES_LOCATION
 #error Fixtures not available.
@@ -31,6 +59,41 @@ TEST(DoxyGen2DocsetTest, CanParseTokens) {
   ASSERT_EQ(tokens[0].GetDeclaredIn(), "benchmarking.cc");
 }
 
+TEST(DoxyGen2DocsetTest, CanSplitTokensAtTokenBoundaries) {
+  const std::string xml =
+      "<?xml version=\"1.0\"?>\n<Tokens version=\"1.0\">\n"
+      "<Token><TokenIdentifier><Name>a</Name></TokenIdentifier></Token>\n"
+      "<Token><TokenIdentifier><Name>b</Name></TokenIdentifier></Token>\n"
+      "<Token><TokenIdentifier><Name>c</Name></TokenIdentifier></Token>\n"
+      "</Tokens>\n";
+  const auto begin = xml.data();
+  const auto end = begin + xml.size();
+  const auto boundaries = SplitTokens(begin, end, 3);
+  ASSERT_EQ(boundaries.size(), 4u);
+  ASSERT_EQ(*boundaries[0], '\n');
+  for (size_t i = 1; i < 3; i++) {
+    ASSERT_EQ(std::string(boundaries[i], 7), "<Token>");
+  }
+  ASSERT_EQ(std::string(boundaries[3], 9), "</Tokens>");
+  ASSERT_TRUE(SplitTokens(begin, begin + 20, 3).empty());
+}
+
+TEST(DoxyGen2DocsetTest, ChunkedTokenParsingMatchesSerialParsing) {
+  TokenParser serial(D2D_FIXTURES_LOCATION "/Tokens.xml");
+  TokenParser chunked(D2D_FIXTURES_LOCATION "/Tokens.xml", 4);
+  ASSERT_TRUE(serial.IsValid());
+  ASSERT_TRUE(chunked.IsValid());
+  ASSERT_GT(chunked.GetChunkCount(), 1u);
+  const auto serial_tokens = serial.ReadTokens();
+  const auto chunked_tokens = chunked.ReadTokens();
+  ASSERT_EQ(serial_tokens.size(), chunked_tokens.size());
+  for (size_t i = 0; i < serial_tokens.size(); i++) {
+    ASSERT_EQ(serial_tokens[i].GetName(), chunked_tokens[i].GetName());
+    ASSERT_EQ(serial_tokens[i].GetPath(), chunked_tokens[i].GetPath());
+    ASSERT_EQ(serial_tokens[i].GetAnchor(), chunked_tokens[i].GetAnchor());
+  }
+}
+
 TEST(DoxyGen2DocsetTest, CanCreateDocsetIndex) {
   DocsetIndex index("/tmp/docsetindex.db");
   ASSERT_TRUE(index.IsValid());
@@ -52,6 +115,70 @@ TEST(DoxyGen2DocsetTest, CanBuildCompleteDocset) {
   ASSERT_TRUE(BuildDocset(D2D_FIXTURES_LOCATION, "/tmp/builtdocset"));
 }
 
+TEST(DoxyGen2DocsetTest, CanVerifyDocset) {
+  ASSERT_TRUE(BuildDocset(D2D_FIXTURES_LOCATION, "/tmp/verifieddocset"));
+  VerifyReport report;
+  ASSERT_TRUE(VerifyDocset("/tmp/verifieddocset/io.flutter.engine.docset", 4,
+                           report));
+  ASSERT_GT(report.index_rows, 0u);
+  // Only one of the pages referenced by Tokens.xml is in the fixtures.
+  ASSERT_GT(report.missing_pages, 0u);
+  ASSERT_GT(report.dash_anchors, 0u);
+  ASSERT_EQ(report.unmatched_dash_anchors, 0u);
+  ASSERT_LE(report.problems.size(), VerifyReport::kMaxDescribedProblems);
+
+  ASSERT_FALSE(VerifyDocset("/tmp/not_a_docset", 1, report));
+}
+
+TEST(DoxyGen2DocsetTest, TokenSorterGroupsTokensByPage) {
+  ASSERT_TRUE(MakeDirectories({"/tmp/tokensorter"}));
+  TokenSorter sorter("/tmp/tokensorter");
+  ASSERT_TRUE(sorter.IsValid());
+
+  // Enough runs for more than one merge pass.
+  const size_t batch_count = TokenSorter::kMaxMergeWidth * 2 + 3;
+  for (size_t batch = 0; batch < batch_count; batch++) {
+    std::vector<Token> tokens;
+    for (size_t page = 4; page > 0; page--) {
+      tokens.emplace_back("Name" + std::to_string(batch), "cl", "",
+                          "page" + std::to_string(page) + ".html",
+                          std::to_string(batch));
+    }
+    ASSERT_TRUE(sorter.AddBatch(std::move(tokens)));
+  }
+  ASSERT_TRUE(sorter.Finish());
+  ASSERT_LE(sorter.GetRunCount(), TokenSorter::kMaxMergeWidth);
+
+  std::vector<Token> tokens;
+  ASSERT_TRUE(sorter.ReadPage("page0.html", tokens));
+  ASSERT_TRUE(tokens.empty());
+  // Page 2 is skipped.
+  for (const auto page : {"page1.html", "page3.html", "page4.html"}) {
+    ASSERT_TRUE(sorter.ReadPage(page, tokens));
+    ASSERT_EQ(tokens.size(), batch_count);
+    for (size_t i = 0; i < tokens.size(); i++) {
+      ASSERT_EQ(tokens[i].GetPath(), page);
+      ASSERT_EQ(tokens[i].GetAnchor(), std::to_string(i));
+      ASSERT_EQ(tokens[i].GetTokenType(), TokenType::kClass);
+    }
+  }
+  ASSERT_TRUE(sorter.ReadPage("page5.html", tokens));
+  ASSERT_TRUE(tokens.empty());
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildDocsetWithLowMemory) {
+  BuildOptions options;
+  options.low_memory = true;
+  ASSERT_TRUE(
+      BuildDocset(D2D_FIXTURES_LOCATION, "/tmp/lowmemorydocset", options));
+  VerifyReport report;
+  ASSERT_TRUE(VerifyDocset("/tmp/lowmemorydocset/io.flutter.engine.docset", 4,
+                           report));
+  ASSERT_GT(report.index_rows, 0u);
+  ASSERT_GT(report.dash_anchors, 0u);
+  ASSERT_EQ(report.unmatched_dash_anchors, 0u);
+}
+
 TEST(DoxyGen2DocsetTest, CanParseHTML) {
   HTMLParser parser(
       OpenFileReadOnly(D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html"));
@@ -67,5 +194,1217 @@ TEST(DoxyGen2DocsetTest, CanGetTokensByFile) {
   ASSERT_EQ(links.size(), 1630u);
 }
 
+TEST(DoxyGen2DocsetTest, CanAddPageTextToFullTextIndex) {
+  {
+    DocsetIndex index("/tmp/docsetindex_fts.db");
+    ASSERT_TRUE(index.IsValid());
+    ASSERT_TRUE(index.EnableFullTextSearch());
+    TokenParser parser(D2D_FIXTURES_LOCATION "/Tokens.xml");
+    ASSERT_TRUE(parser.IsValid());
+    ASSERT_TRUE(index.AddTokens(parser.ReadTokens()));
+    ASSERT_TRUE(index.AddPageText("page.html", "Some Page",
+                                  "The quick brown fox jumps."));
+    ASSERT_TRUE(index.Commit());
+  }
+
+  sqlite3* db = nullptr;
+  ASSERT_EQ(sqlite3_open("/tmp/docsetindex_fts.db", &db), SQLITE_OK);
+  sqlite3_stmt* statement = nullptr;
+  ASSERT_EQ(sqlite3_prepare_v2(db,
+                               "SELECT path FROM searchText WHERE searchText "
+                               "MATCH 'body:brown';",
+                               -1, &statement, nullptr),
+            SQLITE_OK);
+  ASSERT_EQ(sqlite3_step(statement), SQLITE_ROW);
+  ASSERT_STREQ(
+      reinterpret_cast<const char*>(sqlite3_column_text(statement, 0)),
+      "page.html");
+  sqlite3_finalize(statement);
+  sqlite3_close(db);
+}
+
+TEST(DoxyGen2DocsetTest, CanExtractHTMLText) {
+  HTMLParser parser(
+      OpenFileReadOnly(D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html"));
+  ASSERT_TRUE(parser.IsValid());
+  ASSERT_EQ(parser.ExtractTitle(),
+            "Flutter Engine: flutter::Shell Class Reference");
+  auto text = parser.ExtractText();
+  ASSERT_NE(text.find("Shell"), std::string::npos);
+  ASSERT_EQ(text.find("initResizable"), std::string::npos);
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildDocsetWithFullTextSearch) {
+  BuildOptions options;
+  options.full_text_search = true;
+  ASSERT_TRUE(
+      BuildDocset(D2D_FIXTURES_LOCATION, "/tmp/builtdocset_fts", options));
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildSearchAccelerators) {
+  {
+    DocsetIndex index("/tmp/docsetindex_accelerated.db");
+    ASSERT_TRUE(index.IsValid());
+    TokenParser parser(D2D_FIXTURES_LOCATION "/Tokens.xml");
+    ASSERT_TRUE(parser.IsValid());
+    ASSERT_TRUE(index.AddTokens(parser.ReadTokens()));
+    ASSERT_TRUE(index.BuildSearchAccelerators());
+  }
+
+  sqlite3* db = nullptr;
+  ASSERT_EQ(sqlite3_open("/tmp/docsetindex_accelerated.db", &db), SQLITE_OK);
+  sqlite3_stmt* statement = nullptr;
+  ASSERT_EQ(sqlite3_prepare_v2(db,
+                               "SELECT COUNT(*) FROM searchIndex WHERE "
+                               "lowerName >= 'mai' AND lowerName < 'maj' AND "
+                               "id IN (SELECT id FROM searchTrigram WHERE "
+                               "trigram = 'mai');",
+                               -1, &statement, nullptr),
+            SQLITE_OK);
+  ASSERT_EQ(sqlite3_step(statement), SQLITE_ROW);
+  ASSERT_GT(sqlite3_column_int64(statement, 0), 0);
+  sqlite3_finalize(statement);
+  sqlite3_close(db);
+}
+
+TEST(DoxyGen2DocsetTest, CanClassifyTokenTypes) {
+  ASSERT_EQ(ClassifyTokenType("cl", 2), TokenType::kClass);
+  ASSERT_EQ(ClassifyTokenType("instm", 5), TokenType::kInstanceMethod);
+  ASSERT_EQ(ClassifyTokenType("intfm", 5), TokenType::kInterfaceMethod);
+  ASSERT_EQ(ClassifyTokenType("intfcm", 6), TokenType::kInterfaceClassMethod);
+  ASSERT_EQ(ClassifyTokenType("unknown", 7), TokenType::kUnknown);
+  ASSERT_STREQ(GetTokenTypeIndexName(TokenType::kFriendFunction), "Class");
+  ASSERT_STREQ(GetTokenTypeIndexName(TokenType::kUnknown), "Data");
+
+  TokenParser parser(D2D_FIXTURES_LOCATION "/Tokens.xml");
+  ASSERT_TRUE(parser.IsValid());
+  auto tokens = parser.ReadTokens();
+  ASSERT_EQ(tokens[0].GetTokenType(), TokenType::kFunction);
+  ASSERT_STREQ(tokens[0].GetIndexType(), "Function");
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildTokenTable) {
+  TokenParser parser(D2D_FIXTURES_LOCATION "/Tokens.xml");
+  ASSERT_TRUE(parser.IsValid());
+  TokenTable table(parser.ReadTokens());
+  ASSERT_EQ(table.GetSize(), 24877u);
+  ASSERT_EQ(table.GetFileCount(), 1630u);
+  ASSERT_STREQ(table.GetIndexNames().Get(0), "Main");
+  ASSERT_STREQ(table.GetIndexType(0), "Function");
+  ASSERT_STREQ(table.GetAnchors().Get(0), "#a96ee0ac7e6719129af3e0e0eac71bb72");
+  ASSERT_STREQ(table.GetIndexPaths().Get(0),
+               "namespacebenchmarking.html#a96ee0ac7e6719129af3e0e0eac71bb72");
+  ASSERT_STREQ(table.GetDashAnchors().Get(0),
+               "<a name=\"//apple_ref/cpp/Function/Main\" "
+               "class=\"dashAnchor\">&nbsp;</a>");
+
+  auto rows = table.GetRowsForFile("namespacebenchmarking.html");
+  ASSERT_FALSE(rows.empty());
+  ASSERT_EQ(*rows.begin(), 0u);
+  ASSERT_TRUE(table.GetRowsForFile("not_a_page.html").empty());
+}
+
+TEST(DoxyGen2DocsetTest, AnchorFilterOnlyMatchesLinks) {
+  std::vector<Token> tokens;
+  tokens.emplace_back("Foo", "cl", "", "page.html", "a1b2");
+  tokens.emplace_back("Bar", "func", "", "page.html", "a1b2c3");
+  tokens.emplace_back("Baz", "func", "", "page.html", "f00");
+  const TokenTable table(tokens);
+  const AnchorFilter filter(table, table.GetRowsForFile("page.html"));
+
+  auto may_link = [&filter](const std::string& page) {
+    return filter.MayLinkToAnchors(page.data(), page.data() + page.size());
+  };
+  ASSERT_FALSE(may_link(""));
+  ASSERT_FALSE(may_link("<a id=\"a1b2\"></a><a href=\"#a1\">#</a>"));
+  ASSERT_FALSE(may_link("<a href=\"other.html#f0\">"));
+  ASSERT_TRUE(may_link("<a href=\"#a1b2\">"));
+  ASSERT_TRUE(may_link("<a href=\"page.html#f00\">"));
+  ASSERT_TRUE(may_link("#f00"));
+
+  const TokenTable empty_table(std::vector<Token>{});
+  const AnchorFilter empty_filter(empty_table, {});
+  const std::string page = "<a href=\"#a1b2\">";
+  ASSERT_FALSE(
+      empty_filter.MayLinkToAnchors(page.data(), page.data() + page.size()));
+}
+
+TEST(DoxyGen2DocsetTest, AnchorFilterKeepsPagesThatNeedTOC) {
+  TokenParser parser(D2D_FIXTURES_LOCATION "/Tokens.xml");
+  ASSERT_TRUE(parser.IsValid());
+  const TokenTable table(parser.ReadTokens());
+  const auto rows = table.GetRowsForFile("classflutter_1_1_shell.html");
+  ASSERT_FALSE(rows.empty());
+
+  auto mapping =
+      OpenFileReadOnly(D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html");
+  ASSERT_TRUE(mapping);
+  const auto data = static_cast<const char*>(mapping->Get());
+  ASSERT_TRUE(AnchorFilter(table, rows)
+                  .MayLinkToAnchors(data, data + mapping->GetSize()));
+
+  // None of the tokens of another page are linked to from this one.
+  const auto other_rows = table.GetRowsForFile("namespacebenchmarking.html");
+  ASSERT_FALSE(AnchorFilter(table, other_rows)
+                   .MayLinkToAnchors(data, data + mapping->GetSize()));
+  HTMLParser html(std::move(mapping));
+  ASSERT_TRUE(html.IsValid());
+  auto rewritten = html.BuildHTMLWithTOC(table, other_rows);
+  ASSERT_TRUE(rewritten.IsValid());
+  auto original =
+      OpenFileReadOnly(D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html");
+  ASSERT_EQ(rewritten.GetSize(), original->GetSize());
+}
+
+TEST(DoxyGen2DocsetTest, ObjectStoreSharesIdenticalFiles) {
+  char directory[] = "/tmp/objectstore-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const std::string a_path = JoinPaths({directory, "a"});
+  const std::string b_path = JoinPaths({directory, "b"});
+  const std::string c_path = JoinPaths({directory, "c"});
+  ObjectStore store(JoinPaths({directory, "store"}));
+  ASSERT_TRUE(store.IsValid());
+
+  const std::string shared = "shared";
+  const std::string other = "other";
+  ASSERT_TRUE(store.Link(shared.data(), shared.size(), a_path));
+  ASSERT_TRUE(store.Link(shared.data(), shared.size(), b_path));
+  ASSERT_TRUE(store.Link(other.data(), other.size(), c_path));
+  ASSERT_EQ(store.GetAddedObjectCount(), 2u);
+  ASSERT_EQ(store.GetReusedObjectCount(), 1u);
+
+  struct stat a_stat = {};
+  struct stat b_stat = {};
+  ASSERT_EQ(::stat(a_path.c_str(), &a_stat), 0);
+  ASSERT_EQ(::stat(b_path.c_str(), &b_stat), 0);
+  ASSERT_EQ(a_stat.st_ino, b_stat.st_ino);
+  ASSERT_EQ(a_stat.st_nlink, 3u);
+
+  // Writing over a linked file leaves the object alone.
+  ASSERT_TRUE(CopyData(other.data(), other.size(), b_path));
+  auto a = OpenFileReadOnly(a_path);
+  ASSERT_TRUE(a);
+  ASSERT_EQ(std::string(static_cast<const char*>(a->Get()), a->GetSize()),
+            shared);
+
+  size_t removed_objects = 0;
+  uint64_t removed_bytes = 0;
+  ASSERT_TRUE(store.CollectGarbage(removed_objects, removed_bytes));
+  ASSERT_EQ(removed_objects, 0u);
+  ASSERT_EQ(::unlink(c_path.c_str()), 0);
+  ASSERT_TRUE(store.CollectGarbage(removed_objects, removed_bytes));
+  ASSERT_EQ(removed_objects, 1u);
+  ASSERT_EQ(removed_bytes, other.size());
+}
+
+static void MakeTestDocset(const std::string& docset,
+                           const std::vector<std::string>& pages,
+                           const std::vector<Token>& tokens) {
+  const std::vector<std::string> documents = {docset, "Contents", "Resources",
+                                              "Documents"};
+  ASSERT_TRUE(MakeDirectories(documents));
+  ASSERT_TRUE(MakeDirectories(
+      {docset, "Contents", "Resources", "Documents", "sub"}));
+  for (size_t i = 0; i + 1 < pages.size(); i += 2) {
+    ASSERT_TRUE(CopyData(pages[i + 1].data(), pages[i + 1].size(),
+                         JoinPaths(documents, pages[i])));
+  }
+  DocsetIndex index(
+      JoinPaths({docset, "Contents", "Resources", "docSet.dsidx"}));
+  ASSERT_TRUE(index.AddTokens(tokens));
+}
+
+TEST(DoxyGen2DocsetTest, DeltaTurnsOldDocsetIntoNewDocset) {
+  char directory[] = "/tmp/delta-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const auto old_docset = JoinPaths({directory, "old.docset"});
+  const auto new_docset = JoinPaths({directory, "new.docset"});
+  const auto patched_docset = JoinPaths({directory, "patched.docset"});
+  const auto delta = JoinPaths({directory, "docset.delta"});
+
+  const std::vector<std::string> old_pages = {
+      "same.html", "same", "changed.html", "old", "removed.html", "gone"};
+  const std::vector<Token> old_tokens = {
+      Token("A", "cl", "", "same.html", "a"),
+      Token("B", "cl", "", "changed.html", "b")};
+  MakeTestDocset(old_docset, old_pages, old_tokens);
+  MakeTestDocset(patched_docset, old_pages, old_tokens);
+  // Dots inside a name are not a parent directory.
+  MakeTestDocset(new_docset,
+                 {"same.html", "same", "changed.html", "new!",
+                  "sub/added..v2.html", "added"},
+                 {Token("B", "cl", "", "changed.html", "b"),
+                  Token("C", "func", "", "sub/added..v2.html", "c")});
+
+  DeltaStats stats;
+  ASSERT_TRUE(WriteDocsetDelta(old_docset, new_docset, delta, stats));
+  ASSERT_EQ(stats.written_files, 2u);
+  ASSERT_EQ(stats.removed_files, 1u);
+  ASSERT_EQ(stats.added_rows, 1u);
+  ASSERT_EQ(stats.removed_rows, 1u);
+
+  ASSERT_TRUE(ApplyDocsetDelta(delta, patched_docset, stats));
+  // Applying it again changes nothing.
+  ASSERT_TRUE(ApplyDocsetDelta(delta, patched_docset, stats));
+
+  // The patched docset now matches the new one.
+  ASSERT_TRUE(WriteDocsetDelta(patched_docset, new_docset,
+                               JoinPaths({directory, "empty.delta"}), stats));
+  ASSERT_EQ(stats.written_files, 0u);
+  ASSERT_EQ(stats.removed_files, 0u);
+  ASSERT_EQ(stats.added_rows, 0u);
+  ASSERT_EQ(stats.removed_rows, 0u);
+
+  // A docset that was changed since is left alone.
+  const std::vector<std::string> old_documents = {old_docset, "Contents",
+                                                  "Resources", "Documents"};
+  ASSERT_TRUE(CopyData("edited", 6, JoinPaths(old_documents, "removed.html")));
+  ASSERT_FALSE(ApplyDocsetDelta(delta, old_docset, stats));
+  auto changed = OpenFileReadOnly(JoinPaths(old_documents, "changed.html"));
+  ASSERT_TRUE(changed);
+  ASSERT_EQ(std::string(static_cast<const char*>(changed->Get()),
+                        changed->GetSize()),
+            "old");
+}
+
+TEST(DoxyGen2DocsetTest, PathFilterAppliesTheLastMatchingRule) {
+  PathFilter filter;
+  auto add_rule = [&filter](bool exclude, const char* pattern) {
+    PathRule rule;
+    rule.exclude = exclude;
+    rule.pattern = pattern;
+    return filter.AddRule(rule);
+  };
+  ASSERT_TRUE(add_rule(true, "search/"));
+  ASSERT_TRUE(add_rule(true, "*.map"));
+  ASSERT_TRUE(add_rule(true, "Makefile"));
+  ASSERT_TRUE(add_rule(true, "img/**/*.pn?"));
+  ASSERT_TRUE(add_rule(false, "keep.map"));
+  ASSERT_FALSE(add_rule(true, ""));
+
+  ASSERT_FALSE(filter.IsIncluded("search", true));
+  ASSERT_FALSE(filter.IsIncluded("sub/search", true));
+  ASSERT_TRUE(filter.IsIncluded("search", false));
+  ASSERT_FALSE(filter.IsIncluded("graph.map", false));
+  ASSERT_FALSE(filter.IsIncluded("sub/graph.map", false));
+  ASSERT_TRUE(filter.IsIncluded("keep.map", false));
+  ASSERT_TRUE(filter.IsIncluded("graph.mapx", false));
+  ASSERT_FALSE(filter.IsIncluded("Makefile", false));
+  ASSERT_TRUE(filter.IsIncluded("Makefile.in", false));
+  ASSERT_FALSE(filter.IsIncluded("img/a.png", false));
+  ASSERT_FALSE(filter.IsIncluded("img/a/b/c.pnm", false));
+  ASSERT_TRUE(filter.IsIncluded("img/a.jpg", false));
+  ASSERT_TRUE(filter.IsIncluded("other/img/a.png", false));
+  ASSERT_TRUE(filter.IsIncluded("index.html", false));
+}
+
+TEST(DoxyGen2DocsetTest, ListFilesSkipsExcludedSubtrees) {
+  char directory[] = "/tmp/listfiles-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  ASSERT_TRUE(MakeDirectories({directory, "search"}));
+  ASSERT_TRUE(MakeDirectories({directory, "sub"}));
+  for (const auto file : {"index.html", "graph.map", "search/all.js",
+                          "sub/page.html", "sub/page.md5"}) {
+    ASSERT_TRUE(CopyData("x", 1, JoinPaths({directory, file})));
+  }
+  // Links are listed as the files and directories they point to.
+  const auto link = JoinPaths({directory, "link.html"});
+  ASSERT_EQ(::symlink("index.html", link.c_str()), 0);
+  const auto linked = JoinPaths({directory, "linked"});
+  ASSERT_EQ(::symlink("sub", linked.c_str()), 0);
+
+  PathFilter filter;
+  for (const auto pattern : {"search/", "*.map", "*.md5"}) {
+    PathRule rule;
+    rule.pattern = pattern;
+    ASSERT_TRUE(filter.AddRule(rule));
+  }
+  std::vector<std::string> files;
+  ASSERT_TRUE(ListFiles(directory, files, &filter));
+  std::sort(files.begin(), files.end());
+  ASSERT_EQ(files, std::vector<std::string>({"index.html", "link.html",
+                                             "linked/page.html",
+                                             "sub/page.html"}));
+}
+
+TEST(DoxyGen2DocsetTest, CompoundReaderReadsMembersOnce) {
+  char directory[] = "/tmp/compounds-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const std::vector<std::pair<std::string, std::string>> files = {
+      {"index.xml",
+       "<doxygenindex>"
+       "<compound refid=\"group__g\" kind=\"group\"><name>g</name>"
+       "<member refid=\"namespacens_1a01\" kind=\"function\"><name>f</name>"
+       "</member></compound>"
+       "<compound refid=\"classns_1_1_a\" kind=\"class\"><name>ns::A</name>"
+       "</compound>"
+       "<compound refid=\"namespacens\" kind=\"namespace\"><name>ns</name>"
+       "</compound>"
+       "<compound refid=\"intro\" kind=\"page\"><name>intro</name>"
+       "</compound>"
+       "</doxygenindex>"},
+      {"group__g.xml",
+       "<doxygen><compounddef id=\"group__g\" kind=\"group\">"
+       "<compoundname>g</compoundname><sectiondef kind=\"func\">"
+       "<memberdef kind=\"function\" id=\"namespacens_1a01\">"
+       "<name>f</name></memberdef>"
+       "</sectiondef></compounddef></doxygen>"},
+      {"classns_1_1_a.xml",
+       "<doxygen><compounddef id=\"classns_1_1_a\" kind=\"class\" "
+       "language=\"C++\"><compoundname>ns::A</compoundname>"
+       "<sectiondef kind=\"public-func\">"
+       "<memberdef kind=\"function\" id=\"classns_1_1_a_1a02\" static=\"yes\">"
+       "<name>Make</name><location file=\"src/a.h\" line=\"3\"/></memberdef>"
+       "<memberdef kind=\"enum\" id=\"classns_1_1_a_1a03\">"
+       "<name>Kind</name><enumvalue id=\"classns_1_1_a_1a04\">"
+       "<name>kOne</name></enumvalue></memberdef>"
+       "</sectiondef><location file=\"src/a.h\" line=\"1\"/>"
+       "</compounddef></doxygen>"},
+      {"namespacens.xml",
+       "<doxygen><compounddef id=\"namespacens\" kind=\"namespace\" "
+       "language=\"C++\"><compoundname>ns</compoundname>"
+       "<sectiondef kind=\"func\">"
+       "<memberdef kind=\"function\" id=\"namespacens_1a01\">"
+       "<name>f</name><location file=\"src/a.cc\" line=\"9\"/></memberdef>"
+       "</sectiondef></compounddef></doxygen>"},
+  };
+  for (const auto& file : files) {
+    ASSERT_TRUE(CopyData(file.second.data(), file.second.size(),
+                         JoinPaths({directory, file.first})));
+  }
+
+  CompoundReader reader(directory, 2);
+  ASSERT_TRUE(reader.IsValid());
+  ASSERT_EQ(reader.GetCompoundCount(), 3u);
+  const auto tokens = reader.ReadTokens();
+  ASSERT_TRUE(reader.IsValid());
+  ASSERT_EQ(tokens.size(), 6u);
+
+  ASSERT_EQ(tokens[0].GetName(), "ns::A");
+  ASSERT_EQ(tokens[0].GetType(), "cl");
+  ASSERT_EQ(tokens[0].GetScope(), "ns");
+  ASSERT_EQ(tokens[0].GetPath(), "classns_1_1_a.html");
+  ASSERT_EQ(tokens[0].GetDeclaredIn(), "a.h");
+  ASSERT_EQ(tokens[1].GetName(), "Make");
+  ASSERT_EQ(tokens[1].GetType(), "clm");
+  ASSERT_EQ(tokens[1].GetLanguage(), "cpp");
+  ASSERT_EQ(tokens[1].GetScope(), "ns::A");
+  ASSERT_EQ(tokens[1].GetIndexPath(), "classns_1_1_a.html#a02");
+  ASSERT_EQ(tokens[2].GetType(), "enum");
+  ASSERT_EQ(tokens[3].GetName(), "kOne");
+  ASSERT_EQ(tokens[3].GetType(), "econst");
+  ASSERT_EQ(tokens[3].GetScope(), "ns::A");
+  ASSERT_EQ(tokens[4].GetType(), "ns");
+  // The group that lists the function again comes last and adds nothing.
+  ASSERT_EQ(tokens[5].GetName(), "f");
+  ASSERT_EQ(tokens[5].GetType(), "func");
+  ASSERT_EQ(tokens[5].GetScope(), "ns");
+  ASSERT_EQ(tokens[5].GetIndexPath(), "namespacens.html#a01");
+  ASSERT_EQ(tokens[5].GetDeclaredIn(), "a.cc");
+}
+
+TEST(DoxyGen2DocsetTest, TagfileReaderMergesRepeatedMembers) {
+  char directory[] = "/tmp/tagfile-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const auto path = JoinPaths({directory, "project.tag"});
+  const std::string tagfile =
+      "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n"
+      "<tagfile doxygen_version=\"1.9.1\">\n"
+      "  <compound kind=\"file\">\n"
+      "    <name>a.h</name>\n"
+      "    <filename>a_8h.html</filename>\n"
+      "    <member kind=\"function\">\n"
+      "      <type>bool</type>\n"
+      "      <name>operator&lt;</name>\n"
+      "      <anchorfile>namespacens.html</anchorfile>\n"
+      "      <anchor>a01</anchor>\n"
+      "      <arglist>(const A &amp;a, const A &amp;b)</arglist>\n"
+      "    </member>\n"
+      "  </compound>\n"
+      "  <!-- <compound kind=\"class\"> -->\n"
+      "  <compound kind=\"class\">\n"
+      "    <name>ns::A</name>\n"
+      "    <filename>classns_1_1_a</filename>\n"
+      "    <templarg>typename T</templarg>\n"
+      "    <member kind=\"function\" static=\"yes\">\n"
+      "      <name>Make</name>\n"
+      "      <anchorfile>classns_1_1_a.html</anchorfile>\n"
+      "      <anchor>a02</anchor>\n"
+      "    </member>\n"
+      "    <member kind=\"enumeration\">\n"
+      "      <name>Kind</name>\n"
+      "      <anchorfile>classns_1_1_a.html</anchorfile>\n"
+      "      <anchor>a03</anchor>\n"
+      "      <enumvalue file=\"classns_1_1_a.html\" anchor=\"a04\">kOne"
+      "</enumvalue>\n"
+      "    </member>\n"
+      "  </compound>\n"
+      "  <compound kind=\"namespace\">\n"
+      "    <name>ns</name>\n"
+      "    <filename>namespacens.html</filename>\n"
+      "    <class kind=\"class\">ns::A</class>\n"
+      "    <member kind=\"function\">\n"
+      "      <name>operator&lt;</name>\n"
+      "      <anchorfile>namespacens.html</anchorfile>\n"
+      "      <anchor>a01</anchor>\n"
+      "    </member>\n"
+      "  </compound>\n"
+      "  <compound kind=\"page\">\n"
+      "    <name>index</name>\n"
+      "    <filename>index.html</filename>\n"
+      "  </compound>\n"
+      "</tagfile>\n";
+  ASSERT_TRUE(CopyData(tagfile.data(), tagfile.size(), path));
+
+  TagfileReader reader(path);
+  ASSERT_TRUE(reader.IsValid());
+  const auto tokens = reader.ReadTokens();
+  ASSERT_TRUE(reader.IsValid());
+  ASSERT_EQ(tokens.size(), 7u);
+
+  ASSERT_EQ(tokens[0].GetType(), "file");
+  ASSERT_EQ(tokens[0].GetPath(), "a_8h.html");
+  // The function keeps its place but takes the scope of its namespace.
+  ASSERT_EQ(tokens[1].GetName(), "operator<");
+  ASSERT_EQ(tokens[1].GetScope(), "ns");
+  ASSERT_EQ(tokens[1].GetDeclaredIn(), "a.h");
+  ASSERT_EQ(tokens[1].GetIndexPath(), "namespacens.html#a01");
+  ASSERT_EQ(tokens[2].GetName(), "ns::A");
+  ASSERT_EQ(tokens[2].GetType(), "tmplt");
+  ASSERT_EQ(tokens[2].GetPath(), "classns_1_1_a.html");
+  ASSERT_EQ(tokens[3].GetType(), "clm");
+  ASSERT_EQ(tokens[3].GetScope(), "ns::A");
+  ASSERT_EQ(tokens[4].GetType(), "enum");
+  ASSERT_EQ(tokens[5].GetName(), "kOne");
+  ASSERT_EQ(tokens[5].GetType(), "econst");
+  ASSERT_EQ(tokens[5].GetIndexPath(), "classns_1_1_a.html#a04");
+  ASSERT_EQ(tokens[6].GetType(), "ns");
+
+  // Read a compound at a time, the function is still only read once.
+  TagfileReader chunked_reader(path, 1);
+  std::vector<Token> chunk;
+  size_t token_count = 0;
+  while (chunked_reader.ReadChunk(chunk)) {
+    token_count += chunk.size();
+  }
+  ASSERT_TRUE(chunked_reader.IsValid());
+  ASSERT_EQ(token_count, 7u);
+}
+
+TEST(DoxyGen2DocsetTest, ShardsMergeIntoOneDocset) {
+  Shard shard;
+  ASSERT_TRUE(ParseShard("1/3", shard));
+  ASSERT_EQ(shard.index, 1u);
+  ASSERT_EQ(shard.count, 3u);
+  ASSERT_FALSE(ParseShard("3/3", shard));
+  ASSERT_FALSE(ParseShard("1/", shard));
+  ASSERT_FALSE(ParseShard("-1/3", shard));
+  ASSERT_TRUE(IsInShard("any.html", Shard()));
+
+  char directory[] = "/tmp/shards-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  std::vector<std::string> shard_docsets;
+  size_t page_count = 0;
+  for (shard.index = 0, shard.count = 2; shard.index < shard.count;
+       shard.index++) {
+    const auto docset = JoinPaths(
+        {directory, "shard" + std::to_string(shard.index) + ".docset"});
+    const std::vector<std::string> documents = {docset, "Contents",
+                                                "Resources", "Documents"};
+    ASSERT_TRUE(MakeDirectories(documents, "sub"));
+    std::vector<Token> tokens;
+    for (size_t page = 0; page < 16; page++) {
+      const auto path = (page % 2 == 0 ? "sub/page" : "page") +
+                        std::to_string(page) + ".html";
+      if (!IsInShard(path, shard)) {
+        continue;
+      }
+      ASSERT_TRUE(CopyData(path.data(), path.size(),
+                           JoinPaths(documents, path)));
+      tokens.emplace_back("Name" + std::to_string(page), "cl", "", path, "a");
+      page_count++;
+    }
+    DocsetIndex index(
+        JoinPaths({docset, "Contents", "Resources", "docSet.dsidx"}));
+    ASSERT_TRUE(index.AddTokens(tokens));
+    ASSERT_TRUE(index.SetShard(shard, true));
+    ASSERT_TRUE(WriteDocSetPlist(
+        "com.example.docs", "Docs",
+        JoinPaths({docset, "Contents", "Info.plist"})));
+    shard_docsets.push_back(docset);
+  }
+  // Every page belongs to exactly one shard.
+  ASSERT_EQ(page_count, 16u);
+
+  const auto merged = JoinPaths({directory, "merged"});
+  MergeStats stats;
+  ASSERT_FALSE(MergeDocsetShards({shard_docsets[0]}, merged, stats));
+  ASSERT_FALSE(MergeDocsetShards({shard_docsets[0], shard_docsets[0]}, merged,
+                                 stats));
+  ASSERT_TRUE(MergeDocsetShards({shard_docsets[1], shard_docsets[0]}, merged,
+                                stats));
+  ASSERT_EQ(stats.files, 16u);
+  ASSERT_EQ(stats.rows, 16u);
+  ASSERT_EQ(stats.text_rows, 0u);
+
+  auto page = OpenFileReadOnly(
+      JoinPaths({merged, "com.example.docs.docset", "Contents", "Resources",
+                 "Documents", "sub", "page4.html"}));
+  ASSERT_TRUE(page);
+  ASSERT_EQ(std::string(static_cast<const char*>(page->Get()),
+                        page->GetSize()),
+            "sub/page4.html");
+}
+
+// Appends a ustar entry to |archive|. |path| must be shorter than 100 bytes
+// and |prefix| shorter than 155. Old GNU headers have a different magic and
+// keep times where ustar keeps the prefix.
+static void AppendTarEntry(std::string& archive, const std::string& path,
+                           char type, const std::string& contents,
+                           const std::string& prefix = std::string(),
+                           bool old_gnu = false) {
+  char header[512] = {};
+  ::memcpy(header, path.data(), path.size());
+  ::memcpy(header + 345, prefix.data(), prefix.size());
+  ::snprintf(header + 100, 8, "%07o", 0644);
+  ::snprintf(header + 124, 12, "%011o", static_cast<unsigned>(contents.size()));
+  ::snprintf(header + 136, 12, "%011o", 0);
+  ::memset(header + 148, ' ', 8);
+  header[156] = type;
+  ::memcpy(header + 257, old_gnu ? "ustar  \0" : "ustar\0" "00", 8);
+  unsigned checksum = 0;
+  for (const auto byte : header) {
+    checksum += static_cast<unsigned char>(byte);
+  }
+  ::snprintf(header + 148, 7, "%06o", checksum);
+  archive.append(header, sizeof(header));
+  archive += contents;
+  archive.append((512 - contents.size() % 512) % 512, '\0');
+}
+
+static std::string ReadEntryContents(const TarEntry& entry) {
+  return std::string(static_cast<const char*>(entry.contents->Get()),
+                     entry.contents->GetSize());
+}
+
+TEST(DoxyGen2DocsetTest, TarReaderReadsEntriesUnderTheRoot) {
+  char directory[] = "/tmp/tarreader-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const auto long_name = "html/" + std::string(120, 'a') + ".html";
+
+  std::string archive;
+  AppendTarEntry(archive, "html/", '5', "");
+  AppendTarEntry(archive, "html/index.html", '0', "<html></html>");
+  AppendTarEntry(archive, "html/link.html", '2', "");
+  AppendTarEntry(archive, "././@LongLink", 'L', long_name + '\0');
+  AppendTarEntry(archive, long_name.substr(0, 99), '0', "long");
+  AppendTarEntry(archive, "html/sub/", '5', "");
+  AppendTarEntry(archive, "./html/sub/empty.css", '0', "");
+  AppendTarEntry(archive, "prefixed.html", '0', "", "html/sub");
+  AppendTarEntry(archive, "html/gnu.html", '0', "", "14000000000", true);
+  archive.append(1024, '\0');
+  const auto path = JoinPaths({directory, "html.tar"});
+  ASSERT_TRUE(CopyData(archive.data(), archive.size(), path));
+  ASSERT_TRUE(IsTarArchive(path));
+  ASSERT_FALSE(IsTarArchive(directory));
+
+  TarReader reader(path);
+  ASSERT_TRUE(reader.IsValid());
+  TarEntry entry;
+  ASSERT_TRUE(reader.ReadEntry(entry));
+  ASSERT_EQ(entry.path, "html/index.html");
+  ASSERT_EQ(ReadEntryContents(entry), "<html></html>");
+  ASSERT_EQ(reader.GetLeadingDirectory(), "html");
+  reader.SetRoot("html");
+  ASSERT_TRUE(reader.ReadEntry(entry));
+  ASSERT_EQ(entry.path, long_name.substr(5));
+  ASSERT_EQ(ReadEntryContents(entry), "long");
+  ASSERT_TRUE(reader.ReadEntry(entry));
+  ASSERT_EQ(entry.path, "sub/empty.css");
+  ASSERT_EQ(ReadEntryContents(entry), "");
+  ASSERT_TRUE(reader.ReadEntry(entry));
+  ASSERT_EQ(entry.path, "sub/prefixed.html");
+  ASSERT_TRUE(reader.ReadEntry(entry));
+  ASSERT_EQ(entry.path, "gnu.html");
+  ASSERT_FALSE(reader.ReadEntry(entry));
+  ASSERT_TRUE(reader.IsValid());
+
+  // Entries outside of the root directory are not written anywhere.
+  archive.clear();
+  AppendTarEntry(archive, "html/", '5', "");
+  AppendTarEntry(archive, "html/../escaped.html", '0', "");
+  archive.append(1024, '\0');
+  ASSERT_TRUE(CopyData(archive.data(), archive.size(), path));
+  TarReader escaping_reader(path);
+  ASSERT_FALSE(escaping_reader.ReadEntry(entry));
+  ASSERT_FALSE(escaping_reader.IsValid());
+
+  std::string rebased = "html/sub/page.html";
+  ASSERT_TRUE(RebaseTarPath("html", rebased));
+  ASSERT_EQ(rebased, "sub/page.html");
+  rebased = "html.html";
+  ASSERT_FALSE(RebaseTarPath("html", rebased));
+  ASSERT_TRUE(RebaseTarPath("", rebased));
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildDocsetFromArchive) {
+  char directory[] = "/tmp/tarbuild-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+
+  // Tokens.xml and Info.plist come last, so the page is held until then.
+  std::string archive;
+  AppendTarEntry(archive, "./", '5', "");
+  AppendTarEntry(archive, "./sub/page.html", '0',
+                 "<html><body><a id=\"a1\"></a>Main</body></html>");
+  AppendTarEntry(archive, "./Tokens.xml", '0',
+                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Tokens>"
+                 "<Token><TokenIdentifier><Name>Main</Name>"
+                 "<APILanguage>cpp</APILanguage><Type>func</Type>"
+                 "</TokenIdentifier><Path>sub/page.html</Path>"
+                 "<Anchor>a1</Anchor></Token></Tokens>");
+  AppendTarEntry(archive, "./Info.plist", '0',
+                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?><plist><dict>"
+                 "<key>CFBundleIdentifier</key><string>com.example.tar"
+                 "</string><key>CFBundleName</key><string>Tar</string>"
+                 "</dict></plist>");
+  archive.append(1024, '\0');
+  const auto path = JoinPaths({directory, "html.tar"});
+  ASSERT_TRUE(CopyData(archive.data(), archive.size(), path));
+
+  ASSERT_TRUE(BuildDocset(path, directory));
+  const auto docset = JoinPaths({directory, "com.example.tar.docset"});
+  const std::vector<std::string> documents = {docset, "Contents", "Resources",
+                                              "Documents"};
+  ASSERT_TRUE(OpenFileReadOnly(JoinPaths(documents, "sub/page.html")));
+  ASSERT_NE(::access(JoinPaths(documents, "Tokens.xml").c_str(), F_OK), 0);
+
+  VerifyReport report;
+  ASSERT_TRUE(VerifyDocset(docset, 1, report));
+  ASSERT_EQ(report.index_rows, 1u);
+  ASSERT_EQ(report.missing_pages, 0u);
+
+  BuildOptions options;
+  options.low_memory = true;
+  ASSERT_FALSE(BuildDocset(path, directory, options));
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildDocsetFromArchiveOfTopLevelEntries) {
+  char directory[] = "/tmp/tarroot-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const std::string tokens_xml =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Tokens>"
+      "<Token><TokenIdentifier><Name>Main</Name>"
+      "<APILanguage>cpp</APILanguage><Type>func</Type>"
+      "</TokenIdentifier><Path>index.html</Path>"
+      "<Anchor>a1</Anchor></Token></Tokens>";
+  const std::string info_plist =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><plist><dict>"
+      "<key>CFBundleIdentifier</key><string>com.example.tar"
+      "</string><key>CFBundleName</key><string>Tar</string>"
+      "</dict></plist>";
+  const std::string page = "<html><body><a id=\"a1\"></a>Main</body></html>";
+
+  // As from "tar -cf docs.tar search index.html Tokens.xml Info.plist",
+  // which starts with a directory that is not the root, and from
+  // "tar -cf docs.tar docs", which is rooted in its first directory.
+  for (const std::string root : {"", "docs/"}) {
+    std::string archive;
+    if (!root.empty()) {
+      AppendTarEntry(archive, root, '5', "");
+    }
+    AppendTarEntry(archive, root + "search/", '5', "");
+    AppendTarEntry(archive, root + "search/search.js", '0', "search");
+    AppendTarEntry(archive, root + "index.html", '0', page);
+    AppendTarEntry(archive, root + "Tokens.xml", '0', tokens_xml);
+    AppendTarEntry(archive, root + "Info.plist", '0', info_plist);
+    archive.append(1024, '\0');
+    const auto path = JoinPaths({directory, "docs.tar"});
+    ASSERT_TRUE(CopyData(archive.data(), archive.size(), path));
+
+    ASSERT_TRUE(BuildDocset(path, directory));
+    const std::vector<std::string> documents = {
+        directory, "com.example.tar.docset", "Contents", "Resources",
+        "Documents"};
+    ASSERT_TRUE(OpenFileReadOnly(JoinPaths(documents, "index.html")));
+    ASSERT_TRUE(OpenFileReadOnly(JoinPaths(documents, "search/search.js")));
+  }
+}
+
+TEST(DoxyGen2DocsetTest, CanBuildDocsetFromSeveralDoxygenOutputs) {
+  char directory[] = "/tmp/mounts-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+
+  // Both outputs have a page of the same name.
+  std::vector<DoxygenInput> inputs;
+  for (const std::string subproject : {"core", "extras"}) {
+    const auto docs = JoinPaths({directory, subproject});
+    ASSERT_TRUE(MakeDirectories({docs}));
+    const std::string page =
+        "<html><body><a id=\"a1\"></a>" + subproject + "</body></html>";
+    const std::string tokens =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Tokens><Token>"
+        "<TokenIdentifier><Name>" +
+        subproject +
+        "</Name><APILanguage>cpp</APILanguage><Type>func</Type>"
+        "</TokenIdentifier><Path>page.html</Path><Anchor>a1</Anchor>"
+        "</Token></Tokens>";
+    ASSERT_TRUE(CopyData(page.data(), page.size(),
+                         JoinPaths({docs, "page.html"})));
+    ASSERT_TRUE(CopyData(tokens.data(), tokens.size(),
+                         JoinPaths({docs, "Tokens.xml"})));
+    inputs.push_back({subproject, docs});
+  }
+
+  BuildOptions options;
+  options.docset_id = "com.example.mounts";
+  options.docset_name = "Mounts";
+  ASSERT_TRUE(BuildDocset(inputs, directory, options));
+  const auto docset = JoinPaths({directory, "com.example.mounts.docset"});
+  const std::vector<std::string> documents = {docset, "Contents", "Resources",
+                                              "Documents"};
+  ASSERT_TRUE(OpenFileReadOnly(JoinPaths(documents, "core/page.html")));
+  ASSERT_TRUE(OpenFileReadOnly(JoinPaths(documents, "extras/page.html")));
+
+  VerifyReport report;
+  ASSERT_TRUE(VerifyDocset(docset, 1, report));
+  ASSERT_EQ(report.index_rows, 2u);
+  ASSERT_EQ(report.missing_pages, 0u);
+
+  inputs[1].subdirectory = "core";
+  ASSERT_FALSE(BuildDocset(inputs, directory, options));
+}
+
+TEST(DoxyGen2DocsetTest, PagesAreKnownByTheirTokens) {
+  char directory[] = "/tmp/extensions-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const auto docs = JoinPaths({directory, "docs"});
+  ASSERT_TRUE(MakeDirectories({docs}));
+
+  // As with HTML_FILE_EXTENSION = .xhtml and .php.
+  std::string tokens =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Tokens>";
+  for (const std::string page : {"page.xhtml", "page.php"}) {
+    const std::string contents =
+        "<html><body><a href=\"#a1\">A</a><a id=\"a1\"></a>Text</body>"
+        "</html>";
+    ASSERT_TRUE(CopyData(contents.data(), contents.size(),
+                         JoinPaths({docs, page})));
+    tokens +=
+        "<Token><TokenIdentifier><Name>" + page +
+        "</Name><APILanguage>cpp</APILanguage><Type>func</Type>"
+        "</TokenIdentifier><Path>" +
+        page + "</Path><Anchor>a1</Anchor></Token>";
+  }
+  tokens += "</Tokens>";
+  ASSERT_TRUE(CopyData(tokens.data(), tokens.size(),
+                       JoinPaths({docs, "Tokens.xml"})));
+
+  BuildOptions options;
+  options.docset_id = "com.example.extensions";
+  options.docset_name = "Extensions";
+  options.full_text_search = true;
+  ASSERT_TRUE(BuildDocset(docs, directory, options));
+  const auto docset = JoinPaths({directory, "com.example.extensions.docset"});
+
+  VerifyReport report;
+  ASSERT_TRUE(VerifyDocset(docset, 1, report));
+  ASSERT_EQ(report.index_rows, 2u);
+  ASSERT_EQ(report.dash_anchors, 2u);
+  ASSERT_EQ(report.GetProblemCount(), 0u);
+
+  sqlite3* db = nullptr;
+  ASSERT_EQ(sqlite3_open(JoinPaths({docset, "Contents", "Resources",
+                                    "docSet.dsidx"})
+                             .c_str(),
+                         &db),
+            SQLITE_OK);
+  sqlite3_stmt* statement = nullptr;
+  ASSERT_EQ(sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM searchText", -1,
+                               &statement, nullptr),
+            SQLITE_OK);
+  ASSERT_EQ(sqlite3_step(statement), SQLITE_ROW);
+  ASSERT_EQ(sqlite3_column_int(statement, 0), 2);
+  sqlite3_finalize(statement);
+  sqlite3_close(db);
+}
+
+TEST(DoxyGen2DocsetTest, TaskGraphSkipsDependentsOfFailedTasks) {
+  std::atomic<int> runs(0);
+  std::atomic<bool> first_done(false);
+  std::atomic<bool> saw_first_done(false);
+
+  TaskGraph graph;
+  const auto first = graph.Add("first", [&]() {
+    runs++;
+    first_done = true;
+    return true;
+  });
+  graph.Add("second",
+            [&]() {
+              runs++;
+              saw_first_done = first_done.load();
+              return true;
+            },
+            {first});
+  ASSERT_TRUE(graph.Run());
+  ASSERT_EQ(runs, 2);
+  ASSERT_TRUE(saw_first_done);
+
+  TaskGraph failing;
+  const auto failed = failing.Add("failed", [] { return false; });
+  const auto skipped = failing.Add(
+      "skipped",
+      [&]() {
+        runs++;
+        return true;
+      },
+      {failed});
+  failing.Add(
+      "also skipped",
+      [&]() {
+        runs++;
+        return true;
+      },
+      {skipped});
+  failing.Add("independent", [&]() {
+    runs++;
+    return true;
+  });
+  ASSERT_FALSE(failing.Run());
+  ASSERT_EQ(runs, 3);
+}
+
+TEST(DoxyGen2DocsetTest, PerfCountersCoverTasksAndWorkers) {
+  EnablePerfCounters(true);
+  TaskGraph graph;
+  graph.Add("counted", []() {
+    ParallelFor(8, 2, [](size_t) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    return true;
+  });
+  ASSERT_TRUE(graph.Run());
+  EnablePerfCounters(false);
+
+  // Counters may not be available here, but every scope is timed.
+  const auto phases = TakePerfCounts();
+  ASSERT_EQ(phases.size(), 1u);
+  ASSERT_EQ(phases[0].name, "counted");
+  ASSERT_EQ(phases[0].threads.size(), 2u);
+  ASSERT_EQ(phases[0].threads[0].first, "worker 1");
+  ASSERT_EQ(phases[0].threads[1].first, "task");
+  ASSERT_GT(phases[0].threads[1].second.seconds, 0.0);
+  ASSERT_TRUE(TakePerfCounts().empty());
+}
+
+// Hashes the path, mode, modification time and contents of every file under
+// |directory|.
+static uint64_t HashTree(const std::string& directory) {
+  std::vector<std::string> files;
+  if (!ListFiles(directory, files)) {
+    return 0;
+  }
+  std::sort(files.begin(), files.end());
+  uint64_t hash = 0;
+  for (const auto& file : files) {
+    const auto path = JoinPaths({directory, file});
+    struct stat file_stat = {};
+    if (::stat(path.c_str(), &file_stat) != 0) {
+      return 0;
+    }
+    const uint64_t attributes[] = {
+        static_cast<uint64_t>(file_stat.st_mode),
+        static_cast<uint64_t>(file_stat.st_mtime)};
+    hash = Hash64(file.data(), file.size(), hash);
+    hash = Hash64(attributes, sizeof(attributes), hash);
+    const auto mapping = OpenFileReadOnly(path);
+    if (mapping) {
+      hash = Hash64(mapping->Get(), mapping->GetSize(), hash);
+    }
+  }
+  return hash;
+}
+
+TEST(DoxyGen2DocsetTest, BuildsAreReproducible) {
+  BuildOptions options;
+  options.full_text_search = true;
+  options.search_accelerators = true;
+  options.mtime = 1600000000;
+  std::vector<uint64_t> hashes;
+  for (const size_t concurrency : {1, 2, 8}) {
+    const auto location = "/tmp/reproducible_" + std::to_string(concurrency);
+    options.concurrency = concurrency;
+    ASSERT_TRUE(BuildDocset(D2D_FIXTURES_LOCATION, location, options));
+    hashes.push_back(
+        HashTree(JoinPaths({location, "io.flutter.engine.docset"})));
+  }
+  ASSERT_NE(hashes[0], 0u);
+  ASSERT_EQ(hashes[0], hashes[1]);
+  ASSERT_EQ(hashes[0], hashes[2]);
+}
+
+TEST(DoxyGen2DocsetTest, NormalizeFileModesLeavesLinkedFilesAlone) {
+  char directory[] = "/tmp/normalize-XXXXXX";
+  ASSERT_NE(::mkdtemp(directory), nullptr);
+  const auto own = JoinPaths({directory, "own.html"});
+  const auto object = JoinPaths({directory, "object"});
+  const auto linked = JoinPaths({directory, "linked.html"});
+  ASSERT_TRUE(CopyData("x", 1, own));
+  ASSERT_TRUE(CopyData("y", 1, object));
+  ASSERT_EQ(::chmod(own.c_str(), 0600), 0);
+  ASSERT_EQ(::chmod(object.c_str(), 0400), 0);
+  ASSERT_EQ(::link(object.c_str(), linked.c_str()), 0);
+  struct stat object_stat = {};
+  ASSERT_EQ(::stat(object.c_str(), &object_stat), 0);
+
+  ASSERT_TRUE(NormalizeFileModes(directory, 1600000000));
+  struct stat file_stat = {};
+  ASSERT_EQ(::stat(own.c_str(), &file_stat), 0);
+  ASSERT_EQ(file_stat.st_mode & 07777, 0644u);
+  ASSERT_EQ(file_stat.st_mtime, 1600000000);
+  ASSERT_EQ(::stat(directory, &file_stat), 0);
+  ASSERT_EQ(file_stat.st_mode & 07777, 0755u);
+  ASSERT_EQ(::stat(object.c_str(), &file_stat), 0);
+  ASSERT_EQ(file_stat.st_mode & 07777, 0400u);
+  ASSERT_EQ(file_stat.st_mtime, object_stat.st_mtime);
+}
+
+TEST(DoxyGen2DocsetTest, HashMatchesReferenceValues) {
+  ASSERT_EQ(Hash64("", 0), 0xef46db3751d8e999ull);
+  ASSERT_EQ(Hash64("abc", 3), 0x44bc2cf5ad770999ull);
+  const char kLong[] = "Nobody inspects the spammish repetition";
+  ASSERT_EQ(Hash64(kLong, sizeof(kLong) - 1), 0xfbcea83c8a378bf1ull);
+}
+
+TEST(DoxyGen2DocsetTest, CanRoundTripTokenCache) {
+  const auto tokens_path = D2D_FIXTURES_LOCATION "/Tokens.xml";
+  const auto cache_path = "/tmp/d2d_tokens.tokencache";
+  TokenParser parser(tokens_path);
+  ASSERT_TRUE(parser.IsValid());
+  TokenTable table(parser.ReadTokens());
+  uint64_t key = 0;
+  ASSERT_TRUE(HashFile(tokens_path, key));
+  ASSERT_TRUE(table.Save(cache_path, key));
+
+  TokenTable loaded;
+  ASSERT_FALSE(loaded.Load(cache_path, key + 1));
+  ASSERT_FALSE(loaded.Load("/tmp/d2d_not_a_cache", key));
+  ASSERT_TRUE(loaded.Load(cache_path, key));
+  ASSERT_EQ(loaded.GetSize(), table.GetSize());
+  ASSERT_EQ(loaded.GetFileCount(), table.GetFileCount());
+  for (size_t row = 0; row < table.GetSize(); row++) {
+    ASSERT_STREQ(loaded.GetIndexNames().Get(row),
+                 table.GetIndexNames().Get(row));
+    ASSERT_EQ(loaded.GetTokenType(row), table.GetTokenType(row));
+    ASSERT_STREQ(loaded.GetIndexPaths().Get(row),
+                 table.GetIndexPaths().Get(row));
+    ASSERT_STREQ(loaded.GetDashAnchors().Get(row),
+                 table.GetDashAnchors().Get(row));
+  }
+  const auto rows = loaded.GetRowsForFile("namespacebenchmarking.html");
+  ASSERT_FALSE(rows.empty());
+  ASSERT_EQ(*rows.begin(), 0u);
+}
+
+TEST(DoxyGen2DocsetTest, ScanKernelsMatchScalarKernels) {
+  const auto scalar = GetScanKernels(ScanKernelType::kScalar);
+  ASSERT_NE(scalar, nullptr);
+
+  const char kAlphabet[] = "ab<>\"= \thref";
+  uint32_t state = 42;
+  auto next = [&state]() {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+  };
+
+  for (size_t iteration = 0; iteration < 5000; iteration++) {
+    std::vector<char> buffer(next() % 200);
+    for (auto& c : buffer) {
+      c = kAlphabet[next() % (sizeof(kAlphabet) - 1)];
+    }
+    const char* end = buffer.data() + buffer.size();
+    const char* begin = buffer.data() + next() % (buffer.size() / 4 + 1);
+
+    std::string needle;
+    for (size_t i = 0, length = next() % 7; i < length; i++) {
+      needle.push_back(kAlphabet[next() % (sizeof(kAlphabet) - 1)]);
+    }
+    ByteSet set(needle.c_str());
+
+    for (const auto kernels : GetAvailableScanKernels()) {
+      ASSERT_EQ(kernels->find(begin, end, needle.data(), needle.size()),
+                scalar->find(begin, end, needle.data(), needle.size()))
+          << kernels->name;
+      ASSERT_EQ(kernels->find_any(begin, end, set),
+                scalar->find_any(begin, end, set))
+          << kernels->name;
+      ASSERT_EQ(kernels->skip(begin, end, set), scalar->skip(begin, end, set))
+          << kernels->name;
+    }
+  }
+}
+
+TEST(DoxyGen2DocsetTest, ScanKernelsFindTokens) {
+  auto mapping = OpenFileReadOnly(D2D_FIXTURES_LOCATION "/Tokens.xml");
+  ASSERT_TRUE(mapping && mapping->IsValid());
+  const auto begin = static_cast<const char*>(mapping->Get());
+  const auto end = begin + mapping->GetSize();
+
+  for (const auto kernels : GetAvailableScanKernels()) {
+    size_t count = 0;
+    for (auto found = kernels->find(begin, end, "</Token>", 8); found != end;
+         found = kernels->find(found + 8, end, "</Token>", 8)) {
+      count++;
+    }
+    ASSERT_EQ(count, 24877u) << kernels->name;
+  }
+}
+
+TEST(DoxyGen2DocsetTest, ArenaReusesBlocksAfterReset) {
+  Arena arena(4096);
+  auto first = arena.Allocate(10);
+  ASSERT_NE(first, nullptr);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(first) % alignof(max_align_t), 0u);
+  auto second = arena.Allocate(1);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(second) % alignof(max_align_t), 0u);
+  ASSERT_NE(first, second);
+  auto large = arena.Allocate(10000);
+  ASSERT_NE(large, nullptr);
+  const auto reserved = arena.GetBytesReserved();
+
+  arena.Retain();
+  arena.Release();
+  ASSERT_EQ(arena.GetBytesAllocated(), 0u);
+  ASSERT_EQ(arena.Allocate(10), first);
+  arena.Allocate(10000);
+  ASSERT_EQ(arena.GetBytesReserved(), reserved);
+}
+
+TEST(DoxyGen2DocsetTest, CanParseHTMLRepeatedlyFromThreadArena) {
+  for (size_t i = 0; i < 3; i++) {
+    HTMLParser parser(OpenFileReadOnly(D2D_FIXTURES_LOCATION
+                                       "/classflutter_1_1_shell.html"));
+    ASSERT_TRUE(parser.IsValid());
+    ASSERT_GT(Arena::GetThreadArena().GetBytesAllocated(), 0u);
+  }
+  ASSERT_EQ(Arena::GetThreadArena().GetBytesAllocated(), 0u);
+}
+
+TEST(DoxyGen2DocsetTest, AllocationsStopHittingTheHeapAfterWarmup) {
+  auto& pool = BufferPool::GetThreadPool();
+  auto allocate_pages = []() {
+    for (size_t size = 1000; size < 300000; size += 7919) {
+      Allocation allocation(size);
+      ASSERT_TRUE(allocation.IsValid());
+      ASSERT_EQ(allocation.GetSize(), size);
+      allocation.Get()[size - 1] = 1;
+    }
+  };
+
+  allocate_pages();
+  const auto heap_allocations = pool.GetHeapAllocationCount();
+  ASSERT_GT(pool.GetRetainedBytes(), 0u);
+  for (size_t i = 0; i < 10; i++) {
+    allocate_pages();
+  }
+  ASSERT_EQ(pool.GetHeapAllocationCount(), heap_allocations);
+}
+
+TEST(DoxyGen2DocsetTest, BufferPoolHonorsRetentionLimit) {
+  BufferPool pool(8192);
+  size_t capacity = 0;
+  auto first = pool.Acquire(5000, capacity);
+  ASSERT_EQ(capacity, 8192u);
+  size_t other_capacity = 0;
+  auto second = pool.Acquire(5000, other_capacity);
+  pool.Release(first, capacity);
+  pool.Release(second, other_capacity);
+  ASSERT_EQ(pool.GetRetainedBytes(), 8192u);
+  ASSERT_EQ(pool.Acquire(8000, capacity), first);
+  ASSERT_EQ(pool.GetRetainedBytes(), 0u);
+  pool.Release(first, capacity);
+}
+
+static std::string ReadFileContents(const std::string& path) {
+  auto mapping = OpenFileReadOnly(path);
+  if (!mapping) {
+    return "";
+  }
+  return std::string(static_cast<const char*>(mapping->Get()),
+                     mapping->GetSize());
+}
+
+TEST(DoxyGen2DocsetTest, CopiesMatchWithEveryIOStrategy) {
+  const auto original_thresholds = GetIOThresholds();
+  const auto html = D2D_FIXTURES_LOCATION "/classflutter_1_1_shell.html";
+
+  IOThresholds always_map;
+  always_map.small_file_size = 0;
+  always_map.large_file_size = 0;
+  SetIOThresholds(always_map);
+  const auto mapped = ReadFileContents(html);
+  ASSERT_EQ(mapped.size(), 120404u);
+  ASSERT_TRUE(CopyFile(html, "/tmp/d2d_copy_mapped.html"));
+
+  IOThresholds always_read;
+  always_read.small_file_size = static_cast<size_t>(-1);
+  SetIOThresholds(always_read);
+  ASSERT_EQ(ReadFileContents(html), mapped);
+  ASSERT_TRUE(CopyFile(html, "/tmp/d2d_copy_read.html"));
+  ASSERT_EQ(ReadFileContents("/tmp/d2d_copy_read.html"), mapped);
+
+  ASSERT_TRUE(CopyData("", 0, "/tmp/d2d_empty_file"));
+  ASSERT_TRUE(CopyFile("/tmp/d2d_empty_file", "/tmp/d2d_empty_file_copy"));
+
+  SetIOThresholds(original_thresholds);
+  ASSERT_EQ(ReadFileContents("/tmp/d2d_copy_mapped.html"), mapped);
+}
+
+static int CountLogArguments(int* count) {
+  return ++*count;
+}
+
+TEST(DoxyGen2DocsetTest, LogLevelsSkipFormatting) {
+  int count = 0;
+  SetLogLevel(LogLevel::kQuiet);
+  D2D_LOG << CountLogArguments(&count);
+  D2D_VERBOSE << CountLogArguments(&count);
+  ASSERT_EQ(count, 0);
+  SetLogLevel(LogLevel::kNormal);
+  D2D_LOG << "Logged " << CountLogArguments(&count);
+  D2D_VERBOSE << CountLogArguments(&count);
+  ASSERT_EQ(count, 1);
+  FlushLogs();
+}
+
+TEST(DoxyGen2DocsetTest, RepeatedErrorsAreSuppressed) {
+  const auto path = "/tmp/d2d_repeated_errors.log";
+  AutoFD log_fd(::open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644));
+  ASSERT_TRUE(log_fd.IsValid());
+  FlushLogs();
+  AutoFD saved_stderr(::dup(STDERR_FILENO));
+  ASSERT_NE(::dup2(log_fd.Get(), STDERR_FILENO), -1);
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 4; i++) {
+    threads.emplace_back([i]() {
+      for (size_t j = 0; j < 1000; j++) {
+        D2D_ERROR << "Error " << j << " from thread " << i;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  FlushLogs();
+  ASSERT_NE(::dup2(saved_stderr.Get(), STDERR_FILENO), -1);
+
+  const auto contents = ReadFileContents(path);
+  ASSERT_EQ(std::count(contents.begin(), contents.end(), '\n'),
+            static_cast<std::ptrdiff_t>(kLogRepeatLimit + 1));
+  ASSERT_NE(contents.find("Suppressed 3990 more messages like: Error "),
+            std::string::npos);
+}
+
 }  // namespace testing
 }  // namespace d2d